@@ -0,0 +1,248 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Batch dispatch classes.
+ *
+ * Normally every ready fd gets its own callback. fds that have been put in
+ * a batch class are instead queued up as the results of a wait are
+ * processed, and once they all have been, each class that has anything
+ * queued gets a single callback with the whole lot. That lets callers with
+ * many fds of the same kind deal with them in one pass, e.g. prefetching
+ * their state or reading them all with one round of recvmmsg().
+ *
+ * Another callback may remove an fd after it has been queued, or take it
+ * out of the class, so the queue holds each fd's event as well. That entry
+ * is cleared when the fd leaves the class, and the fd's data is only looked
+ * up when the batch callback runs, as the fd number and even the event
+ * itself may have been reused by then. */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+struct wand_batch_class_t {
+	void (*callback)(wand_event_handler_t *ev_hdl,
+			struct wand_batch_event_t *events, int nevents,
+			void *data);
+	void *data;
+
+	/* Ready fds, and the fd event each one was queued for, or NULL if it
+	 * has since left the class */
+	struct wand_batch_event_t *events;
+	struct wand_fdcb_t **evcbs;
+	int nevents;
+	int size;
+
+	/* Linked into the handler's list of classes to flush */
+	bool pending;
+	struct wand_batch_class_t *next_pending;
+	/* Set while the callback is running, and if the class is destroyed
+	 * during the callback */
+	bool dispatching;
+	bool destroyed;
+
+	struct wand_batch_stats_t stats;
+};
+
+wand_batch_class_t *wand_create_batch_class(wand_event_handler_t *ev_hdl,
+		void (*callback)(wand_event_handler_t *ev_hdl,
+				struct wand_batch_event_t *events,
+				int nevents, void *data),
+		void *data) {
+	wand_batch_class_t *cls;
+
+	(void)ev_hdl;
+	cls = (wand_batch_class_t *)calloc(1, sizeof(wand_batch_class_t));
+	if (cls == NULL)
+		return NULL;
+	cls->callback = callback;
+	cls->data = data;
+	return cls;
+}
+
+/* Drops any queued entry for an fd that is leaving the class */
+static void unqueue(wand_batch_class_t *cls, struct wand_fdcb_t *evcb) {
+	int i;
+
+	for (i = 0; i < cls->nevents; i++) {
+		if (cls->evcbs[i] == evcb)
+			cls->evcbs[i] = NULL;
+	}
+}
+
+static void free_class(wand_batch_class_t *cls) {
+	free(cls->events);
+	free(cls->evcbs);
+	free(cls);
+}
+
+void wand_destroy_batch_class(wand_event_handler_t *ev_hdl,
+		wand_batch_class_t *cls) {
+	wand_batch_class_t **pp;
+	int fd;
+
+	/* Any fds still in the class go back to having their own
+	 * callbacks, and anything queued is dropped */
+	for (fd = 0; fd <= ev_hdl->maxfd && cls->stats.fds > 0; fd++) {
+		if (ev_hdl->fd_events[fd] &&
+				ev_hdl->fd_events[fd]->batch == cls) {
+			ev_hdl->fd_events[fd]->batch = NULL;
+			cls->stats.fds --;
+		}
+	}
+	cls->nevents = 0;
+
+	if (cls->pending) {
+		for (pp = &ev_hdl->batch_pending; *pp != cls;
+				pp = &(*pp)->next_pending)
+			;
+		*pp = cls->next_pending;
+	}
+
+	/* wand_batch_flush() frees it once the callback returns */
+	if (cls->dispatching) {
+		cls->destroyed = true;
+		return;
+	}
+	free_class(cls);
+}
+
+int wand_set_fd_batch(wand_event_handler_t *ev_hdl, int fd,
+		wand_batch_class_t *cls) {
+	struct wand_fdcb_t *evcb;
+
+	if (fd < 0 || fd > ev_hdl->maxfd || ev_hdl->fd_events[fd] == NULL) {
+		fprintf(stderr, "Libwandevent: no fd event for fd %d\n", fd);
+		return -1;
+	}
+	evcb = ev_hdl->fd_events[fd];
+	if (evcb->batch == cls)
+		return 0;
+	if (evcb->batch) {
+		unqueue(evcb->batch, evcb);
+		evcb->batch->stats.fds --;
+	}
+	evcb->batch = cls;
+	if (cls)
+		cls->stats.fds ++;
+	return 0;
+}
+
+void wand_get_batch_stats(wand_batch_class_t *cls,
+		struct wand_batch_stats_t *stats) {
+	*stats = cls->stats;
+}
+
+void wand_batch_forget(struct wand_fdcb_t *evcb) {
+	unqueue(evcb->batch, evcb);
+	evcb->batch->stats.fds --;
+	evcb->batch = NULL;
+}
+
+int wand_batch_queue(wand_event_handler_t *ev_hdl, struct wand_fdcb_t *evcb,
+		int ready) {
+	wand_batch_class_t *cls = evcb->batch;
+	struct wand_batch_event_t *ev;
+
+	if (cls->nevents == cls->size) {
+		struct wand_batch_event_t *events;
+		struct wand_fdcb_t **evcbs;
+		int size = cls->size ? cls->size * 2 : 64;
+
+		events = (struct wand_batch_event_t *)realloc(cls->events,
+				size * sizeof(*events));
+		if (events == NULL)
+			return -1;
+		cls->events = events;
+		evcbs = (struct wand_fdcb_t **)realloc(cls->evcbs,
+				size * sizeof(*evcbs));
+		if (evcbs == NULL)
+			return -1;
+		cls->evcbs = evcbs;
+		cls->size = size;
+	}
+
+	ev = &cls->events[cls->nevents];
+	ev->fd = evcb->fd;
+	ev->events = ready;
+	cls->evcbs[cls->nevents ++] = evcb;
+
+	if (!cls->pending) {
+		cls->pending = true;
+		cls->next_pending = ev_hdl->batch_pending;
+		ev_hdl->batch_pending = cls;
+	}
+	return 0;
+}
+
+void wand_batch_flush(wand_event_handler_t *ev_hdl) {
+	wand_batch_class_t *cls;
+	struct wand_fdcb_t *evcb;
+	int i, n;
+
+	while ((cls = ev_hdl->batch_pending) != NULL) {
+		ev_hdl->batch_pending = cls->next_pending;
+		cls->pending = false;
+
+		/* Drop anything that has left the class since it was
+		 * queued */
+		for (i = 0, n = 0; i < cls->nevents; i++) {
+			evcb = cls->evcbs[i];
+			if (evcb == NULL)
+				continue;
+			cls->events[n] = cls->events[i];
+			cls->events[n++].data = evcb->data;
+			evcb->events ++;
+			if (ev_hdl->idle)
+				wand_idle_touch(ev_hdl, evcb->fd,
+						cls->events[i].events);
+		}
+		cls->nevents = 0;
+		if (n == 0)
+			continue;
+
+		ev_hdl->stats.fd_callbacks += n;
+		cls->stats.batches ++;
+		cls->stats.events += n;
+		if ((unsigned int)n > cls->stats.max_batch)
+			cls->stats.max_batch = n;
+
+		WAND_TRACE(ev_hdl, TRACE_FD_START, 0, -1, n, cls->callback);
+		cls->dispatching = true;
+		cls->callback(ev_hdl, cls->events, n, cls->data);
+		cls->dispatching = false;
+		WAND_TRACE(ev_hdl, TRACE_FD_END, 0, -1, n, cls->callback);
+		if (cls->destroyed)
+			free_class(cls);
+	}
+}
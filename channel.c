@@ -0,0 +1,443 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Single-producer, single-consumer channels between event handlers.
+ *
+ * Elements are copied into a bounded ring. The producer only ever writes
+ * the tail and the consumer only ever writes the head, each on its own
+ * cache line, and each side keeps a private copy of the other's index so
+ * that the shared line is only read when the ring looks full (or empty).
+ *
+ * The consumer is woken up by a doorbell -- an eventfd, or a pipe if
+ * eventfd is unavailable -- but the producer only rings it if the consumer
+ * has said that it is about to block. The consumer's prepare hook delivers
+ * anything in the ring and keeps the loop polling while there is more to
+ * come, so a busy channel costs no system calls at all. Only once the ring
+ * is empty does the consumer raise its sleeping flag, checking the ring
+ * once more afterwards in case the producer missed the flag.
+ *
+ * Backpressure works the same way in the other direction: a producer that
+ * finds the ring full raises its waiting flag, and the consumer rings the
+ * producer's doorbell once it has freed up half the ring. */
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if HAVE_SYS_EVENTFD_H
+ #include <sys/eventfd.h>
+#endif
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+#define CACHE_LINE 64
+
+struct doorbell_t {
+	/* With eventfd, these are the same descriptor */
+	int readfd;
+	int writefd;
+};
+
+struct wand_channel_t {
+	/* Producer side. head_cache is our last look at the consumer's head */
+	uint64_t tail __attribute__((aligned(CACHE_LINE)));
+	uint64_t head_cache;
+	uint64_t sent;
+	uint64_t full;
+	uint64_t consumer_wakeups;
+
+	/* Consumer side. tail_cache is our last look at the producer's tail */
+	uint64_t head __attribute__((aligned(CACHE_LINE)));
+	uint64_t tail_cache;
+	uint64_t received;
+	uint64_t producer_wakeups;
+
+	/* Raised by the consumer when it is about to block, and by the
+	 * producer when it is waiting for space. Whoever rings the doorbell
+	 * lowers the flag again */
+	int consumer_sleeping __attribute__((aligned(CACHE_LINE)));
+	int producer_waiting __attribute__((aligned(CACHE_LINE)));
+
+	/* Fixed once the channel has been set up */
+	char *ring __attribute__((aligned(CACHE_LINE)));
+	size_t elem_size;
+	uint64_t capacity;
+	uint64_t mask;
+	/* Free space at which a waiting producer is woken up */
+	uint64_t low_water;
+
+	wand_event_handler_t *consumer;
+	void (*receive)(wand_event_handler_t *ev_hdl, wand_channel_t *ch,
+			void *data);
+	void *consumer_data;
+	struct doorbell_t consumer_db;
+	struct wand_hook_t hook;
+
+	wand_event_handler_t *producer;
+	void (*writable)(wand_event_handler_t *ev_hdl, wand_channel_t *ch,
+			void *data);
+	void *producer_data;
+	struct doorbell_t producer_db;
+};
+
+static int doorbell_open(struct doorbell_t *db) {
+#if HAVE_SYS_EVENTFD_H
+	db->readfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (db->readfd < 0) {
+		perror("eventfd");
+		return -1;
+	}
+	db->writefd = db->readfd;
+#else
+	int fds[2];
+	if (pipe(fds) != 0) {
+		perror("pipe");
+		return -1;
+	}
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	db->readfd = fds[0];
+	db->writefd = fds[1];
+#endif
+	return 0;
+}
+
+static void doorbell_ring(struct doorbell_t *db) {
+#if HAVE_SYS_EVENTFD_H
+	uint64_t one = 1;
+	if (write(db->writefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		fprintf(stderr, "Libwandevent: error ringing channel doorbell\n");
+	}
+#else
+	char c = 0;
+	if (write(db->writefd, &c, 1) < 0 && errno != EAGAIN) {
+		fprintf(stderr, "Libwandevent: error ringing channel doorbell\n");
+	}
+#endif
+}
+
+static void doorbell_drain(struct doorbell_t *db) {
+#if HAVE_SYS_EVENTFD_H
+	uint64_t count;
+	if (read(db->readfd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		fprintf(stderr, "Libwandevent: error reading channel doorbell\n");
+	}
+#else
+	char buf[64];
+	while (read(db->readfd, buf, sizeof(buf)) > 0);
+#endif
+}
+
+static void doorbell_close(wand_event_handler_t *ev_hdl,
+		struct doorbell_t *db) {
+	wand_del_fd(ev_hdl, db->readfd);
+	close(db->readfd);
+	if (db->writefd != db->readfd)
+		close(db->writefd);
+}
+
+wand_channel_t *wand_create_channel(size_t elem_size, size_t capacity) {
+	struct wand_channel_t *ch;
+	void *mem;
+	uint64_t size = 1;
+
+	if (elem_size == 0 || capacity == 0 || capacity > (1ULL << 32)) {
+		fprintf(stderr, "Libwandevent: invalid channel size %zu x %zu\n",
+				capacity, elem_size);
+		return NULL;
+	}
+	while (size < capacity)
+		size <<= 1;
+
+	if (posix_memalign(&mem, CACHE_LINE, sizeof(struct wand_channel_t)))
+		return NULL;
+	ch = (struct wand_channel_t *)mem;
+	memset(ch, 0, sizeof(struct wand_channel_t));
+	if (posix_memalign(&mem, CACHE_LINE, size * elem_size)) {
+		free(ch);
+		return NULL;
+	}
+	ch->ring = (char *)mem;
+	ch->elem_size = elem_size;
+	ch->capacity = size;
+	ch->mask = size - 1;
+	ch->low_water = (size + 1) / 2;
+	return ch;
+}
+
+/* Copies n elements between the ring, starting at index pos, and buf */
+static void copy_in(struct wand_channel_t *ch, uint64_t pos,
+		const char *buf, uint64_t n) {
+	uint64_t idx = pos & ch->mask;
+	uint64_t first = ch->capacity - idx;
+
+	if (first > n)
+		first = n;
+	memcpy(ch->ring + idx * ch->elem_size, buf, first * ch->elem_size);
+	if (n > first)
+		memcpy(ch->ring, buf + first * ch->elem_size,
+				(n - first) * ch->elem_size);
+}
+
+static void copy_out(struct wand_channel_t *ch, uint64_t pos, char *buf,
+		uint64_t n) {
+	uint64_t idx = pos & ch->mask;
+	uint64_t first = ch->capacity - idx;
+
+	if (first > n)
+		first = n;
+	memcpy(buf, ch->ring + idx * ch->elem_size, first * ch->elem_size);
+	if (n > first)
+		memcpy(buf + first * ch->elem_size, ch->ring,
+				(n - first) * ch->elem_size);
+}
+
+/* Consumer side: true if there is nothing to receive */
+static bool channel_empty(struct wand_channel_t *ch) {
+	if (ch->tail_cache != ch->head)
+		return false;
+	ch->tail_cache = __atomic_load_n(&ch->tail, __ATOMIC_ACQUIRE);
+	return ch->tail_cache == ch->head;
+}
+
+/* Runs just before the consumer's loop waits for events */
+static int channel_prepare(wand_event_handler_t *ev_hdl, void *data) {
+	struct wand_channel_t *ch = (struct wand_channel_t *)data;
+
+	__atomic_store_n(&ch->consumer_sleeping, 0, __ATOMIC_RELAXED);
+	if (!channel_empty(ch)) {
+		/* Keep polling, as there is likely to be more by the time the
+		 * callback has finished */
+		ch->receive(ev_hdl, ch, ch->consumer_data);
+		return 1;
+	}
+
+	/* Tell the producer we are going to sleep, then check that nothing
+	 * arrived while it couldn't have known */
+	__atomic_store_n(&ch->consumer_sleeping, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!channel_empty(ch)) {
+		__atomic_store_n(&ch->consumer_sleeping, 0, __ATOMIC_RELAXED);
+		return 1;
+	}
+	return 0;
+}
+
+static void consumer_doorbell(wand_event_handler_t *ev_hdl, int fd,
+		void *data, enum wand_eventtype_t ev) {
+	(void)ev_hdl;
+	(void)fd;
+	(void)ev;
+
+	/* Whatever is in the ring is delivered by the prepare hook */
+	doorbell_drain(&((struct wand_channel_t *)data)->consumer_db);
+}
+
+static void producer_doorbell(wand_event_handler_t *ev_hdl, int fd,
+		void *data, enum wand_eventtype_t ev) {
+	struct wand_channel_t *ch = (struct wand_channel_t *)data;
+
+	(void)fd;
+	(void)ev;
+
+	doorbell_drain(&ch->producer_db);
+	ch->writable(ev_hdl, ch, ch->producer_data);
+}
+
+int wand_channel_set_consumer(wand_channel_t *ch,
+		wand_event_handler_t *ev_hdl,
+		void (*callback)(wand_event_handler_t *ev_hdl,
+				wand_channel_t *ch, void *data),
+		void *data) {
+
+	if (ch->consumer) {
+		fprintf(stderr, "Libwandevent: channel already has a consumer\n");
+		return -1;
+	}
+	if (doorbell_open(&ch->consumer_db) < 0)
+		return -1;
+	if (wand_add_fd(ev_hdl, ch->consumer_db.readfd, EV_READ, ch,
+			consumer_doorbell) == NULL) {
+		close(ch->consumer_db.readfd);
+		if (ch->consumer_db.writefd != ch->consumer_db.readfd)
+			close(ch->consumer_db.writefd);
+		return -1;
+	}
+
+	ch->consumer = ev_hdl;
+	ch->receive = callback;
+	ch->consumer_data = data;
+	ch->hook.callback = channel_prepare;
+	ch->hook.data = ch;
+	wand_add_prepare_hook(ev_hdl, &ch->hook);
+	return 0;
+}
+
+int wand_channel_set_producer(wand_channel_t *ch,
+		wand_event_handler_t *ev_hdl,
+		void (*callback)(wand_event_handler_t *ev_hdl,
+				wand_channel_t *ch, void *data),
+		void *data) {
+
+	if (ch->producer) {
+		fprintf(stderr, "Libwandevent: channel already has a producer\n");
+		return -1;
+	}
+	if (doorbell_open(&ch->producer_db) < 0)
+		return -1;
+	if (wand_add_fd(ev_hdl, ch->producer_db.readfd, EV_READ, ch,
+			producer_doorbell) == NULL) {
+		close(ch->producer_db.readfd);
+		if (ch->producer_db.writefd != ch->producer_db.readfd)
+			close(ch->producer_db.writefd);
+		return -1;
+	}
+
+	ch->producer = ev_hdl;
+	ch->writable = callback;
+	ch->producer_data = data;
+	return 0;
+}
+
+/* Producer side: asks to be told once there is room again */
+static void wait_for_space(struct wand_channel_t *ch) {
+	uint64_t head;
+
+	if (ch->producer == NULL)
+		return;
+
+	__atomic_store_n(&ch->producer_waiting, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	/* The consumer may have made room before it could see the flag, in
+	 * which case nobody else is going to wake us up */
+	head = __atomic_load_n(&ch->head, __ATOMIC_ACQUIRE);
+	if (ch->capacity - (ch->tail - head) >= ch->low_water &&
+			__atomic_exchange_n(&ch->producer_waiting, 0,
+					__ATOMIC_ACQ_REL))
+		doorbell_ring(&ch->producer_db);
+}
+
+size_t wand_channel_send(wand_channel_t *ch, const void *elems, size_t n) {
+	uint64_t tail = ch->tail;
+	uint64_t space = ch->capacity - (tail - ch->head_cache);
+	size_t count = n;
+
+	if (space < count) {
+		ch->head_cache = __atomic_load_n(&ch->head, __ATOMIC_ACQUIRE);
+		space = ch->capacity - (tail - ch->head_cache);
+		if (space < count)
+			count = space;
+	}
+
+	if (count > 0) {
+		copy_in(ch, tail, (const char *)elems, count);
+		__atomic_store_n(&ch->tail, tail + count, __ATOMIC_RELEASE);
+		ch->sent += count;
+
+		/* Pairs with the fence in channel_prepare() */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ch->consumer_sleeping, __ATOMIC_RELAXED) &&
+				__atomic_exchange_n(&ch->consumer_sleeping, 0,
+						__ATOMIC_ACQ_REL)) {
+			ch->consumer_wakeups ++;
+			doorbell_ring(&ch->consumer_db);
+		}
+	}
+
+	if (count < n) {
+		ch->full ++;
+		wait_for_space(ch);
+	}
+	return count;
+}
+
+size_t wand_channel_recv(wand_channel_t *ch, void *elems, size_t max) {
+	uint64_t head = ch->head;
+	uint64_t avail = ch->tail_cache - head;
+	uint64_t tail;
+
+	if (avail < max) {
+		ch->tail_cache = __atomic_load_n(&ch->tail, __ATOMIC_ACQUIRE);
+		avail = ch->tail_cache - head;
+	}
+	if (avail > max)
+		avail = max;
+	if (avail == 0)
+		return 0;
+
+	copy_out(ch, head, (char *)elems, avail);
+	__atomic_store_n(&ch->head, head + avail, __ATOMIC_RELEASE);
+	ch->received += avail;
+
+	/* Pairs with the fence in wait_for_space() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ch->producer_waiting, __ATOMIC_RELAXED)) {
+		tail = __atomic_load_n(&ch->tail, __ATOMIC_ACQUIRE);
+		if (ch->capacity - (tail - (head + avail)) >= ch->low_water &&
+				__atomic_exchange_n(&ch->producer_waiting, 0,
+						__ATOMIC_ACQ_REL)) {
+			ch->producer_wakeups ++;
+			doorbell_ring(&ch->producer_db);
+		}
+	}
+	return avail;
+}
+
+void wand_get_channel_stats(wand_channel_t *ch,
+		struct wand_channel_stats_t *stats) {
+	uint64_t head = __atomic_load_n(&ch->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = __atomic_load_n(&ch->tail, __ATOMIC_ACQUIRE);
+
+	stats->sent = ch->sent;
+	stats->received = ch->received;
+	stats->queued = tail - head;
+	stats->full = ch->full;
+	stats->consumer_wakeups = ch->consumer_wakeups;
+	stats->producer_wakeups = ch->producer_wakeups;
+}
+
+void wand_destroy_channel(wand_channel_t *ch) {
+	if (ch->consumer) {
+		wand_del_prepare_hook(ch->consumer, &ch->hook);
+		doorbell_close(ch->consumer, &ch->consumer_db);
+	}
+	if (ch->producer)
+		doorbell_close(ch->producer, &ch->producer_db);
+	free(ch->ring);
+	free(ch);
+}
@@ -0,0 +1,273 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Child process exit events.
+ *
+ * Where the kernel supports it, each child is watched using a pidfd, which
+ * becomes readable when that particular child exits. This avoids going
+ * through SIGCHLD, which is delivered to whichever handler happens to read
+ * the signal pipe and which the kernel merges, meaning that every child has
+ * to be polled with waitpid() each time it fires.
+ *
+ * On older kernels we fall back to exactly that: a SIGCHLD event that polls
+ * every child we are watching. Exits are passed back to the handler that
+ * registered the child via its mailbox. */
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+struct wand_child_t {
+	pid_t pid;
+	/* pidfd for the child, or -1 if we are relying on SIGCHLD */
+	int pidfd;
+	int status;
+
+	void (*callback)(wand_event_handler_t *ev_hdl, pid_t pid, int status,
+			void *data);
+	void *data;
+	wand_event_handler_t *ev_hdl;
+
+	/* Used by the SIGCHLD fallback */
+	struct wand_child_t *prev;
+	struct wand_child_t *next;
+	struct wand_timer_t *timer;
+	struct wand_mailbox_msg_t msg;
+};
+
+/* Children being watched by the SIGCHLD fallback, from every handler */
+static pthread_mutex_t child_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct wand_child_t *children = NULL;
+static bool have_sigchld = false;
+
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	(void)pid;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void pidfd_read(wand_event_handler_t *ev_hdl, int fd, void *data,
+		enum wand_eventtype_t ev) {
+	struct wand_child_t *child = (struct wand_child_t *)data;
+	int status;
+	pid_t ret;
+
+	(void)ev;
+
+	do {
+		ret = waitpid(child->pid, &status, WNOHANG);
+	} while (ret < 0 && errno == EINTR);
+
+	/* Not actually finished yet */
+	if (ret == 0)
+		return;
+
+	if (ret < 0) {
+		/* Someone else has reaped it already */
+		perror("waitpid");
+		status = -1;
+	}
+
+	wand_del_fd(ev_hdl, fd);
+	close(fd);
+	child->callback(ev_hdl, child->pid, status, child->data);
+	free(child);
+}
+
+static void unlink_child(struct wand_child_t *child) {
+	if (child->prev)
+		child->prev->next = child->next;
+	else
+		children = child->next;
+	if (child->next)
+		child->next->prev = child->prev;
+	child->prev = child->next = NULL;
+}
+
+/* Runs on the handler that registered the child */
+static void deliver_exit(wand_event_handler_t *ev_hdl, void *data) {
+	struct wand_child_t *child = (struct wand_child_t *)data;
+
+	if (child->timer)
+		wand_del_timer(ev_hdl, child->timer);
+	/* The callback is cleared if the child was deleted after it exited */
+	if (child->callback)
+		child->callback(ev_hdl, child->pid, child->status,
+				child->data);
+	free(child);
+}
+
+/* Checks every child we are watching to see if it has exited */
+static void reap_children(void) {
+	struct wand_child_t *child, *next;
+	pid_t ret;
+
+	pthread_mutex_lock(&child_mutex);
+	for (child = children; child != NULL; child = next) {
+		next = child->next;
+		ret = waitpid(child->pid, &child->status, WNOHANG);
+		if (ret == 0 || (ret < 0 && errno == EINTR))
+			continue;
+		if (ret < 0)
+			child->status = -1;
+
+		unlink_child(child);
+		wand_mailbox_post(child->ev_hdl, &child->msg);
+	}
+	pthread_mutex_unlock(&child_mutex);
+}
+
+static void sigchld_event(wand_event_handler_t *ev_hdl, int signum,
+		void *data) {
+	(void)ev_hdl;
+	(void)signum;
+	(void)data;
+	reap_children();
+}
+
+/* The child might have exited before we started watching it, in which case
+ * there won't be another SIGCHLD for it, so check once straight away */
+static void initial_check(wand_event_handler_t *ev_hdl, void *data) {
+	struct wand_child_t *child = (struct wand_child_t *)data;
+
+	(void)ev_hdl;
+	child->timer = NULL;
+	reap_children();
+}
+
+static int watch_with_sigchld(struct wand_child_t *child) {
+	if (wand_mailbox_init(child->ev_hdl) < 0)
+		return -1;
+
+	child->msg.callback = deliver_exit;
+	child->msg.data = child;
+
+	pthread_mutex_lock(&child_mutex);
+	if (!have_sigchld) {
+		if (wand_add_signal(SIGCHLD, NULL, sigchld_event) == NULL) {
+			pthread_mutex_unlock(&child_mutex);
+			fprintf(stderr, "Libwandevent: SIGCHLD is already in use, can't watch child processes\n");
+			return -1;
+		}
+		have_sigchld = true;
+	}
+	child->prev = NULL;
+	child->next = children;
+	if (children)
+		children->prev = child;
+	children = child;
+	pthread_mutex_unlock(&child_mutex);
+
+	child->timer = wand_add_timer(child->ev_hdl, 0, 0, child,
+			initial_check);
+	return 0;
+}
+
+wand_child_t *wand_add_child(wand_event_handler_t *ev_hdl, pid_t pid,
+		void *data,
+		void (*callback)(wand_event_handler_t *ev_hdl, pid_t pid,
+				int status, void *data)) {
+	struct wand_child_t *child;
+
+	if (pid <= 0)
+		return NULL;
+
+	child = (struct wand_child_t *)calloc(1, sizeof(struct wand_child_t));
+	if (child == NULL)
+		return NULL;
+	child->pid = pid;
+	child->callback = callback;
+	child->data = data;
+	child->ev_hdl = ev_hdl;
+
+	child->pidfd = open_pidfd(pid);
+	if (child->pidfd >= 0) {
+		if (wand_add_fd(ev_hdl, child->pidfd, EV_READ, child,
+				pidfd_read) == NULL) {
+			close(child->pidfd);
+			free(child);
+			return NULL;
+		}
+		return child;
+	}
+
+	if (errno != ENOSYS) {
+		/* ESRCH, for instance */
+		perror("pidfd_open");
+		free(child);
+		return NULL;
+	}
+
+	/* Old kernel */
+	if (watch_with_sigchld(child) < 0) {
+		free(child);
+		return NULL;
+	}
+	return child;
+}
+
+void wand_del_child(wand_event_handler_t *ev_hdl, wand_child_t *child) {
+	if (child->pidfd >= 0) {
+		wand_del_fd(ev_hdl, child->pidfd);
+		close(child->pidfd);
+		free(child);
+		return;
+	}
+
+	pthread_mutex_lock(&child_mutex);
+	if (child->prev == NULL && child->next == NULL &&
+			children != child) {
+		/* It has already exited and the exit is on its way to us via
+		 * the mailbox, so we can't free it yet. Let it arrive and
+		 * throw it away */
+		child->callback = NULL;
+		pthread_mutex_unlock(&child_mutex);
+		return;
+	}
+	unlink_child(child);
+	pthread_mutex_unlock(&child_mutex);
+
+	if (child->timer)
+		wand_del_timer(ev_hdl, child->timer);
+	free(child);
+}
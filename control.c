@@ -0,0 +1,586 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Live introspection of an event handler.
+ *
+ * wand_format_stats() takes a snapshot of the handler's state in JSON or
+ * the Prometheus text format. Everything in it is either a counter that is
+ * kept up to date as we go or can be found in constant time -- we only
+ * look at the first few timers in the queue -- so taking a snapshot never
+ * holds up the loop for long, however many events are registered.
+ *
+ * wand_start_control() serves those snapshots over a UNIX socket, handled
+ * by the event handler itself like any other fd. */
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+/* Number of upcoming timers included in a snapshot */
+#define NEXT_TIMERS 8
+/* Most connections to the control socket that we will serve at once */
+#define MAX_CLIENTS 16
+/* Milliseconds a client has to send its request and read the reply */
+#define CLIENT_TIMEOUT 1000
+#define REQUEST_MAX 256
+
+struct control_client_t {
+	int fd;
+	char request[REQUEST_MAX];
+	size_t reqlen;
+	/* The reply, once we have one */
+	char *reply;
+	size_t replylen;
+	size_t sent;
+	struct control_client_t *next;
+};
+
+struct wand_control_t {
+	char *path;
+	int fd;
+	wand_listener_t *listener;
+	struct control_client_t *clients;
+	int nclients;
+};
+
+/* Accumulates formatted output in the same way as snprintf(), counting
+ * the length of everything even once the buffer is full */
+struct outbuf_t {
+	char *buf;
+	size_t len;
+	size_t pos;
+};
+
+static void out_printf(struct outbuf_t *out, const char *fmt, ...) {
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(out->pos < out->len ? out->buf + out->pos : NULL,
+			out->pos < out->len ? out->len - out->pos : 0, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		out->pos += n;
+}
+
+static int64_t usec_until(struct timeval when, struct timeval now) {
+	return (int64_t)(when.tv_sec - now.tv_sec) * 1000000 +
+			(when.tv_usec - now.tv_usec);
+}
+
+/* Fills in how long until each of the first few timers fires, returning
+ * how many there are. A timer that has been pushed back by wand_mod_timer()
+ * is reported at its new deadline, even though we will still wake up at
+ * the old one */
+static int next_timers(wand_event_handler_t *ev_hdl, int64_t *due) {
+	struct wand_timer_t *t;
+	struct timeval now = wand_get_monotonictime(ev_hdl);
+	int n = 0;
+
+	for (t = ev_hdl->timers; t && n < NEXT_TIMERS; t = t->next)
+		due[n++] = usec_until(t->deferred, now);
+	return n;
+}
+
+static const char *backend_name(void) {
+#if HAVE_SYS_EPOLL_H
+	return "epoll";
+#else
+	return "select";
+#endif
+}
+
+static void format_json(wand_event_handler_t *ev_hdl, struct outbuf_t *out,
+		struct wand_loop_stats_t *ls, int64_t *due, int ndue) {
+	int i;
+
+	out_printf(out, "{\"backend\":\"%s\",\"virtual_time\":%s,"
+			"\"fds\":%u,\"timers\":%u,\"signals\":%u,"
+			"\"next_timers_usec\":[", backend_name(),
+			ev_hdl->virtualtime ? "true" : "false",
+			ls->fds, ls->timers, ls->signals);
+	for (i = 0; i < ndue; i++)
+		out_printf(out, "%s%" PRId64, i ? "," : "", due[i]);
+	out_printf(out, "],\"loop\":{\"iterations\":%" PRIu64
+			",\"empty_waits\":%" PRIu64 ",\"max_ready\":%u"
+			",\"fd_callbacks\":%" PRIu64
+			",\"timers_fired\":%" PRIu64
+			",\"signals_delivered\":%" PRIu64
+			",\"fds_migrated_in\":%" PRIu64
+			",\"fds_migrated_out\":%" PRIu64 "}",
+			ls->iterations, ls->empty_waits, ls->max_ready,
+			ls->fd_callbacks, ls->timers_fired,
+			ls->signals_delivered, ls->fds_migrated_in,
+			ls->fds_migrated_out);
+
+	if (ev_hdl->overload) {
+		struct wand_overload_stats_t os;
+
+		wand_get_overload_stats(ev_hdl, &os);
+		out_printf(out, ",\"overload\":{\"state\":\"%s\""
+				",\"lag_usec\":%" PRId64
+				",\"busy_usec\":%" PRId64
+				",\"transitions\":%" PRIu64 "}",
+				os.state == WAND_OVERLOAD_SHEDDING ?
+						"shedding" : "normal",
+				os.lag, os.busy, os.transitions);
+	}
+	if (ev_hdl->workq) {
+		struct wand_work_stats_t ws;
+
+		wand_get_work_stats(ev_hdl, &ws);
+		out_printf(out, ",\"work\":{\"threads\":%u,\"queued\":%u"
+				",\"running\":%u,\"completed\":%" PRIu64 "}",
+				ws.threads, ws.queued, ws.running,
+				ws.total_completed);
+	}
+	out_printf(out, "}\n");
+}
+
+static void prom_metric(struct outbuf_t *out, const char *name,
+		const char *type, const char *help, const char *fmt, ...) {
+	va_list ap;
+	char value[32];
+
+	va_start(ap, fmt);
+	vsnprintf(value, sizeof(value), fmt, ap);
+	va_end(ap);
+	out_printf(out, "# HELP wandevent_%s %s\n# TYPE wandevent_%s %s\n"
+			"wandevent_%s %s\n", name, help, name, type, name,
+			value);
+}
+
+static void format_prometheus(wand_event_handler_t *ev_hdl,
+		struct outbuf_t *out, struct wand_loop_stats_t *ls,
+		int64_t *due, int ndue) {
+
+	out_printf(out, "# HELP wandevent_info Event handler configuration\n"
+			"# TYPE wandevent_info gauge\n"
+			"wandevent_info{backend=\"%s\",virtual_time=\"%s\"} 1\n",
+			backend_name(),
+			ev_hdl->virtualtime ? "true" : "false");
+	prom_metric(out, "fds", "gauge", "Registered fd events",
+			"%u", ls->fds);
+	prom_metric(out, "timers", "gauge", "Registered timers",
+			"%u", ls->timers);
+	prom_metric(out, "signals", "gauge",
+			"Registered signal events", "%u", ls->signals);
+	if (ndue > 0)
+		prom_metric(out, "next_timer_seconds", "gauge",
+				"Time until the next timer is due", "%.6f",
+				due[0] / 1e6);
+	prom_metric(out, "loop_iterations_total", "counter",
+			"Waits for events", "%" PRIu64, ls->iterations);
+	prom_metric(out, "empty_waits_total", "counter",
+			"Waits that ended with no fds ready", "%" PRIu64,
+			ls->empty_waits);
+	prom_metric(out, "max_ready", "gauge",
+			"Most fds ready after a single wait", "%u",
+			ls->max_ready);
+	prom_metric(out, "fd_callbacks_total", "counter",
+			"Callbacks run for fd events", "%" PRIu64,
+			ls->fd_callbacks);
+	prom_metric(out, "timers_fired_total", "counter",
+			"Callbacks run for timers", "%" PRIu64,
+			ls->timers_fired);
+	prom_metric(out, "signals_delivered_total", "counter",
+			"Callbacks run for signals", "%" PRIu64,
+			ls->signals_delivered);
+	prom_metric(out, "fds_migrated_in_total", "counter",
+			"fd events moved from other handlers", "%" PRIu64,
+			ls->fds_migrated_in);
+	prom_metric(out, "fds_migrated_out_total", "counter",
+			"fd events moved to other handlers", "%" PRIu64,
+			ls->fds_migrated_out);
+
+	if (ev_hdl->overload) {
+		struct wand_overload_stats_t os;
+
+		wand_get_overload_stats(ev_hdl, &os);
+		prom_metric(out, "overload_shedding", "gauge",
+				"Whether load is being shed", "%d",
+				os.state == WAND_OVERLOAD_SHEDDING);
+		prom_metric(out, "loop_lag_seconds", "gauge",
+				"Smoothed loop lag", "%.6f", os.lag / 1e6);
+		prom_metric(out, "callback_busy_seconds", "gauge",
+				"Smoothed time spent in callbacks per wait",
+				"%.6f", os.busy / 1e6);
+		prom_metric(out, "overload_transitions_total", "counter",
+				"Changes of overload state", "%" PRIu64,
+				os.transitions);
+	}
+	if (ev_hdl->workq) {
+		struct wand_work_stats_t ws;
+
+		wand_get_work_stats(ev_hdl, &ws);
+		prom_metric(out, "work_threads", "gauge",
+				"Work queue threads", "%u", ws.threads);
+		prom_metric(out, "work_queued", "gauge",
+				"Work waiting for a thread", "%u", ws.queued);
+		prom_metric(out, "work_running", "gauge",
+				"Work being run", "%u", ws.running);
+		prom_metric(out, "work_completed_total", "counter",
+				"Work completed", "%" PRIu64,
+				ws.total_completed);
+	}
+}
+
+int wand_format_stats(wand_event_handler_t *ev_hdl,
+		enum wand_stats_format_t format, char *buf, size_t len) {
+	struct outbuf_t out;
+	struct wand_loop_stats_t ls;
+	int64_t due[NEXT_TIMERS];
+	int ndue;
+
+	out.buf = buf;
+	out.len = len;
+	out.pos = 0;
+	if (len > 0)
+		buf[0] = '\0';
+
+	wand_get_loop_stats(ev_hdl, &ls);
+	ndue = next_timers(ev_hdl, due);
+
+	switch (format) {
+	case WAND_STATS_JSON:
+		format_json(ev_hdl, &out, &ls, due, ndue);
+		break;
+	case WAND_STATS_PROMETHEUS:
+		format_prometheus(ev_hdl, &out, &ls, due, ndue);
+		break;
+	default:
+		fprintf(stderr, "Libwandevent: unknown stats format %d\n",
+				format);
+		return -1;
+	}
+	return (int)out.pos;
+}
+
+static void drop_client(wand_event_handler_t *ev_hdl,
+		struct wand_control_t *ctl, struct control_client_t *client) {
+	struct control_client_t **c = &ctl->clients;
+
+	while (*c != client)
+		c = &(*c)->next;
+	*c = client->next;
+	ctl->nclients --;
+
+	wand_del_fd(ev_hdl, client->fd);
+	close(client->fd);
+	free(client->reply);
+	free(client);
+}
+
+/* Takes a snapshot in the given format, returning it in a buffer that
+ * the caller must free */
+static char *take_snapshot(wand_event_handler_t *ev_hdl,
+		enum wand_stats_format_t format, size_t *lenp) {
+	size_t size = 4096;
+	char *buf = NULL, *tmp;
+	int len;
+
+	for (;;) {
+		tmp = (char *)realloc(buf, size);
+		if (tmp == NULL)
+			break;
+		buf = tmp;
+		len = wand_format_stats(ev_hdl, format, buf, size);
+		if (len < 0)
+			break;
+		if ((size_t)len < size) {
+			*lenp = len;
+			return buf;
+		}
+		size = len + 1;
+	}
+	free(buf);
+	return NULL;
+}
+
+/* Works out what the client wants and builds the reply */
+static int build_reply(wand_event_handler_t *ev_hdl,
+		struct control_client_t *client) {
+	char *cmd = client->request;
+	char *end, *body, *reply;
+	bool http = false;
+	int format = -1;
+	size_t bodylen = 0;
+	char header[160];
+	int hlen = 0;
+
+	client->request[client->reqlen] = '\0';
+	cmd[strcspn(cmd, "\r\n")] = '\0';
+	if (strncmp(cmd, "GET ", 4) == 0) {
+		http = true;
+		cmd += 4;
+		cmd[strcspn(cmd, " ?")] = '\0';
+		while (*cmd == '/')
+			cmd ++;
+	}
+	end = cmd + strlen(cmd);
+	while (end > cmd && end[-1] == ' ')
+		*--end = '\0';
+
+	if (*cmd == '\0' || strcmp(cmd, "json") == 0)
+		format = WAND_STATS_JSON;
+	else if (strcmp(cmd, "prometheus") == 0 || strcmp(cmd, "metrics") == 0)
+		format = WAND_STATS_PROMETHEUS;
+
+	if (format >= 0) {
+		body = take_snapshot(ev_hdl, (enum wand_stats_format_t)format,
+				&bodylen);
+		if (body == NULL)
+			return -1;
+	} else {
+		body = strdup("unknown command\n");
+		if (body == NULL)
+			return -1;
+		bodylen = strlen(body);
+	}
+
+	if (!http) {
+		client->reply = body;
+		client->replylen = bodylen;
+		return 0;
+	}
+
+	hlen = snprintf(header, sizeof(header), "HTTP/1.0 %s\r\n"
+			"Content-Type: %s\r\nContent-Length: %zu\r\n"
+			"Connection: close\r\n\r\n",
+			format < 0 ? "404 Not Found" : "200 OK",
+			format == WAND_STATS_JSON ? "application/json" :
+			format == WAND_STATS_PROMETHEUS ?
+					"text/plain; version=0.0.4" :
+					"text/plain", bodylen);
+	reply = (char *)malloc(hlen + bodylen);
+	if (reply == NULL) {
+		free(body);
+		return -1;
+	}
+	memcpy(reply, header, hlen);
+	memcpy(reply + hlen, body, bodylen);
+	free(body);
+	client->reply = reply;
+	client->replylen = hlen + bodylen;
+	return 0;
+}
+
+/* Sends as much of the reply as we can, returning true once it has all
+ * gone (or the client has gone away) */
+static bool send_reply(struct control_client_t *client) {
+	ssize_t ret;
+
+	while (client->sent < client->replylen) {
+		ret = send(client->fd, client->reply + client->sent,
+				client->replylen - client->sent,
+				MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno != EAGAIN && errno != EWOULDBLOCK;
+		}
+		client->sent += ret;
+	}
+	return true;
+}
+
+static void client_event(wand_event_handler_t *ev_hdl, int fd, void *data,
+		enum wand_eventtype_t ev) {
+	struct control_client_t *client = (struct control_client_t *)data;
+	struct wand_control_t *ctl = ev_hdl->control;
+	char discard[REQUEST_MAX];
+	bool eof = false;
+	ssize_t ret;
+
+	if (ev & EV_TIMEOUT) {
+		drop_client(ev_hdl, ctl, client);
+		return;
+	}
+
+	if (client->reply) {
+		if (send_reply(client))
+			drop_client(ev_hdl, ctl, client);
+		return;
+	}
+
+	/* Read everything that has been sent, as closing a UNIX socket with
+	 * unread data in it makes the other end see a reset. Anything past
+	 * the first line is ignored anyway */
+	for (;;) {
+		if (client->reqlen < REQUEST_MAX - 1)
+			ret = read(fd, client->request + client->reqlen,
+					REQUEST_MAX - 1 - client->reqlen);
+		else
+			ret = read(fd, discard, sizeof(discard));
+		if (ret > 0) {
+			if (client->reqlen < REQUEST_MAX - 1)
+				client->reqlen += ret;
+			continue;
+		}
+		if (ret == 0) {
+			eof = true;
+			break;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			break;
+		drop_client(ev_hdl, ctl, client);
+		return;
+	}
+
+	if (!eof && client->reqlen < REQUEST_MAX - 1 &&
+			memchr(client->request, '\n', client->reqlen) == NULL)
+		return;
+
+	if (build_reply(ev_hdl, client) < 0 || send_reply(client)) {
+		drop_client(ev_hdl, ctl, client);
+		return;
+	}
+	wand_set_fd_flags(ev_hdl, fd, EV_WRITE);
+}
+
+static void control_accept(wand_event_handler_t *ev_hdl, int listenfd,
+		int *fds, int nfds, void *data) {
+	struct wand_control_t *ctl = (struct wand_control_t *)data;
+	struct control_client_t *client;
+	int i;
+
+	(void)listenfd;
+
+	for (i = 0; i < nfds; i++) {
+		client = NULL;
+		if (ctl->nclients < MAX_CLIENTS)
+			client = (struct control_client_t *)calloc(1,
+					sizeof(struct control_client_t));
+		if (client == NULL) {
+			close(fds[i]);
+			continue;
+		}
+		client->fd = fds[i];
+		if (wand_add_fd(ev_hdl, fds[i], EV_READ, client,
+				client_event) == NULL) {
+			close(fds[i]);
+			free(client);
+			continue;
+		}
+		client->next = ctl->clients;
+		ctl->clients = client;
+		ctl->nclients ++;
+		wand_set_fd_timeouts(ev_hdl, fds[i], CLIENT_TIMEOUT,
+				CLIENT_TIMEOUT);
+	}
+}
+
+int wand_start_control(wand_event_handler_t *ev_hdl, const char *path) {
+	struct wand_control_t *ctl;
+	struct sockaddr_un addr;
+	struct stat st;
+
+	if (ev_hdl->control) {
+		fprintf(stderr, "Libwandevent: control socket is already open\n");
+		return -1;
+	}
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Libwandevent: control socket path is too long: %s\n", path);
+		return -1;
+	}
+
+	ctl = (struct wand_control_t *)calloc(1, sizeof(struct wand_control_t));
+	if (ctl == NULL)
+		return -1;
+	ctl->path = strdup(path);
+	ctl->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (ctl->path == NULL || ctl->fd < 0) {
+		perror("socket");
+		goto fail;
+	}
+
+	/* Replace whatever socket was left behind by a previous run, but
+	 * don't go deleting anything else */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (bind(ctl->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		fprintf(stderr, "Libwandevent: failed to bind control socket %s\n", path);
+		goto fail;
+	}
+	if (chmod(path, S_IRUSR | S_IWUSR) < 0 || listen(ctl->fd, 8) < 0) {
+		perror("Libwandevent: control socket");
+		unlink(path);
+		goto fail;
+	}
+
+	ctl->listener = wand_add_listener(ev_hdl, ctl->fd, MAX_CLIENTS,
+			control_accept, ctl);
+	if (ctl->listener == NULL) {
+		unlink(path);
+		goto fail;
+	}
+	ev_hdl->control = ctl;
+	return 0;
+
+fail:
+	if (ctl->fd >= 0)
+		close(ctl->fd);
+	free(ctl->path);
+	free(ctl);
+	return -1;
+}
+
+void wand_stop_control(wand_event_handler_t *ev_hdl) {
+	struct wand_control_t *ctl = ev_hdl->control;
+
+	if (ctl == NULL)
+		return;
+	while (ctl->clients)
+		drop_client(ev_hdl, ctl, ctl->clients);
+	wand_del_listener(ev_hdl, ctl->listener);
+	close(ctl->fd);
+	unlink(ctl->path);
+	free(ctl->path);
+	free(ctl);
+	ev_hdl->control = NULL;
+}
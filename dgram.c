@@ -0,0 +1,457 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Batched datagram sockets.
+ *
+ * Each time a datagram socket becomes readable, we fill a preallocated set
+ * of message slots using recvmmsg() and hand the whole batch to a single
+ * callback, rather than making one system call per datagram. Outgoing
+ * datagrams are copied into a matching set of send slots and flushed with
+ * sendmmsg() just before the event handler next waits for events. */
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+/* Maximum number of recvmmsg() calls per wakeup */
+#define DGRAM_RECV_BUDGET 8
+/* Space for a GRO segment size, a timestamp and a drop counter */
+#define DGRAM_CMSG_SPACE 128
+
+struct wand_dgram_t {
+	int fd;
+	int flags;
+	int batch;
+	size_t slotsize;
+
+	void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+			struct wand_dgram_msg_t *msgs, int nmsgs, void *data);
+	void *data;
+
+	/* Receive slots */
+	struct mmsghdr *rmsgs;
+	struct iovec *riov;
+	struct sockaddr_storage *raddrs;
+	char *rbufs;
+	char *rcmsgs;
+	struct wand_dgram_msg_t *results;
+
+	/* Send slots */
+	struct mmsghdr *smsgs;
+	struct iovec *siov;
+	struct sockaddr_storage *saddrs;
+	char *sbufs;
+	/* Datagrams waiting to be sent, starting from the first unsent */
+	int sfirst;
+	int scount;
+	/* Waiting for the socket to become writable */
+	bool blocked;
+
+	struct wand_hook_t hook;
+	wand_event_handler_t *ev_hdl;
+
+	struct wand_dgram_stats_t stats;
+};
+
+static int dgram_flush(struct wand_dgram_t *dg);
+
+/* Pulls out the extra information that the kernel attached to a datagram */
+static void parse_cmsgs(struct wand_dgram_t *dg, struct msghdr *hdr,
+		struct wand_dgram_msg_t *msg) {
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL;
+			cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+#ifdef UDP_GRO
+		if (cmsg->cmsg_level == SOL_UDP &&
+				cmsg->cmsg_type == UDP_GRO) {
+			int segsize;
+			memcpy(&segsize, CMSG_DATA(cmsg), sizeof(int));
+			msg->segsize = segsize;
+			continue;
+		}
+#endif
+#ifdef SO_TIMESTAMPNS
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+				cmsg->cmsg_type == SO_TIMESTAMPNS) {
+			memcpy(&msg->timestamp, CMSG_DATA(cmsg),
+					sizeof(struct timespec));
+			continue;
+		}
+#endif
+#ifdef SO_RXQ_OVFL
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+				cmsg->cmsg_type == SO_RXQ_OVFL) {
+			uint32_t drops;
+			memcpy(&drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+			dg->stats.drops = drops;
+			continue;
+		}
+#endif
+	}
+}
+
+/* Resets the receive slots so they are ready for the next recvmmsg() */
+static void reset_rslots(struct wand_dgram_t *dg, int n) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		struct msghdr *hdr = &dg->rmsgs[i].msg_hdr;
+
+		hdr->msg_name = &dg->raddrs[i];
+		hdr->msg_namelen = sizeof(struct sockaddr_storage);
+		hdr->msg_control = dg->rcmsgs + i * DGRAM_CMSG_SPACE;
+		hdr->msg_controllen = DGRAM_CMSG_SPACE;
+		hdr->msg_flags = 0;
+		dg->rmsgs[i].msg_len = 0;
+	}
+}
+
+static int recv_batch(struct wand_dgram_t *dg) {
+#if HAVE_RECVMMSG
+	return recvmmsg(dg->fd, dg->rmsgs, dg->batch, MSG_DONTWAIT, NULL);
+#else
+	int i;
+	ssize_t ret;
+
+	for (i = 0; i < dg->batch; i++) {
+		ret = recvmsg(dg->fd, &dg->rmsgs[i].msg_hdr, MSG_DONTWAIT);
+		if (ret < 0)
+			return (i > 0) ? i : -1;
+		dg->rmsgs[i].msg_len = ret;
+	}
+	return i;
+#endif
+}
+
+static void dgram_read(wand_event_handler_t *ev_hdl, int fd,
+		struct wand_dgram_t *dg) {
+	int n, i, calls = 0;
+
+	while (calls++ < DGRAM_RECV_BUDGET) {
+		n = recv_batch(dg);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("recvmmsg");
+				dg->stats.errors ++;
+			}
+			return;
+		}
+		if (n == 0)
+			return;
+
+		for (i = 0; i < n; i++) {
+			struct msghdr *hdr = &dg->rmsgs[i].msg_hdr;
+			struct wand_dgram_msg_t *msg = &dg->results[i];
+
+			msg->buf = dg->riov[i].iov_base;
+			msg->len = dg->rmsgs[i].msg_len;
+			msg->addr = (struct sockaddr *)&dg->raddrs[i];
+			msg->addrlen = hdr->msg_namelen;
+			msg->segsize = 0;
+			msg->timestamp.tv_sec = 0;
+			msg->timestamp.tv_nsec = 0;
+			msg->truncated = (hdr->msg_flags & MSG_TRUNC) != 0;
+			if (hdr->msg_controllen > 0)
+				parse_cmsgs(dg, hdr, msg);
+		}
+
+		dg->stats.batches ++;
+		dg->stats.datagrams += n;
+		if (n == dg->batch)
+			dg->stats.full_batches ++;
+
+		dg->callback(ev_hdl, fd, dg->results, n, dg->data);
+
+		/* The callback may have removed us, in which case dg has been
+		 * freed */
+		if (ev_hdl->fd_events[fd] == NULL ||
+				ev_hdl->fd_events[fd]->data != dg)
+			return;
+		reset_rslots(dg, n);
+
+		/* A partial batch means the socket has been drained */
+		if (n < dg->batch)
+			return;
+	}
+}
+
+static void dgram_event(wand_event_handler_t *ev_hdl, int fd, void *data,
+		enum wand_eventtype_t ev) {
+	struct wand_dgram_t *dg = (struct wand_dgram_t *)data;
+
+	assert(fd == dg->fd);
+
+	if (ev == EV_WRITE) {
+		dg->blocked = false;
+		wand_set_fd_flags(ev_hdl, fd, EV_READ);
+		dgram_flush(dg);
+		return;
+	}
+	dgram_read(ev_hdl, fd, dg);
+}
+
+static int dgram_prepare(wand_event_handler_t *ev_hdl, void *data) {
+	struct wand_dgram_t *dg = (struct wand_dgram_t *)data;
+
+	(void)ev_hdl;
+	if (dg->scount > 0 && !dg->blocked)
+		dgram_flush(dg);
+	return 0;
+}
+
+static int send_batch(struct wand_dgram_t *dg) {
+#if HAVE_SENDMMSG
+	return sendmmsg(dg->fd, &dg->smsgs[dg->sfirst], dg->scount,
+			MSG_DONTWAIT);
+#else
+	int i;
+	ssize_t ret;
+
+	for (i = 0; i < dg->scount; i++) {
+		ret = sendmsg(dg->fd, &dg->smsgs[dg->sfirst + i].msg_hdr,
+				MSG_DONTWAIT);
+		if (ret < 0)
+			return (i > 0) ? i : -1;
+	}
+	return i;
+#endif
+}
+
+/* Sends as many queued datagrams as the socket will take */
+static int dgram_flush(struct wand_dgram_t *dg) {
+	int n;
+
+	while (dg->scount > 0) {
+		n = send_batch(dg);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* Try again once there is room */
+				dg->blocked = true;
+				wand_set_fd_flags(dg->ev_hdl, dg->fd,
+						EV_READ | EV_WRITE);
+				return -1;
+			}
+			/* Skip the datagram that the kernel didn't like
+			 * (e.g. unreachable destination) and keep going */
+			dg->stats.send_errors ++;
+			n = 1;
+		} else {
+			dg->stats.send_batches ++;
+			dg->stats.sent += n;
+		}
+		dg->sfirst += n;
+		dg->scount -= n;
+	}
+	dg->sfirst = 0;
+	return 0;
+}
+
+int wand_dgram_send(wand_dgram_t *dg, const void *buf, size_t len,
+		const struct sockaddr *addr, socklen_t addrlen) {
+	int slot;
+	struct msghdr *hdr;
+
+	if (len > dg->slotsize || addrlen > sizeof(struct sockaddr_storage))
+		return -1;
+
+	if (dg->sfirst + dg->scount == dg->batch) {
+		/* Out of slots, so try to make some room. Anything still
+		 * unsent gets moved to the front */
+		if (!dg->blocked)
+			dgram_flush(dg);
+		if (dg->scount == dg->batch) {
+			dg->stats.send_dropped ++;
+			return -1;
+		}
+		if (dg->sfirst > 0) {
+			int i;
+			for (i = 0; i < dg->scount; i++) {
+				int from = dg->sfirst + i;
+				memcpy(dg->sbufs + i * dg->slotsize,
+						dg->sbufs + from * dg->slotsize,
+						dg->siov[from].iov_len);
+				dg->siov[i].iov_len = dg->siov[from].iov_len;
+				dg->saddrs[i] = dg->saddrs[from];
+				dg->smsgs[i].msg_hdr.msg_namelen =
+					dg->smsgs[from].msg_hdr.msg_namelen;
+			}
+			dg->sfirst = 0;
+		}
+	}
+
+	slot = dg->sfirst + dg->scount;
+	memcpy(dg->sbufs + slot * dg->slotsize, buf, len);
+	dg->siov[slot].iov_len = len;
+
+	hdr = &dg->smsgs[slot].msg_hdr;
+	if (addr) {
+		memcpy(&dg->saddrs[slot], addr, addrlen);
+		hdr->msg_name = &dg->saddrs[slot];
+		hdr->msg_namelen = addrlen;
+	} else {
+		/* Connected socket */
+		hdr->msg_name = NULL;
+		hdr->msg_namelen = 0;
+	}
+	dg->scount ++;
+	return 0;
+}
+
+int wand_dgram_flush(wand_dgram_t *dg) {
+	if (dg->blocked)
+		return -1;
+	return dgram_flush(dg);
+}
+
+void wand_get_dgram_stats(wand_dgram_t *dg, struct wand_dgram_stats_t *stats)
+{
+	*stats = dg->stats;
+}
+
+static void free_dgram(struct wand_dgram_t *dg) {
+	free(dg->rmsgs);
+	free(dg->riov);
+	free(dg->raddrs);
+	free(dg->rbufs);
+	free(dg->rcmsgs);
+	free(dg->results);
+	free(dg->smsgs);
+	free(dg->siov);
+	free(dg->saddrs);
+	free(dg->sbufs);
+	free(dg);
+}
+
+wand_dgram_t *wand_add_dgram(wand_event_handler_t *ev_hdl, int fd,
+		int flags, int batch, size_t slotsize,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				struct wand_dgram_msg_t *msgs, int nmsgs,
+				void *data),
+		void *data) {
+	struct wand_dgram_t *dg;
+	int i, one = 1;
+
+	if (batch <= 0 || slotsize == 0)
+		return NULL;
+
+	dg = (struct wand_dgram_t *)calloc(1, sizeof(struct wand_dgram_t));
+	if (dg == NULL)
+		return NULL;
+	dg->fd = fd;
+	dg->flags = flags;
+	dg->batch = batch;
+	dg->slotsize = slotsize;
+	dg->callback = callback;
+	dg->data = data;
+	dg->ev_hdl = ev_hdl;
+
+	dg->rmsgs = (struct mmsghdr *)calloc(batch, sizeof(struct mmsghdr));
+	dg->riov = (struct iovec *)calloc(batch, sizeof(struct iovec));
+	dg->raddrs = (struct sockaddr_storage *)calloc(batch,
+			sizeof(struct sockaddr_storage));
+	dg->rbufs = (char *)malloc(batch * slotsize);
+	dg->rcmsgs = (char *)calloc(batch, DGRAM_CMSG_SPACE);
+	dg->results = (struct wand_dgram_msg_t *)calloc(batch,
+			sizeof(struct wand_dgram_msg_t));
+	dg->smsgs = (struct mmsghdr *)calloc(batch, sizeof(struct mmsghdr));
+	dg->siov = (struct iovec *)calloc(batch, sizeof(struct iovec));
+	dg->saddrs = (struct sockaddr_storage *)calloc(batch,
+			sizeof(struct sockaddr_storage));
+	dg->sbufs = (char *)malloc(batch * slotsize);
+
+	if (!dg->rmsgs || !dg->riov || !dg->raddrs || !dg->rbufs ||
+			!dg->rcmsgs || !dg->results || !dg->smsgs ||
+			!dg->siov || !dg->saddrs || !dg->sbufs) {
+		free_dgram(dg);
+		return NULL;
+	}
+
+	for (i = 0; i < batch; i++) {
+		dg->riov[i].iov_base = dg->rbufs + i * slotsize;
+		dg->riov[i].iov_len = slotsize;
+		dg->rmsgs[i].msg_hdr.msg_iov = &dg->riov[i];
+		dg->rmsgs[i].msg_hdr.msg_iovlen = 1;
+
+		dg->siov[i].iov_base = dg->sbufs + i * slotsize;
+		dg->smsgs[i].msg_hdr.msg_iov = &dg->siov[i];
+		dg->smsgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	reset_rslots(dg, batch);
+
+	/* Ask for the extra bits of information we can report. None of these
+	 * are essential, so don't worry too much if they aren't supported */
+#ifdef UDP_GRO
+	if (flags & WAND_DGRAM_GRO)
+		setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one));
+#endif
+#ifdef SO_TIMESTAMPNS
+	if (flags & WAND_DGRAM_TIMESTAMP)
+		setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+#endif
+#ifdef SO_RXQ_OVFL
+	setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+#endif
+	(void)one;
+
+	if (wand_add_fd(ev_hdl, fd, EV_READ, dg, dgram_event) == NULL) {
+		free_dgram(dg);
+		return NULL;
+	}
+
+	dg->hook.callback = dgram_prepare;
+	dg->hook.data = dg;
+	wand_add_prepare_hook(ev_hdl, &dg->hook);
+	return dg;
+}
+
+void wand_del_dgram(wand_event_handler_t *ev_hdl, wand_dgram_t *dg) {
+	/* Give anything still queued one last chance to go out */
+	if (!dg->blocked)
+		dgram_flush(dg);
+
+	wand_del_prepare_hook(ev_hdl, &dg->hook);
+	wand_del_fd(ev_hdl, dg->fd);
+	free_dgram(dg);
+}
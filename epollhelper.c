@@ -30,6 +30,8 @@
  *
  */
 
+#include "config.h"
+
 #include <sys/select.h>
 #include <sys/epoll.h>
 #include <stdlib.h>
@@ -40,6 +42,7 @@
 #include <sys/ioctl.h>
 
 #include "epollhelper.h"
+#include "eventinternal.h"
 void set_epoll_event(struct epoll_event *epev, int fd,
                 int flags) {
 
@@ -48,6 +51,7 @@ void set_epoll_event(struct epoll_event *epev, int fd,
 
         if (flags & EV_READ)  epev->events |= (EPOLLIN | EPOLLRDHUP);
         if (flags & EV_WRITE) epev->events |= EPOLLOUT;
+        if (flags & EV_EXCEPT) epev->events |= EPOLLPRI;
 
 }
 
@@ -57,17 +61,19 @@ struct epoll_event *create_epoll_event(wand_event_handler_t *ev_hdl,
         struct epoll_event *epev = NULL;
         int ret = 0;
 
-        epev = (struct epoll_event *)calloc(1, sizeof(struct epoll_event));
+        epev = (struct epoll_event *)wand_handler_alloc(ev_hdl,
+                        sizeof(struct epoll_event));
         if (epev == NULL)
                 return NULL;
 
         set_epoll_event(epev, fd, flags);
         ret = epoll_ctl(ev_hdl->epoll_fd, EPOLL_CTL_ADD, fd, epev);
+        WAND_PROBE5(epoll_ctl, ev_hdl, EPOLL_CTL_ADD, fd, epev->events, ret);
 
         if (ret < 0) {
                 perror("epoll_ctl");
                 fprintf(stderr, "Error adding fd %d to epoll\n", fd);
-                free(epev);
+                wand_handler_free(ev_hdl, epev, sizeof(struct epoll_event));
                 return NULL;
         }
         return epev;
@@ -88,20 +94,42 @@ void process_epoll_event(wand_event_handler_t *ev_hdl,
 
         evcb = ev_hdl->fd_events[fd];
 
+        if (evcb->batch) {
+                int ready = 0;
+
+                /* Same rules as below, but all at once */
+                if (((evtype & EPOLLIN) &&
+                                (wand_fd_active_flags(evcb) & EV_READ)) ||
+                                ((evtype & (EPOLLHUP | EPOLLRDHUP)) &&
+                                (evcb->flags & EV_READ)))
+                        ready |= EV_READ;
+                if ((evtype & EPOLLOUT) &&
+                                (wand_fd_active_flags(evcb) & EV_WRITE))
+                        ready |= EV_WRITE;
+                if ((evtype & (EPOLLERR | EPOLLPRI)) &&
+                                (evcb->flags & EV_EXCEPT))
+                        ready |= EV_EXCEPT;
+                if (ready == 0 || wand_batch_queue(ev_hdl, evcb, ready) == 0)
+                        return;
+        }
+
         if (evcb->flags & EV_READ) {
 		/* epoll can give us multiple events for a single fd, so
 		 * we need to check for both new data and a hang up. Process
-		 * the data first, then check for a client disconnect.
+		 * the data first, then check for a client disconnect. A hang
+		 * up is passed on even if reading is suspended, as epoll
+		 * will keep reporting it regardless.
 		 */
-                if ((evtype & EPOLLIN) == EPOLLIN) {
-                        evcb->callback(ev_hdl, fd, evcb->data, EV_READ);
+                if ((evtype & EPOLLIN) == EPOLLIN &&
+                                (wand_fd_active_flags(evcb) & EV_READ)) {
+                        wand_fd_callback(ev_hdl, evcb, EV_READ);
                 }
 
         	evcb = ev_hdl->fd_events[fd];
 		if (evcb == NULL)
 			return;
                 if ((evtype & EPOLLHUP) || (evtype & EPOLLRDHUP))
-                        evcb->callback(ev_hdl, fd, evcb->data, EV_READ);
+                        wand_fd_callback(ev_hdl, evcb, EV_READ);
         }
 
         /* An earlier callback may invalidate our pointer... */
@@ -109,9 +137,20 @@ void process_epoll_event(wand_event_handler_t *ev_hdl,
         if (evcb == NULL)
                 return;
 
-        if ((evtype & EPOLLOUT) == EPOLLOUT && (evcb->flags & EV_WRITE)) {
+        if ((evtype & EPOLLOUT) == EPOLLOUT &&
+                        (wand_fd_active_flags(evcb) & EV_WRITE)) {
+
+                wand_fd_callback(ev_hdl, evcb, EV_WRITE);
+        }
+
+        evcb = ev_hdl->fd_events[fd];
+        if (evcb == NULL)
+                return;
 
-                evcb->callback(ev_hdl, fd, evcb->data, EV_WRITE);
+        /* epoll always reports errors, but only pass them on if the user
+         * has asked for exception events (e.g. to read the error queue) */
+        if ((evtype & (EPOLLERR | EPOLLPRI)) && (evcb->flags & EV_EXCEPT)) {
+                wand_fd_callback(ev_hdl, evcb, EV_EXCEPT);
         }
 
 }
@@ -123,6 +162,10 @@ int calculate_epoll_delay(wand_event_handler_t *ev_hdl,
         if (next) {
                 ms_delay = (next->expire.tv_sec - ev_hdl->monotonictime.tv_sec) * 1000;
                 ms_delay += ((next->expire.tv_usec - ev_hdl->monotonictime.tv_usec) / 1000);
+                /* The clock may have moved on since we checked the
+                 * timers, and a negative timeout would block forever */
+                if (ms_delay < 0)
+                        ms_delay = 0;
         } else {
                 ms_delay = -1;
         }
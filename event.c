@@ -36,10 +36,12 @@
 #include <sys/select.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <stdarg.h>
 #include <signal.h>
 #include "libwandevent.h"
+#include "eventinternal.h"
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
@@ -109,6 +111,8 @@ static void pipe_read(wand_event_handler_t *ev_hdl, int fd, void *data,
 		return;
 	}
 
+	WAND_PROBE2(signal, ev_hdl, signum);
+
 	/* Don't let any threaded programs mess with our set of signal
 	 * events while we're trying to invoke callbacks */
 	pthread_mutex_lock(&signal_mutex);
@@ -123,6 +127,7 @@ static void pipe_read(wand_event_handler_t *ev_hdl, int fd, void *data,
 	pthread_mutex_unlock(&signal_mutex);
 
 	if (signal != NULL) {
+		ev_hdl->stats.signals_delivered ++;
 		signal->callback(ev_hdl, signum, signal->data);
 	}
 }
@@ -180,19 +185,42 @@ int wand_event_init() {
 	return 1;
 }
 
+static void free_handler(wand_event_handler_t *wand_ev) {
+	if (wand_ev->numa)
+		wand_numa_destroy(wand_ev);
+	else
+		free(wand_ev);
+}
+
 /* Creates an event handler environment and initialises all the "global"
  * variables associated with it */
 wand_event_handler_t * wand_create_event_handler()
+{
+	return wand_create_event_handler_opts(NULL);
+}
+
+wand_event_handler_t * wand_create_event_handler_opts(
+		const struct wand_handler_opts_t *opts)
 {
 	wand_event_handler_t *wand_ev;
-	wand_ev = (wand_event_handler_t *)malloc(sizeof(wand_event_handler_t));
+
+	if (opts && (opts->ncpus > 0 || opts->flags != 0)) {
+		wand_ev = wand_numa_create(opts);
+	} else {
+		wand_ev = (wand_event_handler_t *)malloc(
+				sizeof(wand_event_handler_t));
+		if (wand_ev)
+			wand_ev->numa = NULL;
+	}
+	if (wand_ev == NULL)
+		return NULL;
 
 #if HAVE_SYS_EPOLL_H
 	wand_ev->epoll_fd = epoll_create(100);
 	if (wand_ev->epoll_fd < 0) {
 		perror("epoll_create");
 		fprintf(stderr, "Libwandevent failed to create epoll fd\n");
-		free(wand_ev);
+		free_handler(wand_ev);
 		return NULL;
 	}
 #else
@@ -211,6 +239,21 @@ wand_event_handler_t * wand_create_event_handler()
 	wand_ev->walltime.tv_usec=0;
 	wand_ev->monotonictime.tv_sec=0;
 	wand_ev->monotonictime.tv_usec=0;
+	wand_ev->virtualtime=false;
+	wand_ev->virtualoffset.tv_sec=0;
+	wand_ev->virtualoffset.tv_usec=0;
+	wand_ev->prepare_hooks=NULL;
+	wand_ev->mailbox=NULL;
+	wand_ev->workq=NULL;
+	wand_ev->fileio=NULL;
+	wand_ev->trace=NULL;
+	wand_ev->idle=NULL;
+	wand_ev->pacer=NULL;
+	wand_ev->overload=NULL;
+	wand_ev->control=NULL;
+	wand_ev->batch_pending=NULL;
+	wand_ev->executor=NULL;
+	memset(&wand_ev->stats, 0, sizeof(wand_ev->stats));
 
 	pthread_mutex_lock(&signal_mutex);
 	signal_users ++;
@@ -227,9 +270,10 @@ static void clear_timers(wand_event_handler_t *wand_ev) {
 	while (wand_ev->timers != NULL) {
 		tmp = wand_ev->timers;
 		wand_ev->timers = wand_ev->timers->next;
-		free(tmp);
+		wand_handler_free(wand_ev, tmp, sizeof(struct wand_timer_t));
 	}
 	wand_ev->timers_tail = NULL;
+	wand_ev->stats.timers = 0;
 
 }
 
@@ -265,13 +309,24 @@ static void clear_fds(wand_event_handler_t *wand_ev) {
 		if (wand_ev->fd_events[i])
 			wand_del_fd(wand_ev, i);
 	}
-	free(wand_ev->fd_events);
+	wand_handler_free_fd_table(wand_ev);
 
 }
 
 /* Frees all the resources associated with an event handler */
 void wand_destroy_event_handler(wand_event_handler_t *wand_ev) {
 
+	/* Do this first, as the done callbacks for outstanding work may
+	 * still want to use the handler */
+	wand_fileio_destroy(wand_ev);
+	wand_workqueue_destroy(wand_ev);
+	wand_mailbox_destroy(wand_ev);
+	wand_stop_control(wand_ev);
+	wand_trace_stop(wand_ev);
+	wand_idle_destroy(wand_ev);
+	wand_pacer_destroy(wand_ev);
+	wand_clear_overload(wand_ev);
+
 	clear_timers(wand_ev);
 
 	if (signals) {
@@ -285,7 +340,7 @@ void wand_destroy_event_handler(wand_event_handler_t *wand_ev) {
 	if (wand_ev->epoll_fd >= 0)
 		close(wand_ev->epoll_fd);
 
-	free(wand_ev);
+	free_handler(wand_ev);
 }
 
 /* Returns a timeval that is sec.usec seconds from the current monotonic time.
@@ -343,6 +398,8 @@ struct wand_signal_t *wand_add_signal(int signum, void *data,
 		signals[signal->signum] = signal;
 	} else {
 		/* This signal already has a callback for it */
+		pthread_mutex_unlock(&signal_mutex);
+		free(signal);
 		return NULL;
 
 	}
@@ -381,30 +438,32 @@ void wand_del_signal(int signum)
 			? (a).tv_usec - (b).tv_usec 	\
 			: (a).tv_sec - (b).tv_sec)
 
-/* Registers a timer event */
-struct wand_timer_t *wand_add_timer(wand_event_handler_t *ev_hdl,
-		int sec, int usec, void *data,
-		void (*callback)(wand_event_handler_t *ev_hdl, void *data))
+/* Timer states, stored in wand_timer_t.state */
+enum {
+	TIMER_PENDING,		/* Queued in the timer list */
+	TIMER_FIRING,		/* Has fired and is no longer queued */
+	TIMER_CANCELLED		/* Deleted during its own callback */
+};
+
+/* Also set in wand_timer_t.state while the timer's callback is running, as
+ * the callback may re-queue or delete the timer, but only wand_event_run()
+ * can free it */
+#define TIMER_IN_CALLBACK 0x100
+#define TIMER_STATE(timer) ((timer)->state & ~TIMER_IN_CALLBACK)
+
+/* Inserts a timer into the (sorted) timer list, based on its expire time.
+ * Timers with the same expiry time fire in the order they were inserted */
+static void insert_timer(wand_event_handler_t *ev_hdl,
+		struct wand_timer_t *timer)
 {
-
-	struct wand_timer_t *timer;
 	struct wand_timer_t *tmp = ev_hdl->timers_tail;
 
-	if (sec < 0 || usec < 0 || usec >= 1000000) {
-		fprintf(stderr, "Libwandevent: invalid expiry parameters: %d %d\n", sec, usec);
-		return NULL;
-	}
-
-
-	timer = (struct wand_timer_t *)malloc(sizeof(struct wand_timer_t));
-	timer->expire = wand_calc_expire(ev_hdl, sec, usec);
-	timer->callback = callback;
-	timer->data = data;
+	timer->state = TIMER_PENDING | (timer->state & TIMER_IN_CALLBACK);
 	timer->prev = timer->next = NULL;
 
 	if (ev_hdl->timers==NULL) {
 		ev_hdl->timers_tail=ev_hdl->timers=timer;
-		return timer;
+		return;
 	}
 	assert(ev_hdl->timers_tail->next == NULL);
 
@@ -421,12 +480,12 @@ struct wand_timer_t *wand_add_timer(wand_event_handler_t *ev_hdl,
 			timer->next = tmp->next;
 			timer->prev = tmp;
 			tmp->next = timer;
-			return timer;
+			return;
 		}
 		tmp = tmp->prev;
 	}
 
-	if (TV_CMP(tmp->expire, timer->expire) < 0) {
+	if (TV_CMP(tmp->expire, timer->expire) <= 0) {
 		if (tmp->next)
                 	tmp->next->prev = timer;
                 else
@@ -440,29 +499,11 @@ struct wand_timer_t *wand_add_timer(wand_event_handler_t *ev_hdl,
 		timer->prev = NULL;
 		ev_hdl->timers = timer;
 	}
-	return timer;
-}
-
-static void dump_timers(wand_event_handler_t *ev_hdl) {
-
-	struct wand_timer_t *t = ev_hdl->timers;
-	int c = 0;
-
-	while(t) {
-		fprintf(stderr, "%u.%u ", (uint32_t)t->expire.tv_sec,
-				(uint32_t)t->expire.tv_usec);
-		t = t->next;
-		c++;
-
-		assert(c<5);
-	}
-
-	fprintf(stderr, "\n");
-
 }
 
-/* Cancels a timer event */
-void wand_del_timer(wand_event_handler_t *ev_hdl, struct wand_timer_t *timer)
+/* Removes a timer from the timer list, without freeing it */
+static void unlink_timer(wand_event_handler_t *ev_hdl,
+		struct wand_timer_t *timer)
 {
 	assert(timer->prev!=(void*)0xdeadbeef);
 	assert(timer->next!=(void*)0xdeadbeef);
@@ -476,8 +517,112 @@ void wand_del_timer(wand_event_handler_t *ev_hdl, struct wand_timer_t *timer)
 	if (ev_hdl->timers_tail == timer) {
 		ev_hdl->timers_tail = timer->prev;
 	}
+	timer->prev=(void*)0xdeadbeef;
+	timer->next=(void*)0xdeadbeef;
+}
+
+/* Registers a timer event */
+struct wand_timer_t *wand_add_timer(wand_event_handler_t *ev_hdl,
+		int sec, int usec, void *data,
+		void (*callback)(wand_event_handler_t *ev_hdl, void *data))
+{
+
+	struct wand_timer_t *timer;
+
+	if (sec < 0 || usec < 0 || usec >= 1000000) {
+		fprintf(stderr, "Libwandevent: invalid expiry parameters: %d %d\n", sec, usec);
+		return NULL;
+	}
+
+
+	timer = (struct wand_timer_t *)wand_handler_alloc(ev_hdl,
+			sizeof(struct wand_timer_t));
+	if (timer == NULL)
+		return NULL;
+	timer->expire = wand_calc_expire(ev_hdl, sec, usec);
+	timer->deferred = timer->expire;
+	timer->callback = callback;
+	timer->data = data;
+	timer->state = TIMER_FIRING;
+
+	insert_timer(ev_hdl, timer);
+	ev_hdl->stats.timers ++;
+	WAND_TRACE(ev_hdl, TRACE_ADD_TIMER, 0, -1,
+			(int64_t)sec * 1000000 + usec, timer);
+	WAND_PROBE3(timer_add, ev_hdl, timer, (int64_t)sec * 1000000 + usec);
+	return timer;
+}
+
+/* Moves a timer event to a new expiry time. If the new expiry time is later
+ * than the current one, we just remember it and leave the timer where it is
+ * in the list -- wand_event_run() will requeue the timer when the original
+ * expiry time comes around. Bringing a timer forward has to requeue it
+ * immediately, though. */
+int wand_mod_timer(wand_event_handler_t *ev_hdl, struct wand_timer_t *timer,
+		int sec, int usec)
+{
+	struct timeval expire;
+
+	if (sec < 0 || usec < 0 || usec >= 1000000) {
+		fprintf(stderr, "Libwandevent: invalid expiry parameters: %d %d\n", sec, usec);
+		return -1;
+	}
+
+	expire = wand_calc_expire(ev_hdl, sec, usec);
+	WAND_TRACE(ev_hdl, TRACE_MOD_TIMER, 0, -1,
+			(int64_t)sec * 1000000 + usec, timer);
+	WAND_PROBE3(timer_mod, ev_hdl, timer, (int64_t)sec * 1000000 + usec);
+
+	/* A deleted timer can't be brought back */
+	if (TIMER_STATE(timer) == TIMER_CANCELLED)
+		return -1;
+
+	if (TIMER_STATE(timer) == TIMER_PENDING) {
+		if (TV_CMP(expire, timer->expire) >= 0) {
+			timer->deferred = expire;
+			return 0;
+		}
+		unlink_timer(ev_hdl, timer);
+	}
 
-	free(timer);
+	/* Either the timer is being brought forward, or we are inside the
+	 * timer's callback and it has already been removed from the list */
+	timer->expire = expire;
+	timer->deferred = expire;
+	insert_timer(ev_hdl, timer);
+	return 0;
+}
+
+/* How late a timer is firing, in nanoseconds */
+static int64_t timer_lateness(wand_event_handler_t *ev_hdl,
+		struct wand_timer_t *timer)
+{
+	return ((int64_t)(ev_hdl->monotonictime.tv_sec - timer->expire.tv_sec)
+			* 1000000 + (ev_hdl->monotonictime.tv_usec -
+			timer->expire.tv_usec)) * 1000;
+}
+
+/* Cancels a timer event */
+void wand_del_timer(wand_event_handler_t *ev_hdl, struct wand_timer_t *timer)
+{
+	WAND_TRACE(ev_hdl, TRACE_DEL_TIMER, 0, -1, 0, timer);
+	WAND_PROBE2(timer_del, ev_hdl, timer);
+
+	/* If we're inside the timer's callback, wand_event_run() still
+	 * holds a reference to it and will free it once the callback returns.
+	 * The callback may have re-armed it first, though */
+	if (timer->state & TIMER_IN_CALLBACK) {
+		if (TIMER_STATE(timer) == TIMER_PENDING)
+			unlink_timer(ev_hdl, timer);
+		timer->state = TIMER_CANCELLED | TIMER_IN_CALLBACK;
+		return;
+	}
+	if (TIMER_STATE(timer) != TIMER_PENDING)
+		return;
+
+	unlink_timer(ev_hdl, timer);
+	wand_handler_free(ev_hdl, timer, sizeof(struct wand_timer_t));
+	ev_hdl->stats.timers --;
 }
 
 /* Adds a file descriptor event */
@@ -499,16 +644,29 @@ struct wand_fdcb_t * wand_add_fd(wand_event_handler_t *ev_hdl,
 		}
 	}
 
-	evcb = (struct wand_fdcb_t *)malloc(sizeof(struct wand_fdcb_t));
+	evcb = (struct wand_fdcb_t *)wand_handler_alloc(ev_hdl,
+			sizeof(struct wand_fdcb_t));
+	if (evcb == NULL)
+		return NULL;
 	evcb->fd = fd;
 	evcb->flags = flags;
 	evcb->data = data;
 	evcb->callback = callback;
+	evcb->suspended = 0;
+	memset(evcb->suspend_count, 0, sizeof(evcb->suspend_count));
+	evcb->events = 0;
+	evcb->migratable = false;
+	evcb->batch = NULL;
 
 	if (evcb->fd>ev_hdl->maxfd) {
-		ev_hdl->fd_events=realloc(ev_hdl->fd_events,
-				sizeof(struct wand_fdcb_t)*(evcb->fd+1));
-		/* FIXME: Deal with OOM */
+		struct wand_fdcb_t **table;
+
+		table = wand_handler_fd_table(ev_hdl, evcb->fd);
+		if (table == NULL) {
+			wand_handler_free(ev_hdl, evcb, sizeof(struct wand_fdcb_t));
+			return NULL;
+		}
+		ev_hdl->fd_events = table;
 		while(ev_hdl->maxfd<evcb->fd) {
 			ev_hdl->fd_events[++(ev_hdl->maxfd)]=NULL;
 		}
@@ -519,7 +677,8 @@ struct wand_fdcb_t * wand_add_fd(wand_event_handler_t *ev_hdl,
 #if HAVE_SYS_EPOLL_H
 	evcb->internal = create_epoll_event(ev_hdl, fd, flags);
 	if (evcb->internal == NULL) {
-		free(evcb);
+		ev_hdl->fd_events[evcb->fd]=NULL;
+		wand_handler_free(ev_hdl, evcb, sizeof(struct wand_fdcb_t));
 		return NULL;
 	}
 #else
@@ -536,6 +695,8 @@ struct wand_fdcb_t * wand_add_fd(wand_event_handler_t *ev_hdl,
 	printf("\n");
 #endif
 
+	ev_hdl->stats.fds ++;
+	WAND_TRACE(ev_hdl, TRACE_ADD_FD, flags, fd, 0, callback);
 	return evcb;
 }
 
@@ -551,21 +712,19 @@ int wand_get_fd_flags(wand_event_handler_t *ev_hdl, int fd) {
 	return evcb->flags;
 }
 
-void wand_set_fd_flags(wand_event_handler_t *ev_hdl, int fd, int new_flags) {
-	struct wand_fdcb_t *evcb;
-	assert(fd>=0);
-
-	if (fd > ev_hdl->maxfd || ev_hdl->fd_events[fd] == NULL)
-		return;
-	evcb = ev_hdl->fd_events[fd];
-	assert(evcb->fd == fd);
-
-	evcb->flags = new_flags;
+/* Tells epoll (or select) which events we are currently interested in */
+static void update_fd_interest(wand_event_handler_t *ev_hdl,
+		struct wand_fdcb_t *evcb) {
+	int fd = evcb->fd;
+	int active = wand_fd_active_flags(evcb);
 
+	WAND_TRACE(ev_hdl, TRACE_MOD_FD, active, fd, evcb->flags, 0);
 #if HAVE_SYS_EPOLL_H
-	set_epoll_event((struct epoll_event *)evcb->internal, fd, evcb->flags);
+	set_epoll_event((struct epoll_event *)evcb->internal, fd, active);
 	int ret = epoll_ctl(ev_hdl->epoll_fd, EPOLL_CTL_MOD, fd,
 			(struct epoll_event *)evcb->internal);
+	WAND_PROBE5(epoll_ctl, ev_hdl, EPOLL_CTL_MOD, fd,
+			((struct epoll_event *)evcb->internal)->events, ret);
 	if (ret < 0) {
 		perror("epoll_ctl");
 		fprintf(stderr, "Error modifying fd %d within epoll\n", fd);
@@ -575,12 +734,60 @@ void wand_set_fd_flags(wand_event_handler_t *ev_hdl, int fd, int new_flags) {
 	FD_CLR(fd,&(ev_hdl->rfd));
 	FD_CLR(fd,&(ev_hdl->wfd));
 	FD_CLR(fd,&(ev_hdl->xfd));
-	if (evcb->flags & EV_READ)   FD_SET(evcb->fd,&(ev_hdl->rfd));
-	if (evcb->flags & EV_WRITE)  FD_SET(evcb->fd,&(ev_hdl->wfd));
-	if (evcb->flags & EV_EXCEPT) FD_SET(evcb->fd,&(ev_hdl->xfd));
+	if (active & EV_READ)   FD_SET(evcb->fd,&(ev_hdl->rfd));
+	if (active & EV_WRITE)  FD_SET(evcb->fd,&(ev_hdl->wfd));
+	if (active & EV_EXCEPT) FD_SET(evcb->fd,&(ev_hdl->xfd));
 #endif
 }
 
+void wand_set_fd_flags(wand_event_handler_t *ev_hdl, int fd, int new_flags) {
+	struct wand_fdcb_t *evcb;
+	assert(fd>=0);
+
+	if (fd > ev_hdl->maxfd || ev_hdl->fd_events[fd] == NULL)
+		return;
+	evcb = ev_hdl->fd_events[fd];
+	assert(evcb->fd == fd);
+
+	evcb->flags = new_flags;
+	update_fd_interest(ev_hdl, evcb);
+}
+
+/* Suspensions are counted separately for EV_READ, EV_WRITE and EV_EXCEPT,
+ * so that several things can suspend the same fd independently */
+void wand_suspend_fd(wand_event_handler_t *ev_hdl, int fd, int mask) {
+	struct wand_fdcb_t *evcb;
+	int before, i;
+
+	if (fd < 0 || fd > ev_hdl->maxfd || ev_hdl->fd_events[fd] == NULL)
+		return;
+	evcb = ev_hdl->fd_events[fd];
+	before = wand_fd_active_flags(evcb);
+	for (i = 0; i < 3; i++) {
+		if ((mask & (1 << i)) && evcb->suspend_count[i]++ == 0)
+			evcb->suspended |= 1 << i;
+	}
+	if (wand_fd_active_flags(evcb) != before)
+		update_fd_interest(ev_hdl, evcb);
+}
+
+void wand_resume_fd(wand_event_handler_t *ev_hdl, int fd, int mask) {
+	struct wand_fdcb_t *evcb;
+	int before, i;
+
+	if (fd < 0 || fd > ev_hdl->maxfd || ev_hdl->fd_events[fd] == NULL)
+		return;
+	evcb = ev_hdl->fd_events[fd];
+	before = wand_fd_active_flags(evcb);
+	for (i = 0; i < 3; i++) {
+		if ((mask & (1 << i)) && evcb->suspend_count[i] > 0 &&
+				--evcb->suspend_count[i] == 0)
+			evcb->suspended &= ~(1 << i);
+	}
+	if (wand_fd_active_flags(evcb) != before)
+		update_fd_interest(ev_hdl, evcb);
+}
+
 /* Cancels a file descriptor event */
 void wand_del_fd(wand_event_handler_t *ev_hdl, int fd)
 {
@@ -593,15 +800,24 @@ void wand_del_fd(wand_event_handler_t *ev_hdl, int fd)
 	assert(evcb->fd == fd);
 
 	ev_hdl->fd_events[fd]=NULL;
+	ev_hdl->stats.fds --;
+	WAND_TRACE(ev_hdl, TRACE_DEL_FD, 0, fd, 0, 0);
+	if (ev_hdl->idle)
+		wand_idle_forget(ev_hdl, fd);
+	if (ev_hdl->overload)
+		wand_overload_forget(ev_hdl, fd);
+	if (evcb->batch)
+		wand_batch_forget(evcb);
 #if HAVE_SYS_EPOLL_H
 	int ret = epoll_ctl(ev_hdl->epoll_fd, EPOLL_CTL_DEL, fd,
 			(struct epoll_event *)evcb->internal);
+	WAND_PROBE5(epoll_ctl, ev_hdl, EPOLL_CTL_DEL, fd, 0, ret);
 	if (ret < 0) {
 		perror("epoll_ctl");
 		fprintf(stderr, "Error removing fd %d from epoll (epollfd=%d)\n", fd, ev_hdl->epoll_fd);
 		return;
 	}
-	free(evcb->internal);
+	wand_handler_free(ev_hdl, evcb->internal, sizeof(struct epoll_event));
 #else
 	if (evcb->flags & EV_READ)   FD_CLR(fd,&(ev_hdl->rfd));
 	if (evcb->flags & EV_WRITE)  FD_CLR(fd,&(ev_hdl->wfd));
@@ -612,7 +828,7 @@ void wand_del_fd(wand_event_handler_t *ev_hdl, int fd)
 	printf("del events for %d\n",evcb->fd);
 #endif
 
-	free(evcb);
+	wand_handler_free(ev_hdl, evcb, sizeof(struct wand_fdcb_t));
 }
 
 #define NEXT_TIMER ev_hdl->timers
@@ -622,6 +838,18 @@ void wand_del_fd(wand_event_handler_t *ev_hdl, int fd)
  */
 struct timeval wand_get_walltime(wand_event_handler_t *ev_hdl)
 {
+	if (ev_hdl->virtualtime) {
+		ev_hdl->walltime.tv_sec = ev_hdl->monotonictime.tv_sec +
+				ev_hdl->virtualoffset.tv_sec;
+		ev_hdl->walltime.tv_usec = ev_hdl->monotonictime.tv_usec +
+				ev_hdl->virtualoffset.tv_usec;
+		if (ev_hdl->walltime.tv_usec >= 1000000) {
+			ev_hdl->walltime.tv_sec += 1;
+			ev_hdl->walltime.tv_usec -= 1000000;
+		}
+		return ev_hdl->walltime;
+	}
+
 	if (!ev_hdl->walltimeok) {
 		gettimeofday(&ev_hdl->walltime,NULL);
 		ev_hdl->walltimeok=true;
@@ -632,6 +860,10 @@ struct timeval wand_get_walltime(wand_event_handler_t *ev_hdl)
 
 struct timeval wand_get_monotonictime(wand_event_handler_t *ev_hdl)
 {
+	/* The virtual clock only moves when we move it */
+	if (ev_hdl->virtualtime)
+		return ev_hdl->monotonictime;
+
 #if defined _POSIX_MONOTONIC_CLOCK && (_POSIX_MONOTONIC_CLOCK > -1)
 	struct timespec ts;
 	if (!ev_hdl->monotonictimeok) {
@@ -649,8 +881,130 @@ struct timeval wand_get_monotonictime(wand_event_handler_t *ev_hdl)
 #endif
 }
 
+void wand_set_virtual_time(wand_event_handler_t *ev_hdl,
+		const struct timeval *start)
+{
+	struct timeval wall;
+
+	ev_hdl->virtualtime = false;
+	ev_hdl->walltimeok = false;
+	ev_hdl->monotonictimeok = false;
+	wall = wand_get_walltime(ev_hdl);
+	if (start)
+		ev_hdl->monotonictime = *start;
+	else
+		wand_get_monotonictime(ev_hdl);
+
+	/* Keep the wall time and the virtual clock in step */
+	ev_hdl->virtualoffset.tv_sec = wall.tv_sec -
+			ev_hdl->monotonictime.tv_sec;
+	ev_hdl->virtualoffset.tv_usec = wall.tv_usec -
+			ev_hdl->monotonictime.tv_usec;
+	if (ev_hdl->virtualoffset.tv_usec < 0) {
+		ev_hdl->virtualoffset.tv_sec -= 1;
+		ev_hdl->virtualoffset.tv_usec += 1000000;
+	}
+	ev_hdl->virtualtime = true;
+}
+
+int wand_advance_time(wand_event_handler_t *ev_hdl, int sec, int usec)
+{
+	if (!ev_hdl->virtualtime) {
+		fprintf(stderr, "Libwandevent: can't advance time without a virtual clock\n");
+		return -1;
+	}
+	if (sec < 0 || usec < 0 || usec >= 1000000) {
+		fprintf(stderr, "Libwandevent: invalid time parameters: %d %d\n", sec, usec);
+		return -1;
+	}
+
+	ev_hdl->monotonictime = wand_calc_expire(ev_hdl, sec, usec);
+	return 0;
+}
+
+int wand_advance_time_to(wand_event_handler_t *ev_hdl,
+		const struct timeval *when)
+{
+	if (!ev_hdl->virtualtime) {
+		fprintf(stderr, "Libwandevent: can't advance time without a virtual clock\n");
+		return -1;
+	}
+	if (TV_CMP(*when, ev_hdl->monotonictime) < 0) {
+		fprintf(stderr, "Libwandevent: can't move the virtual clock backwards\n");
+		return -1;
+	}
+
+	ev_hdl->monotonictime = *when;
+	return 0;
+}
+
+/* Registers a hook to be run each time the event handler is about to wait
+ * for events */
+void wand_add_prepare_hook(wand_event_handler_t *ev_hdl,
+		struct wand_hook_t *hook)
+{
+	hook->next = ev_hdl->prepare_hooks;
+	ev_hdl->prepare_hooks = hook;
+}
+
+void wand_del_prepare_hook(wand_event_handler_t *ev_hdl,
+		struct wand_hook_t *hook)
+{
+	struct wand_hook_t **h = &ev_hdl->prepare_hooks;
+
+	while (*h) {
+		if (*h == hook) {
+			*h = hook->next;
+			return;
+		}
+		h = &((*h)->next);
+	}
+}
+
+/* Runs the prepare hooks. Returns true if any of them still has work to do,
+ * in which case we shouldn't block waiting for events */
+static bool run_prepare_hooks(wand_event_handler_t *ev_hdl)
+{
+	struct wand_hook_t *hook = ev_hdl->prepare_hooks;
+	struct wand_hook_t *next;
+	bool busy = false;
+
+	while (hook) {
+		/* The hook may remove itself */
+		next = hook->next;
+		if (hook->callback(ev_hdl, hook->data))
+			busy = true;
+		hook = next;
+	}
+	return busy;
+}
+
 #define MAX_EVENTS 64
 
+static inline void count_wakeup(wand_event_handler_t *ev_hdl, int ready)
+{
+	ev_hdl->stats.iterations ++;
+	if (ready == 0)
+		ev_hdl->stats.empty_waits ++;
+	else if ((unsigned int)ready > ev_hdl->stats.max_ready)
+		ev_hdl->stats.max_ready = ready;
+}
+
+void wand_get_loop_stats(wand_event_handler_t *ev_hdl,
+		struct wand_loop_stats_t *stats)
+{
+	int i;
+
+	*stats = ev_hdl->stats;
+	stats->signals = 0;
+	pthread_mutex_lock(&signal_mutex);
+	for (i = 0; signals && i <= maxsig; i++) {
+		if (signals[i])
+			stats->signals ++;
+	}
+	pthread_mutex_unlock(&signal_mutex);
+}
+
 /* Starts up the event handler. Essentially, the event handler will loop
  * infinitely until an error occurs or an event callback sets the running
  * variable to false.
@@ -659,6 +1013,7 @@ void wand_event_run(wand_event_handler_t *ev_hdl)
 {
 	struct wand_timer_t *tmp = 0;
 	sigset_t current_sig;
+	bool busy;
 
 #if HAVE_SYS_EPOLL_H
 	struct epoll_event epoll_evs[MAX_EVENTS];
@@ -674,6 +1029,9 @@ void wand_event_run(wand_event_handler_t *ev_hdl)
 #endif
 
 
+	if (ev_hdl->numa)
+		wand_numa_pin(ev_hdl);
+
 	while (ev_hdl->running) {
 		pthread_mutex_lock(&signal_mutex);
 		current_sig = active_sig;
@@ -683,9 +1041,12 @@ void wand_event_run(wand_event_handler_t *ev_hdl)
 		wand_get_monotonictime(ev_hdl);
 
 
-		/* Check for timer events that have fired */
+		/* Check for timer events that have fired. On a virtual clock
+		 * we land exactly on a timer's expiry time, so that has to
+		 * count as having fired */
 		while(NEXT_TIMER &&
-			TV_CMP(ev_hdl->monotonictime, NEXT_TIMER->expire)>0)
+			TV_CMP(ev_hdl->monotonictime, NEXT_TIMER->expire) >
+					(ev_hdl->virtualtime ? -1 : 0))
 		{
 			assert(NEXT_TIMER->prev == NULL);
 			tmp=NEXT_TIMER;
@@ -697,24 +1058,66 @@ void wand_event_run(wand_event_handler_t *ev_hdl)
 				ev_hdl->timers_tail=NULL;
 			tmp->prev=(void*)0xdeadbeef;
 			tmp->next=(void*)0xdeadbeef;
+
+			/* The timer has been pushed back since it was queued,
+			 * so requeue it at its new expiry time */
+			if (TV_CMP(tmp->deferred, tmp->expire) > 0) {
+				tmp->expire = tmp->deferred;
+				insert_timer(ev_hdl, tmp);
+				continue;
+			}
 #if EVENT_DEBUG
 			fprintf(stderr,"Timer expired\n");
 #endif
+			tmp->state = TIMER_FIRING | TIMER_IN_CALLBACK;
+			ev_hdl->stats.timers_fired ++;
+			WAND_PROBE4(timer_fire, ev_hdl, tmp,
+					timer_lateness(ev_hdl, tmp),
+					tmp->callback);
+			if (__builtin_expect(ev_hdl->trace != NULL, 0)) {
+				wand_trace_record(ev_hdl->trace,
+						TRACE_TIMER_START, 0, -1,
+						timer_lateness(ev_hdl, tmp),
+						(uintptr_t)tmp);
+			}
 			tmp->callback(ev_hdl, tmp->data);
-			free(tmp);
+			WAND_TRACE(ev_hdl, TRACE_TIMER_END, 0, -1, 0, tmp);
+			WAND_PROBE2(timer_end, ev_hdl, tmp);
+
+			/* The callback may have re-armed the timer using
+			 * wand_mod_timer(), in which case it is back in the
+			 * list and we must not free it */
+			tmp->state &= ~TIMER_IN_CALLBACK;
+			if (tmp->state != TIMER_PENDING) {
+				wand_handler_free(ev_hdl, tmp,
+						sizeof(struct wand_timer_t));
+				ev_hdl->stats.timers --;
+			}
 			if (!ev_hdl->running)
 				return;
 		}
 
+		/* Give anything that batches up work during an iteration a
+		 * chance to flush it before we go to sleep */
+		busy = run_prepare_hooks(ev_hdl);
+		if (!ev_hdl->running)
+			return;
+
 		/* We want our upcoming select() to finish before the next
 		 * timer event is due to fire */
 #if HAVE_SYS_EPOLL_H
-		if (NEXT_TIMER)
+		if (busy || (ev_hdl->virtualtime && NEXT_TIMER))
+			ms_delay = 0;
+		else if (NEXT_TIMER)
 			ms_delay = calculate_epoll_delay(ev_hdl, NEXT_TIMER);
 		else
 			ms_delay = -1;
 #else
-		if (NEXT_TIMER) {
+		if (busy || (ev_hdl->virtualtime && NEXT_TIMER)) {
+			delay.tv_sec = 0;
+			delay.tv_usec = 0;
+			delayp = &delay;
+		} else if (NEXT_TIMER) {
 			delay = calculate_select_delay(ev_hdl, NEXT_TIMER);
 			delayp = &delay;
 		} else {
@@ -731,6 +1134,10 @@ void wand_event_run(wand_event_handler_t *ev_hdl)
 
 
 #if HAVE_SYS_EPOLL_H
+		WAND_TRACE(ev_hdl, TRACE_WAIT_START, 0, -1,
+				ms_delay < 0 ? -1 : (int64_t)ms_delay * 1000, 0);
+		WAND_PROBE2(wait_start, ev_hdl,
+				ms_delay < 0 ? -1 : (int64_t)ms_delay * 1000);
 		do {
 			fdevents = epoll_wait(ev_hdl->epoll_fd,
 					epoll_evs, MAX_EVENTS, ms_delay);
@@ -740,11 +1147,18 @@ void wand_event_run(wand_event_handler_t *ev_hdl)
 				return;
 			}
 		} while (fdevents == -1);
+		WAND_TRACE(ev_hdl, TRACE_WAIT_END, 0, -1, fdevents, 0);
+		WAND_PROBE2(wait_end, ev_hdl, fdevents);
 #else
 		xrfd = ev_hdl->rfd;
 		xwfd = ev_hdl->wfd;
 		xxfd = ev_hdl->xfd;
 
+		WAND_TRACE(ev_hdl, TRACE_WAIT_START, 0, -1, delayp == NULL ? -1 :
+				(int64_t)delay.tv_sec * 1000000 + delay.tv_usec,
+				0);
+		WAND_PROBE2(wait_start, ev_hdl, delayp == NULL ? -1 :
+				(int64_t)delay.tv_sec * 1000000 + delay.tv_usec);
 		/* This select will wait for the next fd event to occur, or
 		 * for the next timer to be ready to fire */
 		do {
@@ -756,12 +1170,43 @@ void wand_event_run(wand_event_handler_t *ev_hdl)
 				return;
 			}
 		} while (retval == -1);
+		WAND_TRACE(ev_hdl, TRACE_WAIT_END, 0, -1, retval, 0);
+		WAND_PROBE2(wait_end, ev_hdl, retval);
 #endif
 
 		/* Invalidate the clocks */
 		ev_hdl->walltimeok=false;
 		ev_hdl->monotonictimeok=false;
 
+#if HAVE_SYS_EPOLL_H
+		count_wakeup(ev_hdl, fdevents);
+#else
+		count_wakeup(ev_hdl, retval);
+#endif
+
+		if (ev_hdl->overload)
+			wand_overload_wake(ev_hdl);
+
+		/* Activity on fds with inactivity timeouts is stamped with
+		 * this, rather than reading the clock every time */
+#if HAVE_SYS_EPOLL_H
+		if (ev_hdl->idle && fdevents > 0)
+#else
+		if (ev_hdl->idle && retval > 0)
+#endif
+			wand_idle_update(ev_hdl);
+
+		/* Nothing is going to happen before the next timer, so on a
+		 * virtual clock we may as well go straight there */
+#if HAVE_SYS_EPOLL_H
+		if (ev_hdl->virtualtime && fdevents == 0 && !busy && NEXT_TIMER
+#else
+		if (ev_hdl->virtualtime && retval == 0 && !busy && NEXT_TIMER
+#endif
+				&& TV_CMP(NEXT_TIMER->expire,
+					ev_hdl->monotonictime) > 0)
+			ev_hdl->monotonictime = NEXT_TIMER->expire;
+
 		/* Block all signal interrupts for signals that we are
 		 * handling again */
 		if (using_signals) {
@@ -781,5 +1226,7 @@ void wand_event_run(wand_event_handler_t *ev_hdl)
 			process_select_event(ev_hdl, fd, &xrfd, &xwfd, &xxfd);
 		}
 #endif
+		if (ev_hdl->batch_pending)
+			wand_batch_flush(ev_hdl);
 	}
 }
@@ -0,0 +1,339 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+#ifndef EVENTINTERNAL_H_
+#define EVENTINTERNAL_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include "libwandevent.h"
+#include "tracefmt.h"
+
+/* Internal interfaces shared between the various parts of libwandevent.
+ * None of this is installed or part of the public API. */
+
+/* A message that can be posted to an event handler from any thread. The
+ * callback is invoked on the thread running wand_event_run() for that
+ * handler. The message memory belongs to the poster -- the callback is
+ * responsible for freeing it, if required */
+struct wand_mailbox_msg_t {
+	void (*callback)(wand_event_handler_t *ev_hdl, void *data);
+	void *data;
+	struct wand_mailbox_msg_t *next;
+};
+
+/* A hook that is run every time an event handler is about to wait for
+ * events, after any expired timers have been fired. If the callback returns
+ * non-zero, the handler will only poll for events rather than blocking */
+struct wand_hook_t {
+	int (*callback)(wand_event_handler_t *ev_hdl, void *data);
+	void *data;
+	struct wand_hook_t *next;
+};
+
+void wand_add_prepare_hook(wand_event_handler_t *ev_hdl,
+		struct wand_hook_t *hook);
+void wand_del_prepare_hook(wand_event_handler_t *ev_hdl,
+		struct wand_hook_t *hook);
+
+/* Creates the mailbox for an event handler, if it doesn't already exist.
+ * Must be called from the thread that owns the handler */
+int wand_mailbox_init(wand_event_handler_t *ev_hdl);
+
+/* Posts a message to an event handler. Safe to call from any thread, but
+ * the mailbox must have been created first */
+void wand_mailbox_post(wand_event_handler_t *ev_hdl,
+		struct wand_mailbox_msg_t *msg);
+
+/* Delivers any messages that are waiting in the mailbox */
+void wand_mailbox_flush(wand_event_handler_t *ev_hdl);
+
+/* Delivers any outstanding messages and frees the mailbox */
+void wand_mailbox_destroy(wand_event_handler_t *ev_hdl);
+
+/* Shuts down the worker threads and frees the work queue */
+void wand_workqueue_destroy(wand_event_handler_t *ev_hdl);
+
+/* Completes any outstanding file I/O and frees the file I/O state */
+void wand_fileio_destroy(wand_event_handler_t *ev_hdl);
+
+struct wand_executor_t;
+
+/* Creates the task deques for a loop group's handlers */
+int wand_executor_create(wand_loop_group_t *group, int queue_size,
+		struct wand_executor_t **execp);
+
+/* Cancels any tasks that are left and frees the executor. The loops must
+ * have stopped */
+void wand_executor_destroy(struct wand_executor_t *exec);
+
+struct wand_rebalancer_t;
+
+/* Starts the rebalance timers for a loop group's handlers */
+int wand_rebalancer_create(wand_loop_group_t *group,
+		const struct wand_rebalance_opts_t *opts,
+		struct wand_rebalancer_t **rbp);
+
+/* Removes the rebalance timers. The loops must have stopped */
+void wand_rebalancer_destroy(struct wand_rebalancer_t *rb);
+
+/* Creates a shared fd set and registers it with a loop group's handlers */
+int wand_shared_create(wand_loop_group_t *group, int batch,
+		wand_shared_t **shp);
+
+/* Frees a shared fd set. The loops must have stopped */
+void wand_shared_destroy(wand_shared_t *sh);
+
+/* USDT probes, built with --enable-usdt. All probes are in the
+ * libwandevent provider, and take the event handler as their first
+ * argument:
+ *
+ *	wait_start(ev_hdl, timeout in usec or -1)
+ *	wait_end(ev_hdl, number of ready fds)
+ *	fd_start(ev_hdl, fd, event type, callback)
+ *	fd_end(ev_hdl, fd, event type)
+ *	timer_add(ev_hdl, timer, delay in usec)
+ *	timer_mod(ev_hdl, timer, delay in usec)
+ *	timer_del(ev_hdl, timer)
+ *	timer_fire(ev_hdl, timer, lateness in nsec, callback)
+ *	timer_end(ev_hdl, timer)
+ *	signal(ev_hdl, signum)
+ *	epoll_ctl(ev_hdl, op, fd, events, return value)
+ *
+ * The arguments aren't evaluated at all unless the probes are built */
+#if ENABLE_USDT
+ #include <sys/sdt.h>
+ #define WAND_PROBE2(name, a, b) DTRACE_PROBE2(libwandevent, name, a, b)
+ #define WAND_PROBE3(name, a, b, c) \
+	DTRACE_PROBE3(libwandevent, name, a, b, c)
+ #define WAND_PROBE4(name, a, b, c, d) \
+	DTRACE_PROBE4(libwandevent, name, a, b, c, d)
+ #define WAND_PROBE5(name, a, b, c, d, e) \
+	DTRACE_PROBE5(libwandevent, name, a, b, c, d, e)
+#else
+ #define WAND_PROBE2(name, a, b) do { } while (0)
+ #define WAND_PROBE3(name, a, b, c) do { } while (0)
+ #define WAND_PROBE4(name, a, b, c, d) do { } while (0)
+ #define WAND_PROBE5(name, a, b, c, d, e) do { } while (0)
+#endif
+
+/* An event trace being recorded by a handler, see trace.c */
+struct wand_trace_t {
+	struct wand_trace_header_t *hdr;
+	struct wand_trace_record_t *records;
+	/* Our copy of hdr->head, which only we write to */
+	uint64_t head;
+	uint64_t mask;
+	size_t maplen;
+	int fd;
+};
+
+static inline uint64_t wand_trace_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline void wand_trace_record(struct wand_trace_t *trace, int type,
+		int evtype, int fd, int64_t arg, uint64_t id) {
+	struct wand_trace_record_t *rec;
+
+	rec = &trace->records[trace->head & trace->mask];
+	rec->ticks = wand_trace_ticks();
+	rec->type = type;
+	rec->evtype = evtype;
+	rec->fd = fd;
+	rec->arg = arg;
+	rec->id = id;
+	/* Anyone reading the file while we are running can trust everything
+	 * before head */
+	__atomic_store_n(&trace->hdr->head, ++trace->head, __ATOMIC_RELEASE);
+}
+
+#define WAND_TRACE(ev_hdl, type, evtype, fd, arg, id) \
+	do { \
+		if (__builtin_expect((ev_hdl)->trace != NULL, 0)) \
+			wand_trace_record((ev_hdl)->trace, (type), (evtype), \
+					(fd), (arg), (uint64_t)(uintptr_t)(id)); \
+	} while (0)
+
+/* Inactivity timeout state for an fd, see idle.c */
+struct wand_idle_fd_t {
+	int fd;
+	/* Timeouts, in ticks of WAND_IDLE_RESOLUTION ms, or 0 if unused */
+	uint64_t read_ticks;
+	uint64_t write_ticks;
+	/* When the callback last fired for each direction */
+	uint64_t last_read;
+	uint64_t last_write;
+	/* The tick of the wheel bucket we are in */
+	uint64_t deadline;
+	struct wand_idle_fd_t *next;
+	struct wand_idle_fd_t **pprev;
+};
+
+struct wand_idle_t {
+	/* Indexed by fd */
+	struct wand_idle_fd_t **fds;
+	int maxfd;
+	/* Current tick, updated each time the handler wakes up */
+	uint64_t now;
+	/* Buckets before this tick have been processed */
+	uint64_t cur_tick;
+	struct wand_idle_fd_t *wheel[1024];
+	/* Buckets that might have something in them */
+	uint64_t occupied[1024 / 64];
+	struct wand_timer_t *timer;
+	uint64_t timer_tick;
+	/* True while expired buckets are being processed */
+	bool turning;
+};
+
+/* Forgets any timeouts for an fd whose event is being removed */
+void wand_idle_forget(wand_event_handler_t *ev_hdl, int fd);
+
+/* Brings the timeout clock up to date after waiting for events */
+void wand_idle_update(wand_event_handler_t *ev_hdl);
+
+/* Frees the timeout state */
+void wand_idle_destroy(wand_event_handler_t *ev_hdl);
+
+/* Resets the inactivity timeout for an fd, if it has one */
+static inline void wand_idle_touch(wand_event_handler_t *ev_hdl, int fd,
+		int ev) {
+	struct wand_idle_t *idle = ev_hdl->idle;
+	struct wand_idle_fd_t *st;
+
+	if (fd > idle->maxfd || (st = idle->fds[fd]) == NULL)
+		return;
+	if (ev & EV_READ)
+		st->last_read = idle->now;
+	if (ev & EV_WRITE)
+		st->last_write = idle->now;
+}
+
+/* Stops pacing rate limiters and frees the pacing state */
+void wand_pacer_destroy(wand_event_handler_t *ev_hdl);
+
+/* Allocates memory for a timer, fd event or similar, from the handler's
+ * NUMA-local pools if it has them. Must be freed with wand_handler_free(),
+ * passing the same size */
+void *wand_handler_alloc(wand_event_handler_t *ev_hdl, size_t size);
+void wand_handler_free(wand_event_handler_t *ev_hdl, void *ptr, size_t size);
+
+/* Returns an fd table with room for fds up to maxfd, keeping the contents
+ * of the current one, or NULL if that isn't possible */
+struct wand_fdcb_t **wand_handler_fd_table(wand_event_handler_t *ev_hdl,
+		int maxfd);
+void wand_handler_free_fd_table(wand_event_handler_t *ev_hdl);
+
+/* Allocates a handler with NUMA-local memory. Only the numa field is set */
+wand_event_handler_t *wand_numa_create(
+		const struct wand_handler_opts_t *opts);
+
+/* Frees the handler's memory, including the handler itself */
+void wand_numa_destroy(wand_event_handler_t *ev_hdl);
+
+/* Pins the calling thread to the handler's CPUs */
+void wand_numa_pin(wand_event_handler_t *ev_hdl);
+
+/* Notes when the handler woke up, for measuring callback time */
+void wand_overload_wake(wand_event_handler_t *ev_hdl);
+
+/* Forgets that an fd is sheddable, as its event is being removed */
+void wand_overload_forget(wand_event_handler_t *ev_hdl, int fd);
+
+/* Returns the events that are suspended for an fd while shedding */
+int wand_overload_shed_flags(wand_event_handler_t *ev_hdl, int fd);
+
+/* Queues a ready fd for its batch class's callback. Returns -1 if it
+ * couldn't be queued, in which case its own callback should be run */
+int wand_batch_queue(wand_event_handler_t *ev_hdl, struct wand_fdcb_t *evcb,
+		int ready);
+
+/* Runs the callback for every batch class with ready fds queued */
+void wand_batch_flush(wand_event_handler_t *ev_hdl);
+
+/* Takes an fd out of its batch class, as its event is being removed */
+void wand_batch_forget(struct wand_fdcb_t *evcb);
+
+/* Finds the first c in [p, end), or returns NULL. wand_find_byte uses the
+ * fastest of the others that the CPU supports. They are only exported for
+ * the sake of framing-bench */
+extern const uint8_t *(*wand_find_byte)(const uint8_t *p, const uint8_t *end,
+		uint8_t c);
+const uint8_t *wand_find_byte_scalar(const uint8_t *p, const uint8_t *end,
+		uint8_t c);
+#if defined(__x86_64__) || defined(__i386__)
+const uint8_t *wand_find_byte_sse2(const uint8_t *p, const uint8_t *end,
+		uint8_t c);
+const uint8_t *wand_find_byte_avx2(const uint8_t *p, const uint8_t *end,
+		uint8_t c);
+#endif
+
+/* The events that we are actually watching for on an fd */
+static inline int wand_fd_active_flags(struct wand_fdcb_t *evcb) {
+	return evcb->flags & ~evcb->suspended;
+}
+
+/* Temporarily stops watching for (or resumes watching for) the events in
+ * mask on an fd, without changing the flags the user asked for. Every
+ * suspension must be matched by a resume */
+void wand_suspend_fd(wand_event_handler_t *ev_hdl, int fd, int mask);
+void wand_resume_fd(wand_event_handler_t *ev_hdl, int fd, int mask);
+
+/* Runs the callback for an fd event, tracing it if required. The event may
+ * be freed by the callback, so evcb must not be used afterwards */
+static inline void wand_fd_callback(wand_event_handler_t *ev_hdl,
+		struct wand_fdcb_t *evcb, enum wand_eventtype_t ev) {
+	int fd = evcb->fd;
+	uintptr_t cb = (uintptr_t)evcb->callback;
+
+	WAND_PROBE4(fd_start, ev_hdl, fd, ev, cb);
+	ev_hdl->stats.fd_callbacks ++;
+	evcb->events ++;
+	if (ev_hdl->idle)
+		wand_idle_touch(ev_hdl, fd, ev);
+	if (__builtin_expect(ev_hdl->trace == NULL, 1)) {
+		evcb->callback(ev_hdl, fd, evcb->data, ev);
+	} else {
+		wand_trace_record(ev_hdl->trace, TRACE_FD_START, ev, fd, 0,
+				cb);
+		evcb->callback(ev_hdl, fd, evcb->data, ev);
+		WAND_TRACE(ev_hdl, TRACE_FD_END, ev, fd, 0, cb);
+	}
+	WAND_PROBE3(fd_end, ev_hdl, fd, ev);
+}
+
+#endif
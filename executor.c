@@ -0,0 +1,445 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Work-stealing executor for the loops in a loop group.
+ *
+ * Each loop has a Chase-Lev deque of deferred tasks. A loop pushes tasks
+ * onto the bottom of its own deque and takes them back from the bottom
+ * (newest first, while their data is still in cache), while other loops
+ * steal from the top (oldest first). Only stealing needs an atomic
+ * read-modify-write, and only the owner ever touches the bottom.
+ *
+ * Tasks are run from a prepare hook, i.e. when a loop has finished with
+ * its events and is about to wait for more. A loop with nothing of its own
+ * to do steals from the others before it goes to sleep. A loop that is
+ * sleeping won't notice new tasks, so a loop that defers a task wakes one
+ * sleeping loop through its mailbox, if there are any. Loops say they are
+ * going to sleep, and then check every deque once more, so that a task
+ * can't be pushed without either a wakeup or the sleeper seeing it. */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+#define CACHE_LINE 64
+/* Default size of each loop's deque */
+#define DEFAULT_QUEUE_SIZE 4096
+/* Most tasks run per pass through the event loop, so that a long queue of
+ * tasks can't hold up the loop's own events for too long */
+#define TASK_BUDGET 8
+
+struct wand_task_t {
+	void (*fn)(void *data);
+	void (*done)(wand_event_handler_t *ev_hdl, void *data,
+			bool cancelled);
+	void *data;
+	int flags;
+	/* The loop that deferred the task */
+	wand_event_handler_t *origin;
+	/* Used to send the completion back to the origin */
+	struct wand_mailbox_msg_t msg;
+};
+
+struct wand_exec_loop_t {
+	/* Next task to steal. Written by thieves and, when the deque is
+	 * down to its last task, by the owner */
+	int64_t top __attribute__((aligned(CACHE_LINE)));
+	/* Next free slot. Only ever written by the owner */
+	int64_t bottom __attribute__((aligned(CACHE_LINE)));
+
+	/* Set while the loop is, or is about to be, blocked waiting for
+	 * events */
+	int sleeping __attribute__((aligned(CACHE_LINE)));
+	/* Set while wake_msg is sitting in the loop's mailbox */
+	int wake_pending;
+
+	struct wand_task_t **tasks __attribute__((aligned(CACHE_LINE)));
+	int64_t mask;
+
+	struct wand_executor_t *exec;
+	int index;
+	wand_event_handler_t *ev_hdl;
+	struct wand_hook_t hook;
+	struct wand_mailbox_msg_t wake_msg;
+	/* For picking which loop to steal from first */
+	uint32_t seed;
+
+	struct wand_executor_stats_t stats;
+};
+
+struct wand_executor_t {
+	int nloops;
+	struct wand_exec_loop_t **loops;
+	/* Number of loops with sleeping set */
+	int nsleeping __attribute__((aligned(CACHE_LINE)));
+};
+
+/* Owner only: adds a task to the bottom of the deque */
+static bool deque_push(struct wand_exec_loop_t *loop,
+		struct wand_task_t *task) {
+	int64_t b = __atomic_load_n(&loop->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&loop->top, __ATOMIC_ACQUIRE);
+
+	if (b - t > loop->mask)
+		return false;
+	__atomic_store_n(&loop->tasks[b & loop->mask], task, __ATOMIC_RELAXED);
+	/* Publishes the task to thieves */
+	__atomic_store_n(&loop->bottom, b + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Owner only: takes the newest task back from the bottom of the deque */
+static struct wand_task_t *deque_take(struct wand_exec_loop_t *loop) {
+	int64_t b = __atomic_load_n(&loop->bottom, __ATOMIC_RELAXED) - 1;
+	int64_t t;
+	struct wand_task_t *task;
+
+	__atomic_store_n(&loop->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&loop->top, __ATOMIC_RELAXED);
+
+	if (t > b) {
+		/* Empty */
+		__atomic_store_n(&loop->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	task = __atomic_load_n(&loop->tasks[b & loop->mask], __ATOMIC_RELAXED);
+	if (t == b) {
+		/* This is the last task, so we are racing the thieves */
+		if (!__atomic_compare_exchange_n(&loop->top, &t, t + 1, false,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			task = NULL;
+		__atomic_store_n(&loop->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return task;
+}
+
+/* Any thread: takes the oldest task from the top of the deque. Returns
+ * NULL if the deque is empty or another thread got there first */
+static struct wand_task_t *deque_steal(struct wand_exec_loop_t *loop) {
+	int64_t t = __atomic_load_n(&loop->top, __ATOMIC_ACQUIRE);
+	int64_t b;
+	struct wand_task_t *task;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&loop->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return NULL;
+
+	task = __atomic_load_n(&loop->tasks[t & loop->mask], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&loop->top, &t, t + 1, false,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return task;
+}
+
+static bool deque_empty(struct wand_exec_loop_t *loop) {
+	return __atomic_load_n(&loop->top, __ATOMIC_ACQUIRE) >=
+			__atomic_load_n(&loop->bottom, __ATOMIC_ACQUIRE);
+}
+
+/* Runs on the origin's thread */
+static void task_returned(wand_event_handler_t *ev_hdl, void *data) {
+	struct wand_task_t *task = (struct wand_task_t *)data;
+
+	task->done(ev_hdl, task->data, false);
+	free(task);
+}
+
+static void run_task(struct wand_exec_loop_t *loop,
+		struct wand_task_t *task) {
+	task->fn(task->data);
+	loop->stats.run ++;
+
+	if (task->done == NULL) {
+		free(task);
+	} else if (!(task->flags & WAND_TASK_RETURN) ||
+			task->origin == loop->ev_hdl) {
+		task->done(loop->ev_hdl, task->data, false);
+		free(task);
+	} else {
+		task->msg.callback = task_returned;
+		task->msg.data = task;
+		wand_mailbox_post(task->origin, &task->msg);
+	}
+}
+
+/* Looks for a task in the other loops' deques, starting from a random
+ * one so that thieves don't all pile onto the same victim */
+static struct wand_task_t *steal_task(struct wand_exec_loop_t *loop) {
+	struct wand_executor_t *exec = loop->exec;
+	struct wand_task_t *task;
+	int i, victim;
+
+	loop->seed ^= loop->seed << 13;
+	loop->seed ^= loop->seed >> 17;
+	loop->seed ^= loop->seed << 5;
+	victim = loop->seed % exec->nloops;
+
+	for (i = 0; i < exec->nloops; i++, victim++) {
+		if (victim == exec->nloops)
+			victim = 0;
+		if (victim == loop->index)
+			continue;
+		task = deque_steal(exec->loops[victim]);
+		if (task) {
+			loop->stats.stolen ++;
+			return task;
+		}
+	}
+	return NULL;
+}
+
+static bool any_tasks(struct wand_executor_t *exec) {
+	int i;
+
+	for (i = 0; i < exec->nloops; i++) {
+		if (!deque_empty(exec->loops[i]))
+			return true;
+	}
+	return false;
+}
+
+static void wake_loop(wand_event_handler_t *ev_hdl, void *data) {
+	struct wand_exec_loop_t *loop = (struct wand_exec_loop_t *)data;
+
+	(void)ev_hdl;
+	/* Nothing else to do -- the prepare hook will look for tasks on the
+	 * way back to sleep */
+	__atomic_store_n(&loop->wake_pending, 0, __ATOMIC_RELEASE);
+}
+
+/* Wakes up one sleeping loop, if there are any, to help with a task that
+ * has just been pushed */
+static void wake_sleeper(struct wand_exec_loop_t *loop) {
+	struct wand_executor_t *exec = loop->exec;
+	struct wand_exec_loop_t *other;
+	int i, idx;
+
+	/* Pairs with the increment of nsleeping in executor_prepare() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&exec->nsleeping, __ATOMIC_RELAXED) == 0)
+		return;
+
+	for (i = 1; i < exec->nloops; i++) {
+		idx = (loop->index + i) % exec->nloops;
+		other = exec->loops[idx];
+		if (!__atomic_load_n(&other->sleeping, __ATOMIC_RELAXED) ||
+				!__atomic_exchange_n(&other->sleeping, 0,
+						__ATOMIC_ACQ_REL))
+			continue;
+		__atomic_sub_fetch(&exec->nsleeping, 1, __ATOMIC_RELAXED);
+		if (__atomic_exchange_n(&other->wake_pending, 1,
+				__ATOMIC_ACQ_REL) == 0)
+			wand_mailbox_post(other->ev_hdl, &other->wake_msg);
+		loop->stats.wakeups ++;
+		return;
+	}
+}
+
+static int executor_prepare(wand_event_handler_t *ev_hdl, void *data) {
+	struct wand_exec_loop_t *loop = (struct wand_exec_loop_t *)data;
+	struct wand_executor_t *exec = loop->exec;
+	struct wand_task_t *task;
+	int ran = 0;
+
+	(void)ev_hdl;
+
+	/* We're awake, whether or not somebody woke us */
+	if (__atomic_load_n(&loop->sleeping, __ATOMIC_RELAXED) &&
+			__atomic_exchange_n(&loop->sleeping, 0,
+					__ATOMIC_ACQ_REL))
+		__atomic_sub_fetch(&exec->nsleeping, 1, __ATOMIC_RELAXED);
+
+	while (ran < TASK_BUDGET) {
+		task = deque_take(loop);
+		if (task == NULL)
+			task = steal_task(loop);
+		if (task == NULL)
+			break;
+		run_task(loop, task);
+		ran ++;
+	}
+	/* Come straight back if there might be more to do */
+	if (ran > 0)
+		return 1;
+
+	__atomic_store_n(&loop->sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&exec->nsleeping, 1, __ATOMIC_SEQ_CST);
+	if (any_tasks(exec)) {
+		if (__atomic_exchange_n(&loop->sleeping, 0, __ATOMIC_ACQ_REL))
+			__atomic_sub_fetch(&exec->nsleeping, 1,
+					__ATOMIC_RELAXED);
+		return 1;
+	}
+	return 0;
+}
+
+int wand_executor_create(wand_loop_group_t *group, int queue_size,
+		struct wand_executor_t **execp) {
+	struct wand_executor_t *exec;
+	struct wand_exec_loop_t *loop;
+	int64_t size = 1;
+	void *mem;
+	int i, nloops = wand_loop_group_size(group);
+
+	if (queue_size <= 0)
+		queue_size = DEFAULT_QUEUE_SIZE;
+	while (size < queue_size)
+		size <<= 1;
+
+	exec = (struct wand_executor_t *)calloc(1,
+			sizeof(struct wand_executor_t));
+	if (exec == NULL)
+		return -1;
+	exec->loops = (struct wand_exec_loop_t **)calloc(nloops,
+			sizeof(struct wand_exec_loop_t *));
+	if (exec->loops == NULL) {
+		free(exec);
+		return -1;
+	}
+	exec->nloops = nloops;
+
+	for (i = 0; i < nloops; i++) {
+		if (posix_memalign(&mem, CACHE_LINE,
+				sizeof(struct wand_exec_loop_t)) != 0)
+			goto fail;
+		loop = (struct wand_exec_loop_t *)mem;
+		memset(loop, 0, sizeof(struct wand_exec_loop_t));
+		exec->loops[i] = loop;
+
+		loop->tasks = (struct wand_task_t **)calloc(size,
+				sizeof(struct wand_task_t *));
+		if (loop->tasks == NULL)
+			goto fail;
+		loop->mask = size - 1;
+		loop->exec = exec;
+		loop->index = i;
+		loop->ev_hdl = wand_loop_group_handler(group, i);
+		loop->seed = 2654435761U * (i + 1);
+		loop->wake_msg.callback = wake_loop;
+		loop->wake_msg.data = loop;
+		loop->hook.callback = executor_prepare;
+		loop->hook.data = loop;
+	}
+
+	/* Only hook in once everything has been allocated */
+	for (i = 0; i < nloops; i++) {
+		loop = exec->loops[i];
+		loop->ev_hdl->executor = loop;
+		wand_add_prepare_hook(loop->ev_hdl, &loop->hook);
+	}
+	*execp = exec;
+	return 0;
+
+fail:
+	for (i = 0; i < nloops; i++) {
+		if (exec->loops[i]) {
+			free(exec->loops[i]->tasks);
+			free(exec->loops[i]);
+		}
+	}
+	free(exec->loops);
+	free(exec);
+	return -1;
+}
+
+void wand_executor_destroy(struct wand_executor_t *exec) {
+	struct wand_exec_loop_t *loop;
+	struct wand_task_t *task;
+	int i;
+
+	/* The loops have stopped, so whatever is left will never run */
+	for (i = 0; i < exec->nloops; i++) {
+		loop = exec->loops[i];
+		/* wake_msg may still be in the mailbox */
+		wand_mailbox_flush(loop->ev_hdl);
+		while ((task = deque_take(loop)) != NULL) {
+			if (task->done)
+				task->done(task->origin, task->data, true);
+			free(task);
+		}
+		wand_del_prepare_hook(loop->ev_hdl, &loop->hook);
+		loop->ev_hdl->executor = NULL;
+	}
+	for (i = 0; i < exec->nloops; i++) {
+		free(exec->loops[i]->tasks);
+		free(exec->loops[i]);
+	}
+	free(exec->loops);
+	free(exec);
+}
+
+int wand_defer_task(wand_event_handler_t *ev_hdl, void (*fn)(void *data),
+		void (*done)(wand_event_handler_t *ev_hdl, void *data,
+				bool cancelled),
+		void *data, int flags) {
+	struct wand_exec_loop_t *loop = ev_hdl->executor;
+	struct wand_task_t *task;
+
+	if (loop == NULL) {
+		fprintf(stderr, "Libwandevent: handler has no executor\n");
+		return -1;
+	}
+
+	task = (struct wand_task_t *)malloc(sizeof(struct wand_task_t));
+	if (task == NULL)
+		return -1;
+	task->fn = fn;
+	task->done = done;
+	task->data = data;
+	task->flags = flags;
+	task->origin = ev_hdl;
+
+	if (!deque_push(loop, task)) {
+		loop->stats.full ++;
+		free(task);
+		return -1;
+	}
+	loop->stats.deferred ++;
+	wake_sleeper(loop);
+	return 0;
+}
+
+void wand_get_executor_stats(wand_event_handler_t *ev_hdl,
+		struct wand_executor_stats_t *stats) {
+	struct wand_exec_loop_t *loop = ev_hdl->executor;
+
+	if (loop == NULL) {
+		memset(stats, 0, sizeof(struct wand_executor_stats_t));
+		return;
+	}
+	*stats = loop->stats;
+	stats->queued = __atomic_load_n(&loop->bottom, __ATOMIC_RELAXED) -
+			__atomic_load_n(&loop->top, __ATOMIC_RELAXED);
+}
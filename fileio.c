@@ -0,0 +1,758 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Asynchronous file I/O.
+ *
+ * epoll and select always report regular files as ready, so a write to a
+ * busy disk from within a callback will block the entire event handler.
+ * Instead, file reads, writes and syncs are queued up during each iteration
+ * of the event loop and submitted just before the handler goes to sleep.
+ * Writes to the same fd that are queued in the same iteration and that are
+ * contiguous on disk are merged into a single vectored write.
+ *
+ * Requests are submitted to io_uring if the kernel supports it, with
+ * completions signalled through an eventfd that is registered with the
+ * handler. Otherwise, each batch of requests is handed to the worker thread
+ * pool (see workqueue.c).
+ *
+ * A sync must not overtake writes to the same fd that were queued before it,
+ * or it wouldn't make them durable. io_uring takes care of this for us with
+ * IOSQE_IO_DRAIN; with the thread pool, syncs are held back until those
+ * writes have completed. */
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#if HAVE_LINUX_IO_URING_H && HAVE_SYS_EVENTFD_H
+ #include <sys/mman.h>
+ #include <sys/syscall.h>
+ #include <sys/eventfd.h>
+ #include <linux/io_uring.h>
+ #if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && \
+		defined(__NR_io_uring_register)
+  #define USE_IO_URING 1
+ #endif
+#endif
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+/* Maximum number of writes that will be merged into one request */
+#define MAX_BATCH_IOV 64
+/* Number of submission queue entries for io_uring */
+#define URING_ENTRIES 256
+
+enum {
+	FILEOP_READ,
+	FILEOP_WRITE,
+	FILEOP_FSYNC,
+	FILEOP_FDATASYNC
+};
+
+/* A single request, as made by the user */
+struct fileop_t {
+	int type;
+	int fd;
+	void *buf;
+	size_t len;
+	off_t offset;
+	void (*callback)(wand_event_handler_t *ev_hdl, int fd, void *buf,
+			ssize_t result, void *data);
+	void *data;
+	struct fileop_t *next;
+};
+
+/* One or more requests that are submitted as a single operation */
+struct filebatch_t {
+	int type;
+	int fd;
+	off_t offset;
+	size_t len;
+	int niov;
+	struct iovec iov[MAX_BATCH_IOV];
+	ssize_t result;
+
+	struct fileop_t *ops;
+	struct fileop_t *ops_tail;
+
+	/* Order in which batches were handed to the worker threads */
+	uint64_t seq;
+	/* Writes running on the worker threads are kept in a list, so that
+	 * we know when a sync can go ahead */
+	struct filebatch_t *wnext;
+	struct filebatch_t **wpprev;
+
+	struct wand_fileio_t *fio;
+	struct filebatch_t *next;
+};
+
+#if USE_IO_URING
+struct uring_t {
+	int fd;
+	/* eventfd that the kernel signals when completions are posted */
+	int efd;
+
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *sq_array;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	unsigned cq_entries;
+	struct io_uring_cqe *cqes;
+};
+#endif
+
+struct wand_fileio_t {
+	enum wand_file_backend_t backend;
+
+	/* Batches waiting to be submitted at the end of this iteration */
+	struct filebatch_t *staged;
+	struct filebatch_t *staged_tail;
+	/* Batches that have been submitted but not completed */
+	unsigned int inflight;
+
+	/* Writes given to the worker threads that haven't completed, and syncs
+	 * waiting for some of them to finish */
+	struct filebatch_t *writing;
+	struct filebatch_t *held;
+	uint64_t next_seq;
+	/* Set once the handler is being destroyed and the work queue can't
+	 * take any more work */
+	bool closing;
+
+	struct wand_hook_t hook;
+#if USE_IO_URING
+	struct uring_t ring;
+#endif
+};
+
+static int fileio_prepare(wand_event_handler_t *ev_hdl, void *data);
+static void release_syncs(wand_event_handler_t *ev_hdl,
+		struct wand_fileio_t *fio);
+
+/* Delivers the result of a batch to each of the requests within it */
+static void complete_batch(wand_event_handler_t *ev_hdl,
+		struct filebatch_t *batch) {
+	struct wand_fileio_t *fio = batch->fio;
+	struct fileop_t *op, *next;
+	ssize_t remaining = batch->result;
+	ssize_t res;
+	bool wrote = false;
+
+	fio->inflight --;
+
+	if (batch->wpprev) {
+		*batch->wpprev = batch->wnext;
+		if (batch->wnext)
+			batch->wnext->wpprev = batch->wpprev;
+		batch->wpprev = NULL;
+		wrote = true;
+	}
+
+	for (op = batch->ops; op != NULL; op = next) {
+		next = op->next;
+		if (batch->result < 0) {
+			res = batch->result;
+		} else if (op->type == FILEOP_FSYNC ||
+				op->type == FILEOP_FDATASYNC) {
+			res = 0;
+		} else {
+			/* A short transfer only affects the later requests
+			 * in a merged batch */
+			res = ((size_t)remaining < op->len) ? remaining :
+					(ssize_t)op->len;
+			remaining -= res;
+		}
+		if (op->callback)
+			op->callback(ev_hdl, op->fd, op->buf, res, op->data);
+		free(op);
+	}
+	free(batch);
+
+	/* Any syncs that were waiting on this write can go now, after its
+	 * callbacks have been run */
+	if (wrote && fio->held)
+		release_syncs(ev_hdl, fio);
+}
+
+/* Runs a batch synchronously. Used by worker threads, or as a last resort */
+static void run_batch(struct filebatch_t *batch) {
+	ssize_t ret;
+
+	switch (batch->type) {
+	case FILEOP_READ:
+		ret = preadv(batch->fd, batch->iov, batch->niov, batch->offset);
+		break;
+	case FILEOP_WRITE:
+		ret = pwritev(batch->fd, batch->iov, batch->niov,
+				batch->offset);
+		break;
+	case FILEOP_FSYNC:
+		ret = fsync(batch->fd);
+		break;
+	case FILEOP_FDATASYNC:
+		ret = fdatasync(batch->fd);
+		break;
+	default:
+		ret = -1;
+		errno = EINVAL;
+	}
+	batch->result = (ret < 0) ? -errno : ret;
+}
+
+static void batch_work(void *data) {
+	run_batch((struct filebatch_t *)data);
+}
+
+static void batch_done(wand_event_handler_t *ev_hdl, void *data,
+		bool cancelled) {
+	struct filebatch_t *batch = (struct filebatch_t *)data;
+
+	/* This only happens if the handler is being destroyed, but we still
+	 * don't want to throw away anything that the user has written */
+	if (cancelled)
+		run_batch(batch);
+	complete_batch(ev_hdl, batch);
+}
+
+#if USE_IO_URING
+
+static int uring_setup(wand_event_handler_t *ev_hdl, struct uring_t *ring);
+static void uring_teardown(wand_event_handler_t *ev_hdl, struct uring_t *ring);
+
+/* Reaps any completions that the kernel has posted */
+static void uring_reap(wand_event_handler_t *ev_hdl, struct uring_t *ring) {
+	unsigned head, tail;
+	struct io_uring_cqe *cqe;
+	struct filebatch_t *batch;
+
+	head = *ring->cq_head;
+	for (;;) {
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			break;
+		cqe = &ring->cqes[head & ring->cq_mask];
+		batch = (struct filebatch_t *)(uintptr_t)cqe->user_data;
+		batch->result = cqe->res;
+		head ++;
+		/* Give the slot back before running the callback, which
+		 * may well queue up more I/O */
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+		complete_batch(ev_hdl, batch);
+	}
+}
+
+static void uring_event(wand_event_handler_t *ev_hdl, int fd, void *data,
+		enum wand_eventtype_t ev) {
+	struct uring_t *ring = (struct uring_t *)data;
+	uint64_t count;
+
+	assert(ev == EV_READ);
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		perror("read");
+	}
+	uring_reap(ev_hdl, ring);
+}
+
+static int uring_setup(wand_event_handler_t *ev_hdl, struct uring_t *ring) {
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	memset(ring, 0, sizeof(struct uring_t));
+	ring->efd = -1;
+
+	ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_len = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		goto fail;
+	}
+	ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_CQ_RING);
+	if (ring->cq_ptr == MAP_FAILED) {
+		ring->cq_ptr = NULL;
+		goto fail;
+	}
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_len,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto fail;
+	}
+
+	ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask = *(unsigned *)((char *)ring->sq_ptr +
+			p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+
+	ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = *(unsigned *)((char *)ring->cq_ptr +
+			p.cq_off.ring_mask);
+	ring->cq_entries = p.cq_entries;
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr +
+			p.cq_off.cqes);
+
+	ring->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring->efd < 0)
+		goto fail;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD,
+			&ring->efd, 1) < 0)
+		goto fail;
+	if (wand_add_fd(ev_hdl, ring->efd, EV_READ, ring, uring_event) == NULL)
+		goto fail;
+
+	return 0;
+
+fail:
+	uring_teardown(ev_hdl, ring);
+	return -1;
+}
+
+static void uring_teardown(wand_event_handler_t *ev_hdl,
+		struct uring_t *ring) {
+	if (ring->efd >= 0) {
+		wand_del_fd(ev_hdl, ring->efd);
+		close(ring->efd);
+	}
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_len);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	ring->fd = -1;
+	ring->efd = -1;
+}
+
+/* Queues up as many staged batches as there is room for in the ring, then
+ * submits them all with a single system call */
+static void uring_submit(struct wand_fileio_t *fio) {
+	struct uring_t *ring = &fio->ring;
+	struct filebatch_t *batch;
+	struct io_uring_sqe *sqe;
+	unsigned tail, head, idx;
+	unsigned queued = 0;
+	int ret;
+
+	tail = *ring->sq_tail;
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	/* Don't let the number of requests in flight exceed the size of the
+	 * completion queue */
+	while (fio->staged && tail - head < ring->sq_entries &&
+			fio->inflight < ring->cq_entries) {
+		batch = fio->staged;
+		fio->staged = batch->next;
+		if (fio->staged == NULL)
+			fio->staged_tail = NULL;
+
+		idx = tail & ring->sq_mask;
+		sqe = &ring->sqes[idx];
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->fd = batch->fd;
+		sqe->user_data = (uint64_t)(uintptr_t)batch;
+
+		switch (batch->type) {
+		case FILEOP_READ:
+		case FILEOP_WRITE:
+			sqe->opcode = (batch->type == FILEOP_READ) ?
+					IORING_OP_READV : IORING_OP_WRITEV;
+			sqe->addr = (uint64_t)(uintptr_t)batch->iov;
+			sqe->len = batch->niov;
+			sqe->off = batch->offset;
+			break;
+		case FILEOP_FSYNC:
+		case FILEOP_FDATASYNC:
+			sqe->opcode = IORING_OP_FSYNC;
+			if (batch->type == FILEOP_FDATASYNC)
+				sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			/* Wait for everything submitted before us, so that
+			 * earlier writes are covered by the sync */
+			sqe->flags |= IOSQE_IO_DRAIN;
+			break;
+		}
+		ring->sq_array[idx] = idx;
+		tail ++;
+		queued ++;
+		fio->inflight ++;
+	}
+
+	if (queued == 0)
+		return;
+
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, queued, 0, 0,
+				NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		perror("io_uring_enter");
+	}
+}
+
+/* Blocks until everything that we have submitted has completed */
+static void uring_wait_all(wand_event_handler_t *ev_hdl,
+		struct wand_fileio_t *fio) {
+	while (fio->staged || fio->inflight > 0) {
+		uring_submit(fio);
+		if (syscall(__NR_io_uring_enter, fio->ring.fd, 0, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+				errno != EINTR) {
+			perror("io_uring_enter");
+			return;
+		}
+		uring_reap(ev_hdl, &fio->ring);
+	}
+}
+
+#endif
+
+static struct wand_fileio_t *get_fileio(wand_event_handler_t *ev_hdl) {
+	struct wand_fileio_t *fio;
+
+	if (ev_hdl->fileio)
+		return ev_hdl->fileio;
+
+	fio = (struct wand_fileio_t *)calloc(1, sizeof(struct wand_fileio_t));
+	if (fio == NULL)
+		return NULL;
+
+	fio->backend = WAND_FILE_THREADS;
+#if USE_IO_URING
+	if (uring_setup(ev_hdl, &fio->ring) == 0)
+		fio->backend = WAND_FILE_URING;
+#endif
+
+	fio->hook.callback = fileio_prepare;
+	fio->hook.data = fio;
+	wand_add_prepare_hook(ev_hdl, &fio->hook);
+
+	ev_hdl->fileio = fio;
+	return fio;
+}
+
+int wand_file_set_backend(wand_event_handler_t *ev_hdl,
+		enum wand_file_backend_t backend) {
+	struct wand_fileio_t *fio;
+
+	if ((fio = get_fileio(ev_hdl)) == NULL)
+		return -1;
+
+	if (fio->backend == backend)
+		return 0;
+
+	/* Can't switch once there is I/O underway */
+	if (fio->staged || fio->inflight > 0)
+		return -1;
+
+#if USE_IO_URING
+	if (backend == WAND_FILE_THREADS) {
+		uring_teardown(ev_hdl, &fio->ring);
+		fio->backend = backend;
+		return 0;
+	}
+	if (backend == WAND_FILE_URING) {
+		if (uring_setup(ev_hdl, &fio->ring) < 0)
+			return -1;
+		fio->backend = backend;
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+enum wand_file_backend_t wand_file_get_backend(wand_event_handler_t *ev_hdl) {
+	struct wand_fileio_t *fio;
+
+	if ((fio = get_fileio(ev_hdl)) == NULL)
+		return WAND_FILE_THREADS;
+	return fio->backend;
+}
+
+/* Hands a batch to the worker threads, or runs it if there aren't any */
+static void start_batch(wand_event_handler_t *ev_hdl,
+		struct wand_fileio_t *fio, struct filebatch_t *batch) {
+	batch->next = NULL;
+	if (batch->type == FILEOP_WRITE) {
+		batch->wnext = fio->writing;
+		if (fio->writing)
+			fio->writing->wpprev = &batch->wnext;
+		batch->wpprev = &fio->writing;
+		fio->writing = batch;
+	}
+
+	if (fio->closing || wand_queue_work(ev_hdl, batch_work, batch_done,
+			batch) == NULL) {
+		/* No worker threads, so just do it ourselves */
+		run_batch(batch);
+		complete_batch(ev_hdl, batch);
+	}
+}
+
+/* Checks whether a sync has to wait for a write to the same fd that was
+ * started before it */
+static bool sync_blocked(struct wand_fileio_t *fio,
+		struct filebatch_t *batch) {
+	struct filebatch_t *w;
+
+	for (w = fio->writing; w != NULL; w = w->wnext) {
+		if (w->fd == batch->fd && w->seq < batch->seq)
+			return true;
+	}
+	return false;
+}
+
+/* Starts any held syncs that no longer have writes to wait for */
+static void release_syncs(wand_event_handler_t *ev_hdl,
+		struct wand_fileio_t *fio) {
+	struct filebatch_t **p = &fio->held;
+	struct filebatch_t *batch;
+
+	while ((batch = *p) != NULL) {
+		if (sync_blocked(fio, batch)) {
+			p = &batch->next;
+			continue;
+		}
+		*p = batch->next;
+		start_batch(ev_hdl, fio, batch);
+	}
+}
+
+/* Hands every batch that was staged during this iteration to the backend */
+static int fileio_prepare(wand_event_handler_t *ev_hdl, void *data) {
+	struct wand_fileio_t *fio = (struct wand_fileio_t *)data;
+	struct filebatch_t *batch;
+
+	if (fio->staged == NULL)
+		return 0;
+
+#if USE_IO_URING
+	if (fio->backend == WAND_FILE_URING) {
+		uring_submit(fio);
+		/* If the ring was full, anything left over will have to wait
+		 * for some completions to arrive */
+		return 0;
+	}
+#endif
+
+	while ((batch = fio->staged) != NULL) {
+		fio->staged = batch->next;
+		if (fio->staged == NULL)
+			fio->staged_tail = NULL;
+		fio->inflight ++;
+		batch->seq = fio->next_seq ++;
+		if ((batch->type == FILEOP_FSYNC ||
+				batch->type == FILEOP_FDATASYNC) &&
+				sync_blocked(fio, batch)) {
+			batch->next = fio->held;
+			fio->held = batch;
+			continue;
+		}
+		start_batch(ev_hdl, fio, batch);
+	}
+	return 0;
+}
+
+static void stage_batch(struct wand_fileio_t *fio, struct filebatch_t *batch) {
+	batch->next = NULL;
+	if (fio->staged_tail)
+		fio->staged_tail->next = batch;
+	else
+		fio->staged = batch;
+	fio->staged_tail = batch;
+}
+
+static int queue_fileop(wand_event_handler_t *ev_hdl, int type, int fd,
+		void *buf, size_t len, off_t offset,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				void *buf, ssize_t result, void *data),
+		void *data) {
+	struct wand_fileio_t *fio;
+	struct fileop_t *op;
+	struct filebatch_t *batch;
+
+	if (fd < 0)
+		return -1;
+	if ((fio = get_fileio(ev_hdl)) == NULL)
+		return -1;
+
+	op = (struct fileop_t *)malloc(sizeof(struct fileop_t));
+	if (op == NULL)
+		return -1;
+	op->type = type;
+	op->fd = fd;
+	op->buf = buf;
+	op->len = len;
+	op->offset = offset;
+	op->callback = callback;
+	op->data = data;
+	op->next = NULL;
+
+	/* See if we can tack this write onto the end of the previous one */
+	batch = fio->staged_tail;
+	if (type == FILEOP_WRITE && batch && batch->type == FILEOP_WRITE &&
+			batch->fd == fd && batch->niov < MAX_BATCH_IOV &&
+			batch->offset + (off_t)batch->len == offset &&
+			batch->len + len <= SSIZE_MAX) {
+		batch->iov[batch->niov].iov_base = buf;
+		batch->iov[batch->niov].iov_len = len;
+		batch->niov ++;
+		batch->len += len;
+		batch->ops_tail->next = op;
+		batch->ops_tail = op;
+		return 0;
+	}
+
+	batch = (struct filebatch_t *)malloc(sizeof(struct filebatch_t));
+	if (batch == NULL) {
+		free(op);
+		return -1;
+	}
+	batch->type = type;
+	batch->fd = fd;
+	batch->offset = offset;
+	batch->len = len;
+	batch->niov = 0;
+	if (type == FILEOP_READ || type == FILEOP_WRITE) {
+		batch->iov[0].iov_base = buf;
+		batch->iov[0].iov_len = len;
+		batch->niov = 1;
+	}
+	batch->result = 0;
+	batch->ops = batch->ops_tail = op;
+	batch->seq = 0;
+	batch->wnext = NULL;
+	batch->wpprev = NULL;
+	batch->fio = fio;
+	stage_batch(fio, batch);
+	return 0;
+}
+
+int wand_file_write(wand_event_handler_t *ev_hdl, int fd, const void *buf,
+		size_t len, off_t offset,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				void *buf, ssize_t result, void *data),
+		void *data) {
+	return queue_fileop(ev_hdl, FILEOP_WRITE, fd, (void *)buf, len,
+			offset, callback, data);
+}
+
+int wand_file_read(wand_event_handler_t *ev_hdl, int fd, void *buf,
+		size_t len, off_t offset,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				void *buf, ssize_t result, void *data),
+		void *data) {
+	return queue_fileop(ev_hdl, FILEOP_READ, fd, buf, len, offset,
+			callback, data);
+}
+
+int wand_file_fsync(wand_event_handler_t *ev_hdl, int fd, bool datasync,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				void *buf, ssize_t result, void *data),
+		void *data) {
+	return queue_fileop(ev_hdl,
+			datasync ? FILEOP_FDATASYNC : FILEOP_FSYNC, fd,
+			NULL, 0, 0, callback, data);
+}
+
+void *wand_file_alloc_buffer(size_t len) {
+	void *buf = NULL;
+
+	/* Round up, so that the entire buffer can be used for O_DIRECT */
+	len = (len + WAND_FILE_ALIGN - 1) & ~((size_t)WAND_FILE_ALIGN - 1);
+	if (len == 0)
+		len = WAND_FILE_ALIGN;
+	if (posix_memalign(&buf, WAND_FILE_ALIGN, len) != 0)
+		return NULL;
+	return buf;
+}
+
+void wand_file_free_buffer(void *buf) {
+	free(buf);
+}
+
+void wand_fileio_destroy(wand_event_handler_t *ev_hdl) {
+	struct wand_fileio_t *fio = ev_hdl->fileio;
+
+	if (fio == NULL)
+		return;
+
+#if USE_IO_URING
+	if (fio->backend == WAND_FILE_URING) {
+		uring_wait_all(ev_hdl, fio);
+		uring_teardown(ev_hdl, &fio->ring);
+	}
+#endif
+	/* Anything still staged goes to the worker threads, and destroying
+	 * the work queue waits for it all to complete */
+	fileio_prepare(ev_hdl, fio);
+	fio->closing = true;
+	wand_workqueue_destroy(ev_hdl);
+	assert(fio->inflight == 0 && fio->held == NULL);
+
+	wand_del_prepare_hook(ev_hdl, &fio->hook);
+	free(fio);
+	ev_hdl->fileio = NULL;
+}
@@ -0,0 +1,275 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Micro-benchmark for the framing decoders.
+ *
+ * Generates a buffer of newline-delimited frames with random lengths and
+ * splits it up with each implementation of the delimiter search, first
+ * directly on the buffer and then end to end, through a framer reading
+ * from a socket. The scalar search is the byte-by-byte loop that
+ * protocols would otherwise use, and libc's memchr() is shown for
+ * comparison. Built with "make framing-bench" */
+#include "config.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+#define RUNS 5
+
+struct impl_t {
+	const char *name;
+	const uint8_t *(*find)(const uint8_t *p, const uint8_t *end,
+			uint8_t c);
+	bool available;
+};
+
+static const uint8_t *find_memchr(const uint8_t *p, const uint8_t *end,
+		uint8_t c) {
+	return (const uint8_t *)memchr(p, c, end - p);
+}
+
+static struct impl_t impls[] = {
+	{ "scalar", wand_find_byte_scalar, true },
+	{ "memchr", find_memchr, true },
+#if defined(__x86_64__) || defined(__i386__)
+	{ "sse2", wand_find_byte_sse2, false },
+	{ "avx2", wand_find_byte_avx2, false },
+#endif
+};
+#define NIMPLS (sizeof(impls) / sizeof(impls[0]))
+
+static uint8_t *data;
+static size_t datalen;
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fills the buffer with frames of printable junk, 1 to 2 * mean bytes
+ * long, each ending in a newline */
+static uint64_t generate(size_t len, unsigned int mean) {
+	uint64_t frames = 0;
+	size_t pos = 0, flen, i;
+
+	data = (uint8_t *)malloc(len);
+	if (data == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	while (pos < len) {
+		flen = 1 + rand() % (2 * mean);
+		if (pos + flen + 1 > len)
+			flen = len - pos - 1;
+		for (i = 0; i < flen; i++)
+			data[pos + i] = 'a' + rand() % 26;
+		pos += flen;
+		data[pos++] = '\n';
+		frames ++;
+	}
+	datalen = len;
+	return frames;
+}
+
+static uint64_t split(const struct impl_t *impl) {
+	const uint8_t *p = data, *end = data + datalen, *hit;
+	uint64_t frames = 0;
+
+	while ((hit = impl->find(p, end, '\n')) != NULL) {
+		frames ++;
+		p = hit + 1;
+	}
+	return frames;
+}
+
+struct e2e_t {
+	wand_framer_t *fr;
+	uint64_t frames;
+	uint64_t expected;
+	int wfd;
+};
+
+static void *writer(void *arg) {
+	struct e2e_t *e = (struct e2e_t *)arg;
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < datalen) {
+		n = write(e->wfd, data + off, datalen - off);
+		if (n <= 0) {
+			perror("write");
+			break;
+		}
+		off += n;
+	}
+	return NULL;
+}
+
+static void frame_cb(wand_event_handler_t *ev_hdl, int fd,
+		const uint8_t *frame, size_t len, void *data) {
+	struct e2e_t *e = (struct e2e_t *)data;
+
+	(void)fd;
+	(void)frame;
+	(void)len;
+	if (++e->frames == e->expected)
+		ev_hdl->running = false;
+}
+
+static void error_cb(wand_event_handler_t *ev_hdl, int fd, int err,
+		void *data) {
+	(void)fd;
+	(void)data;
+	fprintf(stderr, "framer error: %s\n", strerror(err));
+	ev_hdl->running = false;
+}
+
+static double end_to_end(const struct impl_t *impl, uint64_t expected) {
+	struct wand_framer_opts_t opts;
+	wand_event_handler_t *ev_hdl;
+	struct e2e_t e;
+	pthread_t thread;
+	int sv[2];
+	double start;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	ev_hdl = wand_create_event_handler();
+	memset(&opts, 0, sizeof(opts));
+	opts.type = WAND_FRAME_LINE;
+	memset(&e, 0, sizeof(e));
+	e.expected = expected;
+	e.wfd = sv[1];
+	e.fr = wand_add_framer(ev_hdl, sv[0], &opts, frame_cb, error_cb, &e);
+
+	wand_find_byte = impl->find;
+	start = now();
+	pthread_create(&thread, NULL, writer, &e);
+	wand_event_run(ev_hdl);
+	start = now() - start;
+	pthread_join(thread, NULL);
+
+	if (e.frames != expected)
+		fprintf(stderr, "%s: got %" PRIu64 " frames, expected %" PRIu64 "\n",
+				impl->name, e.frames, expected);
+	wand_del_framer(ev_hdl, e.fr);
+	wand_destroy_event_handler(ev_hdl);
+	close(sv[0]);
+	close(sv[1]);
+	return start;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-s size in MB] [-l mean frame length]\n",
+			prog);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	unsigned int mb = 64, mean = 64;
+	uint64_t expected, frames;
+	double best, t;
+	size_t i;
+	int opt, run;
+
+	while ((opt = getopt(argc, argv, "s:l:")) != -1) {
+		switch (opt) {
+		case 's':
+			mb = atoi(optarg);
+			break;
+		case 'l':
+			mean = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (mb == 0 || mean == 0)
+		usage(argv[0]);
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	impls[2].available = __builtin_cpu_supports("sse2");
+	impls[3].available = __builtin_cpu_supports("avx2");
+#endif
+
+	srand(1);
+	expected = generate((size_t)mb << 20, mean);
+	printf("%u MB, %" PRIu64 " frames, mean length %u\n\n", mb, expected,
+			mean);
+	printf("%-8s %12s %12s %12s %12s\n", "", "search MB/s", "ns/frame",
+			"framer MB/s", "ns/frame");
+
+	wand_event_init();
+	for (i = 0; i < NIMPLS; i++) {
+		if (!impls[i].available) {
+			printf("%-8s %12s\n", impls[i].name, "unsupported");
+			continue;
+		}
+
+		best = 0;
+		for (run = 0; run < RUNS; run++) {
+			t = now();
+			frames = split(&impls[i]);
+			t = now() - t;
+			if (frames != expected)
+				fprintf(stderr, "%s: found %" PRIu64 " frames, expected %" PRIu64 "\n",
+						impls[i].name, frames, expected);
+			if (best == 0 || t < best)
+				best = t;
+		}
+		printf("%-8s %12.0f %12.2f", impls[i].name, mb / best,
+				best * 1e9 / expected);
+
+		best = 0;
+		for (run = 0; run < RUNS; run++) {
+			t = end_to_end(&impls[i], expected);
+			if (best == 0 || t < best)
+				best = t;
+		}
+		printf(" %12.0f %12.2f\n", mb / best, best * 1e9 / expected);
+	}
+
+	free(data);
+	return 0;
+}
@@ -0,0 +1,494 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Message framing for stream sockets.
+ *
+ * A framer owns the read side of a socket. Each time the socket becomes
+ * readable we read into a buffer big enough for the largest frame, split
+ * off every complete frame and pass each one to the callback as a pointer
+ * into the buffer, so frames are never copied. Whatever is left over is
+ * moved to the front of the buffer once it gets near the end.
+ *
+ * Frames are either ended by a delimiter or preceded by a length. Finding
+ * delimiters is where the time goes, so that is done 16 (SSE2) or 32
+ * (AVX2) bytes at a time, choosing the widest implementation that the CPU
+ * supports the first time we search. */
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+ #include <immintrin.h>
+ #define HAVE_X86_SIMD 1
+#endif
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+/* Default limit on the size of a frame */
+#define DEFAULT_MAX_FRAME 65536
+/* Smallest read buffer, so that small frames are read in large batches */
+#define MIN_BUFFER 65536
+/* Most reads per wakeup, so that one busy socket can't starve the rest */
+#define FRAMER_READ_BUDGET 8
+/* Longest varint we accept, enough for 64 bits */
+#define MAX_VARINT 10
+
+struct wand_framer_t {
+	int fd;
+	struct wand_framer_opts_t opts;
+
+	uint8_t *buf;
+	size_t size;
+	/* Unprocessed data runs from start to end */
+	size_t start;
+	size_t end;
+	/* Bytes after start that are known not to hold a delimiter */
+	size_t scanned;
+
+	void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+			const uint8_t *frame, size_t len, void *data);
+	void (*error)(wand_event_handler_t *ev_hdl, int fd, int err,
+			void *data);
+	void *data;
+
+	/* Set once we have stopped reading after an error or EOF */
+	bool failed;
+	struct wand_framer_stats_t stats;
+};
+
+const uint8_t *wand_find_byte_scalar(const uint8_t *p, const uint8_t *end,
+		uint8_t c) {
+	for (; p < end; p++) {
+		if (*p == c)
+			return p;
+	}
+	return NULL;
+}
+
+#if HAVE_X86_SIMD
+/* Both of these check 64 or 128 bytes per iteration, combining the
+ * comparisons so that there is only one branch, and only work out where
+ * the match was once there is one */
+__attribute__((target("sse2")))
+const uint8_t *wand_find_byte_sse2(const uint8_t *p, const uint8_t *end,
+		uint8_t c) {
+	const uint8_t *first = p;
+	__m128i needle = _mm_set1_epi8((char)c);
+	__m128i e0, e1, e2, e3;
+	unsigned int m;
+
+	while (end - p >= 64) {
+		e0 = _mm_cmpeq_epi8(needle, _mm_loadu_si128((const __m128i *)p));
+		e1 = _mm_cmpeq_epi8(needle,
+				_mm_loadu_si128((const __m128i *)(p + 16)));
+		e2 = _mm_cmpeq_epi8(needle,
+				_mm_loadu_si128((const __m128i *)(p + 32)));
+		e3 = _mm_cmpeq_epi8(needle,
+				_mm_loadu_si128((const __m128i *)(p + 48)));
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(e0, e1),
+				_mm_or_si128(e2, e3)))) {
+			uint64_t mm = (uint64_t)_mm_movemask_epi8(e0) |
+					((uint64_t)_mm_movemask_epi8(e1) << 16) |
+					((uint64_t)_mm_movemask_epi8(e2) << 32) |
+					((uint64_t)_mm_movemask_epi8(e3) << 48);
+			return p + __builtin_ctzll(mm);
+		}
+		p += 64;
+	}
+	while (end - p >= 16) {
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(needle,
+				_mm_loadu_si128((const __m128i *)p)));
+		if (m)
+			return p + __builtin_ctz(m);
+		p += 16;
+	}
+	if (p == end)
+		return NULL;
+	if (end - first < 16)
+		return wand_find_byte_scalar(p, end, c);
+
+	/* Finish with a load that overlaps what we have already checked,
+	 * rather than going byte by byte */
+	m = _mm_movemask_epi8(_mm_cmpeq_epi8(needle,
+			_mm_loadu_si128((const __m128i *)(end - 16))));
+	m &= ~0U << (16 - (end - p));
+	return m ? end - 16 + __builtin_ctz(m) : NULL;
+}
+
+__attribute__((target("avx2")))
+const uint8_t *wand_find_byte_avx2(const uint8_t *p, const uint8_t *end,
+		uint8_t c) {
+	const uint8_t *first = p;
+	__m256i needle = _mm256_set1_epi8((char)c);
+	__m256i e0, e1, e2, e3;
+	unsigned int m;
+
+	while (end - p >= 128) {
+		e0 = _mm256_cmpeq_epi8(needle,
+				_mm256_loadu_si256((const __m256i *)p));
+		e1 = _mm256_cmpeq_epi8(needle,
+				_mm256_loadu_si256((const __m256i *)(p + 32)));
+		e2 = _mm256_cmpeq_epi8(needle,
+				_mm256_loadu_si256((const __m256i *)(p + 64)));
+		e3 = _mm256_cmpeq_epi8(needle,
+				_mm256_loadu_si256((const __m256i *)(p + 96)));
+		if (_mm256_movemask_epi8(_mm256_or_si256(
+				_mm256_or_si256(e0, e1),
+				_mm256_or_si256(e2, e3)))) {
+			uint64_t mm = (uint32_t)_mm256_movemask_epi8(e0) |
+					((uint64_t)(uint32_t)
+					_mm256_movemask_epi8(e1) << 32);
+			if (mm)
+				return p + __builtin_ctzll(mm);
+			mm = (uint32_t)_mm256_movemask_epi8(e2) |
+					((uint64_t)(uint32_t)
+					_mm256_movemask_epi8(e3) << 32);
+			return p + 64 + __builtin_ctzll(mm);
+		}
+		p += 128;
+	}
+	while (end - p >= 32) {
+		m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(needle,
+				_mm256_loadu_si256((const __m256i *)p)));
+		if (m)
+			return p + __builtin_ctz(m);
+		p += 32;
+	}
+	if (p == end)
+		return NULL;
+	if (end - first < 32)
+		return wand_find_byte_sse2(p, end, c);
+
+	m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(needle,
+			_mm256_loadu_si256((const __m256i *)(end - 32))));
+	m &= ~0U << (32 - (end - p));
+	return m ? end - 32 + __builtin_ctz(m) : NULL;
+}
+#endif
+
+/* Picks the best implementation on the first search, and uses it from then
+ * on. Threads racing to do this all come up with the same answer */
+static const uint8_t *find_byte_resolve(const uint8_t *p,
+		const uint8_t *end, uint8_t c) {
+	const uint8_t *(*impl)(const uint8_t *, const uint8_t *, uint8_t);
+
+	impl = wand_find_byte_scalar;
+#if HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		impl = wand_find_byte_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		impl = wand_find_byte_sse2;
+#endif
+	__atomic_store_n(&wand_find_byte, impl, __ATOMIC_RELAXED);
+	return impl(p, end, c);
+}
+
+const uint8_t *(*wand_find_byte)(const uint8_t *p, const uint8_t *end,
+		uint8_t c) = find_byte_resolve;
+
+static void framer_fail(wand_event_handler_t *ev_hdl,
+		struct wand_framer_t *fr, int err) {
+	/* Stop watching the socket altogether, as epoll would keep telling
+	 * us about a hang up or error */
+	fr->failed = true;
+	wand_del_fd(ev_hdl, fr->fd);
+	if (err != 0)
+		fr->stats.errors ++;
+	if (fr->error)
+		fr->error(ev_hdl, fr->fd, err, fr->data);
+}
+
+/* Passes a frame to the callback. Returns false if the callback removed
+ * the framer */
+static bool deliver(wand_event_handler_t *ev_hdl, struct wand_framer_t *fr,
+		const uint8_t *frame, size_t len) {
+	int fd = fr->fd;
+
+	fr->stats.frames ++;
+	fr->callback(ev_hdl, fd, frame, len, fr->data);
+	return ev_hdl->fd_events[fd] != NULL &&
+			ev_hdl->fd_events[fd]->data == fr;
+}
+
+/* Splits off frames ending in a delimiter. Returns false if the framer has
+ * been removed or has failed */
+static bool split_delimited(wand_event_handler_t *ev_hdl,
+		struct wand_framer_t *fr) {
+	enum wand_frame_type_t type = fr->opts.type;
+	uint8_t delim = (type == WAND_FRAME_DELIM) ? fr->opts.delim : '\n';
+	const uint8_t *frame, *hit;
+	size_t len, limit;
+
+	/* Leave room for a trailing CR that will be stripped */
+	limit = fr->opts.max_frame + (type == WAND_FRAME_DELIM ? 0 : 1);
+
+	for (;;) {
+		frame = fr->buf + fr->start;
+		hit = wand_find_byte(frame + fr->scanned, fr->buf + fr->end,
+				delim);
+		if (hit == NULL) {
+			fr->scanned = fr->end - fr->start;
+			if (fr->scanned > limit) {
+				framer_fail(ev_hdl, fr, EMSGSIZE);
+				return false;
+			}
+			return true;
+		}
+
+		len = hit - frame;
+		if (type != WAND_FRAME_DELIM && len > 0 && hit[-1] == '\r') {
+			len --;
+		} else if (type == WAND_FRAME_CRLF) {
+			/* A bare newline is just part of the frame */
+			fr->scanned = len + 1;
+			continue;
+		}
+		if (len > fr->opts.max_frame) {
+			framer_fail(ev_hdl, fr, EMSGSIZE);
+			return false;
+		}
+
+		fr->start = hit + 1 - fr->buf;
+		fr->scanned = 0;
+		if (!deliver(ev_hdl, fr, frame, len))
+			return false;
+	}
+}
+
+/* Reads a varint (7 bits per byte, least significant first, with the top
+ * bit set on all but the last byte). Returns the length of the header, 0
+ * if it isn't all there yet or -1 if it is too long */
+static int read_varint(const uint8_t *p, size_t avail, uint64_t *value) {
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < MAX_VARINT; i++) {
+		if ((size_t)i == avail)
+			return 0;
+		v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+		if (!(p[i] & 0x80)) {
+			*value = v;
+			return i + 1;
+		}
+	}
+	return -1;
+}
+
+static uint64_t read_fixed(const uint8_t *p, unsigned int size,
+		bool little_endian) {
+	uint64_t v = 0;
+	unsigned int i;
+
+	for (i = 0; i < size; i++) {
+		if (little_endian)
+			v |= (uint64_t)p[i] << (8 * i);
+		else
+			v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+/* Splits off frames that are preceded by their length */
+static bool split_prefixed(wand_event_handler_t *ev_hdl,
+		struct wand_framer_t *fr) {
+	const uint8_t *p;
+	size_t avail;
+	uint64_t len;
+	int hlen;
+
+	for (;;) {
+		p = fr->buf + fr->start;
+		avail = fr->end - fr->start;
+
+		if (fr->opts.type == WAND_FRAME_VARINT) {
+			hlen = read_varint(p, avail, &len);
+			if (hlen < 0) {
+				framer_fail(ev_hdl, fr, EPROTO);
+				return false;
+			}
+			if (hlen == 0)
+				return true;
+		} else {
+			hlen = fr->opts.header_size;
+			if (avail < (size_t)hlen)
+				return true;
+			len = read_fixed(p, hlen, (fr->opts.flags &
+					WAND_FRAME_LITTLE_ENDIAN) != 0);
+		}
+
+		if (fr->opts.flags & WAND_FRAME_INCLUSIVE) {
+			if (len < (uint64_t)hlen) {
+				framer_fail(ev_hdl, fr, EPROTO);
+				return false;
+			}
+			len -= hlen;
+		}
+		if (len > fr->opts.max_frame) {
+			framer_fail(ev_hdl, fr, EMSGSIZE);
+			return false;
+		}
+		if (avail - hlen < len)
+			return true;
+
+		fr->start += hlen + len;
+		if (!deliver(ev_hdl, fr, p + hlen, len))
+			return false;
+	}
+}
+
+static void framer_read(wand_event_handler_t *ev_hdl, int fd, void *data,
+		enum wand_eventtype_t ev) {
+	struct wand_framer_t *fr = (struct wand_framer_t *)data;
+	size_t space;
+	ssize_t n;
+	int reads = 0;
+	bool ok;
+
+	(void)ev;
+
+	while (reads < FRAMER_READ_BUDGET) {
+		/* Make room by moving any partial frame to the front of the
+		 * buffer, but only once we are running short */
+		if (fr->start == fr->end) {
+			fr->start = fr->end = 0;
+		} else if (fr->start > 0 && fr->size - fr->end < fr->size / 2) {
+			memmove(fr->buf, fr->buf + fr->start,
+					fr->end - fr->start);
+			fr->stats.moved += fr->end - fr->start;
+			fr->end -= fr->start;
+			fr->start = 0;
+		}
+
+		space = fr->size - fr->end;
+		n = read(fd, fr->buf + fr->end, space);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				framer_fail(ev_hdl, fr, errno);
+			return;
+		}
+		if (n == 0) {
+			framer_fail(ev_hdl, fr, 0);
+			return;
+		}
+		reads ++;
+		fr->stats.reads ++;
+		fr->stats.bytes += n;
+		fr->end += n;
+
+		if (fr->opts.type == WAND_FRAME_LENGTH ||
+				fr->opts.type == WAND_FRAME_VARINT)
+			ok = split_prefixed(ev_hdl, fr);
+		else
+			ok = split_delimited(ev_hdl, fr);
+		if (!ok)
+			return;
+
+		/* A short read means the socket has been drained */
+		if ((size_t)n < space)
+			return;
+	}
+}
+
+wand_framer_t *wand_add_framer(wand_event_handler_t *ev_hdl, int fd,
+		const struct wand_framer_opts_t *opts,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				const uint8_t *frame, size_t len, void *data),
+		void (*error)(wand_event_handler_t *ev_hdl, int fd, int err,
+				void *data),
+		void *data) {
+	struct wand_framer_t *fr;
+
+	fr = (struct wand_framer_t *)calloc(1, sizeof(struct wand_framer_t));
+	if (fr == NULL)
+		return NULL;
+
+	fr->opts = *opts;
+	if (fr->opts.max_frame == 0)
+		fr->opts.max_frame = DEFAULT_MAX_FRAME;
+	if (fr->opts.type == WAND_FRAME_LENGTH) {
+		if (fr->opts.header_size == 0)
+			fr->opts.header_size = 4;
+		if (fr->opts.header_size > 8) {
+			fprintf(stderr, "Libwandevent: invalid frame header size %u\n",
+					fr->opts.header_size);
+			free(fr);
+			return NULL;
+		}
+	} else if (fr->opts.type > WAND_FRAME_VARINT) {
+		fprintf(stderr, "Libwandevent: unknown frame type %d\n",
+				fr->opts.type);
+		free(fr);
+		return NULL;
+	}
+
+	/* Enough for the largest frame, along with its header or delimiter */
+	fr->size = fr->opts.max_frame + MAX_VARINT + 2;
+	if (fr->size < MIN_BUFFER)
+		fr->size = MIN_BUFFER;
+	fr->buf = (uint8_t *)malloc(fr->size);
+	if (fr->buf == NULL) {
+		free(fr);
+		return NULL;
+	}
+
+	fr->fd = fd;
+	fr->callback = callback;
+	fr->error = error;
+	fr->data = data;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+	if (wand_add_fd(ev_hdl, fd, EV_READ, fr, framer_read) == NULL) {
+		free(fr->buf);
+		free(fr);
+		return NULL;
+	}
+	return fr;
+}
+
+void wand_get_framer_stats(wand_framer_t *fr,
+		struct wand_framer_stats_t *stats) {
+	*stats = fr->stats;
+}
+
+void wand_del_framer(wand_event_handler_t *ev_hdl, wand_framer_t *fr) {
+	if (!fr->failed)
+		wand_del_fd(ev_hdl, fr->fd);
+	free(fr->buf);
+	free(fr);
+}
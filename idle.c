@@ -0,0 +1,315 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Inactivity timeouts for fd events.
+ *
+ * Each fd with timeouts just remembers the tick at which its callback last
+ * fired for reading and for writing, so resetting a timeout is a single
+ * store. The fds sit in a timer wheel of coarse buckets, keyed by the
+ * earliest time that they could possibly time out. When a bucket comes due,
+ * any fd that has seen activity in the meantime is simply moved to the
+ * bucket for its new deadline, so an active fd costs one bucket move per
+ * timeout period rather than a timer operation per event. The whole wheel
+ * is driven by a single timer, set for the next bucket with anything in it.
+ */
+#include "config.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+/* Must be a power of two, and match the size of wand_idle_t.wheel */
+#define WHEEL_SIZE 1024
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define TICK_USEC (WAND_IDLE_RESOLUTION * 1000)
+
+static uint64_t time_to_tick(struct timeval tv) {
+	return ((uint64_t)tv.tv_sec * 1000000 + tv.tv_usec) / TICK_USEC;
+}
+
+static void unlink_idle(struct wand_idle_fd_t *st) {
+	if (st->pprev == NULL)
+		return;
+	*st->pprev = st->next;
+	if (st->next)
+		st->next->pprev = st->pprev;
+	st->next = NULL;
+	st->pprev = NULL;
+}
+
+static void push_idle(struct wand_idle_fd_t **list, struct wand_idle_fd_t *st) {
+	st->next = *list;
+	if (st->next)
+		st->next->pprev = &st->next;
+	st->pprev = list;
+	*list = st;
+}
+
+/* The earliest tick at which this fd could time out, or 0 if it has no
+ * timeouts. Activity is stamped with the tick it happened in, which could
+ * be almost a whole tick ago, hence the extra tick */
+static uint64_t next_deadline(struct wand_idle_fd_t *st) {
+	uint64_t rd = 0, wr = 0;
+
+	if (st->read_ticks)
+		rd = st->last_read + st->read_ticks + 1;
+	if (st->write_ticks)
+		wr = st->last_write + st->write_ticks + 1;
+	if (rd == 0 || (wr != 0 && wr < rd))
+		return wr;
+	return rd;
+}
+
+static void wheel_fire(wand_event_handler_t *ev_hdl, void *data);
+
+/* Makes sure the wheel timer will fire in time for the given tick */
+static void arm_wheel(wand_event_handler_t *ev_hdl, uint64_t tick) {
+	struct wand_idle_t *idle = ev_hdl->idle;
+	struct timeval now = wand_get_monotonictime(ev_hdl);
+	uint64_t now_us = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+	uint64_t due_us = tick * TICK_USEC;
+	uint64_t delay = due_us > now_us ? due_us - now_us : 0;
+
+	if (idle->timer) {
+		if (idle->timer_tick <= tick)
+			return;
+		wand_del_timer(ev_hdl, idle->timer);
+	}
+	idle->timer = wand_add_timer(ev_hdl, delay / 1000000, delay % 1000000,
+			NULL, wheel_fire);
+	idle->timer_tick = tick;
+}
+
+static void insert_idle(wand_event_handler_t *ev_hdl,
+		struct wand_idle_fd_t *st) {
+	struct wand_idle_t *idle = ev_hdl->idle;
+	uint64_t deadline = next_deadline(st);
+	int b;
+
+	if (deadline == 0)
+		return;
+	/* Anything already overdue goes in the next bucket we look at */
+	if (deadline < idle->cur_tick)
+		deadline = idle->cur_tick;
+
+	st->deadline = deadline;
+	b = deadline & WHEEL_MASK;
+	push_idle(&idle->wheel[b], st);
+	idle->occupied[b / 64] |= 1ULL << (b % 64);
+	/* While the wheel is being turned, the timer is set afterwards */
+	if (!idle->turning)
+		arm_wheel(ev_hdl, deadline);
+}
+
+/* Finds the next bucket at or after cur_tick that has anything in it */
+static bool next_occupied(struct wand_idle_t *idle, uint64_t *tick) {
+	uint64_t t;
+
+	for (t = idle->cur_tick; t < idle->cur_tick + WHEEL_SIZE; t++) {
+		int b = t & WHEEL_MASK;
+
+		/* Skip empty words quickly */
+		if ((b % 64) == 0 && idle->occupied[b / 64] == 0) {
+			t += 63;
+			continue;
+		}
+		if (idle->occupied[b / 64] & (1ULL << (b % 64))) {
+			*tick = t;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void wheel_fire(wand_event_handler_t *ev_hdl, void *data) {
+	struct wand_idle_t *idle = ev_hdl->idle;
+	struct wand_idle_fd_t *list, *expired = NULL, *st;
+	struct wand_fdcb_t *evcb;
+	uint64_t now, t, end, tick;
+	int b, ev;
+
+	(void)data;
+	idle->timer = NULL;
+	idle->turning = true;
+	now = time_to_tick(wand_get_monotonictime(ev_hdl));
+	idle->now = now;
+
+	/* After a long stall, one pass over the whole wheel is enough */
+	end = now + 1;
+	if (end - idle->cur_tick > WHEEL_SIZE)
+		idle->cur_tick = end - WHEEL_SIZE;
+
+	for (t = idle->cur_tick; t < end; t++) {
+		b = t & WHEEL_MASK;
+		list = idle->wheel[b];
+		if (list == NULL)
+			continue;
+		idle->wheel[b] = NULL;
+		idle->occupied[b / 64] &= ~(1ULL << (b % 64));
+		list->pprev = &list;
+
+		while ((st = list) != NULL) {
+			unlink_idle(st);
+			if (next_deadline(st) <= now)
+				push_idle(&expired, st);
+			else
+				insert_idle(ev_hdl, st);
+		}
+	}
+	idle->cur_tick = end;
+	idle->turning = false;
+	if (next_occupied(idle, &tick))
+		arm_wheel(ev_hdl, tick);
+
+	/* Fire one timeout per fd at a time; if the other direction has
+	 * also expired, it will go off on the next tick. Each fd is put back
+	 * in the wheel before its callback runs, so the callback is free to
+	 * change its timeouts or delete it */
+	while ((st = expired) != NULL) {
+		unlink_idle(st);
+		if (st->read_ticks &&
+				st->last_read + st->read_ticks + 1 <= now) {
+			st->last_read = now;
+			ev = EV_TIMEOUT | EV_READ;
+		} else {
+			st->last_write = now;
+			ev = EV_TIMEOUT | EV_WRITE;
+		}
+		insert_idle(ev_hdl, st);
+
+		evcb = ev_hdl->fd_events[st->fd];
+		assert(evcb != NULL);
+		wand_fd_callback(ev_hdl, evcb, (enum wand_eventtype_t)ev);
+	}
+}
+
+int wand_set_fd_timeouts(wand_event_handler_t *ev_hdl, int fd, int read_ms,
+		int write_ms) {
+	struct wand_idle_t *idle = ev_hdl->idle;
+	struct wand_idle_fd_t *st;
+
+	if (fd < 0 || fd > ev_hdl->maxfd || ev_hdl->fd_events[fd] == NULL) {
+		fprintf(stderr, "Libwandevent: no fd event for fd %d\n", fd);
+		return -1;
+	}
+	if (read_ms < 0 || write_ms < 0)
+		return -1;
+
+	if (idle == NULL) {
+		if (read_ms == 0 && write_ms == 0)
+			return 0;
+		idle = (struct wand_idle_t *)calloc(1,
+				sizeof(struct wand_idle_t));
+		if (idle == NULL)
+			return -1;
+		idle->maxfd = -1;
+		idle->now = time_to_tick(wand_get_monotonictime(ev_hdl));
+		idle->cur_tick = idle->now;
+		ev_hdl->idle = idle;
+	}
+
+	if (fd > idle->maxfd) {
+		struct wand_idle_fd_t **fds;
+
+		fds = (struct wand_idle_fd_t **)realloc(idle->fds,
+				(fd + 1) * sizeof(struct wand_idle_fd_t *));
+		if (fds == NULL)
+			return -1;
+		memset(fds + idle->maxfd + 1, 0,
+				(fd - idle->maxfd) * sizeof(*fds));
+		idle->fds = fds;
+		idle->maxfd = fd;
+	}
+
+	st = idle->fds[fd];
+	if (read_ms == 0 && write_ms == 0) {
+		if (st) {
+			unlink_idle(st);
+			free(st);
+			idle->fds[fd] = NULL;
+		}
+		return 0;
+	}
+
+	if (st == NULL) {
+		st = (struct wand_idle_fd_t *)calloc(1,
+				sizeof(struct wand_idle_fd_t));
+		if (st == NULL)
+			return -1;
+		st->fd = fd;
+		idle->fds[fd] = st;
+	} else {
+		unlink_idle(st);
+	}
+
+	/* Round up, so we never time out early */
+	idle->now = time_to_tick(wand_get_monotonictime(ev_hdl));
+	st->read_ticks = (read_ms + WAND_IDLE_RESOLUTION - 1) /
+			WAND_IDLE_RESOLUTION;
+	st->write_ticks = (write_ms + WAND_IDLE_RESOLUTION - 1) /
+			WAND_IDLE_RESOLUTION;
+	st->last_read = st->last_write = idle->now;
+	insert_idle(ev_hdl, st);
+	return 0;
+}
+
+void wand_idle_forget(wand_event_handler_t *ev_hdl, int fd) {
+	struct wand_idle_t *idle = ev_hdl->idle;
+	struct wand_idle_fd_t *st;
+
+	if (fd > idle->maxfd || (st = idle->fds[fd]) == NULL)
+		return;
+	/* The wheel timer is left alone; it will find nothing to do */
+	unlink_idle(st);
+	free(st);
+	idle->fds[fd] = NULL;
+}
+
+void wand_idle_update(wand_event_handler_t *ev_hdl) {
+	ev_hdl->idle->now = time_to_tick(wand_get_monotonictime(ev_hdl));
+}
+
+void wand_idle_destroy(wand_event_handler_t *ev_hdl) {
+	struct wand_idle_t *idle = ev_hdl->idle;
+	int fd;
+
+	if (idle == NULL)
+		return;
+	if (idle->timer)
+		wand_del_timer(ev_hdl, idle->timer);
+	for (fd = 0; fd <= idle->maxfd; fd++)
+		free(idle->fds[fd]);
+	free(idle->fds);
+	free(idle);
+	ev_hdl->idle = NULL;
+}
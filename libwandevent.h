@@ -33,7 +33,10 @@
 #ifndef EVENT_H
 #define EVENT_H
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <time.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -42,10 +45,28 @@ extern "C" {
 enum wand_eventtype_t {
 	EV_READ   = 1,
 	EV_WRITE  = 2,
-	EV_EXCEPT = 4
+	EV_EXCEPT = 4,
+	/* Combined with EV_READ or EV_WRITE when an inactivity timeout set
+	 * by wand_set_fd_timeouts() expires */
+	EV_TIMEOUT = 8
 };
 
+/* Granularity of fd inactivity timeouts, in milliseconds */
+#define WAND_IDLE_RESOLUTION 10
+
 typedef struct wand_event_handler_t wand_event_handler_t;
+typedef struct wand_work_t wand_work_t;
+typedef struct wand_loop_group_t wand_loop_group_t;
+typedef struct wand_shared_t wand_shared_t;
+typedef struct wand_batch_class_t wand_batch_class_t;
+typedef struct wand_listener_t wand_listener_t;
+typedef struct wand_dgram_t wand_dgram_t;
+typedef struct wand_zc_t wand_zc_t;
+typedef struct wand_packet_ring_t wand_packet_ring_t;
+typedef struct wand_child_t wand_child_t;
+typedef struct wand_ratelimit_t wand_ratelimit_t;
+typedef struct wand_channel_t wand_channel_t;
+typedef struct wand_framer_t wand_framer_t;
 
 /* File descriptor event */
 struct wand_fdcb_t {
@@ -59,6 +80,17 @@ struct wand_fdcb_t {
 	void (*callback)(wand_event_handler_t *ev_hdl, int fd, void *data,
 			enum wand_eventtype_t ev);
 	void *internal;
+	/* Events that are being ignored for now, e.g. while a rate limiter
+	 * is out of tokens, and the number of reasons for ignoring each of
+	 * EV_READ, EV_WRITE and EV_EXCEPT. Don't touch! */
+	int suspended;
+	uint16_t suspend_count[3];
+	/* Callbacks run since the rebalancer last looked at the fd, and
+	 * whether the rebalancer may move it, see wand_set_fd_migratable() */
+	uint32_t events;
+	bool migratable;
+	/* Batch class the fd belongs to, see wand_set_fd_batch() */
+	wand_batch_class_t *batch;
 };
 
 /* Timer event */
@@ -74,6 +106,14 @@ struct wand_timer_t {
 	 * links. DO NOT touch these unless you want your timers to break! */
 	struct wand_timer_t *prev;
 	struct wand_timer_t *next;
+
+	/* Deadline requested by wand_mod_timer() that is later than expire.
+	 * The timer is only moved to this deadline once expire comes around,
+	 * so pushing a timer back is cheap. Again, don't touch! */
+	struct timeval deferred;
+	/* Internal state of the timer, used to allow timers to be modified
+	 * or deleted from within their own callback */
+	int state;
 };
 
 /* Signal event */
@@ -86,6 +126,28 @@ struct wand_signal_t {
 	void *data;
 };
 
+/* Event loop statistics, see wand_get_loop_stats() */
+struct wand_loop_stats_t {
+	/* Registered fd events (including the handler's own), timers and
+	 * signals. Signals are shared by every handler in the process */
+	unsigned int fds;
+	unsigned int timers;
+	unsigned int signals;
+	/* Passes through the event loop, i.e. waits for events */
+	uint64_t iterations;
+	/* Waits that ended with no fds ready */
+	uint64_t empty_waits;
+	/* Most fds that were ready after a single wait */
+	unsigned int max_ready;
+	/* Callbacks run for fd, timer and signal events */
+	uint64_t fd_callbacks;
+	uint64_t timers_fired;
+	uint64_t signals_delivered;
+	/* fd events moved to and from other handlers, see wand_migrate_fd() */
+	uint64_t fds_migrated_in;
+	uint64_t fds_migrated_out;
+};
+
 /* The event handler environment - essentially holds the "global" variables
  * for a libwandevent instance */
 struct wand_event_handler_t {
@@ -120,6 +182,351 @@ struct wand_event_handler_t {
 	 * control to the user program */
 	bool running;
 
+	/* If true, monotonictime is a virtual clock that only moves when
+	 * we tell it to, see wand_set_virtual_time() */
+	bool virtualtime;
+	/* Difference between the wall time and the virtual clock */
+	struct timeval virtualoffset;
+
+	/* Hooks to run just before waiting for events */
+	struct wand_hook_t *prepare_hooks;
+	/* Used to pass callbacks to this handler from other threads */
+	struct wand_mailbox_t *mailbox;
+	/* Worker threads for wand_queue_work() */
+	struct wand_workqueue_t *workq;
+	/* Asynchronous file I/O state */
+	struct wand_fileio_t *fileio;
+	/* Event trace being recorded, if any */
+	struct wand_trace_t *trace;
+	/* Inactivity timeouts for fd events */
+	struct wand_idle_t *idle;
+	/* Rate limiters waiting for tokens */
+	struct wand_pacer_t *pacer;
+	/* Overload protection, see wand_set_overload() */
+	struct wand_overload_t *overload;
+	/* CPU pinning and NUMA-local memory, see
+	 * wand_create_event_handler_opts() */
+	struct wand_numa_t *numa;
+	/* Control socket, see wand_start_control() */
+	struct wand_control_t *control;
+	/* Batch classes with ready fds queued during this iteration */
+	wand_batch_class_t *batch_pending;
+	/* Task deque, if the handler belongs to a loop group with an
+	 * executor, see wand_loop_group_enable_executor() */
+	struct wand_exec_loop_t *executor;
+	/* Loop statistics. The counts of fds and timers are kept up to date
+	 * as events are added and removed */
+	struct wand_loop_stats_t stats;
+
+};
+
+/* Work queue statistics, see wand_get_work_stats() */
+struct wand_work_stats_t {
+	/* Number of worker threads that have been started */
+	unsigned int threads;
+	/* Work waiting for a worker thread */
+	unsigned int queued;
+	/* Work currently being run by a worker thread */
+	unsigned int running;
+	/* Work that has finished but whose done callback is yet to be run */
+	unsigned int completing;
+	/* Largest number of items that have been waiting at once */
+	unsigned int max_queued;
+
+	uint64_t total_queued;
+	uint64_t total_completed;
+	uint64_t total_cancelled;
+};
+
+/* Backends that can be used for asynchronous file I/O */
+enum wand_file_backend_t {
+	/* Requests are run by worker threads, see wand_queue_work() */
+	WAND_FILE_THREADS,
+	/* Requests are submitted to the kernel using io_uring */
+	WAND_FILE_URING
+};
+
+/* Alignment of buffers returned by wand_file_alloc_buffer(), suitable for
+ * use with files opened using O_DIRECT */
+#define WAND_FILE_ALIGN 4096
+
+/* Listener statistics, see wand_get_listener_stats() */
+struct wand_listener_stats_t {
+	/* Connections accepted */
+	uint64_t accepted;
+	/* Connections closed immediately because we ran out of fds */
+	uint64_t dropped;
+	/* Batches of connections delivered */
+	uint64_t batches;
+	/* Unexpected errors from accept() */
+	uint64_t errors;
+};
+
+/* Options for wand_add_dgram() */
+enum {
+	/* Let the kernel coalesce datagrams from the same flow (UDP GRO) */
+	WAND_DGRAM_GRO = 1,
+	/* Report kernel receive timestamps */
+	WAND_DGRAM_TIMESTAMP = 2
+};
+
+/* A datagram received by a batched datagram socket */
+struct wand_dgram_msg_t {
+	/* The contents of the datagram, only valid during the callback */
+	void *buf;
+	size_t len;
+	/* Where the datagram came from */
+	struct sockaddr *addr;
+	socklen_t addrlen;
+	/* If non-zero, buf holds several datagrams that the kernel has
+	 * coalesced (UDP GRO), each of this size except perhaps the last */
+	uint16_t segsize;
+	/* Kernel receive timestamp, if WAND_DGRAM_TIMESTAMP was set */
+	struct timespec timestamp;
+	/* The datagram was too big for its slot and has been truncated */
+	bool truncated;
+};
+
+/* Batched datagram socket statistics, see wand_get_dgram_stats() */
+struct wand_dgram_stats_t {
+	/* Number of batches and datagrams received */
+	uint64_t batches;
+	uint64_t datagrams;
+	/* Batches that filled every slot */
+	uint64_t full_batches;
+	/* Datagrams dropped by the kernel because the socket buffer was full,
+	 * if the kernel reports it */
+	uint64_t drops;
+	/* Receive errors */
+	uint64_t errors;
+
+	/* Number of batches and datagrams sent */
+	uint64_t send_batches;
+	uint64_t sent;
+	/* Datagrams that the kernel refused to send */
+	uint64_t send_errors;
+	/* Datagrams dropped because every send slot was in use */
+	uint64_t send_dropped;
+};
+
+/* Zero-copy socket statistics, see wand_get_zc_stats() */
+struct wand_zc_stats_t {
+	/* Sends made using MSG_ZEROCOPY */
+	uint64_t zerocopy_sends;
+	/* Sends that were copied, because they were small or zero-copy is
+	 * not available */
+	uint64_t copied_sends;
+	/* Zero-copy sends where the kernel ended up copying anyway */
+	uint64_t kernel_copied;
+	/* Zero-copy sends whose buffers have not been released yet */
+	uint64_t pending;
+};
+
+/* Options for wand_add_packet_ring(). Any field left as zero takes its
+ * default value */
+struct wand_packet_ring_opts_t {
+	/* Size of each block in the ring, which must be a multiple of the
+	 * page size (default 1MB) */
+	unsigned int block_size;
+	/* Number of blocks in the ring (default 64) */
+	unsigned int block_count;
+	/* Maximum space used by a single packet (default 2048) */
+	unsigned int frame_size;
+	/* Milliseconds after which the kernel hands over a block that isn't
+	 * full yet, bounding the capture latency (default 10) */
+	unsigned int block_timeout;
+	/* If non-zero, join this PACKET_FANOUT group so that packets are
+	 * split between several rings */
+	int fanout_group;
+	/* PACKET_FANOUT_ mode for the fanout group (default hash) */
+	int fanout_mode;
+};
+
+/* A packet in a block delivered by a packet ring. The data points directly
+ * into the ring and is only valid during the callback */
+struct wand_packet_t {
+	const uint8_t *data;
+	/* Number of bytes captured */
+	uint32_t caplen;
+	/* Length of the packet on the wire */
+	uint32_t len;
+	struct timespec ts;
+	/* VLAN tag stripped by the NIC, or 0 */
+	uint16_t vlan_tci;
+};
+
+/* Packet ring statistics, see wand_get_packet_ring_stats() */
+struct wand_packet_ring_stats_t {
+	/* Blocks delivered to the callback */
+	uint64_t blocks;
+	/* Packets seen and dropped by the kernel */
+	uint64_t packets;
+	uint64_t drops;
+	/* Times the kernel found the ring full */
+	uint64_t freezes;
+};
+
+/* Rate limiter statistics, see wand_get_ratelimit_stats() */
+struct wand_ratelimit_stats_t {
+	/* Tokens taken or charged */
+	uint64_t taken;
+	/* Takes that failed for lack of tokens */
+	uint64_t denied;
+	/* Number of times the limiter has run out of tokens */
+	uint64_t throttles;
+	/* True if the limiter is out of tokens right now */
+	bool throttled;
+};
+
+/* How a framer finds the end of each frame */
+enum wand_frame_type_t {
+	/* Ends with a newline, with any CR before it stripped */
+	WAND_FRAME_LINE,
+	/* Ends with CR LF. A newline on its own is part of the frame */
+	WAND_FRAME_CRLF,
+	/* Ends with the delim byte */
+	WAND_FRAME_DELIM,
+	/* Preceded by a fixed size unsigned length */
+	WAND_FRAME_LENGTH,
+	/* Preceded by a varint length, as used by protobuf */
+	WAND_FRAME_VARINT
+};
+
+/* Flags for wand_framer_opts_t */
+enum {
+	/* Fixed size lengths are little endian rather than big endian */
+	WAND_FRAME_LITTLE_ENDIAN = 1,
+	/* The length includes the length header itself */
+	WAND_FRAME_INCLUSIVE = 2
+};
+
+/* Options for wand_add_framer(). Any field left as zero takes its default
+ * value */
+struct wand_framer_opts_t {
+	enum wand_frame_type_t type;
+	/* The delimiter for WAND_FRAME_DELIM */
+	uint8_t delim;
+	/* Size of the length for WAND_FRAME_LENGTH, from 1 to 8 bytes
+	 * (default 4) */
+	unsigned int header_size;
+	/* Combination of the WAND_FRAME_ flags */
+	int flags;
+	/* Largest frame that will be accepted, not counting the delimiter or
+	 * length (default 65536) */
+	size_t max_frame;
+};
+
+/* Framer statistics, see wand_get_framer_stats() */
+struct wand_framer_stats_t {
+	/* Reads from the socket, and the bytes they returned */
+	uint64_t reads;
+	uint64_t bytes;
+	/* Frames delivered */
+	uint64_t frames;
+	/* Bytes of partial frames moved to the front of the buffer */
+	uint64_t moved;
+	/* Oversized or malformed frames and read errors */
+	uint64_t errors;
+};
+
+/* Channel statistics, see wand_get_channel_stats() */
+struct wand_channel_stats_t {
+	/* Elements sent and received */
+	uint64_t sent;
+	uint64_t received;
+	/* Elements waiting to be received */
+	uint64_t queued;
+	/* Sends that found the channel full */
+	uint64_t full;
+	/* Times the producer had to wake the consumer up, and the other way
+	 * around */
+	uint64_t consumer_wakeups;
+	uint64_t producer_wakeups;
+};
+
+/* Flags for wand_handler_opts_t */
+enum {
+	/* Place the handler's memory on numa_node, rather than on the node
+	 * that the CPUs belong to */
+	WAND_HANDLER_NODE = 1,
+	/* Back the handler's memory with transparent huge pages */
+	WAND_HANDLER_HUGEPAGES = 2
+};
+
+/* Options for wand_create_event_handler_opts() */
+struct wand_handler_opts_t {
+	/* CPUs to pin the thread running the handler to */
+	const int *cpus;
+	int ncpus;
+	/* Combination of the WAND_HANDLER_ flags */
+	int flags;
+	/* NUMA node for the handler's memory, if WAND_HANDLER_NODE is set */
+	int numa_node;
+};
+
+/* Where an event handler's memory has ended up, see
+ * wand_get_numa_stats() */
+struct wand_numa_stats_t {
+	/* The node the memory is meant to be on, or -1 for any */
+	int node;
+	/* The CPU the handler's thread was running on once it was pinned,
+	 * or -1 if it hasn't been run yet */
+	int cpu;
+	/* True if huge pages were asked for and the kernel accepted */
+	bool hugepages;
+	/* Address space set aside for the handler, in bytes */
+	size_t reserved;
+	/* Pages that have actually been touched, and how many of those are
+	 * on the intended node and on other nodes */
+	size_t pages;
+	size_t local_pages;
+	size_t remote_pages;
+};
+
+/* States of the overload controller */
+enum wand_overload_state_t {
+	WAND_OVERLOAD_NORMAL,
+	/* Sheddable fds are suspended until the handler recovers */
+	WAND_OVERLOAD_SHEDDING
+};
+
+/* Overload controller thresholds, see wand_set_overload() */
+struct wand_overload_opts_t {
+	/* Loop lag, in usec, at which we start shedding (default 50000) and
+	 * at which we stop again (default 10000) */
+	unsigned int lag_high;
+	unsigned int lag_low;
+	/* Time spent in callbacks per iteration of the event loop, in usec,
+	 * at which we start shedding (default 100000) and stop again
+	 * (default 20000) */
+	unsigned int busy_high;
+	unsigned int busy_low;
+	/* How often the loop lag is measured, in ms (default 10) */
+	unsigned int probe_interval;
+	/* Minimum time between changes of state, in ms (default 500) */
+	unsigned int hold_time;
+};
+
+/* Overload controller statistics, see wand_get_overload_stats() */
+struct wand_overload_stats_t {
+	enum wand_overload_state_t state;
+	/* Time since the state last changed, in usec */
+	int64_t since;
+	/* Smoothed loop lag and time spent in callbacks per iteration, and
+	 * the largest of each seen so far, in usec */
+	int64_t lag;
+	int64_t busy;
+	int64_t max_lag;
+	int64_t max_busy;
+	/* Number of changes of state */
+	uint64_t transitions;
+};
+
+/* Formats for wand_format_stats() */
+enum wand_stats_format_t {
+	WAND_STATS_JSON,
+	/* Prometheus text exposition format */
+	WAND_STATS_PROMETHEUS
 };
 
 /* Initialises libwandevent, particularly the signal handling */
@@ -128,6 +535,20 @@ int wand_event_init(void);
 /* Creates and initialises a new event handler environment */
 wand_event_handler_t * wand_create_event_handler(void);
 
+/* Creates an event handler whose thread is pinned to a set of CPUs, and
+ * whose own memory (the handler, its fd table, timers and fd events) is
+ * placed on a particular NUMA node -- by default, the node that the first
+ * of the CPUs belongs to -- regardless of which thread creates it. The
+ * thread is pinned each time wand_event_run() is called. opts may be NULL,
+ * which is the same as wand_create_event_handler() */
+wand_event_handler_t * wand_create_event_handler_opts(
+		const struct wand_handler_opts_t *opts);
+
+/* Reports where the memory for a handler created with CPUs or a node has
+ * been placed. Returns -1 for other handlers */
+int wand_get_numa_stats(wand_event_handler_t *ev_hdl,
+		struct wand_numa_stats_t *stats);
+
 /* Destroys and frees an event handler environment */
 void wand_destroy_event_handler(wand_event_handler_t *wand_ev);
 
@@ -159,17 +580,697 @@ int wand_get_fd_flags(wand_event_handler_t *ev_hdl, int fd);
 
 void wand_set_fd_flags(wand_event_handler_t *ev_hdl, int fd, int new_flags);
 
+/* Sets inactivity timeouts, in milliseconds, for an fd that has been
+ * registered with wand_add_fd(). If the fd's callback isn't called for
+ * EV_READ (or EV_WRITE) within the timeout, it is called with
+ * EV_TIMEOUT | EV_READ (or EV_TIMEOUT | EV_WRITE) instead, and the timeout
+ * starts again. A timeout of 0 disables it. The timeouts are reset for free
+ * whenever the callback fires, but are only checked every
+ * WAND_IDLE_RESOLUTION ms, so may go off up to that much late. They are
+ * removed along with the fd event. Returns 0 on success, -1 on error */
+int wand_set_fd_timeouts(wand_event_handler_t *ev_hdl, int fd, int read_ms,
+		int write_ms);
+
+/* Creates a token-bucket rate limiter that allows rate tokens per second,
+ * with bursts of up to burst tokens. If group is not NULL, tokens are also
+ * drawn from the group limiter, which can be shared by several limiters to
+ * give them an overall limit. A group must not be destroyed before the
+ * limiters in it. Limiters must be destroyed before their event handler */
+wand_ratelimit_t * wand_create_ratelimit(wand_event_handler_t *ev_hdl,
+		double rate, uint64_t burst, wand_ratelimit_t *group);
+
+/* Changes the rate and burst size of a limiter */
+int wand_ratelimit_set_rate(wand_ratelimit_t *rl, double rate,
+		uint64_t burst);
+
+/* Takes n tokens from the limiter (and its group) if they are all
+ * available, returning false otherwise. Either way, if there aren't enough
+ * tokens left for another take of n, the limiter is throttled until there
+ * are: the fds attached to it are suspended, and once enough tokens have
+ * built up the fds are resumed and the limiter's callback is called. A
+ * take of more than burst tokens can never succeed */
+bool wand_ratelimit_take(wand_ratelimit_t *rl, uint64_t n);
+
+/* Takes n tokens regardless, running into debt if necessary, e.g. to
+ * account for a send whose size was only known after the fact. The
+ * limiter is throttled in the same way as for wand_ratelimit_take() */
+void wand_ratelimit_charge(wand_ratelimit_t *rl, uint64_t n);
+
+/* Returns the number of tokens that could be taken right now */
+uint64_t wand_ratelimit_available(wand_ratelimit_t *rl);
+
+/* Returns how long, in microseconds, until n tokens will be available, or
+ * -1 if that will never happen at the current rate */
+int64_t wand_ratelimit_delay(wand_ratelimit_t *rl, uint64_t n);
+
+/* Suspends the given events (EV_READ and/or EV_WRITE) on an fd registered
+ * with wand_add_fd() whenever the limiter is throttled. The fd keeps the
+ * flags set by wand_add_fd() and wand_set_fd_flags(), but the handler
+ * stops watching for the suspended events. A hang up is still reported to
+ * a suspended reader. The fd should be detached before its event is
+ * removed */
+int wand_ratelimit_attach(wand_ratelimit_t *rl, int fd, int flags);
+
+/* Stops a limiter from controlling an fd, resuming it if necessary */
+void wand_ratelimit_detach(wand_ratelimit_t *rl, int fd);
+
+/* Sets a function to be called when a throttled limiter has enough tokens
+ * again, after its fds have been resumed */
+void wand_ratelimit_set_callback(wand_ratelimit_t *rl,
+		void (*callback)(wand_event_handler_t *ev_hdl,
+				wand_ratelimit_t *rl, void *data),
+		void *data);
+
+/* Fills in the statistics for a rate limiter */
+void wand_get_ratelimit_stats(wand_ratelimit_t *rl,
+		struct wand_ratelimit_stats_t *stats);
+
+/* Destroys a rate limiter, resuming any fds that it has suspended */
+void wand_destroy_ratelimit(wand_ratelimit_t *rl);
+
+/* Creates a channel for passing elements of elem_size bytes from one
+ * thread to another, with room for at least capacity elements. Elements
+ * are copied in and out, so should be small -- a pointer, or a record of a
+ * few cache lines. A channel has a single producer and a single consumer,
+ * usually each running their own event handler */
+wand_channel_t * wand_create_channel(size_t elem_size, size_t capacity);
+
+/* Registers the consumer side of a channel with an event handler. The
+ * callback is called from that handler whenever there are elements to
+ * receive, and should take them with wand_channel_recv(). While elements
+ * keep arriving the handler polls for them rather than waiting, so the
+ * producer only has to wake it up (with a system call) once it has
+ * emptied the channel and is about to block. Must be called before the
+ * handler is started, or from the handler's own thread */
+int wand_channel_set_consumer(wand_channel_t *ch,
+		wand_event_handler_t *ev_hdl,
+		void (*callback)(wand_event_handler_t *ev_hdl,
+				wand_channel_t *ch, void *data),
+		void *data);
+
+/* Registers the producer side of a channel with an event handler, so that
+ * the callback is called from that handler once a channel that was full
+ * has room again. A producer that doesn't register can still send, but
+ * will have to find out when there is room for itself. The same rules
+ * apply as for wand_channel_set_consumer() */
+int wand_channel_set_producer(wand_channel_t *ch,
+		wand_event_handler_t *ev_hdl,
+		void (*callback)(wand_event_handler_t *ev_hdl,
+				wand_channel_t *ch, void *data),
+		void *data);
+
+/* Copies up to n elements into the channel. Returns the number sent, which
+ * is less than n if the channel filled up, in which case the producer's
+ * callback will be called once half the channel is free. Must only be
+ * called by the producer */
+size_t wand_channel_send(wand_channel_t *ch, const void *elems, size_t n);
+
+/* Copies up to max elements out of the channel, returning the number
+ * received. Must only be called by the consumer */
+size_t wand_channel_recv(wand_channel_t *ch, void *elems, size_t max);
+
+/* Fills in the statistics for a channel. The counts may be slightly out of
+ * date when read from a thread other than the producer or consumer */
+void wand_get_channel_stats(wand_channel_t *ch,
+		struct wand_channel_stats_t *stats);
+
+/* Destroys a channel, discarding anything left in it. Must be called
+ * while neither of the handlers it is registered with is running, and
+ * before they are destroyed */
+void wand_destroy_channel(wand_channel_t *ch);
+
+/* Moves an existing timer event so that it fires sec.usec seconds from now.
+ * Pushing a timer further into the future is O(1). This is safe to call from
+ * within the timer's own callback, in which case the timer is re-armed rather
+ * than freed. Returns 0 on success, -1 if the expiry parameters are invalid
+ * or the timer has been deleted from within its own callback */
+int wand_mod_timer(wand_event_handler_t *ev_hdl, struct wand_timer_t *timer,
+		int sec, int usec);
+
 /* Cancels a timer event */
 void wand_del_timer(wand_event_handler_t *ev_hdl, struct wand_timer_t *);
 
 /* Cancels a signal event */
 void wand_del_signal(int signum);
 
+/* Registers an event for when the child process pid exits. The callback is
+ * given the status from waitpid(), as the child has already been reaped, and
+ * the event is removed afterwards. Uses a pidfd where the kernel supports it,
+ * otherwise falls back to SIGCHLD, in which case the program must not use
+ * SIGCHLD for anything else */
+wand_child_t * wand_add_child(wand_event_handler_t *ev_hdl, pid_t pid,
+		void *data,
+		void (*callback)(wand_event_handler_t *ev_hdl, pid_t pid,
+				int status, void *data));
+
+/* Stops watching for a child process to exit, without reaping it */
+void wand_del_child(wand_event_handler_t *ev_hdl, wand_child_t *child);
+
+/* Sets the maximum number of worker threads used by wand_queue_work(). The
+ * default is 4. Threads are only started as they are needed, and the limit
+ * can't be reduced below the number of threads that are already running */
+int wand_set_work_threads(wand_event_handler_t *ev_hdl, int nthreads);
+
+/* Runs work_fn on a worker thread, so that it can block without holding up
+ * the event handler. Once work_fn returns, done_fn is called from the event
+ * handler's own thread. Returns NULL if the work could not be queued,
+ * including if there are no worker threads and none could be started */
+wand_work_t * wand_queue_work(wand_event_handler_t *ev_hdl,
+		void (*work_fn)(void *data),
+		void (*done_fn)(wand_event_handler_t *ev_hdl, void *data,
+				bool cancelled),
+		void *data);
+
+/* Cancels queued work that has not yet been started by a worker thread. The
+ * done callback will still be called, with cancelled set to true. Returns
+ * -1 if the work has already started, in which case it will run to
+ * completion as normal. The work must not be cancelled after its done
+ * callback has been called */
+int wand_cancel_work(wand_event_handler_t *ev_hdl, wand_work_t *work);
+
+/* Fills in the current work queue statistics for an event handler */
+void wand_get_work_stats(wand_event_handler_t *ev_hdl,
+		struct wand_work_stats_t *stats);
+
+/* Queues an asynchronous write of len bytes from buf to fd, starting at
+ * offset. The buffer must not be modified until the callback has been
+ * called with the result of the write, which is either the number of bytes
+ * written or a negative errno value. Writes to the same fd that are queued
+ * during the same iteration of the event loop and are contiguous within the
+ * file are submitted together as a single write. Returns -1 if the write
+ * could not be queued */
+int wand_file_write(wand_event_handler_t *ev_hdl, int fd, const void *buf,
+		size_t len, off_t offset,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				void *buf, ssize_t result, void *data),
+		void *data);
+
+/* Queues an asynchronous read of up to len bytes from fd at offset into buf.
+ * The result passed to the callback is the number of bytes read, or a
+ * negative errno value */
+int wand_file_read(wand_event_handler_t *ev_hdl, int fd, void *buf,
+		size_t len, off_t offset,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				void *buf, ssize_t result, void *data),
+		void *data);
+
+/* Queues an asynchronous fsync (or fdatasync, if datasync is true) of fd.
+ * The sync doesn't start until every write to fd that was queued before it
+ * has completed, so those writes are covered by it. Other asynchronous
+ * requests are not ordered with respect to each other */
+int wand_file_fsync(wand_event_handler_t *ev_hdl, int fd, bool datasync,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				void *buf, ssize_t result, void *data),
+		void *data);
+
+/* Chooses the backend used for asynchronous file I/O. By default, io_uring
+ * is used if the kernel supports it. The backend can only be changed while
+ * there is no file I/O outstanding */
+int wand_file_set_backend(wand_event_handler_t *ev_hdl,
+		enum wand_file_backend_t backend);
+
+/* Returns the backend being used for asynchronous file I/O */
+enum wand_file_backend_t wand_file_get_backend(wand_event_handler_t *ev_hdl);
+
+/* Allocates a buffer aligned to WAND_FILE_ALIGN, with the length rounded up
+ * to a multiple of WAND_FILE_ALIGN */
+void * wand_file_alloc_buffer(size_t len);
+
+/* Frees a buffer allocated with wand_file_alloc_buffer() */
+void wand_file_free_buffer(void *buf);
+
+/* Registers a listening socket. Each time the socket becomes readable, up to
+ * budget connections are accepted (non-blocking and close-on-exec) and
+ * passed to the callback in batches. A budget of 0 uses the default. If we
+ * run out of file descriptors, pending connections are accepted and closed
+ * immediately rather than being left in the backlog */
+wand_listener_t * wand_add_listener(wand_event_handler_t *ev_hdl,
+		int fd, int budget,
+		void (*callback)(wand_event_handler_t *ev_hdl, int listenfd,
+				int *fds, int nfds, void *data),
+		void *data);
+
+/* Registers every connection accepted by a listener with the target handler,
+ * using the given flags, callback and data. If the target is not the
+ * listener's own handler, the connections are passed to the target's thread
+ * to be registered there. This must be called before the target handler is
+ * started, or from the target handler's thread. The listener's callback (if
+ * any) is still called afterwards, but must not close the connections */
+int wand_listener_set_target(wand_listener_t *listener,
+		wand_event_handler_t *target, int flags,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				void *data, enum wand_eventtype_t ev),
+		void *data);
+
+/* Fills in the statistics for a listener */
+void wand_get_listener_stats(wand_listener_t *listener,
+		struct wand_listener_stats_t *stats);
+
+/* Removes a listener. The listening socket itself is not closed */
+void wand_del_listener(wand_event_handler_t *ev_hdl,
+		wand_listener_t *listener);
+
+/* Registers a stream socket whose data is made up of frames, which are
+ * passed to the callback one at a time. The frame points directly into the
+ * framer's read buffer, without the delimiter or length, and is only valid
+ * during the callback. If the socket is closed by the other end, or there
+ * is a read error or a frame is too large or malformed, the framer stops
+ * reading and the error callback (if any) is called with 0, errno, EMSGSIZE
+ * or EPROTO respectively. The framer should then be removed. opts must not
+ * be NULL. The socket is made non-blocking */
+wand_framer_t * wand_add_framer(wand_event_handler_t *ev_hdl, int fd,
+		const struct wand_framer_opts_t *opts,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				const uint8_t *frame, size_t len, void *data),
+		void (*error)(wand_event_handler_t *ev_hdl, int fd, int err,
+				void *data),
+		void *data);
+
+/* Fills in the statistics for a framer */
+void wand_get_framer_stats(wand_framer_t *fr,
+		struct wand_framer_stats_t *stats);
+
+/* Removes a framer. This may be done from within its callbacks. The socket
+ * itself is not closed */
+void wand_del_framer(wand_event_handler_t *ev_hdl, wand_framer_t *fr);
+
+/* Registers a datagram socket for batched receiving and sending. Each time
+ * the socket becomes readable, up to batch datagrams (of up to slotsize
+ * bytes each) are read at a time using recvmmsg() and passed to the callback
+ * together. flags is a combination of the WAND_DGRAM_ options */
+wand_dgram_t * wand_add_dgram(wand_event_handler_t *ev_hdl, int fd,
+		int flags, int batch, size_t slotsize,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				struct wand_dgram_msg_t *msgs, int nmsgs,
+				void *data),
+		void *data);
+
+/* Queues a datagram to be sent, copying it into one of the socket's send
+ * slots. addr may be NULL if the socket is connected. Queued datagrams are
+ * sent together using sendmmsg() before the event handler next waits for
+ * events. Returns -1 if the datagram is too large or there are no free
+ * slots */
+int wand_dgram_send(wand_dgram_t *dg, const void *buf, size_t len,
+		const struct sockaddr *addr, socklen_t addrlen);
+
+/* Sends any queued datagrams immediately */
+int wand_dgram_flush(wand_dgram_t *dg);
+
+/* Fills in the statistics for a batched datagram socket */
+void wand_get_dgram_stats(wand_dgram_t *dg, struct wand_dgram_stats_t *stats);
+
+/* Removes a batched datagram socket, sending anything still queued if
+ * possible. The socket itself is not closed */
+void wand_del_dgram(wand_event_handler_t *ev_hdl, wand_dgram_t *dg);
+
+/* Registers a socket for zero-copy sending with wand_zc_send(). The flags,
+ * data and callback behave exactly like wand_add_fd(), except that EV_EXCEPT
+ * events are also used internally to collect send completions -- so if the
+ * flags for the socket are changed with wand_set_fd_flags(), EV_EXCEPT must
+ * remain set. EV_EXCEPT is passed on to the callback if it was in flags, or
+ * if the socket has an error other than a completion, which the callback
+ * should deal with (e.g. by checking SO_ERROR and closing). Sends of at least
+ * threshold bytes (0 for the default) use MSG_ZEROCOPY; anything smaller is
+ * copied as normal. The release callback is called once the kernel has
+ * finished with the buffer from each successful send */
+wand_zc_t * wand_add_zc_fd(wand_event_handler_t *ev_hdl, int fd, int flags,
+		size_t threshold, void *data,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				void *data, enum wand_eventtype_t ev),
+		void (*release)(wand_event_handler_t *ev_hdl, int fd,
+				void *cookie, void *data));
+
+/* Sends data on a zero-copy socket, with the same return value as send().
+ * If the send succeeds, buf must not be modified or freed until the release
+ * callback has been called with the given cookie. For sends that are copied,
+ * the release callback is called before this function returns */
+ssize_t wand_zc_send(wand_zc_t *zc, const void *buf, size_t len, int flags,
+		void *cookie);
+
+/* Fills in the statistics for a zero-copy socket */
+void wand_get_zc_stats(wand_zc_t *zc, struct wand_zc_stats_t *stats);
+
+/* Removes a zero-copy socket. Any sends that are still outstanding are
+ * released. The socket itself is not closed */
+void wand_del_zc_fd(wand_event_handler_t *ev_hdl, wand_zc_t *zc);
+
+/* Opens an AF_PACKET socket with a TPACKET_V3 receive ring on the given
+ * interface (or on every interface, if ifname is NULL). Each time the kernel
+ * hands over a block of packets, the callback is given the packets within it
+ * along with a pointer to the raw block (a struct tpacket_block_desc). The
+ * block is returned to the kernel once the callback returns. opts may be
+ * NULL to use the defaults. Requires CAP_NET_RAW */
+wand_packet_ring_t * wand_add_packet_ring(wand_event_handler_t *ev_hdl,
+		const char *ifname,
+		const struct wand_packet_ring_opts_t *opts,
+		void (*callback)(wand_event_handler_t *ev_hdl,
+				wand_packet_ring_t *ring,
+				struct wand_packet_t *packets,
+				unsigned int npackets, void *block,
+				void *data),
+		void *data);
+
+/* Returns the packet socket used by a packet ring, e.g. to attach a BPF
+ * filter */
+int wand_packet_ring_fd(wand_packet_ring_t *ring);
+
+/* Fills in the statistics for a packet ring */
+void wand_get_packet_ring_stats(wand_packet_ring_t *ring,
+		struct wand_packet_ring_stats_t *stats);
+
+/* Removes a packet ring, closing its socket */
+void wand_del_packet_ring(wand_event_handler_t *ev_hdl,
+		wand_packet_ring_t *ring);
+
+/* Creates a group of nloops event handlers, each of which will be run by its
+ * own thread. cpus is an array of nloops CPU numbers that the threads should
+ * be pinned to (or -1 to leave a thread unpinned). If cpus is NULL, the
+ * threads are pinned to the CPUs that we are allowed to run on, in order.
+ * Events can be added to the handlers using wand_loop_group_handler() up
+ * until the group is started */
+wand_loop_group_t * wand_create_loop_group(int nloops, const int *cpus);
+
+/* Returns the number of event handlers in a loop group */
+int wand_loop_group_size(wand_loop_group_t *group);
+
+/* Returns the event handler for a given loop in the group */
+wand_event_handler_t * wand_loop_group_handler(wand_loop_group_t *group,
+		int index);
+
+/* Returns the index of an event handler within a loop group, or -1 if the
+ * handler is not part of the group */
+int wand_loop_group_index(wand_loop_group_t *group,
+		wand_event_handler_t *ev_hdl);
+
+/* Opens a SO_REUSEPORT listening socket on addr for each loop in the group
+ * and registers it with that loop's handler, using the given callback. New
+ * connections are steered to the loop that is pinned to the CPU that
+ * received them, if the kernel supports it. Must be called before the group
+ * is started */
+int wand_loop_group_listen(wand_loop_group_t *group,
+		const struct sockaddr *addr, socklen_t addrlen, int backlog,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				void *data, enum wand_eventtype_t ev),
+		void *data);
+
+/* Starts a thread running wand_event_run() for each loop in the group */
+int wand_loop_group_start(wand_loop_group_t *group);
+
+/* Asks every loop in the group to stop. Safe to call from any thread,
+ * including from within a callback run by one of the loops */
+void wand_loop_group_stop(wand_loop_group_t *group);
+
+/* Waits for every loop in the group to stop */
+void wand_loop_group_join(wand_loop_group_t *group);
+
+/* Stops the group, if it is running, and frees the group along with all of
+ * its event handlers and listening sockets */
+void wand_destroy_loop_group(wand_loop_group_t *group);
+
+/* Gives each loop in the group a work-stealing deque of up to queue_size
+ * tasks (or 0 for the default), so that wand_defer_task() can be used with
+ * the group's handlers. Loops run tasks when they run out of events, and
+ * loops that have nothing to do take tasks from busy loops before they go
+ * to sleep. Must be called before the group is started */
+int wand_loop_group_enable_executor(wand_loop_group_t *group,
+		int queue_size);
+
+/* Run the done callback on the handler that deferred the task, rather than
+ * on whichever handler happened to run it */
+#define WAND_TASK_RETURN 1
+
+/* Defers a CPU-bound task, fn, to be run by any of the loops in the
+ * handler's loop group. Once fn has returned, done (if not NULL) is called
+ * by the loop that ran it or, with WAND_TASK_RETURN, by ev_hdl. Tasks that
+ * haven't run when the group is destroyed are passed to done with cancelled
+ * set. Must be called from the thread running ev_hdl. Returns -1 if the
+ * handler's deque is full */
+int wand_defer_task(wand_event_handler_t *ev_hdl, void (*fn)(void *data),
+		void (*done)(wand_event_handler_t *ev_hdl, void *data,
+				bool cancelled),
+		void *data, int flags);
+
+/* Executor statistics for one loop, see wand_get_executor_stats() */
+struct wand_executor_stats_t {
+	/* Tasks deferred by this loop */
+	uint64_t deferred;
+	/* Tasks run by this loop, including those it stole */
+	uint64_t run;
+	/* Tasks this loop took from other loops' deques */
+	uint64_t stolen;
+	/* Times this loop woke a sleeping loop to help out */
+	uint64_t wakeups;
+	/* Tasks refused because the deque was full */
+	uint64_t full;
+	/* Tasks waiting in this loop's deque */
+	uint64_t queued;
+};
+
+/* Fills in the executor statistics for a handler in a loop group */
+void wand_get_executor_stats(wand_event_handler_t *ev_hdl,
+		struct wand_executor_stats_t *stats);
+
+/* Moves an fd event from src to dst, which is usually another handler in
+ * the same loop group, along with its flags, data, callback, inactivity
+ * timeouts and whether it is sheddable or migratable. Must be called from
+ * the thread running src, and dst must have a mailbox. The event is gone
+ * from src when this returns, and is added to dst by dst's own thread, after
+ * which moved (if not NULL) is called by dst, e.g. to move any timers that
+ * go with the fd. If the event couldn't be added to dst, moved is still
+ * called, but wand_get_fd_flags() will return -1. No readiness is lost in
+ * between. From then on, the callback and its data are used by dst's
+ * thread. Fails if the fd is suspended, e.g. by a rate limiter, as that
+ * belongs to src */
+int wand_migrate_fd(wand_event_handler_t *src, wand_event_handler_t *dst,
+		int fd, void (*moved)(wand_event_handler_t *ev_hdl, int fd,
+				void *data));
+
+/* Allows the rebalancer to move an fd event to another handler with
+ * wand_migrate_fd(). Off by default, as it is only safe for fds registered
+ * directly with wand_add_fd() whose callback doesn't care which thread it
+ * is run by */
+int wand_set_fd_migratable(wand_event_handler_t *ev_hdl, int fd,
+		bool migratable);
+
+/* Rebalancer options, see wand_loop_group_enable_rebalancer() */
+struct wand_rebalance_opts_t {
+	/* How often each loop checks its load, in ms (default 100) */
+	unsigned int interval;
+	/* How far above the average number of fd callbacks a loop must be,
+	 * as a percentage, before it moves fds away (default 25) */
+	unsigned int imbalance;
+	/* Most fds a loop moves per interval (default 4) */
+	unsigned int max_moves;
+	/* Loops that ran fewer fd callbacks than this in an interval are
+	 * left alone (default 1000) */
+	unsigned int min_load;
+};
+
+/* Periodically moves the busiest migratable fds away from loops that are
+ * running many more fd callbacks than the others, to the least busy loop.
+ * An fd is only moved if that makes the two loops more even. opts may be
+ * NULL to use the defaults. Must be called before the group is started */
+int wand_loop_group_enable_rebalancer(wand_loop_group_t *group,
+		const struct wand_rebalance_opts_t *opts);
+
+/* Shared dispatch statistics, see wand_get_shared_stats() */
+struct wand_shared_stats_t {
+	/* Registered fds */
+	uint64_t fds;
+	/* Callbacks run */
+	uint64_t callbacks;
+	/* Times a loop took a batch of events */
+	uint64_t batches;
+	/* Times a loop was woken but the events had already been taken by
+	 * the other loops */
+	uint64_t empty;
+	/* Events dropped because their fd had been deleted */
+	uint64_t stale;
+};
+
+/* Creates a set of fds that are shared by every loop in the group. Each
+ * time an fd is ready, its callback is run by whichever loop gets to it
+ * first, and no other loop will run it for that fd until it has returned.
+ * The callback is passed the handler of the loop running it, which should
+ * be used for timers and anything else that isn't thread-safe. Loops take
+ * up to batch events at a time (or 0 for the default). Requires epoll. Must
+ * be called before the group is started. The shared set is freed along
+ * with the group */
+wand_shared_t * wand_loop_group_enable_shared(wand_loop_group_t *group,
+		int batch);
+
+/* Adds an fd to a shared set, with the same flags, data and callback as
+ * wand_add_fd(). Safe to call from any thread. Returns 0 on success, -1 on
+ * error */
+int wand_shared_add_fd(wand_shared_t *sh, int fd, int flags, void *data,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				void *data, enum wand_eventtype_t ev));
+
+/* Changes the events a shared fd is registered for. Safe to call from any
+ * thread */
+int wand_shared_set_fd_flags(wand_shared_t *sh, int fd, int flags);
+
+/* Removes an fd from a shared set. Safe to call from any thread. If another
+ * loop is running the fd's callback, waits for it to finish, so that the fd
+ * can be closed and its data freed as soon as this returns */
+int wand_shared_del_fd(wand_shared_t *sh, int fd);
+
+/* Fills in the statistics for a shared set */
+void wand_get_shared_stats(wand_shared_t *sh,
+		struct wand_shared_stats_t *stats);
+
+/* A ready fd passed to a batch callback */
+struct wand_batch_event_t {
+	int fd;
+	/* EV_READ, EV_WRITE and/or EV_EXCEPT */
+	int events;
+	/* The data the fd event was registered with */
+	void *data;
+};
+
+/* Batch class statistics, see wand_get_batch_stats() */
+struct wand_batch_stats_t {
+	/* fds in the class */
+	unsigned int fds;
+	/* Largest batch so far */
+	unsigned int max_batch;
+	/* Batch callbacks run, and the ready fds passed to them */
+	uint64_t batches;
+	uint64_t events;
+};
+
+/* Creates a batch class. Each time the handler wakes up, every fd in the
+ * class that is ready is passed to the callback in a single array, once
+ * the handler has been through all of the fds that were ready, instead of
+ * each fd's own callback being run. The array is only valid during the
+ * callback. The callback may remove fds, including ones that come later in
+ * the array. Classes must be destroyed before their event handler */
+wand_batch_class_t * wand_create_batch_class(wand_event_handler_t *ev_hdl,
+		void (*callback)(wand_event_handler_t *ev_hdl,
+				struct wand_batch_event_t *events,
+				int nevents, void *data),
+		void *data);
+
+/* Puts an fd that has been registered with wand_add_fd() into a batch
+ * class, or takes it out if cls is NULL. The fd leaves the class when its
+ * event is removed, or moved to another handler */
+int wand_set_fd_batch(wand_event_handler_t *ev_hdl, int fd,
+		wand_batch_class_t *cls);
+
+/* Fills in the statistics for a batch class */
+void wand_get_batch_stats(wand_batch_class_t *cls,
+		struct wand_batch_stats_t *stats);
+
+/* Destroys a batch class. Any fds still in it go back to having their own
+ * callbacks run */
+void wand_destroy_batch_class(wand_event_handler_t *ev_hdl,
+		wand_batch_class_t *cls);
+
+/* Starts recording a trace of what the event handler is doing -- waits,
+ * callbacks, timer lateness and events being added, changed and removed --
+ * into a ring of fixed-size records in a file at path, which can be examined
+ * with the wandevent-trace tool. nrecords is rounded up to a power of two;
+ * once the ring is full the oldest records are overwritten. Returns 0 on success,
+ * -1 on error */
+int wand_trace_start(wand_event_handler_t *ev_hdl, const char *path,
+		size_t nrecords);
+
+/* Stops recording a trace, if one is running */
+void wand_trace_stop(wand_event_handler_t *ev_hdl);
+
+/* Enables overload protection for an event handler, or changes its
+ * thresholds. The handler measures the loop lag (how late a timer set
+ * every probe_interval ms fires) and how long the callbacks take in each
+ * iteration. Once either goes above its high threshold, the handler starts
+ * shedding load: the events marked with wand_set_fd_sheddable() are
+ * suspended until both have come back below their low thresholds. opts
+ * may be NULL to use the defaults. Returns 0 on success, -1 on error */
+int wand_set_overload(wand_event_handler_t *ev_hdl,
+		const struct wand_overload_opts_t *opts);
+
+/* Disables overload protection, resuming anything that has been shed */
+void wand_clear_overload(wand_event_handler_t *ev_hdl);
+
+/* Marks the given events (EV_READ and/or EV_WRITE) on an fd registered
+ * with wand_add_fd() to be suspended while the handler is overloaded, e.g.
+ * EV_READ on a listening socket. Flags of 0 unmarks the fd. Requires
+ * overload protection to be enabled */
+int wand_set_fd_sheddable(wand_event_handler_t *ev_hdl, int fd, int flags);
+
+/* Adds a function to be called whenever the overload state changes, after
+ * sheddable fds have been suspended or resumed */
+int wand_add_overload_callback(wand_event_handler_t *ev_hdl,
+		void (*callback)(wand_event_handler_t *ev_hdl,
+				enum wand_overload_state_t state, void *data),
+		void *data);
+
+/* Removes a callback added with wand_add_overload_callback() */
+void wand_del_overload_callback(wand_event_handler_t *ev_hdl,
+		void (*callback)(wand_event_handler_t *ev_hdl,
+				enum wand_overload_state_t state, void *data),
+		void *data);
+
+/* Returns the current overload state */
+enum wand_overload_state_t wand_get_overload_state(
+		wand_event_handler_t *ev_hdl);
+
+/* Fills in the overload controller statistics */
+void wand_get_overload_stats(wand_event_handler_t *ev_hdl,
+		struct wand_overload_stats_t *stats);
+
+/* Fills in the event loop statistics for a handler */
+void wand_get_loop_stats(wand_event_handler_t *ev_hdl,
+		struct wand_loop_stats_t *stats);
+
+/* Writes a snapshot of the handler's state into buf, in the same way as
+ * snprintf(): the number of registered events, the time until the next few
+ * timers are due, the backend in use and the loop statistics, along with
+ * the overload and work queue state if those are in use. Returns the
+ * length of the whole snapshot, which may be larger than len, or -1 on
+ * error. Must be called from the handler's own thread */
+int wand_format_stats(wand_event_handler_t *ev_hdl,
+		enum wand_stats_format_t format, char *buf, size_t len);
+
+/* Opens a UNIX stream socket at path that serves snapshots from
+ * wand_format_stats(), from within the handler itself. A client sends a
+ * single line, "json" or "prometheus" (an empty line means json), and
+ * gets the snapshot back before the connection is closed. HTTP requests
+ * such as "GET /metrics" are also understood, so the socket can be read
+ * with curl --unix-socket. Any existing socket at path is replaced, and
+ * the new one is only accessible by its owner. Returns -1 on error */
+int wand_start_control(wand_event_handler_t *ev_hdl, const char *path);
+
+/* Closes the control socket, and any open connections to it, and removes
+ * it from the filesystem */
+void wand_stop_control(wand_event_handler_t *ev_hdl);
+
 /* Starts the event handler - at this point, the execution of your program
  * will now only occur via the callback functions for the events you registered
  * prior to calling this function */
 void wand_event_run(wand_event_handler_t *ev_hdl);
 
+/* Switches the event handler to a virtual clock, starting at start (or at
+ * the current monotonic time, if start is NULL). From then on, time only
+ * moves forward when wand_advance_time() is called, or when the handler
+ * finds no fd events ready, in which case it jumps straight to the expiry
+ * time of the next timer. This allows timer-heavy code to run as fast as
+ * the CPU allows, with timers that are due at the same time always firing
+ * in the order they were added. The wall time moves with the virtual
+ * clock */
+void wand_set_virtual_time(wand_event_handler_t *ev_hdl,
+		const struct timeval *start);
+
+/* Moves a virtual clock forward by sec.usec seconds. Timers that become due
+ * fire on the next pass through the event loop. Returns -1 if the handler
+ * isn't using a virtual clock or the interval is invalid */
+int wand_advance_time(wand_event_handler_t *ev_hdl, int sec, int usec);
+
+/* Moves a virtual clock forward to the given monotonic time, e.g. the
+ * timestamp of the next packet in a capture being replayed. Returns -1 if
+ * the handler isn't using a virtual clock or when is in the past */
+int wand_advance_time_to(wand_event_handler_t *ev_hdl,
+		const struct timeval *when);
+
 /* Returns the current walltime */
 struct timeval wand_get_walltime(wand_event_handler_t *ev_hdl);
 
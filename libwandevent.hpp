@@ -0,0 +1,411 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* C++ interface to libwandevent.
+ *
+ * This is a thin, header-only layer over the C API. Each handle stores its
+ * callable inline and registers a static trampoline, generated per callable
+ * type, with the C library - so there is no std::function and no heap
+ * allocated closure. The C event's data pointer refers to the handle itself
+ * and is updated whenever the handle is moved, so handles are move-only and
+ * cancel their event when they are destroyed.
+ *
+ * Requires C++17. Like the C API, none of this is thread-safe: a handle must
+ * only be used from the thread running its loop.
+ */
+
+#ifndef LIBWANDEVENT_HPP
+#define LIBWANDEVENT_HPP
+
+#include <chrono>
+#include <type_traits>
+#include <utility>
+
+#include "libwandevent.h"
+
+namespace wand {
+
+/* Initialises the library. Call this once, before creating any loops */
+inline int init() {
+	return wand_event_init();
+}
+
+/* Wraps a member function and an object into a callable, for use as a
+ * callback, e.g. wand::Timer t(loop, 1s, wand::bind<&Foo::tick>(this)); */
+template <auto Method, typename T>
+struct Bound {
+	T *obj;
+
+	template <typename... Args>
+	decltype(auto) operator()(Args&&... args) const {
+		return (obj->*Method)(std::forward<Args>(args)...);
+	}
+};
+
+template <auto Method, typename T>
+Bound<Method, T> bind(T *obj) {
+	return Bound<Method, T>{obj};
+}
+
+/* Owns an event handler */
+class Loop {
+public:
+	Loop() : ev_hdl(wand_create_event_handler()) {}
+
+	~Loop() {
+		if (ev_hdl)
+			wand_destroy_event_handler(ev_hdl);
+	}
+
+	Loop(Loop&& other) noexcept : ev_hdl(other.ev_hdl) {
+		other.ev_hdl = nullptr;
+	}
+
+	Loop& operator=(Loop&& other) noexcept {
+		if (this != &other) {
+			if (ev_hdl)
+				wand_destroy_event_handler(ev_hdl);
+			ev_hdl = other.ev_hdl;
+			other.ev_hdl = nullptr;
+		}
+		return *this;
+	}
+
+	Loop(const Loop&) = delete;
+	Loop& operator=(const Loop&) = delete;
+
+	/* False if the handler couldn't be created */
+	explicit operator bool() const { return ev_hdl != nullptr; }
+
+	wand_event_handler_t *get() const { return ev_hdl; }
+
+	/* Runs until stop() is called */
+	void run() {
+		ev_hdl->running = true;
+		wand_event_run(ev_hdl);
+	}
+
+	void stop() { ev_hdl->running = false; }
+
+	struct timeval monotonic_time() const {
+		return wand_get_monotonictime(ev_hdl);
+	}
+
+	struct timeval wall_time() const {
+		return wand_get_walltime(ev_hdl);
+	}
+
+private:
+	wand_event_handler_t *ev_hdl;
+};
+
+/* Watches a file descriptor. The callback is called as fn(fd, ev), where ev
+ * is the wand_eventtype_t that fired. The fd itself is not closed when the
+ * watch is destroyed */
+template <typename F>
+class FdWatch {
+public:
+	FdWatch(wand_event_handler_t *ev_hdl, int fd, int flags, F fn)
+		: fn(std::move(fn)), ev_hdl(ev_hdl), fdcb(nullptr) {
+		static_assert(std::is_invocable_v<F&, int, wand_eventtype_t>,
+				"FdWatch callback must accept (int, wand_eventtype_t)");
+		fdcb = wand_add_fd(ev_hdl, fd, flags, this, trampoline);
+	}
+
+	FdWatch(Loop& loop, int fd, int flags, F fn)
+		: FdWatch(loop.get(), fd, flags, std::move(fn)) {}
+
+	~FdWatch() { cancel(); }
+
+	FdWatch(FdWatch&& other) noexcept
+		: fn(std::move(other.fn)), ev_hdl(other.ev_hdl),
+		  fdcb(other.fdcb) {
+		other.fdcb = nullptr;
+		if (fdcb)
+			fdcb->data = this;
+	}
+
+	FdWatch& operator=(FdWatch&& other) noexcept {
+		if (this != &other) {
+			cancel();
+			fn = std::move(other.fn);
+			ev_hdl = other.ev_hdl;
+			fdcb = other.fdcb;
+			other.fdcb = nullptr;
+			if (fdcb)
+				fdcb->data = this;
+		}
+		return *this;
+	}
+
+	FdWatch(const FdWatch&) = delete;
+	FdWatch& operator=(const FdWatch&) = delete;
+
+	/* False if the fd couldn't be registered, or has been cancelled */
+	explicit operator bool() const { return fdcb != nullptr; }
+
+	int fd() const { return fdcb ? fdcb->fd : -1; }
+
+	int flags() const { return fdcb ? fdcb->flags : 0; }
+
+	void set_flags(int flags) {
+		if (fdcb)
+			wand_set_fd_flags(ev_hdl, fdcb->fd, flags);
+	}
+
+	void cancel() {
+		if (fdcb) {
+			wand_del_fd(ev_hdl, fdcb->fd);
+			fdcb = nullptr;
+		}
+	}
+
+private:
+	static void trampoline(wand_event_handler_t *, int fd, void *data,
+			enum wand_eventtype_t ev) {
+		/* The callback may destroy or move the watch, so don't touch
+		 * it afterwards */
+		static_cast<FdWatch *>(data)->fn(fd, ev);
+	}
+
+	F fn;
+	wand_event_handler_t *ev_hdl;
+	struct wand_fdcb_t *fdcb;
+};
+
+/* A timer that can be armed, re-armed and cancelled. The callback is called
+ * as fn() and the timer is then disarmed until arm() is called again, which
+ * may be done from within the callback itself */
+template <typename F>
+class Timer {
+public:
+	Timer(wand_event_handler_t *ev_hdl, F fn)
+		: fn(std::move(fn)), ev_hdl(ev_hdl), timer(nullptr) {
+		static_assert(std::is_invocable_v<F&>,
+				"Timer callback must take no arguments");
+	}
+
+	template <typename Rep, typename Period>
+	Timer(wand_event_handler_t *ev_hdl,
+			std::chrono::duration<Rep, Period> after, F fn)
+		: Timer(ev_hdl, std::move(fn)) {
+		arm(after);
+	}
+
+	Timer(Loop& loop, F fn) : Timer(loop.get(), std::move(fn)) {}
+
+	template <typename Rep, typename Period>
+	Timer(Loop& loop, std::chrono::duration<Rep, Period> after, F fn)
+		: Timer(loop.get(), after, std::move(fn)) {}
+
+	~Timer() { cancel(); }
+
+	Timer(Timer&& other) noexcept
+		: fn(std::move(other.fn)), ev_hdl(other.ev_hdl),
+		  timer(other.timer) {
+		other.timer = nullptr;
+		if (timer)
+			timer->data = this;
+	}
+
+	Timer& operator=(Timer&& other) noexcept {
+		if (this != &other) {
+			cancel();
+			fn = std::move(other.fn);
+			ev_hdl = other.ev_hdl;
+			timer = other.timer;
+			other.timer = nullptr;
+			if (timer)
+				timer->data = this;
+		}
+		return *this;
+	}
+
+	Timer(const Timer&) = delete;
+	Timer& operator=(const Timer&) = delete;
+
+	/* Arms the timer to fire after the given interval, replacing any
+	 * earlier deadline. Returns false if the timer couldn't be added */
+	template <typename Rep, typename Period>
+	bool arm(std::chrono::duration<Rep, Period> after) {
+		auto usec = std::chrono::duration_cast<
+				std::chrono::microseconds>(after).count();
+		int sec = (int)(usec / 1000000);
+
+		if (timer)
+			return wand_mod_timer(ev_hdl, timer, sec,
+					(int)(usec % 1000000)) == 0;
+		timer = wand_add_timer(ev_hdl, sec, (int)(usec % 1000000),
+				this, trampoline);
+		return timer != nullptr;
+	}
+
+	bool armed() const { return timer != nullptr; }
+
+	void cancel() {
+		if (timer) {
+			wand_del_timer(ev_hdl, timer);
+			timer = nullptr;
+		}
+	}
+
+private:
+	static void trampoline(wand_event_handler_t *, void *data) {
+		Timer *self = static_cast<Timer *>(data);
+
+		/* libwandevent frees the timer once the callback returns */
+		self->timer = nullptr;
+		self->fn();
+	}
+
+	F fn;
+	wand_event_handler_t *ev_hdl;
+	struct wand_timer_t *timer;
+};
+
+/* Handles a signal. The callback is called as fn(signum) by whichever loop
+ * notices the signal first. Only one handler may exist for each signal */
+template <typename F>
+class Signal {
+public:
+	Signal(int signum, F fn) : fn(std::move(fn)), sig(nullptr) {
+		static_assert(std::is_invocable_v<F&, int>,
+				"Signal callback must accept (int)");
+		sig = wand_add_signal(signum, this, trampoline);
+	}
+
+	~Signal() { cancel(); }
+
+	Signal(Signal&& other) noexcept
+		: fn(std::move(other.fn)), sig(other.sig) {
+		other.sig = nullptr;
+		if (sig)
+			sig->data = this;
+	}
+
+	Signal& operator=(Signal&& other) noexcept {
+		if (this != &other) {
+			cancel();
+			fn = std::move(other.fn);
+			sig = other.sig;
+			other.sig = nullptr;
+			if (sig)
+				sig->data = this;
+		}
+		return *this;
+	}
+
+	Signal(const Signal&) = delete;
+	Signal& operator=(const Signal&) = delete;
+
+	/* False if the signal already had a handler */
+	explicit operator bool() const { return sig != nullptr; }
+
+	int signum() const { return sig ? sig->signum : -1; }
+
+	void cancel() {
+		if (sig) {
+			wand_del_signal(sig->signum);
+			sig = nullptr;
+		}
+	}
+
+private:
+	static void trampoline(wand_event_handler_t *, int signum,
+			void *data) {
+		static_cast<Signal *>(data)->fn(signum);
+	}
+
+	F fn;
+	struct wand_signal_t *sig;
+};
+
+/* Owns a channel carrying elements of type T from one thread to another,
+ * see wand_create_channel(). This is the one handle that is shared between
+ * threads: send() must only be called by the producer and recv() only by
+ * the consumer. Register each side with wand_channel_set_producer() and
+ * wand_channel_set_consumer(), using get() */
+template <typename T>
+class Channel {
+public:
+	explicit Channel(size_t capacity)
+		: ch(wand_create_channel(sizeof(T), capacity)) {
+		static_assert(std::is_trivially_copyable_v<T>,
+				"Channel elements must be trivially copyable");
+	}
+
+	~Channel() { reset(); }
+
+	Channel(Channel&& other) noexcept : ch(other.ch) {
+		other.ch = nullptr;
+	}
+
+	Channel& operator=(Channel&& other) noexcept {
+		if (this != &other) {
+			reset();
+			ch = other.ch;
+			other.ch = nullptr;
+		}
+		return *this;
+	}
+
+	Channel(const Channel&) = delete;
+	Channel& operator=(const Channel&) = delete;
+
+	/* False if the channel couldn't be created */
+	explicit operator bool() const { return ch != nullptr; }
+
+	wand_channel_t *get() const { return ch; }
+
+	/* Returns the number of elements sent, which is less than n if the
+	 * channel is full */
+	size_t send(const T *elems, size_t n) {
+		return wand_channel_send(ch, elems, n);
+	}
+
+	bool send(const T& elem) { return wand_channel_send(ch, &elem, 1) == 1; }
+
+	size_t recv(T *elems, size_t max) {
+		return wand_channel_recv(ch, elems, max);
+	}
+
+private:
+	void reset() {
+		if (ch) {
+			wand_destroy_channel(ch);
+			ch = nullptr;
+		}
+	}
+
+	wand_channel_t *ch;
+};
+
+} /* namespace wand */
+
+#endif
@@ -0,0 +1,614 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* C++20 coroutine support for libwandevent.
+ *
+ * A wand::Scheduler attaches to an event handler and lets wand::Task<>
+ * coroutines wait for fd readiness and timers in straight-line code:
+ *
+ *	wand::Task<> echo(int fd) {
+ *		char buf[512];
+ *		for (;;) {
+ *			ssize_t n = read(fd, buf, sizeof(buf));
+ *			if (n < 0 && errno == EAGAIN) {
+ *				if (!co_await wand::with_timeout(30s,
+ *						wand::readable(fd)))
+ *					break;
+ *				continue;
+ *			}
+ *			...
+ *		}
+ *		wand::close_fd(fd);
+ *	}
+ *
+ *	sched.spawn(echo(fd));
+ *
+ * Tasks are lazy and are resumed from the event handler's callbacks, so they
+ * are driven by wand_event_run() like everything else. Awaiting a task
+ * transfers control to it directly (symmetric transfer) and it hands control
+ * straight back to its awaiter when it finishes, so deep chains of tasks
+ * don't grow the stack (provided the compiler turns the transfer into a
+ * tail call, which gcc and clang do when optimising).
+ *
+ * Waiting for an fd doesn't add and remove an fd event each time. The
+ * scheduler keeps the fd registered and only drops interest in a direction
+ * when it fires with nobody waiting (removing the fd once neither direction
+ * is wanted), so a coroutine that reads until EAGAIN and waits again doesn't
+ * need a system call to do so. Because of this, fds that have been waited on
+ * must be closed with wand::close_fd() (or passed to Scheduler::forget()
+ * first) so that the registration goes away.
+ *
+ * Coroutine frames are allocated from a per-scheduler pool, which caches
+ * freed frames by size, so spawning a task per connection doesn't hit
+ * malloc once the pool is warm. A scheduler belongs to the thread that
+ * creates it, and there can be only one per thread.
+ */
+
+#ifndef LIBWANDEVENT_CORO_HPP
+#define LIBWANDEVENT_CORO_HPP
+
+#include <cassert>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "libwandevent.hpp"
+
+namespace wand {
+
+/* Caches coroutine frames in per-size free lists. Frames are always
+ * allocated in multiples of GRANULE, so a frame can be returned to whichever
+ * pool is current when it is freed, or to the global heap if there is none */
+class FramePool {
+public:
+	FramePool() : lists(), counts() {}
+
+	~FramePool() {
+		for (std::size_t i = 0; i < NBUCKETS; i++) {
+			while (lists[i]) {
+				FreeFrame *f = lists[i];
+				lists[i] = f->next;
+				::operator delete(f);
+			}
+		}
+	}
+
+	FramePool(const FramePool&) = delete;
+	FramePool& operator=(const FramePool&) = delete;
+
+	static void *allocate(std::size_t size) {
+		FramePool *pool = current;
+
+		size = rounded(size);
+		if (pool && size <= MAX_FRAME) {
+			std::size_t b = size / GRANULE - 1;
+			FreeFrame *f = pool->lists[b];
+			if (f) {
+				pool->lists[b] = f->next;
+				pool->counts[b]--;
+				return f;
+			}
+		}
+		return ::operator new(size);
+	}
+
+	static void release(void *frame, std::size_t size) {
+		FramePool *pool = current;
+
+		size = rounded(size);
+		if (pool && size <= MAX_FRAME) {
+			std::size_t b = size / GRANULE - 1;
+			if (pool->counts[b] < MAX_CACHED) {
+				FreeFrame *f = static_cast<FreeFrame *>(frame);
+				f->next = pool->lists[b];
+				pool->lists[b] = f;
+				pool->counts[b]++;
+				return;
+			}
+		}
+		::operator delete(frame);
+	}
+
+	/* The pool used by coroutines created on this thread */
+	static inline thread_local FramePool *current = nullptr;
+
+private:
+	struct FreeFrame {
+		FreeFrame *next;
+	};
+
+	static constexpr std::size_t GRANULE = 64;
+	static constexpr std::size_t MAX_FRAME = 4096;
+	static constexpr std::size_t NBUCKETS = MAX_FRAME / GRANULE;
+	/* Don't hang on to more than this many frames of each size */
+	static constexpr unsigned MAX_CACHED = 256;
+
+	static std::size_t rounded(std::size_t size) {
+		return (size + GRANULE - 1) & ~(GRANULE - 1);
+	}
+
+	FreeFrame *lists[NBUCKETS];
+	unsigned counts[NBUCKETS];
+};
+
+template <typename T = void>
+class Task;
+
+namespace detail {
+
+inline void split_usec(std::chrono::microseconds d, int &sec, int &usec) {
+	long long count = d.count() < 0 ? 0 : d.count();
+
+	sec = (int)(count / 1000000);
+	usec = (int)(count % 1000000);
+}
+
+struct PromiseBase {
+	/* The coroutine awaiting this one, resumed when it finishes */
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+	/* Started with Scheduler::spawn(), so nobody will collect the result
+	 * and the frame frees itself */
+	bool detached = false;
+
+	static void *operator new(std::size_t size) {
+		return FramePool::allocate(size);
+	}
+
+	static void operator delete(void *frame, std::size_t size) {
+		FramePool::release(frame, size);
+	}
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+
+		template <typename P>
+		std::coroutine_handle<> await_suspend(
+				std::coroutine_handle<P> h) noexcept {
+			PromiseBase &p = h.promise();
+
+			if (p.detached) {
+				h.destroy();
+				return std::noop_coroutine();
+			}
+			if (p.continuation)
+				return p.continuation;
+			return std::noop_coroutine();
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	FinalAwaiter final_suspend() noexcept { return {}; }
+
+	void unhandled_exception() {
+		/* Nowhere to report it */
+		if (detached)
+			std::terminate();
+		error = std::current_exception();
+	}
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+	std::optional<T> value;
+
+	Task<T> get_return_object() noexcept;
+
+	template <typename U>
+	void return_value(U&& v) {
+		value.emplace(std::forward<U>(v));
+	}
+
+	T result() {
+		if (error)
+			std::rethrow_exception(error);
+		return std::move(*value);
+	}
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+	Task<void> get_return_object() noexcept;
+
+	void return_void() noexcept {}
+
+	void result() {
+		if (error)
+			std::rethrow_exception(error);
+	}
+};
+
+} /* namespace detail */
+
+/* A lazily started coroutine returning T. It starts running when it is
+ * awaited, or when it is passed to Scheduler::spawn() */
+template <typename T>
+class [[nodiscard]] Task {
+public:
+	using promise_type = detail::Promise<T>;
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	explicit Task(handle_type h) noexcept : h(h) {}
+
+	~Task() {
+		if (h)
+			h.destroy();
+	}
+
+	Task(Task&& other) noexcept : h(std::exchange(other.h, {})) {}
+
+	Task& operator=(Task&& other) noexcept {
+		if (this != &other) {
+			if (h)
+				h.destroy();
+			h = std::exchange(other.h, {});
+		}
+		return *this;
+	}
+
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+
+	auto operator co_await() noexcept {
+		struct Awaiter {
+			handle_type h;
+
+			bool await_ready() noexcept {
+				return !h || h.done();
+			}
+
+			std::coroutine_handle<> await_suspend(
+					std::coroutine_handle<> awaiter)
+					noexcept {
+				h.promise().continuation = awaiter;
+				return h;
+			}
+
+			T await_resume() {
+				return h.promise().result();
+			}
+		};
+		return Awaiter{h};
+	}
+
+	/* Gives up ownership of the coroutine */
+	handle_type release() noexcept {
+		return std::exchange(h, {});
+	}
+
+private:
+	handle_type h;
+};
+
+namespace detail {
+
+template <typename T>
+inline Task<T> Promise<T>::get_return_object() noexcept {
+	return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() noexcept {
+	return Task<void>(
+			std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+} /* namespace detail */
+
+class FdWait;
+class TimedFdWait;
+
+/* Runs coroutines on an event handler */
+class Scheduler {
+public:
+	explicit Scheduler(wand_event_handler_t *ev_hdl)
+		: ev_hdl(ev_hdl), prev_pool(FramePool::current) {
+		assert(cur == nullptr);
+		cur = this;
+		FramePool::current = &pool;
+	}
+
+	explicit Scheduler(Loop& loop) : Scheduler(loop.get()) {}
+
+	~Scheduler() {
+		for (std::size_t fd = 0; fd < fds.size(); fd++) {
+			if (fds[fd].registered)
+				wand_del_fd(ev_hdl, (int)fd);
+		}
+		cur = nullptr;
+		FramePool::current = prev_pool;
+	}
+
+	Scheduler(const Scheduler&) = delete;
+	Scheduler& operator=(const Scheduler&) = delete;
+
+	/* The scheduler belonging to this thread */
+	static Scheduler& current() {
+		assert(cur != nullptr);
+		return *cur;
+	}
+
+	wand_event_handler_t *get() const { return ev_hdl; }
+
+	/* Starts a task that runs until it completes by itself. It runs up to
+	 * its first suspension point before spawn() returns */
+	void spawn(Task<void> task) {
+		auto h = task.release();
+
+		h.promise().detached = true;
+		h.resume();
+	}
+
+	void run() {
+		ev_hdl->running = true;
+		wand_event_run(ev_hdl);
+	}
+
+	void stop() { ev_hdl->running = false; }
+
+	/* Removes the fd from the event handler. Nothing may be waiting on it */
+	void forget(int fd) {
+		if (fd < 0 || (std::size_t)fd >= fds.size())
+			return;
+		FdState& st = fds[fd];
+		assert(st.reader == nullptr && st.writer == nullptr);
+		if (st.registered)
+			wand_del_fd(ev_hdl, fd);
+		st = FdState();
+	}
+
+private:
+	friend class FdWait;
+	friend class TimedFdWait;
+
+	struct FdState {
+		bool registered = false;
+		int flags = 0;
+		FdWait *reader = nullptr;
+		FdWait *writer = nullptr;
+	};
+
+	inline bool wait(FdWait *w);
+	inline void cancel(FdWait *w);
+	static inline void fd_event(wand_event_handler_t *ev_hdl, int fd,
+			void *data, enum wand_eventtype_t ev);
+
+	static inline thread_local Scheduler *cur = nullptr;
+
+	wand_event_handler_t *ev_hdl;
+	FramePool pool;
+	FramePool *prev_pool;
+	std::vector<FdState> fds;
+};
+
+/* Awaitable that resumes once an fd is readable or writable */
+class FdWait {
+public:
+	FdWait(Scheduler& sched, int fd, int ev)
+		: sched(sched), fd(fd), ev(ev) {}
+
+	bool await_ready() const noexcept { return false; }
+
+	/* Doesn't suspend if the fd couldn't be registered, in which case
+	 * the caller will find out why when it next uses the fd */
+	bool await_suspend(std::coroutine_handle<> h) {
+		handle = h;
+		return sched.wait(this);
+	}
+
+	void await_resume() const noexcept {}
+
+protected:
+	friend class Scheduler;
+
+	static void expired(wand_event_handler_t *, void *data) {
+		FdWait *w = static_cast<FdWait *>(data);
+
+		w->deadline = nullptr;
+		w->timed_out = true;
+		w->sched.cancel(w);
+		w->handle.resume();
+	}
+
+	Scheduler& sched;
+	int fd;
+	int ev;
+	std::coroutine_handle<> handle;
+	struct wand_timer_t *deadline = nullptr;
+	bool timed_out = false;
+};
+
+/* As FdWait, but gives up after a timeout. Returns false if it timed out */
+class TimedFdWait : public FdWait {
+public:
+	TimedFdWait(FdWait w, std::chrono::microseconds timeout)
+		: FdWait(w), timeout(timeout) {}
+
+	bool await_suspend(std::coroutine_handle<> h) {
+		int sec, usec;
+
+		if (!FdWait::await_suspend(h))
+			return false;
+		detail::split_usec(timeout, sec, usec);
+		deadline = wand_add_timer(sched.get(), sec, usec, this, expired);
+		if (deadline == nullptr) {
+			/* Rather than wait forever, give up straight away */
+			sched.cancel(this);
+			timed_out = true;
+			return false;
+		}
+		return true;
+	}
+
+	bool await_resume() const noexcept { return !timed_out; }
+
+private:
+	std::chrono::microseconds timeout;
+};
+
+inline bool Scheduler::wait(FdWait *w) {
+	if ((std::size_t)w->fd >= fds.size())
+		fds.resize(w->fd + 1);
+
+	FdState& st = fds[w->fd];
+	FdWait *&slot = (w->ev == EV_READ) ? st.reader : st.writer;
+
+	assert(slot == nullptr);
+	if (!st.registered) {
+		if (wand_add_fd(ev_hdl, w->fd, w->ev, this, fd_event) == NULL)
+			return false;
+		st.registered = true;
+		st.flags = w->ev;
+	} else if (!(st.flags & w->ev)) {
+		st.flags |= w->ev;
+		wand_set_fd_flags(ev_hdl, w->fd, st.flags);
+	}
+	slot = w;
+	return true;
+}
+
+inline void Scheduler::cancel(FdWait *w) {
+	FdState& st = fds[w->fd];
+
+	/* Leave the interest in place, it will be dropped if the fd fires
+	 * before anyone waits on it again */
+	if (st.reader == w)
+		st.reader = nullptr;
+	if (st.writer == w)
+		st.writer = nullptr;
+}
+
+inline void Scheduler::fd_event(wand_event_handler_t *ev_hdl, int fd,
+		void *data, enum wand_eventtype_t ev) {
+	Scheduler *sched = static_cast<Scheduler *>(data);
+	FdState& st = sched->fds[fd];
+	FdWait **slot;
+	FdWait *w;
+
+	if (ev == EV_READ)
+		slot = &st.reader;
+	else if (ev == EV_WRITE)
+		slot = &st.writer;
+	else
+		return;
+
+	w = *slot;
+	if (w == nullptr) {
+		st.flags &= ~ev;
+		/* epoll reports hang ups and errors even with no interest, so
+		 * don't leave the fd registered once nobody wants it */
+		if (st.flags == 0) {
+			wand_del_fd(ev_hdl, fd);
+			st.registered = false;
+		} else {
+			wand_set_fd_flags(ev_hdl, fd, st.flags);
+		}
+		return;
+	}
+
+	*slot = nullptr;
+	if (w->deadline) {
+		wand_del_timer(ev_hdl, w->deadline);
+		w->deadline = nullptr;
+	}
+	/* st may be invalid once the coroutine has run */
+	w->handle.resume();
+}
+
+/* Awaitable that resumes after an interval has passed */
+class Sleep {
+public:
+	Sleep(wand_event_handler_t *ev_hdl, std::chrono::microseconds dur)
+		: ev_hdl(ev_hdl), dur(dur) {}
+
+	bool await_ready() const noexcept { return false; }
+
+	bool await_suspend(std::coroutine_handle<> h) {
+		int sec, usec;
+
+		handle = h;
+		detail::split_usec(dur, sec, usec);
+		return wand_add_timer(ev_hdl, sec, usec, this, fire) != NULL;
+	}
+
+	void await_resume() const noexcept {}
+
+private:
+	static void fire(wand_event_handler_t *, void *data) {
+		static_cast<Sleep *>(data)->handle.resume();
+	}
+
+	wand_event_handler_t *ev_hdl;
+	std::chrono::microseconds dur;
+	std::coroutine_handle<> handle;
+};
+
+inline FdWait readable(int fd) {
+	return FdWait(Scheduler::current(), fd, EV_READ);
+}
+
+inline FdWait writable(int fd) {
+	return FdWait(Scheduler::current(), fd, EV_WRITE);
+}
+
+template <typename Rep, typename Period>
+Sleep sleep_for(std::chrono::duration<Rep, Period> dur) {
+	return Sleep(Scheduler::current().get(),
+			std::chrono::duration_cast<std::chrono::microseconds>(
+					dur));
+}
+
+/* Waits for an fd, but gives up after the given interval. co_await yields
+ * false if it timed out, or if the timeout couldn't be set up */
+template <typename Rep, typename Period>
+TimedFdWait with_timeout(std::chrono::duration<Rep, Period> timeout,
+		FdWait w) {
+	return TimedFdWait(w,
+			std::chrono::duration_cast<std::chrono::microseconds>(
+					timeout));
+}
+
+/* Closes an fd that coroutines have been waiting on */
+inline int close_fd(int fd) {
+	Scheduler::current().forget(fd);
+	return ::close(fd);
+}
+
+} /* namespace wand */
+
+#endif
@@ -0,0 +1,281 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Batched accept() for listening sockets.
+ *
+ * Rather than accepting a single connection each time a listening socket
+ * becomes readable, we keep accepting until the backlog is empty or we have
+ * used up our budget for this wakeup, handing the new connections to the
+ * user in batches.
+ *
+ * If we run out of file descriptors, we can't accept anything and the
+ * listening socket stays readable, which would leave us spinning. To avoid
+ * this, each listener holds a spare descriptor in reserve that it can give
+ * up in order to accept (and immediately close) pending connections. */
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+/* Number of connections handed to the callback at once */
+#define LISTEN_BATCH 64
+/* Default number of connections to accept per wakeup */
+#define DEFAULT_LISTEN_BUDGET 256
+
+struct wand_listener_t {
+	int fd;
+	int budget;
+	/* Spare descriptor, released if we hit the fd limit */
+	int reserve;
+
+	void (*callback)(wand_event_handler_t *ev_hdl, int listenfd,
+			int *fds, int nfds, void *data);
+	void *data;
+
+	/* Handler that accepted connections should be registered with */
+	wand_event_handler_t *target;
+	int target_flags;
+	void (*target_callback)(wand_event_handler_t *ev_hdl, int fd,
+			void *data, enum wand_eventtype_t ev);
+	void *target_data;
+
+	struct wand_listener_stats_t stats;
+};
+
+/* A batch of connections on their way to another handler */
+struct handoff_t {
+	struct wand_mailbox_msg_t msg;
+	int flags;
+	void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+			void *data, enum wand_eventtype_t ev);
+	void *data;
+	int nfds;
+	int fds[LISTEN_BATCH];
+};
+
+static void open_reserve(struct wand_listener_t *l) {
+	l->reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+static int accept_one(int fd) {
+#if HAVE_ACCEPT4
+	return accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	int newfd = accept(fd, NULL, NULL);
+	if (newfd >= 0) {
+		fcntl(newfd, F_SETFL, fcntl(newfd, F_GETFL, 0) | O_NONBLOCK);
+		fcntl(newfd, F_SETFD, FD_CLOEXEC);
+	}
+	return newfd;
+#endif
+}
+
+static void register_fds(wand_event_handler_t *ev_hdl, int *fds, int nfds,
+		int flags, void (*callback)(wand_event_handler_t *ev_hdl,
+				int fd, void *data, enum wand_eventtype_t ev),
+		void *data) {
+	int i;
+
+	for (i = 0; i < nfds; i++) {
+		if (wand_add_fd(ev_hdl, fds[i], flags, data, callback) == NULL)
+			close(fds[i]);
+	}
+}
+
+/* Mailbox callback, runs on the target handler's thread */
+static void handoff_fds(wand_event_handler_t *ev_hdl, void *data) {
+	struct handoff_t *h = (struct handoff_t *)data;
+
+	register_fds(ev_hdl, h->fds, h->nfds, h->flags, h->callback, h->data);
+	free(h);
+}
+
+static void deliver_batch(wand_event_handler_t *ev_hdl,
+		struct wand_listener_t *l, int *fds, int nfds) {
+	struct handoff_t *h;
+
+	if (nfds == 0)
+		return;
+
+	l->stats.batches ++;
+
+	if (l->target == NULL) {
+		l->callback(ev_hdl, l->fd, fds, nfds, l->data);
+		return;
+	}
+
+	if (l->target == ev_hdl) {
+		register_fds(ev_hdl, fds, nfds, l->target_flags,
+				l->target_callback, l->target_data);
+	} else {
+		/* Another thread owns the target, so let it register the
+		 * connections itself */
+		h = (struct handoff_t *)malloc(sizeof(struct handoff_t));
+		if (h == NULL) {
+			while (nfds > 0)
+				close(fds[--nfds]);
+			return;
+		}
+		h->msg.callback = handoff_fds;
+		h->msg.data = h;
+		h->flags = l->target_flags;
+		h->callback = l->target_callback;
+		h->data = l->target_data;
+		h->nfds = nfds;
+		memcpy(h->fds, fds, nfds * sizeof(int));
+		wand_mailbox_post(l->target, &h->msg);
+	}
+
+	/* Let the user know about the connections too, if they want */
+	if (l->callback)
+		l->callback(ev_hdl, l->fd, fds, nfds, l->data);
+}
+
+static void listener_read(wand_event_handler_t *ev_hdl, int fd, void *data,
+		enum wand_eventtype_t ev) {
+	struct wand_listener_t *l = (struct wand_listener_t *)data;
+	int fds[LISTEN_BATCH];
+	int nfds = 0, accepted = 0, newfd;
+
+	(void)ev;
+
+	while (accepted < l->budget) {
+		newfd = accept_one(fd);
+		if (newfd >= 0) {
+			fds[nfds++] = newfd;
+			accepted ++;
+			l->stats.accepted ++;
+			if (nfds == LISTEN_BATCH) {
+				deliver_batch(ev_hdl, l, fds, nfds);
+				nfds = 0;
+				/* The callback may have removed us */
+				if (ev_hdl->fd_events[fd] == NULL ||
+						ev_hdl->fd_events[fd]->data != l)
+					return;
+			}
+			continue;
+		}
+
+		if (errno == EINTR || errno == ECONNABORTED)
+			continue;
+
+		if ((errno == EMFILE || errno == ENFILE) && l->reserve >= 0) {
+			/* Out of descriptors. Use our spare one to accept the
+			 * connection and then close it straight away, so that
+			 * the client isn't left hanging and we don't spin on
+			 * a listening socket that is always readable */
+			close(l->reserve);
+			newfd = accept(fd, NULL, NULL);
+			if (newfd >= 0) {
+				close(newfd);
+				l->stats.dropped ++;
+			}
+			open_reserve(l);
+			accepted ++;
+			continue;
+		}
+
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			perror("accept");
+			l->stats.errors ++;
+		}
+		break;
+	}
+
+	deliver_batch(ev_hdl, l, fds, nfds);
+}
+
+wand_listener_t *wand_add_listener(wand_event_handler_t *ev_hdl,
+		int fd, int budget,
+		void (*callback)(wand_event_handler_t *ev_hdl, int listenfd,
+				int *fds, int nfds, void *data),
+		void *data) {
+	struct wand_listener_t *l;
+
+	l = (struct wand_listener_t *)calloc(1, sizeof(struct wand_listener_t));
+	if (l == NULL)
+		return NULL;
+
+	l->fd = fd;
+	l->budget = (budget > 0) ? budget : DEFAULT_LISTEN_BUDGET;
+	l->callback = callback;
+	l->data = data;
+	open_reserve(l);
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+	if (wand_add_fd(ev_hdl, fd, EV_READ, l, listener_read) == NULL) {
+		if (l->reserve >= 0)
+			close(l->reserve);
+		free(l);
+		return NULL;
+	}
+	return l;
+}
+
+int wand_listener_set_target(struct wand_listener_t *l,
+		wand_event_handler_t *target, int flags,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				void *data, enum wand_eventtype_t ev),
+		void *data) {
+
+	/* We need the target's mailbox to hand connections over, which
+	 * has to be created by whoever owns the target */
+	if (target && wand_mailbox_init(target) < 0)
+		return -1;
+
+	l->target = target;
+	l->target_flags = flags;
+	l->target_callback = callback;
+	l->target_data = data;
+	return 0;
+}
+
+void wand_get_listener_stats(struct wand_listener_t *l,
+		struct wand_listener_stats_t *stats) {
+	*stats = l->stats;
+}
+
+void wand_del_listener(wand_event_handler_t *ev_hdl,
+		struct wand_listener_t *l) {
+	wand_del_fd(ev_hdl, l->fd);
+	if (l->reserve >= 0)
+		close(l->reserve);
+	free(l);
+}
@@ -0,0 +1,465 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Groups of event handlers, each run by its own thread.
+ *
+ * An event handler is single-threaded, so the way to use more than one core
+ * is to run several of them. A loop group starts one handler per thread,
+ * pins each thread to a CPU (with the handler's memory on that CPU's NUMA
+ * node) and can open a SO_REUSEPORT listening socket for each handler so
+ * that incoming connections are spread across them. Where
+ * the kernel allows it, a classic BPF program is attached to the reuseport
+ * group so that each connection is handed to the loop running on the CPU
+ * that received it; otherwise we fall back to SO_INCOMING_CPU. */
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#if HAVE_LINUX_FILTER_H
+ #include <linux/filter.h>
+#endif
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+struct group_loop_t {
+	wand_loop_group_t *group;
+	wand_event_handler_t *ev_hdl;
+	/* CPU to pin the thread to, or -1 */
+	int cpu;
+	pthread_t thread;
+	bool started;
+	/* Posted to the handler to make it stop */
+	struct wand_mailbox_msg_t stop_msg;
+	/* Set while stop_msg is sitting in the handler's mailbox */
+	int stop_pending;
+};
+
+struct wand_loop_group_t {
+	int nloops;
+	struct group_loop_t *loops;
+
+	/* Listening sockets opened by wand_loop_group_listen() */
+	int *listenfds;
+	int nlistenfds;
+
+	/* See wand_loop_group_enable_executor() */
+	struct wand_executor_t *executor;
+	/* See wand_loop_group_enable_rebalancer() */
+	struct wand_rebalancer_t *rebalancer;
+	/* See wand_loop_group_enable_shared() */
+	wand_shared_t *shared;
+};
+
+/* Picks the CPUs to use when the caller hasn't given us any -- just go
+ * through the CPUs that we are allowed to run on, in order */
+static void default_cpus(wand_loop_group_t *group) {
+	cpu_set_t allowed;
+	int cpu = 0, i, ncpus;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		for (i = 0; i < group->nloops; i++)
+			group->loops[i].cpu = -1;
+		return;
+	}
+
+	ncpus = CPU_COUNT(&allowed);
+	for (i = 0; i < group->nloops; i++) {
+		if (i % ncpus == 0)
+			cpu = 0;
+		while (!CPU_ISSET(cpu, &allowed))
+			cpu ++;
+		group->loops[i].cpu = cpu ++;
+	}
+}
+
+static void stop_loop(wand_event_handler_t *ev_hdl, void *data) {
+	struct group_loop_t *loop = (struct group_loop_t *)data;
+
+	ev_hdl->running = false;
+	__atomic_store_n(&loop->stop_pending, 0, __ATOMIC_RELEASE);
+}
+
+wand_loop_group_t *wand_create_loop_group(int nloops, const int *cpus) {
+	wand_loop_group_t *group;
+	int i;
+
+	if (nloops <= 0)
+		return NULL;
+
+	group = (wand_loop_group_t *)calloc(1, sizeof(wand_loop_group_t));
+	if (group == NULL)
+		return NULL;
+	group->loops = (struct group_loop_t *)calloc(nloops,
+			sizeof(struct group_loop_t));
+	if (group->loops == NULL) {
+		free(group);
+		return NULL;
+	}
+	group->nloops = nloops;
+
+	if (cpus) {
+		for (i = 0; i < nloops; i++)
+			group->loops[i].cpu = cpus[i];
+	} else {
+		default_cpus(group);
+	}
+
+	for (i = 0; i < nloops; i++) {
+		struct group_loop_t *loop = &group->loops[i];
+
+		loop->group = group;
+		loop->stop_msg.callback = stop_loop;
+		loop->stop_msg.data = loop;
+		/* Pinned loops keep their memory on their own node */
+		if (loop->cpu >= 0) {
+			struct wand_handler_opts_t opts;
+
+			memset(&opts, 0, sizeof(opts));
+			opts.cpus = &loop->cpu;
+			opts.ncpus = 1;
+			loop->ev_hdl = wand_create_event_handler_opts(&opts);
+		} else {
+			loop->ev_hdl = wand_create_event_handler();
+		}
+		if (loop->ev_hdl == NULL ||
+				wand_mailbox_init(loop->ev_hdl) < 0) {
+			fprintf(stderr, "Libwandevent: failed to create event handler for loop group\n");
+			wand_destroy_loop_group(group);
+			return NULL;
+		}
+	}
+
+	return group;
+}
+
+int wand_loop_group_size(wand_loop_group_t *group) {
+	return group->nloops;
+}
+
+wand_event_handler_t *wand_loop_group_handler(wand_loop_group_t *group,
+		int index) {
+	if (index < 0 || index >= group->nloops)
+		return NULL;
+	return group->loops[index].ev_hdl;
+}
+
+int wand_loop_group_index(wand_loop_group_t *group,
+		wand_event_handler_t *ev_hdl) {
+	int i;
+
+	for (i = 0; i < group->nloops; i++) {
+		if (group->loops[i].ev_hdl == ev_hdl)
+			return i;
+	}
+	return -1;
+}
+
+#if HAVE_LINUX_FILTER_H && defined(SO_ATTACH_REUSEPORT_CBPF)
+/* Attaches a BPF program to a reuseport group that maps the CPU that a
+ * connection arrived on to the index of the loop pinned to that CPU. The
+ * index of each socket in the group is the order in which they were bound.
+ * CPUs that don't have a loop of their own are spread across the loops
+ * using (cpu % nloops) */
+static int attach_reuseport_bpf(wand_loop_group_t *group, int fd) {
+	struct sock_filter *code;
+	struct sock_fprog prog;
+	int i, n = 0, ret;
+
+	/* The program is a load, two instructions per loop and two more at
+	 * the end, and the kernel won't take more than BPF_MAXINSNS */
+	if (group->nloops * 2 + 3 > BPF_MAXINSNS)
+		return -1;
+
+	code = (struct sock_filter *)calloc(group->nloops * 2 + 4,
+			sizeof(struct sock_filter));
+	if (code == NULL)
+		return -1;
+
+	/* A = current CPU */
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+			SKF_AD_OFF + SKF_AD_CPU);
+	for (i = 0; i < group->nloops; i++) {
+		if (group->loops[i].cpu < 0)
+			continue;
+		/* if (A == cpu) return i; */
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ |
+				BPF_K, group->loops[i].cpu, 0, 1);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+	}
+	/* return A % nloops */
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K,
+			group->nloops);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+	prog.len = n;
+	prog.filter = code;
+	ret = setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+			sizeof(prog));
+	free(code);
+	return ret;
+}
+#endif
+
+int wand_loop_group_listen(wand_loop_group_t *group,
+		const struct sockaddr *addr, socklen_t addrlen, int backlog,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				void *data, enum wand_eventtype_t ev),
+		void *data) {
+	int *fds;
+	int i, fd, one = 1;
+#if EVENT_DEBUG
+	bool steered = false;
+#endif
+
+	fds = (int *)realloc(group->listenfds,
+			(group->nlistenfds + group->nloops) * sizeof(int));
+	if (fds == NULL)
+		return -1;
+	group->listenfds = fds;
+	fds = group->listenfds + group->nlistenfds;
+
+	/* Sockets have to be bound in loop order, as the BPF program refers
+	 * to them by their position within the reuseport group */
+	for (i = 0; i < group->nloops; i++) {
+		fd = socket(addr->sa_family,
+				SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			perror("socket");
+			goto fail;
+		}
+		fds[i] = fd;
+
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one,
+					sizeof(one)) < 0 ||
+				setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one,
+					sizeof(one)) < 0) {
+			perror("setsockopt");
+			close(fd);
+			goto fail;
+		}
+
+#ifdef SO_INCOMING_CPU
+		/* Only used if we can't attach the BPF program, but it
+		 * doesn't hurt to set it anyway */
+		if (group->loops[i].cpu >= 0) {
+			setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU,
+					&group->loops[i].cpu, sizeof(int));
+		}
+#endif
+
+		if (bind(fd, addr, addrlen) < 0) {
+			perror("bind");
+			close(fd);
+			goto fail;
+		}
+		if (listen(fd, backlog) < 0) {
+			perror("listen");
+			close(fd);
+			goto fail;
+		}
+
+#if HAVE_LINUX_FILTER_H && defined(SO_ATTACH_REUSEPORT_CBPF)
+		/* The program applies to the whole group, so it only needs
+		 * to be attached once */
+		if (i == 0 && attach_reuseport_bpf(group, fd) == 0) {
+#if EVENT_DEBUG
+			steered = true;
+#endif
+		}
+#endif
+
+		if (wand_add_fd(group->loops[i].ev_hdl, fd, EV_READ, data,
+				callback) == NULL) {
+			close(fd);
+			goto fail;
+		}
+	}
+
+#if EVENT_DEBUG
+	fprintf(stderr, "Loop group listening on %d sockets, %s\n", group->nloops,
+			steered ? "BPF steering" : "SO_INCOMING_CPU steering");
+#endif
+	group->nlistenfds += group->nloops;
+	return 0;
+
+fail:
+	while (--i >= 0) {
+		wand_del_fd(group->loops[i].ev_hdl, fds[i]);
+		close(fds[i]);
+	}
+	return -1;
+}
+
+int wand_loop_group_enable_executor(wand_loop_group_t *group,
+		int queue_size) {
+	int i;
+
+	for (i = 0; i < group->nloops; i++) {
+		if (group->loops[i].started) {
+			fprintf(stderr, "Libwandevent: loop group has already been started\n");
+			return -1;
+		}
+	}
+	if (group->executor)
+		return 0;
+	if (wand_executor_create(group, queue_size, &group->executor) < 0) {
+		fprintf(stderr, "Libwandevent: failed to create executor for loop group\n");
+		return -1;
+	}
+	return 0;
+}
+
+int wand_loop_group_enable_rebalancer(wand_loop_group_t *group,
+		const struct wand_rebalance_opts_t *opts) {
+	int i;
+
+	for (i = 0; i < group->nloops; i++) {
+		if (group->loops[i].started) {
+			fprintf(stderr, "Libwandevent: loop group has already been started\n");
+			return -1;
+		}
+	}
+	if (group->rebalancer)
+		return 0;
+	return wand_rebalancer_create(group, opts, &group->rebalancer);
+}
+
+wand_shared_t *wand_loop_group_enable_shared(wand_loop_group_t *group,
+		int batch) {
+	int i;
+
+	for (i = 0; i < group->nloops; i++) {
+		if (group->loops[i].started) {
+			fprintf(stderr, "Libwandevent: loop group has already been started\n");
+			return NULL;
+		}
+	}
+	if (group->shared == NULL &&
+			wand_shared_create(group, batch, &group->shared) < 0)
+		return NULL;
+	return group->shared;
+}
+
+static void *loop_thread(void *data) {
+	struct group_loop_t *loop = (struct group_loop_t *)data;
+
+	/* The handler pins us to its CPU itself */
+	wand_event_run(loop->ev_hdl);
+	return NULL;
+}
+
+int wand_loop_group_start(wand_loop_group_t *group) {
+	int i;
+
+	for (i = 0; i < group->nloops; i++) {
+		struct group_loop_t *loop = &group->loops[i];
+
+		if (loop->started)
+			continue;
+		loop->ev_hdl->running = true;
+		if (pthread_create(&loop->thread, NULL, loop_thread,
+					loop) != 0) {
+			fprintf(stderr, "Libwandevent: failed to start loop thread\n");
+			wand_loop_group_stop(group);
+			wand_loop_group_join(group);
+			return -1;
+		}
+		loop->started = true;
+	}
+	return 0;
+}
+
+void wand_loop_group_stop(wand_loop_group_t *group) {
+	int i;
+
+	/* The handlers belong to other threads, so we have to ask them to
+	 * stop themselves */
+	for (i = 0; i < group->nloops; i++) {
+		struct group_loop_t *loop = &group->loops[i];
+
+		if (!loop->started)
+			continue;
+		/* The message can only be in the mailbox once */
+		if (__atomic_exchange_n(&loop->stop_pending, 1,
+				__ATOMIC_ACQ_REL) == 0) {
+			wand_mailbox_post(loop->ev_hdl, &loop->stop_msg);
+		}
+	}
+}
+
+void wand_loop_group_join(wand_loop_group_t *group) {
+	int i;
+
+	for (i = 0; i < group->nloops; i++) {
+		if (!group->loops[i].started)
+			continue;
+		pthread_join(group->loops[i].thread, NULL);
+		group->loops[i].started = false;
+	}
+}
+
+void wand_destroy_loop_group(wand_loop_group_t *group) {
+	int i;
+
+	wand_loop_group_stop(group);
+	wand_loop_group_join(group);
+
+	for (i = 0; i < group->nlistenfds; i++) {
+		wand_del_fd(group->loops[i % group->nloops].ev_hdl,
+				group->listenfds[i]);
+		close(group->listenfds[i]);
+	}
+	free(group->listenfds);
+
+	if (group->executor)
+		wand_executor_destroy(group->executor);
+	if (group->rebalancer)
+		wand_rebalancer_destroy(group->rebalancer);
+	if (group->shared)
+		wand_shared_destroy(group->shared);
+
+	for (i = 0; i < group->nloops; i++) {
+		if (group->loops[i].ev_hdl)
+			wand_destroy_event_handler(group->loops[i].ev_hdl);
+	}
+	free(group->loops);
+	free(group);
+}
@@ -0,0 +1,216 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Mailbox for passing callbacks to an event handler from other threads.
+ *
+ * Messages are appended to a mutex-protected list and the handler is woken
+ * up via an eventfd (or a pipe, if eventfd is unavailable). The eventfd is
+ * only written to when the list goes from empty to non-empty, so a burst of
+ * messages costs a single wakeup and a single callback on the loop side. */
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#if HAVE_SYS_EVENTFD_H
+ #include <sys/eventfd.h>
+#endif
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+struct wand_mailbox_t {
+	/* Protects the message list */
+	pthread_mutex_t lock;
+	/* Messages waiting to be delivered, oldest first */
+	struct wand_mailbox_msg_t *head;
+	struct wand_mailbox_msg_t *tail;
+	/* Read and write ends of the wakeup fd. With eventfd, these are the
+	 * same descriptor */
+	int readfd;
+	int writefd;
+};
+
+static void mailbox_wakeup(struct wand_mailbox_t *mb) {
+#if HAVE_SYS_EVENTFD_H
+	uint64_t one = 1;
+	if (write(mb->writefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		fprintf(stderr, "Libwandevent: error writing to mailbox\n");
+	}
+#else
+	char c = 0;
+	if (write(mb->writefd, &c, 1) < 0 && errno != EAGAIN) {
+		fprintf(stderr, "Libwandevent: error writing to mailbox\n");
+	}
+#endif
+}
+
+static void mailbox_drain(struct wand_mailbox_t *mb) {
+#if HAVE_SYS_EVENTFD_H
+	uint64_t count;
+	if (read(mb->readfd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		fprintf(stderr, "Libwandevent: error reading from mailbox\n");
+	}
+#else
+	char buf[64];
+	while (read(mb->readfd, buf, sizeof(buf)) > 0);
+#endif
+}
+
+/* Runs every message in the mailbox, in the order they were posted */
+static void mailbox_deliver(wand_event_handler_t *ev_hdl,
+		struct wand_mailbox_t *mb) {
+	struct wand_mailbox_msg_t *msg, *next;
+
+	/* Drain the wakeup fd before taking the list, otherwise we may lose
+	 * the wakeup for a message that is posted in between */
+	mailbox_drain(mb);
+
+	pthread_mutex_lock(&mb->lock);
+	msg = mb->head;
+	mb->head = mb->tail = NULL;
+	pthread_mutex_unlock(&mb->lock);
+
+	while (msg) {
+		/* The callback may free the message */
+		next = msg->next;
+		msg->callback(ev_hdl, msg->data);
+		msg = next;
+	}
+}
+
+static void mailbox_read(wand_event_handler_t *ev_hdl, int fd, void *data,
+		enum wand_eventtype_t ev) {
+
+	assert(ev == EV_READ);
+	assert(fd == ((struct wand_mailbox_t *)data)->readfd);
+
+	mailbox_deliver(ev_hdl, (struct wand_mailbox_t *)data);
+}
+
+int wand_mailbox_init(wand_event_handler_t *ev_hdl) {
+	struct wand_mailbox_t *mb;
+
+	if (ev_hdl->mailbox)
+		return 0;
+
+	mb = (struct wand_mailbox_t *)calloc(1, sizeof(struct wand_mailbox_t));
+	if (mb == NULL)
+		return -1;
+
+#if HAVE_SYS_EVENTFD_H
+	mb->readfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (mb->readfd < 0) {
+		perror("eventfd");
+		free(mb);
+		return -1;
+	}
+	mb->writefd = mb->readfd;
+#else
+	int fds[2];
+	if (pipe(fds) != 0) {
+		perror("pipe");
+		free(mb);
+		return -1;
+	}
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	mb->readfd = fds[0];
+	mb->writefd = fds[1];
+#endif
+
+	pthread_mutex_init(&mb->lock, NULL);
+
+	if (wand_add_fd(ev_hdl, mb->readfd, EV_READ, mb, mailbox_read)
+			== NULL) {
+		fprintf(stderr, "Libwandevent: failed to register mailbox\n");
+		close(mb->readfd);
+		if (mb->writefd != mb->readfd)
+			close(mb->writefd);
+		pthread_mutex_destroy(&mb->lock);
+		free(mb);
+		return -1;
+	}
+
+	ev_hdl->mailbox = mb;
+	return 0;
+}
+
+void wand_mailbox_post(wand_event_handler_t *ev_hdl,
+		struct wand_mailbox_msg_t *msg) {
+	struct wand_mailbox_t *mb = ev_hdl->mailbox;
+	bool wakeup;
+
+	assert(mb);
+	msg->next = NULL;
+
+	pthread_mutex_lock(&mb->lock);
+	wakeup = (mb->head == NULL);
+	if (mb->tail)
+		mb->tail->next = msg;
+	else
+		mb->head = msg;
+	mb->tail = msg;
+	pthread_mutex_unlock(&mb->lock);
+
+	/* Only the first message in a batch needs to wake the loop up */
+	if (wakeup)
+		mailbox_wakeup(mb);
+}
+
+void wand_mailbox_flush(wand_event_handler_t *ev_hdl) {
+	if (ev_hdl->mailbox)
+		mailbox_deliver(ev_hdl, ev_hdl->mailbox);
+}
+
+void wand_mailbox_destroy(wand_event_handler_t *ev_hdl) {
+	struct wand_mailbox_t *mb = ev_hdl->mailbox;
+
+	if (mb == NULL)
+		return;
+
+	/* Make sure nothing posted to us gets leaked */
+	mailbox_deliver(ev_hdl, mb);
+
+	wand_del_fd(ev_hdl, mb->readfd);
+	close(mb->readfd);
+	if (mb->writefd != mb->readfd)
+		close(mb->writefd);
+	pthread_mutex_destroy(&mb->lock);
+	free(mb);
+	ev_hdl->mailbox = NULL;
+}
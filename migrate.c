@@ -0,0 +1,338 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Moving fd events between the handlers in a loop group.
+ *
+ * An fd event can only be touched by the thread running its handler, so a
+ * migration is done in two halves. The source handler removes the event and
+ * posts everything needed to recreate it to the destination's mailbox, where
+ * the destination adds it back. The fd is not being watched by anyone in
+ * between, but the handlers only use level-triggered readiness, so anything
+ * that arrives in the meantime is reported by the destination as soon as
+ * the fd is added.
+ *
+ * The rebalancer uses this to even out the loops. Every interval, each loop
+ * publishes how many fd callbacks it has run. A loop that is well above the
+ * average sends its busiest migratable fds to the quietest loop, stopping
+ * before it would swap places with it. Each loop only ever moves its own
+ * fds, so there is no need for the loops to agree on a plan. */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+struct wand_migration_t {
+	struct wand_mailbox_msg_t msg;
+	int fd;
+	int flags;
+	void *data;
+	void (*callback)(wand_event_handler_t *ev_hdl, int fd, void *data,
+			enum wand_eventtype_t ev);
+	void (*moved)(wand_event_handler_t *ev_hdl, int fd, void *data);
+	bool migratable;
+	/* Inactivity timeouts, in ms */
+	int read_ms;
+	int write_ms;
+	/* Events to suspend while the handler is overloaded */
+	int shed;
+};
+
+static void migration_arrived(wand_event_handler_t *ev_hdl, void *data) {
+	struct wand_migration_t *mig = (struct wand_migration_t *)data;
+	struct wand_fdcb_t *evcb;
+
+	evcb = wand_add_fd(ev_hdl, mig->fd, mig->flags, mig->data,
+			mig->callback);
+	if (evcb == NULL) {
+		fprintf(stderr, "Libwandevent: failed to migrate fd %d\n",
+				mig->fd);
+	} else {
+		evcb->migratable = mig->migratable;
+		if (mig->read_ms || mig->write_ms)
+			wand_set_fd_timeouts(ev_hdl, mig->fd, mig->read_ms,
+					mig->write_ms);
+		if (mig->shed && ev_hdl->overload)
+			wand_set_fd_sheddable(ev_hdl, mig->fd, mig->shed);
+		ev_hdl->stats.fds_migrated_in ++;
+	}
+	if (mig->moved)
+		mig->moved(ev_hdl, mig->fd, mig->data);
+	free(mig);
+}
+
+int wand_migrate_fd(wand_event_handler_t *src, wand_event_handler_t *dst,
+		int fd, void (*moved)(wand_event_handler_t *ev_hdl, int fd,
+				void *data)) {
+	struct wand_fdcb_t *evcb;
+	struct wand_migration_t *mig;
+	struct wand_idle_fd_t *st;
+
+	if (fd < 0 || fd > src->maxfd || src->fd_events[fd] == NULL) {
+		fprintf(stderr, "Libwandevent: no fd event for fd %d\n", fd);
+		return -1;
+	}
+	if (src == dst)
+		return 0;
+	if (dst->mailbox == NULL) {
+		fprintf(stderr, "Libwandevent: cannot migrate fd %d to a handler without a mailbox\n", fd);
+		return -1;
+	}
+	evcb = src->fd_events[fd];
+	/* Whatever has suspended the fd belongs to this handler, and won't
+	 * know to resume it once it has moved */
+	if (evcb->suspended) {
+		fprintf(stderr, "Libwandevent: cannot migrate suspended fd %d\n",
+				fd);
+		return -1;
+	}
+
+	mig = (struct wand_migration_t *)calloc(1,
+			sizeof(struct wand_migration_t));
+	if (mig == NULL)
+		return -1;
+	mig->fd = fd;
+	mig->flags = evcb->flags;
+	mig->data = evcb->data;
+	mig->callback = evcb->callback;
+	mig->moved = moved;
+	mig->migratable = evcb->migratable;
+	if (src->idle && fd <= src->idle->maxfd &&
+			(st = src->idle->fds[fd]) != NULL) {
+		mig->read_ms = st->read_ticks * WAND_IDLE_RESOLUTION;
+		mig->write_ms = st->write_ticks * WAND_IDLE_RESOLUTION;
+	}
+	if (src->overload)
+		mig->shed = wand_overload_shed_flags(src, fd);
+
+	wand_del_fd(src, fd);
+	src->stats.fds_migrated_out ++;
+
+	mig->msg.callback = migration_arrived;
+	mig->msg.data = mig;
+	wand_mailbox_post(dst, &mig->msg);
+	return 0;
+}
+
+int wand_set_fd_migratable(wand_event_handler_t *ev_hdl, int fd,
+		bool migratable) {
+	if (fd < 0 || fd > ev_hdl->maxfd || ev_hdl->fd_events[fd] == NULL)
+		return -1;
+	ev_hdl->fd_events[fd]->migratable = migratable;
+	return 0;
+}
+
+struct rebalance_loop_t {
+	struct wand_rebalancer_t *rb;
+	int index;
+	wand_event_handler_t *ev_hdl;
+	struct wand_timer_t *timer;
+	/* fd_callbacks at the end of the last interval */
+	uint64_t last_callbacks;
+	/* Callbacks run in the last interval, plus anything that has been
+	 * sent our way since. Read and added to by the other loops */
+	uint64_t load __attribute__((aligned(64)));
+};
+
+struct wand_rebalancer_t {
+	struct wand_rebalance_opts_t opts;
+	int nloops;
+	struct rebalance_loop_t *loops;
+};
+
+struct rebalance_fd_t {
+	int fd;
+	uint32_t events;
+};
+
+static const struct wand_rebalance_opts_t default_opts = {
+	100,	/* interval */
+	25,	/* imbalance */
+	4,	/* max_moves */
+	1000	/* min_load */
+};
+
+static int cmp_hottest(const void *a, const void *b) {
+	const struct rebalance_fd_t *x = (const struct rebalance_fd_t *)a;
+	const struct rebalance_fd_t *y = (const struct rebalance_fd_t *)b;
+
+	if (x->events != y->events)
+		return x->events < y->events ? 1 : -1;
+	return x->fd - y->fd;
+}
+
+/* Finds the busiest migratable fds, resetting every fd's count for the
+ * next interval. Returns the number of candidates */
+static int collect_fds(wand_event_handler_t *ev_hdl,
+		struct rebalance_fd_t **fdsp) {
+	struct rebalance_fd_t *fds = NULL, *tmp;
+	struct wand_fdcb_t *evcb;
+	int i, n = 0, size = 0;
+
+	for (i = 0; i <= ev_hdl->maxfd; i++) {
+		evcb = ev_hdl->fd_events[i];
+		if (evcb == NULL)
+			continue;
+		if (evcb->migratable && evcb->events > 0 &&
+				evcb->suspended == 0) {
+			if (n == size) {
+				size = size ? size * 2 : 16;
+				tmp = (struct rebalance_fd_t *)realloc(fds,
+						size * sizeof(*fds));
+				if (tmp == NULL)
+					break;
+				fds = tmp;
+			}
+			fds[n].fd = i;
+			fds[n].events = evcb->events;
+			n ++;
+		}
+		evcb->events = 0;
+	}
+	/* Anything we missed running out of memory is reset next time */
+	if (n > 1)
+		qsort(fds, n, sizeof(*fds), cmp_hottest);
+	*fdsp = fds;
+	return n;
+}
+
+static void rebalance_fire(wand_event_handler_t *ev_hdl, void *data) {
+	struct rebalance_loop_t *loop = (struct rebalance_loop_t *)data;
+	struct wand_rebalancer_t *rb = loop->rb;
+	struct rebalance_loop_t *target = NULL;
+	struct rebalance_fd_t *fds;
+	uint64_t load, other, total = 0, min = UINT64_MAX, gap;
+	int i, n, moves = 0;
+
+	load = ev_hdl->stats.fd_callbacks - loop->last_callbacks;
+	loop->last_callbacks = ev_hdl->stats.fd_callbacks;
+	__atomic_store_n(&loop->load, load, __ATOMIC_RELAXED);
+
+	for (i = 0; i < rb->nloops; i++) {
+		other = i == loop->index ? load :
+				__atomic_load_n(&rb->loops[i].load,
+						__ATOMIC_RELAXED);
+		total += other;
+		if (other < min) {
+			min = other;
+			target = &rb->loops[i];
+		}
+	}
+
+	n = collect_fds(ev_hdl, &fds);
+	/* Only bother if we're busy and well above the average */
+	if (target != loop && load >= rb->opts.min_load &&
+			load * 100 * rb->nloops >
+			total * (100 + rb->opts.imbalance)) {
+		/* Moving more than half the difference would just make the
+		 * target the busy one */
+		gap = (load - min) / 2;
+		for (i = 0; i < n && moves < (int)rb->opts.max_moves; i++) {
+			if (fds[i].events > gap)
+				continue;
+			if (wand_migrate_fd(ev_hdl, target->ev_hdl, fds[i].fd,
+					NULL) < 0)
+				continue;
+			gap -= fds[i].events;
+			moves ++;
+			/* So other busy loops don't all pick the same
+			 * target before it has caught up */
+			__atomic_add_fetch(&target->load, fds[i].events,
+					__ATOMIC_RELAXED);
+			__atomic_sub_fetch(&loop->load, fds[i].events,
+					__ATOMIC_RELAXED);
+		}
+	}
+	free(fds);
+
+	wand_mod_timer(ev_hdl, loop->timer, rb->opts.interval / 1000,
+			(rb->opts.interval % 1000) * 1000);
+}
+
+int wand_rebalancer_create(wand_loop_group_t *group,
+		const struct wand_rebalance_opts_t *opts,
+		struct wand_rebalancer_t **rbp) {
+	struct wand_rebalancer_t *rb;
+	struct rebalance_loop_t *loop;
+	void *mem;
+	int i;
+
+	rb = (struct wand_rebalancer_t *)calloc(1,
+			sizeof(struct wand_rebalancer_t));
+	if (rb == NULL)
+		return -1;
+	rb->opts = opts ? *opts : default_opts;
+	if (rb->opts.interval == 0) {
+		fprintf(stderr, "Libwandevent: invalid rebalance interval\n");
+		free(rb);
+		return -1;
+	}
+	rb->nloops = wand_loop_group_size(group);
+	if (posix_memalign(&mem, 64,
+			rb->nloops * sizeof(struct rebalance_loop_t)) != 0) {
+		free(rb);
+		return -1;
+	}
+	rb->loops = (struct rebalance_loop_t *)mem;
+	memset(rb->loops, 0, rb->nloops * sizeof(struct rebalance_loop_t));
+
+	for (i = 0; i < rb->nloops; i++) {
+		loop = &rb->loops[i];
+		loop->rb = rb;
+		loop->index = i;
+		loop->ev_hdl = wand_loop_group_handler(group, i);
+		loop->last_callbacks = loop->ev_hdl->stats.fd_callbacks;
+		loop->timer = wand_add_timer(loop->ev_hdl,
+				rb->opts.interval / 1000,
+				(rb->opts.interval % 1000) * 1000, loop,
+				rebalance_fire);
+		if (loop->timer == NULL) {
+			while (--i >= 0)
+				wand_del_timer(rb->loops[i].ev_hdl,
+						rb->loops[i].timer);
+			free(rb->loops);
+			free(rb);
+			return -1;
+		}
+	}
+	*rbp = rb;
+	return 0;
+}
+
+void wand_rebalancer_destroy(struct wand_rebalancer_t *rb) {
+	int i;
+
+	for (i = 0; i < rb->nloops; i++)
+		wand_del_timer(rb->loops[i].ev_hdl, rb->loops[i].timer);
+	free(rb->loops);
+	free(rb);
+}
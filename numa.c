@@ -0,0 +1,419 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* CPU pinning and NUMA-local memory for event handlers.
+ *
+ * A handler created with CPUs or a NUMA node in its options gets its own
+ * memory: the handler itself, timers, fd events and their epoll records
+ * come from pools carved out of chunks that we map ourselves, and the fd
+ * table is a single mapping big enough for every fd we could be asked to
+ * watch, which only costs memory as it is touched. Each mapping is bound
+ * to the chosen node with mbind() before anything touches it, so it ends
+ * up on that node no matter which thread creates the handler or adds the
+ * events, and can be backed by transparent huge pages. The thread that
+ * runs the handler is pinned to the CPUs each time wand_event_run() is
+ * called.
+ */
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#if HAVE_LINUX_MEMPOLICY_H
+#include <linux/mempolicy.h>
+#endif
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+#define CHUNK_SIZE (256 * 1024)
+#define HUGE_CHUNK_SIZE (2 * 1024 * 1024)
+/* Objects are rounded up to this, and pools are kept per rounded size */
+#define POOL_ALIGN 16
+#define MAX_POOLS 8
+/* Limits on the size of the fd table we reserve */
+#define MIN_FD_TABLE 65536
+#define MAX_FD_TABLE (1 << 22)
+
+struct numa_chunk_t {
+	void *base;
+	size_t len;
+	struct numa_chunk_t *next;
+};
+
+struct numa_pool_t {
+	size_t size;
+	void *free;
+};
+
+struct wand_numa_t {
+	cpu_set_t cpus;
+	bool pin;
+	/* Node that memory is bound to, or -1 */
+	int node;
+	bool hugepages;
+	/* CPU the loop thread was on after being pinned, or -1 */
+	int cpu;
+
+	struct numa_chunk_t *chunks;
+	/* Unused space in the newest chunk */
+	char *next;
+	size_t left;
+	size_t chunk_size;
+	struct numa_pool_t pools[MAX_POOLS];
+
+	struct wand_fdcb_t **fd_table;
+	size_t fd_table_len;
+	int fd_table_cap;
+};
+
+/* Finds the node that a CPU belongs to, or -1 if we can't tell */
+static int cpu_node(int cpu) {
+	char path[64];
+	struct dirent *d;
+	DIR *dir;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (dir == NULL)
+		return -1;
+	while ((d = readdir(dir)) != NULL) {
+		if (sscanf(d->d_name, "node%d", &node) == 1)
+			break;
+	}
+	closedir(dir);
+	return node;
+}
+
+/* Maps len bytes, aligned to align, bound to our node */
+static void *numa_map(struct wand_numa_t *numa, size_t len, size_t align) {
+	char *p, *start;
+	size_t extra = align > (size_t)getpagesize() ? align : 0;
+
+	p = mmap(NULL, len + extra, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	start = p;
+	if (extra) {
+		/* Trim the mapping so that huge pages can be used */
+		start = (char *)(((uintptr_t)p + align - 1) & ~(align - 1));
+		if (start > p)
+			munmap(p, start - p);
+		if (start + len < p + len + extra)
+			munmap(start + len, (p + len + extra) - (start + len));
+	}
+
+#if HAVE_LINUX_MEMPOLICY_H && defined(SYS_mbind)
+	if (numa->node >= 0) {
+		/* The kernel ignores the last bit of the mask, so leave room
+		 * for an extra word */
+		unsigned long mask[(numa->node / (8 * sizeof(long))) + 2];
+
+		memset(mask, 0, sizeof(mask));
+		mask[numa->node / (8 * sizeof(long))] =
+				1UL << (numa->node % (8 * sizeof(long)));
+		/* Preferred rather than bound, so that we fall back to
+		 * another node rather than failing if ours is full */
+		if (syscall(SYS_mbind, start, len, MPOL_PREFERRED, mask,
+				8 * sizeof(mask), 0) < 0 && errno != ENOSYS)
+			perror("mbind");
+	}
+#endif
+#ifdef MADV_HUGEPAGE
+	if (numa->hugepages && madvise(start, len, MADV_HUGEPAGE) < 0)
+		numa->hugepages = false;
+#endif
+	return start;
+}
+
+static struct numa_pool_t *find_pool(struct wand_numa_t *numa, size_t size) {
+	int i;
+
+	for (i = 0; i < MAX_POOLS; i++) {
+		if (numa->pools[i].size == size)
+			return &numa->pools[i];
+		if (numa->pools[i].size == 0) {
+			numa->pools[i].size = size;
+			return &numa->pools[i];
+		}
+	}
+	return NULL;
+}
+
+static void *numa_alloc(struct wand_numa_t *numa, size_t size) {
+	struct numa_pool_t *pool;
+	struct numa_chunk_t *chunk;
+	void *obj;
+
+	size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+	pool = find_pool(numa, size);
+	if (pool == NULL || size > numa->chunk_size)
+		return malloc(size);
+
+	if (pool->free) {
+		obj = pool->free;
+		pool->free = *(void **)obj;
+		return obj;
+	}
+
+	if (numa->left < size) {
+		/* Whatever is left in the old chunk is wasted, but it can
+		 * only be smaller than the objects we hand out */
+		chunk = (struct numa_chunk_t *)malloc(sizeof(*chunk));
+		if (chunk == NULL)
+			return NULL;
+		chunk->len = numa->chunk_size;
+		chunk->base = numa_map(numa, chunk->len,
+				numa->hugepages ? HUGE_CHUNK_SIZE : 0);
+		if (chunk->base == NULL) {
+			free(chunk);
+			return NULL;
+		}
+		chunk->next = numa->chunks;
+		numa->chunks = chunk;
+		numa->next = (char *)chunk->base;
+		numa->left = chunk->len;
+	}
+	obj = numa->next;
+	numa->next += size;
+	numa->left -= size;
+	return obj;
+}
+
+static void numa_free(struct wand_numa_t *numa, void *ptr, size_t size) {
+	struct numa_pool_t *pool;
+
+	size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+	pool = find_pool(numa, size);
+	if (pool == NULL || size > numa->chunk_size) {
+		free(ptr);
+		return;
+	}
+	*(void **)ptr = pool->free;
+	pool->free = ptr;
+}
+
+void *wand_handler_alloc(wand_event_handler_t *ev_hdl, size_t size) {
+	if (ev_hdl->numa == NULL)
+		return malloc(size);
+	return numa_alloc(ev_hdl->numa, size);
+}
+
+void wand_handler_free(wand_event_handler_t *ev_hdl, void *ptr, size_t size) {
+	if (ptr == NULL)
+		return;
+	if (ev_hdl->numa == NULL)
+		free(ptr);
+	else
+		numa_free(ev_hdl->numa, ptr, size);
+}
+
+struct wand_fdcb_t **wand_handler_fd_table(wand_event_handler_t *ev_hdl,
+		int maxfd) {
+	struct wand_numa_t *numa = ev_hdl->numa;
+
+	if (numa == NULL)
+		return (struct wand_fdcb_t **)realloc(ev_hdl->fd_events,
+				sizeof(struct wand_fdcb_t *) * (maxfd + 1));
+	if (maxfd >= numa->fd_table_cap) {
+		fprintf(stderr, "Libwandevent: fd %d is too large for the fd table\n",
+				maxfd);
+		return NULL;
+	}
+	return numa->fd_table;
+}
+
+void wand_handler_free_fd_table(wand_event_handler_t *ev_hdl) {
+	if (ev_hdl->numa == NULL)
+		free(ev_hdl->fd_events);
+}
+
+void wand_numa_pin(wand_event_handler_t *ev_hdl) {
+	struct wand_numa_t *numa = ev_hdl->numa;
+	int err;
+
+	if (!numa->pin)
+		return;
+	err = pthread_setaffinity_np(pthread_self(), sizeof(numa->cpus),
+			&numa->cpus);
+	if (err != 0) {
+		fprintf(stderr, "Libwandevent: failed to pin event handler: %s\n",
+				strerror(err));
+		return;
+	}
+	/* Make sure we are actually running on one of them */
+	sched_yield();
+	numa->cpu = sched_getcpu();
+}
+
+wand_event_handler_t *wand_numa_create(
+		const struct wand_handler_opts_t *opts) {
+	struct wand_numa_t *numa;
+	wand_event_handler_t *ev_hdl;
+	struct rlimit rl;
+	int i;
+
+	numa = (struct wand_numa_t *)calloc(1, sizeof(*numa));
+	if (numa == NULL)
+		return NULL;
+	numa->node = -1;
+	numa->cpu = -1;
+
+	CPU_ZERO(&numa->cpus);
+	for (i = 0; i < opts->ncpus; i++) {
+		if (opts->cpus[i] < 0 || opts->cpus[i] >= CPU_SETSIZE) {
+			fprintf(stderr, "Libwandevent: invalid CPU %d\n",
+					opts->cpus[i]);
+			free(numa);
+			return NULL;
+		}
+		CPU_SET(opts->cpus[i], &numa->cpus);
+		numa->pin = true;
+	}
+	if (opts->flags & WAND_HANDLER_NODE)
+		numa->node = opts->numa_node;
+	else if (opts->ncpus > 0)
+		numa->node = cpu_node(opts->cpus[0]);
+	numa->hugepages = (opts->flags & WAND_HANDLER_HUGEPAGES) != 0;
+	numa->chunk_size = numa->hugepages ? HUGE_CHUNK_SIZE : CHUNK_SIZE;
+
+	/* Room for every fd we are allowed to open */
+	numa->fd_table_cap = MIN_FD_TABLE;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+			rl.rlim_max > (rlim_t)numa->fd_table_cap)
+		numa->fd_table_cap = rl.rlim_max > MAX_FD_TABLE ?
+				MAX_FD_TABLE : (int)rl.rlim_max;
+	numa->fd_table_len = numa->fd_table_cap * sizeof(struct wand_fdcb_t *);
+	numa->fd_table = (struct wand_fdcb_t **)numa_map(numa,
+			numa->fd_table_len, numa->hugepages ?
+			HUGE_CHUNK_SIZE : 0);
+	if (numa->fd_table == NULL) {
+		free(numa);
+		return NULL;
+	}
+
+	ev_hdl = (wand_event_handler_t *)numa_alloc(numa, sizeof(*ev_hdl));
+	if (ev_hdl == NULL) {
+		munmap(numa->fd_table, numa->fd_table_len);
+		free(numa);
+		return NULL;
+	}
+	ev_hdl->numa = numa;
+	return ev_hdl;
+}
+
+void wand_numa_destroy(wand_event_handler_t *ev_hdl) {
+	struct wand_numa_t *numa = ev_hdl->numa;
+	struct numa_chunk_t *chunk;
+
+	/* The handler itself lives in one of the chunks */
+	while ((chunk = numa->chunks) != NULL) {
+		numa->chunks = chunk->next;
+		munmap(chunk->base, chunk->len);
+		free(chunk);
+	}
+	munmap(numa->fd_table, numa->fd_table_len);
+	free(numa);
+}
+
+/* Counts which nodes the resident pages in a mapping are on */
+static void count_pages(struct wand_numa_t *numa, void *base, size_t len,
+		struct wand_numa_stats_t *stats) {
+#if defined(SYS_move_pages)
+	size_t page = getpagesize();
+	size_t npages = (len + page - 1) / page, i, n;
+	void *pages[256];
+	int status[256];
+
+	for (i = 0; i < npages; i += n) {
+		size_t j;
+
+		n = npages - i > 256 ? 256 : npages - i;
+		for (j = 0; j < n; j++)
+			pages[j] = (char *)base + (i + j) * page;
+		/* With no target nodes, this just tells us where the pages
+		 * are, or -ENOENT if they haven't been touched */
+		if (syscall(SYS_move_pages, 0, n, pages, NULL, status, 0) < 0)
+			return;
+		for (j = 0; j < n; j++) {
+			if (status[j] < 0)
+				continue;
+			stats->pages ++;
+			if (numa->node < 0 || status[j] == numa->node)
+				stats->local_pages ++;
+			else
+				stats->remote_pages ++;
+		}
+	}
+#else
+	(void)numa;
+	(void)base;
+	(void)len;
+	(void)stats;
+#endif
+}
+
+int wand_get_numa_stats(wand_event_handler_t *ev_hdl,
+		struct wand_numa_stats_t *stats) {
+	struct wand_numa_t *numa = ev_hdl->numa;
+	struct numa_chunk_t *chunk;
+	size_t used;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->node = -1;
+	stats->cpu = -1;
+	if (numa == NULL)
+		return -1;
+
+	stats->node = numa->node;
+	stats->cpu = numa->cpu;
+	stats->hugepages = numa->hugepages;
+	stats->reserved = numa->fd_table_len;
+	for (chunk = numa->chunks; chunk != NULL; chunk = chunk->next) {
+		stats->reserved += chunk->len;
+		count_pages(numa, chunk->base, chunk->len, stats);
+	}
+	/* Only look at the part of the fd table that could be in use */
+	used = (ev_hdl->maxfd + 1) * sizeof(struct wand_fdcb_t *);
+	count_pages(numa, numa->fd_table, used, stats);
+	return 0;
+}
@@ -0,0 +1,368 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Overload protection.
+ *
+ * Two things are measured: the loop lag, which is how late a probe timer
+ * fires, and the time spent running callbacks in each iteration, from
+ * waking up to going back to sleep. Both are smoothed, and once either
+ * goes over its high threshold the handler starts shedding: every fd that
+ * has been marked as sheddable has the marked events suspended, so that
+ * work we can put off (new connections, bulk transfers) stops competing
+ * with everything else. Shedding stops once both have come back under
+ * their low thresholds, and neither change happens within hold_time of
+ * the last one, so that we don't flap.
+ */
+#include "config.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+struct overload_cb_t {
+	void (*callback)(wand_event_handler_t *ev_hdl,
+			enum wand_overload_state_t state, void *data);
+	void *data;
+	struct overload_cb_t *next;
+};
+
+struct wand_overload_t {
+	struct wand_overload_opts_t opts;
+	enum wand_overload_state_t state;
+	/* When the state last changed, in usec */
+	int64_t changed;
+
+	/* Smoothed measurements, in usec */
+	int64_t lag;
+	int64_t busy;
+	int64_t max_lag;
+	int64_t max_busy;
+	uint64_t transitions;
+
+	struct wand_timer_t *probe;
+	struct wand_hook_t hook;
+	/* When we last woke up from waiting for events, or 0 */
+	int64_t woke;
+
+	/* Events to suspend while shedding, indexed by fd */
+	int *shed;
+	int maxfd;
+
+	struct overload_cb_t *callbacks;
+};
+
+static const struct wand_overload_opts_t default_opts = {
+	50000,		/* lag_high */
+	10000,		/* lag_low */
+	100000,		/* busy_high */
+	20000,		/* busy_low */
+	10,		/* probe_interval */
+	500		/* hold_time */
+};
+
+static int64_t now_usec(wand_event_handler_t *ev_hdl) {
+	struct timeval tv = wand_get_monotonictime(ev_hdl);
+
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void shed_fds(wand_event_handler_t *ev_hdl, bool shed) {
+	struct wand_overload_t *ov = ev_hdl->overload;
+	int fd;
+
+	for (fd = 0; fd <= ov->maxfd; fd++) {
+		if (ov->shed[fd] == 0)
+			continue;
+		if (shed)
+			wand_suspend_fd(ev_hdl, fd, ov->shed[fd]);
+		else
+			wand_resume_fd(ev_hdl, fd, ov->shed[fd]);
+	}
+}
+
+static void set_state(wand_event_handler_t *ev_hdl,
+		enum wand_overload_state_t state, int64_t now) {
+	struct wand_overload_t *ov = ev_hdl->overload;
+	struct overload_cb_t *cb, *next;
+
+	ov->state = state;
+	ov->changed = now;
+	ov->transitions ++;
+	shed_fds(ev_hdl, state == WAND_OVERLOAD_SHEDDING);
+
+	/* A callback may remove itself */
+	for (cb = ov->callbacks; cb != NULL; cb = next) {
+		next = cb->next;
+		cb->callback(ev_hdl, state, cb->data);
+		/* ...or switch the controller off altogether */
+		if (ev_hdl->overload != ov)
+			return;
+	}
+}
+
+static void check_state(wand_event_handler_t *ev_hdl, int64_t now) {
+	struct wand_overload_t *ov = ev_hdl->overload;
+	struct wand_overload_opts_t *o = &ov->opts;
+
+	if (now - ov->changed < (int64_t)o->hold_time * 1000)
+		return;
+
+	if (ov->state == WAND_OVERLOAD_NORMAL) {
+		if (ov->lag >= o->lag_high || ov->busy >= o->busy_high)
+			set_state(ev_hdl, WAND_OVERLOAD_SHEDDING, now);
+	} else {
+		if (ov->lag <= o->lag_low && ov->busy <= o->busy_low)
+			set_state(ev_hdl, WAND_OVERLOAD_NORMAL, now);
+	}
+}
+
+/* Exponentially weighted moving average, giving each new sample 1/4 */
+static int64_t smooth(int64_t avg, int64_t sample) {
+	return avg + (sample - avg) / 4;
+}
+
+static void probe_fire(wand_event_handler_t *ev_hdl, void *data) {
+	struct wand_overload_t *ov = ev_hdl->overload;
+	int64_t now = now_usec(ev_hdl);
+	int64_t lag;
+
+	(void)data;
+	lag = now - ((int64_t)ov->probe->expire.tv_sec * 1000000 +
+			ov->probe->expire.tv_usec);
+	if (lag < 0)
+		lag = 0;
+	if (lag > ov->max_lag)
+		ov->max_lag = lag;
+	ov->lag = smooth(ov->lag, lag);
+
+	/* The overload callbacks may switch us off, which deletes the probe,
+	 * so only re-arm it if we are still here */
+	check_state(ev_hdl, now);
+	if (ev_hdl->overload != ov)
+		return;
+	wand_mod_timer(ev_hdl, ov->probe, ov->opts.probe_interval / 1000,
+			(ov->opts.probe_interval % 1000) * 1000);
+}
+
+/* Runs just before we go to sleep, so the time since we woke up is how
+ * long the callbacks took */
+static int overload_prepare(wand_event_handler_t *ev_hdl, void *data) {
+	struct wand_overload_t *ov = ev_hdl->overload;
+	int64_t now, busy;
+
+	(void)data;
+	if (ov->woke == 0)
+		return 0;
+	/* The cached clock is from before the timers ran */
+	ev_hdl->monotonictimeok = false;
+	now = now_usec(ev_hdl);
+	busy = now - ov->woke;
+	ov->woke = 0;
+	if (busy > ov->max_busy)
+		ov->max_busy = busy;
+	ov->busy = smooth(ov->busy, busy);
+	check_state(ev_hdl, now);
+	return 0;
+}
+
+void wand_overload_wake(wand_event_handler_t *ev_hdl) {
+	ev_hdl->overload->woke = now_usec(ev_hdl);
+}
+
+int wand_set_overload(wand_event_handler_t *ev_hdl,
+		const struct wand_overload_opts_t *opts) {
+	struct wand_overload_t *ov = ev_hdl->overload;
+	struct wand_overload_opts_t o;
+
+	o = opts ? *opts : default_opts;
+	if (o.lag_low > o.lag_high || o.busy_low > o.busy_high ||
+			o.probe_interval == 0) {
+		fprintf(stderr, "Libwandevent: invalid overload thresholds\n");
+		return -1;
+	}
+
+	if (ov == NULL) {
+		ov = (struct wand_overload_t *)calloc(1, sizeof(*ov));
+		if (ov == NULL)
+			return -1;
+		ov->maxfd = -1;
+		ov->state = WAND_OVERLOAD_NORMAL;
+		ov->probe = wand_add_timer(ev_hdl, o.probe_interval / 1000,
+				(o.probe_interval % 1000) * 1000, NULL,
+				probe_fire);
+		if (ov->probe == NULL) {
+			free(ov);
+			return -1;
+		}
+		ov->hook.callback = overload_prepare;
+		ov->hook.data = NULL;
+		wand_add_prepare_hook(ev_hdl, &ov->hook);
+		ov->changed = now_usec(ev_hdl) - (int64_t)o.hold_time * 1000;
+		ev_hdl->overload = ov;
+	}
+	ov->opts = o;
+	return 0;
+}
+
+int wand_set_fd_sheddable(wand_event_handler_t *ev_hdl, int fd, int flags) {
+	struct wand_overload_t *ov = ev_hdl->overload;
+	int *shed, old;
+
+	if (ov == NULL) {
+		fprintf(stderr, "Libwandevent: overload protection is not enabled\n");
+		return -1;
+	}
+	if (fd < 0 || fd > ev_hdl->maxfd || ev_hdl->fd_events[fd] == NULL)
+		return -1;
+	flags &= (EV_READ | EV_WRITE);
+
+	if (fd > ov->maxfd) {
+		if (flags == 0)
+			return 0;
+		shed = (int *)realloc(ov->shed, (fd + 1) * sizeof(int));
+		if (shed == NULL)
+			return -1;
+		memset(shed + ov->maxfd + 1, 0,
+				(fd - ov->maxfd) * sizeof(int));
+		ov->shed = shed;
+		ov->maxfd = fd;
+	}
+
+	old = ov->shed[fd];
+	ov->shed[fd] = flags;
+	if (ov->state == WAND_OVERLOAD_SHEDDING) {
+		wand_resume_fd(ev_hdl, fd, old & ~flags);
+		wand_suspend_fd(ev_hdl, fd, flags & ~old);
+	}
+	return 0;
+}
+
+void wand_overload_forget(wand_event_handler_t *ev_hdl, int fd) {
+	struct wand_overload_t *ov = ev_hdl->overload;
+
+	/* The fd event is going away, so there is nothing to resume */
+	if (fd <= ov->maxfd)
+		ov->shed[fd] = 0;
+}
+
+int wand_overload_shed_flags(wand_event_handler_t *ev_hdl, int fd) {
+	struct wand_overload_t *ov = ev_hdl->overload;
+
+	if (fd > ov->maxfd)
+		return 0;
+	return ov->shed[fd];
+}
+
+int wand_add_overload_callback(wand_event_handler_t *ev_hdl,
+		void (*callback)(wand_event_handler_t *ev_hdl,
+				enum wand_overload_state_t state, void *data),
+		void *data) {
+	struct wand_overload_t *ov = ev_hdl->overload;
+	struct overload_cb_t *cb, **pos;
+
+	if (ov == NULL) {
+		fprintf(stderr, "Libwandevent: overload protection is not enabled\n");
+		return -1;
+	}
+	cb = (struct overload_cb_t *)malloc(sizeof(*cb));
+	if (cb == NULL)
+		return -1;
+	cb->callback = callback;
+	cb->data = data;
+	cb->next = NULL;
+	/* Callbacks are run in the order they were added */
+	for (pos = &ov->callbacks; *pos != NULL; pos = &(*pos)->next)
+		;
+	*pos = cb;
+	return 0;
+}
+
+void wand_del_overload_callback(wand_event_handler_t *ev_hdl,
+		void (*callback)(wand_event_handler_t *ev_hdl,
+				enum wand_overload_state_t state, void *data),
+		void *data) {
+	struct wand_overload_t *ov = ev_hdl->overload;
+	struct overload_cb_t *cb, **pos;
+
+	if (ov == NULL)
+		return;
+	for (pos = &ov->callbacks; (cb = *pos) != NULL; pos = &cb->next) {
+		if (cb->callback == callback && cb->data == data) {
+			*pos = cb->next;
+			free(cb);
+			return;
+		}
+	}
+}
+
+enum wand_overload_state_t wand_get_overload_state(
+		wand_event_handler_t *ev_hdl) {
+	if (ev_hdl->overload == NULL)
+		return WAND_OVERLOAD_NORMAL;
+	return ev_hdl->overload->state;
+}
+
+void wand_get_overload_stats(wand_event_handler_t *ev_hdl,
+		struct wand_overload_stats_t *stats) {
+	struct wand_overload_t *ov = ev_hdl->overload;
+
+	memset(stats, 0, sizeof(*stats));
+	if (ov == NULL)
+		return;
+	stats->state = ov->state;
+	stats->lag = ov->lag;
+	stats->busy = ov->busy;
+	stats->max_lag = ov->max_lag;
+	stats->max_busy = ov->max_busy;
+	stats->transitions = ov->transitions;
+	stats->since = now_usec(ev_hdl) - ov->changed;
+}
+
+void wand_clear_overload(wand_event_handler_t *ev_hdl) {
+	struct wand_overload_t *ov = ev_hdl->overload;
+	struct overload_cb_t *cb;
+
+	if (ov == NULL)
+		return;
+	if (ov->state == WAND_OVERLOAD_SHEDDING)
+		shed_fds(ev_hdl, false);
+	wand_del_prepare_hook(ev_hdl, &ov->hook);
+	wand_del_timer(ev_hdl, ov->probe);
+	while ((cb = ov->callbacks) != NULL) {
+		ov->callbacks = cb->next;
+		free(cb);
+	}
+	free(ov->shed);
+	free(ov);
+	ev_hdl->overload = NULL;
+}
@@ -0,0 +1,339 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Packet capture using a TPACKET_V3 memory-mapped receive ring.
+ *
+ * The kernel writes packets straight into a ring of blocks that is shared
+ * with us, and only wakes us up once a block is full or has timed out. Each
+ * retired block is passed to the user in one go, with every packet in it
+ * described by a pointer into the ring, so no packet data is ever copied.
+ * The block is handed back to the kernel once the callback returns. */
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+#if HAVE_LINUX_IF_PACKET_H
+ #include <sys/mman.h>
+ #include <net/if.h>
+ #include <arpa/inet.h>
+ #include <linux/if_packet.h>
+ #include <linux/if_ether.h>
+ #ifdef TPACKET3_HDRLEN
+  #define USE_TPACKET_V3 1
+ #endif
+#endif
+
+#define DEFAULT_BLOCK_SIZE (1 << 20)
+#define DEFAULT_BLOCK_COUNT 64
+#define DEFAULT_FRAME_SIZE 2048
+#define DEFAULT_BLOCK_TIMEOUT 10
+
+#if USE_TPACKET_V3
+
+struct wand_packet_ring_t {
+	int fd;
+	uint8_t *map;
+	size_t maplen;
+	unsigned int block_size;
+	unsigned int block_count;
+	/* Next block we expect the kernel to hand us */
+	unsigned int current;
+
+	/* Describes the packets in the block being delivered */
+	struct wand_packet_t *packets;
+	unsigned int maxpackets;
+
+	void (*callback)(wand_event_handler_t *ev_hdl, wand_packet_ring_t *ring,
+			struct wand_packet_t *packets, unsigned int npackets,
+			void *block, void *data);
+	void *data;
+
+	struct wand_packet_ring_stats_t stats;
+};
+
+static struct tpacket_block_desc *get_block(struct wand_packet_ring_t *ring,
+		unsigned int i) {
+	return (struct tpacket_block_desc *)(ring->map +
+			(size_t)i * ring->block_size);
+}
+
+/* Fills in the packet descriptions for a block */
+static unsigned int walk_block(struct wand_packet_ring_t *ring,
+		struct tpacket_block_desc *block) {
+	struct tpacket3_hdr *hdr;
+	unsigned int i, n = block->hdr.bh1.num_pkts;
+	struct wand_packet_t *packets;
+
+	if (n > ring->maxpackets) {
+		packets = (struct wand_packet_t *)realloc(ring->packets,
+				n * sizeof(struct wand_packet_t));
+		if (packets == NULL)
+			return 0;
+		ring->packets = packets;
+		ring->maxpackets = n;
+	}
+
+	hdr = (struct tpacket3_hdr *)((uint8_t *)block +
+			block->hdr.bh1.offset_to_first_pkt);
+	for (i = 0; i < n; i++) {
+		struct wand_packet_t *pkt = &ring->packets[i];
+
+		pkt->data = (uint8_t *)hdr + hdr->tp_mac;
+		pkt->caplen = hdr->tp_snaplen;
+		pkt->len = hdr->tp_len;
+		pkt->ts.tv_sec = hdr->tp_sec;
+		pkt->ts.tv_nsec = hdr->tp_nsec;
+		pkt->vlan_tci = (hdr->tp_status & TP_STATUS_VLAN_VALID) ?
+				hdr->hv1.tp_vlan_tci : 0;
+		hdr = (struct tpacket3_hdr *)((uint8_t *)hdr +
+				hdr->tp_next_offset);
+	}
+	return n;
+}
+
+static void ring_read(wand_event_handler_t *ev_hdl, int fd, void *data,
+		enum wand_eventtype_t ev) {
+	struct wand_packet_ring_t *ring = (struct wand_packet_ring_t *)data;
+	struct tpacket_block_desc *block;
+	unsigned int n, delivered = 0;
+
+	(void)ev;
+
+	/* Don't hog the loop if the kernel is filling blocks as fast as
+	 * we can empty them */
+	while (delivered < ring->block_count) {
+		block = get_block(ring, ring->current);
+		if ((__atomic_load_n(&block->hdr.bh1.block_status,
+				__ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0)
+			break;
+
+		n = walk_block(ring, block);
+		ring->stats.blocks ++;
+		delivered ++;
+		ring->callback(ev_hdl, ring, ring->packets, n, block,
+				ring->data);
+
+		/* The callback may have removed us */
+		if (ev_hdl->fd_events[fd] == NULL ||
+				ev_hdl->fd_events[fd]->data != ring)
+			return;
+
+		/* Give the block back to the kernel */
+		__atomic_store_n(&block->hdr.bh1.block_status,
+				TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		ring->current = (ring->current + 1) % ring->block_count;
+	}
+}
+
+wand_packet_ring_t *wand_add_packet_ring(wand_event_handler_t *ev_hdl,
+		const char *ifname,
+		const struct wand_packet_ring_opts_t *opts,
+		void (*callback)(wand_event_handler_t *ev_hdl,
+				wand_packet_ring_t *ring,
+				struct wand_packet_t *packets,
+				unsigned int npackets, void *block,
+				void *data),
+		void *data) {
+	struct wand_packet_ring_t *ring;
+	struct tpacket_req3 req;
+	struct sockaddr_ll ll;
+	int version = TPACKET_V3;
+	unsigned int frame_size, timeout;
+
+	ring = (struct wand_packet_ring_t *)calloc(1,
+			sizeof(struct wand_packet_ring_t));
+	if (ring == NULL)
+		return NULL;
+	ring->callback = callback;
+	ring->data = data;
+	ring->map = MAP_FAILED;
+
+	ring->block_size = (opts && opts->block_size) ? opts->block_size :
+			DEFAULT_BLOCK_SIZE;
+	ring->block_count = (opts && opts->block_count) ? opts->block_count :
+			DEFAULT_BLOCK_COUNT;
+	frame_size = (opts && opts->frame_size) ? opts->frame_size :
+			DEFAULT_FRAME_SIZE;
+	timeout = (opts && opts->block_timeout) ? opts->block_timeout :
+			DEFAULT_BLOCK_TIMEOUT;
+
+	ring->fd = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			htons(ETH_P_ALL));
+	if (ring->fd < 0) {
+		perror("socket");
+		goto fail;
+	}
+
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version,
+			sizeof(version)) < 0) {
+		perror("setsockopt(PACKET_VERSION)");
+		goto fail;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = ring->block_size;
+	req.tp_block_nr = ring->block_count;
+	req.tp_frame_size = frame_size;
+	req.tp_frame_nr = (ring->block_size / frame_size) * ring->block_count;
+	req.tp_retire_blk_tov = timeout;
+	req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req,
+			sizeof(req)) < 0) {
+		perror("setsockopt(PACKET_RX_RING)");
+		goto fail;
+	}
+
+	ring->maplen = (size_t)ring->block_size * ring->block_count;
+	ring->map = (uint8_t *)mmap(NULL, ring->maplen,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED,
+			ring->fd, 0);
+	if (ring->map == MAP_FAILED) {
+		/* Try again without locking the pages in memory */
+		ring->map = (uint8_t *)mmap(NULL, ring->maplen,
+				PROT_READ | PROT_WRITE, MAP_SHARED,
+				ring->fd, 0);
+	}
+	if (ring->map == MAP_FAILED) {
+		perror("mmap");
+		goto fail;
+	}
+
+	memset(&ll, 0, sizeof(ll));
+	ll.sll_family = AF_PACKET;
+	ll.sll_protocol = htons(ETH_P_ALL);
+	if (ifname) {
+		ll.sll_ifindex = if_nametoindex(ifname);
+		if (ll.sll_ifindex == 0) {
+			fprintf(stderr, "Libwandevent: unknown interface %s\n",
+					ifname);
+			goto fail;
+		}
+	}
+	if (bind(ring->fd, (struct sockaddr *)&ll, sizeof(ll)) < 0) {
+		perror("bind");
+		goto fail;
+	}
+
+	/* Fanout has to be set up after binding */
+	if (opts && opts->fanout_group > 0) {
+		int fanout = (opts->fanout_group & 0xffff) |
+				(opts->fanout_mode << 16);
+		if (setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT, &fanout,
+				sizeof(fanout)) < 0) {
+			perror("setsockopt(PACKET_FANOUT)");
+			goto fail;
+		}
+	}
+
+	if (wand_add_fd(ev_hdl, ring->fd, EV_READ, ring, ring_read) == NULL)
+		goto fail;
+
+	return ring;
+
+fail:
+	if (ring->map != MAP_FAILED)
+		munmap(ring->map, ring->maplen);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	free(ring);
+	return NULL;
+}
+
+int wand_packet_ring_fd(wand_packet_ring_t *ring) {
+	return ring->fd;
+}
+
+void wand_get_packet_ring_stats(wand_packet_ring_t *ring,
+		struct wand_packet_ring_stats_t *stats) {
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+
+	/* The kernel resets its counters each time we read them */
+	memset(&st, 0, sizeof(st));
+	if (getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &st,
+			&len) == 0) {
+		ring->stats.packets += st.tp_packets;
+		ring->stats.drops += st.tp_drops;
+		ring->stats.freezes += st.tp_freeze_q_cnt;
+	}
+	*stats = ring->stats;
+}
+
+void wand_del_packet_ring(wand_event_handler_t *ev_hdl,
+		wand_packet_ring_t *ring) {
+	wand_del_fd(ev_hdl, ring->fd);
+	munmap(ring->map, ring->maplen);
+	close(ring->fd);
+	free(ring->packets);
+	free(ring);
+}
+
+#else
+
+/* No TPACKET_V3 support, so packet rings are not available */
+wand_packet_ring_t *wand_add_packet_ring(wand_event_handler_t *ev_hdl,
+		const char *ifname,
+		const struct wand_packet_ring_opts_t *opts,
+		void (*callback)(wand_event_handler_t *ev_hdl,
+				wand_packet_ring_t *ring,
+				struct wand_packet_t *packets,
+				unsigned int npackets, void *block,
+				void *data),
+		void *data) {
+	(void)ev_hdl; (void)ifname; (void)opts; (void)callback; (void)data;
+	fprintf(stderr, "Libwandevent: packet rings are not supported on this system\n");
+	return NULL;
+}
+
+int wand_packet_ring_fd(wand_packet_ring_t *ring) {
+	(void)ring;
+	return -1;
+}
+
+void wand_get_packet_ring_stats(wand_packet_ring_t *ring,
+		struct wand_packet_ring_stats_t *stats) {
+	(void)ring;
+	memset(stats, 0, sizeof(struct wand_packet_ring_stats_t));
+}
+
+void wand_del_packet_ring(wand_event_handler_t *ev_hdl,
+		wand_packet_ring_t *ring) {
+	(void)ev_hdl; (void)ring;
+}
+
+#endif
@@ -0,0 +1,621 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Token-bucket rate limiters.
+ *
+ * Each limiter holds up to burst tokens and is refilled continuously at
+ * rate tokens per second. The refill is worked out from the time since the
+ * limiter was last looked at, so a limiter that isn't being used costs
+ * nothing. A limiter may draw from a group limiter as well as its own
+ * bucket, so that several limiters can share an overall limit.
+ *
+ * When a limiter can't cover another take of the size it was last asked
+ * for, it is throttled: the fds attached to it stop being watched for the
+ * events it controls, and it goes into a list of throttled limiters sorted
+ * by when they will have enough tokens again. A single timer per handler is
+ * set for the head of that list. Where possible the timer is a timerfd with
+ * an absolute deadline, so pacing is accurate to well under a millisecond
+ * rather than to the millisecond timeout given to epoll_wait(). Handlers on
+ * a virtual clock, or without timerfd, use an ordinary timer instead.
+ */
+#include "config.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+/* Allow for rounding when deciding whether there are enough tokens */
+#define TOKEN_SLACK 1e-6
+
+struct ratelimit_fd_t {
+	int fd;
+	int flags;
+};
+
+struct wand_ratelimit_t {
+	wand_event_handler_t *ev_hdl;
+	/* Limiter that we also draw tokens from, if any */
+	struct wand_ratelimit_t *group;
+	/* Number of limiters using this one as their group */
+	int members;
+
+	/* Tokens per second */
+	double rate;
+	double burst;
+	double tokens;
+	/* When tokens was last brought up to date, in nanoseconds */
+	uint64_t last;
+	/* Size of the last take, which is what we need before resuming */
+	double need;
+	/* Tokens wanted by members of this group that have been denied and
+	 * are waiting to try again */
+	double backlog;
+	/* What we have added to the backlog of our groups */
+	double backlogged;
+
+	/* fds that we suspend, along with the events to suspend */
+	struct ratelimit_fd_t *fds;
+	int nfds;
+	int allocfds;
+
+	void (*callback)(wand_event_handler_t *ev_hdl, wand_ratelimit_t *rl,
+			void *data);
+	void *data;
+
+	/* While throttled, we are in the handler's list of throttled
+	 * limiters, waiting until resume_at */
+	bool throttled;
+	uint64_t resume_at;
+	struct wand_ratelimit_t *next;
+	struct wand_ratelimit_t **pprev;
+
+	struct wand_ratelimit_stats_t stats;
+};
+
+struct wand_pacer_t {
+	/* Throttled limiters, soonest to resume first */
+	struct wand_ratelimit_t *throttled;
+	/* Clock used for refills: true if it is the handler's virtual
+	 * clock rather than CLOCK_MONOTONIC */
+	bool virtual;
+	int timerfd;
+	struct wand_timer_t *timer;
+	/* When the timer is going to go off, or 0 if it isn't set */
+	uint64_t armed_at;
+};
+
+static uint64_t pacer_now(wand_event_handler_t *ev_hdl) {
+	struct timespec ts;
+	struct timeval tv;
+
+	if (ev_hdl->pacer->virtual) {
+		tv = wand_get_monotonictime(ev_hdl);
+		return (uint64_t)tv.tv_sec * 1000000000ULL +
+				(uint64_t)tv.tv_usec * 1000;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pacer_fire(wand_event_handler_t *ev_hdl);
+
+static void pacer_timer(wand_event_handler_t *ev_hdl, void *data) {
+	(void)data;
+	ev_hdl->pacer->timer = NULL;
+	pacer_fire(ev_hdl);
+}
+
+#if HAVE_SYS_TIMERFD_H
+static void pacer_timerfd(wand_event_handler_t *ev_hdl, int fd, void *data,
+		enum wand_eventtype_t ev) {
+	uint64_t expirations;
+
+	(void)data;
+	(void)ev;
+	if (read(fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	pacer_fire(ev_hdl);
+}
+#endif
+
+static struct wand_pacer_t *pacer_init(wand_event_handler_t *ev_hdl) {
+	struct wand_pacer_t *pacer;
+
+	if (ev_hdl->pacer)
+		return ev_hdl->pacer;
+
+	pacer = (struct wand_pacer_t *)calloc(1, sizeof(*pacer));
+	if (pacer == NULL)
+		return NULL;
+	pacer->virtual = ev_hdl->virtualtime;
+	pacer->timerfd = -1;
+
+#if HAVE_SYS_TIMERFD_H
+	if (!pacer->virtual) {
+		pacer->timerfd = timerfd_create(CLOCK_MONOTONIC,
+				TFD_NONBLOCK | TFD_CLOEXEC);
+		if (pacer->timerfd >= 0 && wand_add_fd(ev_hdl, pacer->timerfd,
+				EV_READ, NULL, pacer_timerfd) == NULL) {
+			close(pacer->timerfd);
+			pacer->timerfd = -1;
+		}
+	}
+#endif
+	ev_hdl->pacer = pacer;
+	return pacer;
+}
+
+/* Makes sure that the timer will go off in time for the first throttled
+ * limiter. If it is already set for earlier than that, it is left alone
+ * and we sort things out when it goes off */
+static void arm_pacer(wand_event_handler_t *ev_hdl) {
+	struct wand_pacer_t *pacer = ev_hdl->pacer;
+	uint64_t at, now, delay;
+
+	if (pacer->throttled == NULL)
+		return;
+	at = pacer->throttled->resume_at;
+	if (at == UINT64_MAX)
+		return;
+	if (pacer->armed_at != 0 && pacer->armed_at <= at)
+		return;
+
+#if HAVE_SYS_TIMERFD_H
+	if (pacer->timerfd >= 0) {
+		struct itimerspec its;
+
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = at / 1000000000ULL;
+		its.it_value.tv_nsec = at % 1000000000ULL;
+		if (timerfd_settime(pacer->timerfd, TFD_TIMER_ABSTIME, &its,
+				NULL) < 0) {
+			perror("timerfd_settime");
+			return;
+		}
+		pacer->armed_at = at;
+		return;
+	}
+#endif
+	now = pacer_now(ev_hdl);
+	/* Round up, so that we never wake before the tokens are there */
+	delay = at > now ? (at - now + 999) / 1000 : 0;
+	if (pacer->timer)
+		wand_del_timer(ev_hdl, pacer->timer);
+	pacer->timer = wand_add_timer(ev_hdl, delay / 1000000,
+			delay % 1000000, NULL, pacer_timer);
+	if (pacer->timer)
+		pacer->armed_at = at;
+}
+
+static void unlink_throttled(struct wand_ratelimit_t *rl) {
+	if (rl->pprev == NULL)
+		return;
+	*rl->pprev = rl->next;
+	if (rl->next)
+		rl->next->pprev = rl->pprev;
+	rl->next = NULL;
+	rl->pprev = NULL;
+}
+
+static void insert_throttled(struct wand_pacer_t *pacer,
+		struct wand_ratelimit_t *rl) {
+	struct wand_ratelimit_t **pos = &pacer->throttled;
+
+	/* There are rarely many limiters throttled at once */
+	while (*pos && (*pos)->resume_at <= rl->resume_at)
+		pos = &(*pos)->next;
+	rl->next = *pos;
+	if (rl->next)
+		rl->next->pprev = &rl->next;
+	rl->pprev = pos;
+	*pos = rl;
+}
+
+static void refill(struct wand_ratelimit_t *rl, uint64_t now) {
+	if (now <= rl->last)
+		return;
+	rl->tokens += (double)(now - rl->last) * rl->rate / 1e9;
+	if (rl->tokens > rl->burst)
+		rl->tokens = rl->burst;
+	rl->last = now;
+}
+
+static void refill_all(struct wand_ratelimit_t *rl, uint64_t now) {
+	for (; rl != NULL; rl = rl->group)
+		refill(rl, now);
+}
+
+/* Nanoseconds until every bucket we draw from holds n tokens, or
+ * UINT64_MAX if that will never happen at the current rates.
+ *
+ * Members of a group that have been denied are let in first: everyone
+ * else waits until the group could also cover the backlog. Otherwise,
+ * when several members are resumed at once, whichever fd happens to be
+ * dispatched first would get every token */
+static uint64_t time_until(struct wand_ratelimit_t *rl, double n) {
+	struct wand_ratelimit_t *l;
+	uint64_t wait = 0, w;
+	double need, ns;
+
+	for (l = rl; l != NULL; l = l->group) {
+		need = n > l->burst ? l->burst : n;
+		if (l != rl)
+			need += l->backlog - rl->backlogged;
+		if (l->tokens + TOKEN_SLACK >= need)
+			continue;
+		if (l->rate <= 0)
+			return UINT64_MAX;
+		ns = (need - l->tokens) * 1e9 / l->rate;
+		if (ns >= (double)(UINT64_MAX / 2))
+			return UINT64_MAX;
+		/* Round up, so that we never resume a little too early */
+		w = (uint64_t)ns;
+		if ((double)w < ns)
+			w ++;
+		if (w > wait)
+			wait = w;
+	}
+	return wait;
+}
+
+/* Works out when a throttled limiter can resume, and puts it in the right
+ * place in the list */
+static void reschedule(struct wand_ratelimit_t *rl, uint64_t now) {
+	uint64_t wait = time_until(rl, rl->need);
+
+	unlink_throttled(rl);
+	rl->resume_at = wait == UINT64_MAX ? UINT64_MAX : now + wait;
+	insert_throttled(rl->ev_hdl->pacer, rl);
+}
+
+static bool draws_from(struct wand_ratelimit_t *rl,
+		struct wand_ratelimit_t *bucket) {
+	for (; rl != NULL; rl = rl->group) {
+		if (rl == bucket)
+			return true;
+	}
+	return false;
+}
+
+/* Gives throttled limiters that draw from bucket a new deadline, after the
+ * bucket's rate or backlog has changed. Unless everyone is true, limiters
+ * that are already in the backlog keep their place. They are still
+ * resumed by the timer, even if they could go right away, so that their
+ * callbacks aren't run from in here */
+static void reschedule_waiting(struct wand_ratelimit_t *bucket, uint64_t now,
+		bool everyone) {
+	struct wand_ratelimit_t *l, *next, *moved = NULL;
+
+	for (l = bucket->ev_hdl->pacer->throttled; l != NULL; l = next) {
+		next = l->next;
+		if (!draws_from(l, bucket) || (!everyone && l->backlogged))
+			continue;
+		unlink_throttled(l);
+		l->next = moved;
+		moved = l;
+	}
+	while ((l = moved) != NULL) {
+		moved = l->next;
+		refill_all(l, now);
+		reschedule(l, now);
+	}
+}
+
+static void set_suspended(struct wand_ratelimit_t *rl, bool suspend) {
+	int i;
+
+	for (i = 0; i < rl->nfds; i++) {
+		if (suspend)
+			wand_suspend_fd(rl->ev_hdl, rl->fds[i].fd,
+					rl->fds[i].flags);
+		else
+			wand_resume_fd(rl->ev_hdl, rl->fds[i].fd,
+					rl->fds[i].flags);
+	}
+}
+
+/* Sets how many tokens we are waiting for in the backlog of our groups */
+static void set_backlog(struct wand_ratelimit_t *rl, double n) {
+	struct wand_ratelimit_t *l;
+
+	for (l = rl->group; l != NULL; l = l->group)
+		l->backlog += n - rl->backlogged;
+	rl->backlogged = n;
+}
+
+static void unthrottle(struct wand_ratelimit_t *rl) {
+	if (rl->backlogged)
+		set_backlog(rl, 0);
+	unlink_throttled(rl);
+	rl->throttled = false;
+	set_suspended(rl, false);
+}
+
+/* Throttles the limiter if it can't cover its next take, or lets it go if
+ * it can */
+static void update_throttle(struct wand_ratelimit_t *rl, uint64_t now) {
+	if (time_until(rl, rl->need) == 0) {
+		if (rl->throttled)
+			unthrottle(rl);
+		return;
+	}
+
+	if (!rl->throttled) {
+		rl->throttled = true;
+		rl->stats.throttles ++;
+		set_suspended(rl, true);
+	}
+	reschedule(rl, now);
+	arm_pacer(rl->ev_hdl);
+}
+
+static void pacer_fire(wand_event_handler_t *ev_hdl) {
+	struct wand_pacer_t *pacer = ev_hdl->pacer;
+	struct wand_ratelimit_t *rl;
+	uint64_t now = pacer_now(ev_hdl);
+
+	pacer->armed_at = 0;
+	/* Anything that the callbacks throttle again will be due after now,
+	 * so this can't go on forever */
+	while ((rl = pacer->throttled) != NULL && rl->resume_at <= now) {
+		unthrottle(rl);
+		if (rl->callback)
+			rl->callback(ev_hdl, rl, rl->data);
+	}
+	arm_pacer(ev_hdl);
+}
+
+wand_ratelimit_t * wand_create_ratelimit(wand_event_handler_t *ev_hdl,
+		double rate, uint64_t burst, wand_ratelimit_t *group) {
+	struct wand_ratelimit_t *rl;
+
+	if (rate < 0 || burst == 0) {
+		fprintf(stderr, "Libwandevent: invalid rate limit\n");
+		return NULL;
+	}
+	if (group && group->ev_hdl != ev_hdl) {
+		fprintf(stderr, "Libwandevent: rate limit group belongs to a different event handler\n");
+		return NULL;
+	}
+	if (pacer_init(ev_hdl) == NULL)
+		return NULL;
+
+	rl = (struct wand_ratelimit_t *)calloc(1, sizeof(*rl));
+	if (rl == NULL)
+		return NULL;
+	rl->ev_hdl = ev_hdl;
+	rl->group = group;
+	if (group)
+		group->members ++;
+	rl->rate = rate;
+	rl->burst = burst;
+	/* Start off full */
+	rl->tokens = burst;
+	rl->need = 1;
+	rl->last = pacer_now(ev_hdl);
+	return rl;
+}
+
+int wand_ratelimit_set_rate(wand_ratelimit_t *rl, double rate,
+		uint64_t burst) {
+	uint64_t now;
+
+	if (rate < 0 || burst == 0)
+		return -1;
+	now = pacer_now(rl->ev_hdl);
+	/* Tokens gained so far were earned at the old rate */
+	refill(rl, now);
+	rl->rate = rate;
+	rl->burst = burst;
+	if (rl->tokens > rl->burst)
+		rl->tokens = rl->burst;
+
+	reschedule_waiting(rl, now, true);
+	arm_pacer(rl->ev_hdl);
+	return 0;
+}
+
+void wand_ratelimit_set_callback(wand_ratelimit_t *rl,
+		void (*callback)(wand_event_handler_t *ev_hdl,
+				wand_ratelimit_t *rl, void *data),
+		void *data) {
+	rl->callback = callback;
+	rl->data = data;
+}
+
+int wand_ratelimit_attach(wand_ratelimit_t *rl, int fd, int flags) {
+	struct ratelimit_fd_t *fds;
+	int i;
+
+	flags &= (EV_READ | EV_WRITE);
+	if (fd < 0 || flags == 0)
+		return -1;
+
+	for (i = 0; i < rl->nfds; i++) {
+		if (rl->fds[i].fd == fd)
+			break;
+	}
+	if (i == rl->nfds) {
+		if (rl->nfds == rl->allocfds) {
+			int n = rl->allocfds ? rl->allocfds * 2 : 4;
+
+			fds = (struct ratelimit_fd_t *)realloc(rl->fds,
+					n * sizeof(*fds));
+			if (fds == NULL)
+				return -1;
+			rl->fds = fds;
+			rl->allocfds = n;
+		}
+		rl->fds[i].fd = fd;
+		rl->fds[i].flags = 0;
+		rl->nfds ++;
+	}
+
+	if (rl->throttled) {
+		wand_resume_fd(rl->ev_hdl, fd, rl->fds[i].flags & ~flags);
+		wand_suspend_fd(rl->ev_hdl, fd, flags & ~rl->fds[i].flags);
+	}
+	rl->fds[i].flags = flags;
+	return 0;
+}
+
+void wand_ratelimit_detach(wand_ratelimit_t *rl, int fd) {
+	int i;
+
+	for (i = 0; i < rl->nfds; i++) {
+		if (rl->fds[i].fd != fd)
+			continue;
+		if (rl->throttled)
+			wand_resume_fd(rl->ev_hdl, fd, rl->fds[i].flags);
+		rl->fds[i] = rl->fds[--rl->nfds];
+		return;
+	}
+}
+
+bool wand_ratelimit_take(wand_ratelimit_t *rl, uint64_t n) {
+	struct wand_ratelimit_t *l;
+	uint64_t now = pacer_now(rl->ev_hdl);
+	bool ok = true;
+
+	refill_all(rl, now);
+	for (l = rl; l != NULL; l = l->group) {
+		if (l->tokens + TOKEN_SLACK < (double)n) {
+			ok = false;
+			break;
+		}
+	}
+
+	if (ok) {
+		for (l = rl; l != NULL; l = l->group)
+			l->tokens -= n;
+		rl->stats.taken += n;
+		if (rl->backlogged)
+			set_backlog(rl, 0);
+	} else {
+		rl->stats.denied ++;
+		/* Join the queue for our groups, in front of anyone who
+		 * hasn't been turned away yet */
+		if (rl->group && rl->backlogged != n) {
+			set_backlog(rl, n);
+			reschedule_waiting(rl->group, now, false);
+		}
+	}
+	rl->need = n;
+	update_throttle(rl, now);
+	return ok;
+}
+
+void wand_ratelimit_charge(wand_ratelimit_t *rl, uint64_t n) {
+	struct wand_ratelimit_t *l;
+	uint64_t now = pacer_now(rl->ev_hdl);
+
+	refill_all(rl, now);
+	for (l = rl; l != NULL; l = l->group)
+		l->tokens -= n;
+	rl->stats.taken += n;
+	rl->need = n;
+	if (rl->backlogged)
+		set_backlog(rl, 0);
+	update_throttle(rl, now);
+}
+
+uint64_t wand_ratelimit_available(wand_ratelimit_t *rl) {
+	struct wand_ratelimit_t *l;
+	double avail = rl->burst;
+
+	refill_all(rl, pacer_now(rl->ev_hdl));
+	for (l = rl; l != NULL; l = l->group) {
+		if (l->tokens < avail)
+			avail = l->tokens;
+	}
+	if (avail < 0)
+		return 0;
+	return (uint64_t)(avail + TOKEN_SLACK);
+}
+
+int64_t wand_ratelimit_delay(wand_ratelimit_t *rl, uint64_t n) {
+	uint64_t wait;
+
+	refill_all(rl, pacer_now(rl->ev_hdl));
+	wait = time_until(rl, n);
+	if (wait == UINT64_MAX)
+		return -1;
+	return (wait + 999) / 1000;
+}
+
+void wand_get_ratelimit_stats(wand_ratelimit_t *rl,
+		struct wand_ratelimit_stats_t *stats) {
+	*stats = rl->stats;
+	stats->throttled = rl->throttled;
+}
+
+void wand_destroy_ratelimit(wand_ratelimit_t *rl) {
+	if (rl->members > 0) {
+		fprintf(stderr, "Libwandevent: can't destroy a rate limit group that is still in use\n");
+		return;
+	}
+	if (rl->throttled)
+		unthrottle(rl);
+	if (rl->backlogged)
+		set_backlog(rl, 0);
+	if (rl->group)
+		rl->group->members --;
+	free(rl->fds);
+	free(rl);
+}
+
+void wand_pacer_destroy(wand_event_handler_t *ev_hdl) {
+	struct wand_pacer_t *pacer = ev_hdl->pacer;
+	struct wand_ratelimit_t *rl;
+
+	if (pacer == NULL)
+		return;
+	/* Any limiters left over are the user's, but they can't stay in
+	 * our list */
+	while ((rl = pacer->throttled) != NULL) {
+		unlink_throttled(rl);
+		rl->throttled = false;
+	}
+	if (pacer->timerfd >= 0) {
+		wand_del_fd(ev_hdl, pacer->timerfd);
+		close(pacer->timerfd);
+	}
+	if (pacer->timer)
+		wand_del_timer(ev_hdl, pacer->timer);
+	free(pacer);
+	ev_hdl->pacer = NULL;
+}
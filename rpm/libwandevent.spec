@@ -54,11 +54,14 @@ rm -rf %{buildroot}
 %defattr(-,root,root,-)
 %doc
 %{_libdir}/*.so.*
+%{_bindir}/wandevent-trace
+%{_datadir}/libwandevent
 
 %files devel
 %defattr(-,root,root,-)
 %doc
 %{_includedir}/*.h
+%{_includedir}/*.hpp
 %{_libdir}/*.a
 %{_libdir}/*.la
 %{_libdir}/*.so
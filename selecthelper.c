@@ -30,6 +30,8 @@
  *
  */
 
+#include "config.h"
+
 #include <sys/select.h>
 #include <stdlib.h>
 #include <sys/time.h>
@@ -37,36 +39,48 @@
 #include <sys/ioctl.h>
 
 #include "selecthelper.h"
+#include "eventinternal.h"
 
 void process_select_event(wand_event_handler_t *ev_hdl,
                 int fd, fd_set *xrfd, fd_set *xwfd, fd_set *xxfd) {
+        struct wand_fdcb_t *evcb = ev_hdl->fd_events[fd];
+
+        if (evcb->batch) {
+                int active = wand_fd_active_flags(evcb), ready = 0;
+
+                if ((active & EV_READ) && FD_ISSET(fd, xrfd))
+                        ready |= EV_READ;
+                if ((active & EV_WRITE) && FD_ISSET(fd, xwfd))
+                        ready |= EV_WRITE;
+                if ((active & EV_EXCEPT) && FD_ISSET(fd, xxfd))
+                        ready |= EV_EXCEPT;
+                if (ready == 0 || wand_batch_queue(ev_hdl, evcb, ready) == 0)
+                        return;
+        }
+
         /* This code makes me feel dirty */
-        if ((ev_hdl->fd_events[fd]->flags & EV_READ) && FD_ISSET(fd,xrfd)) {
+        if ((wand_fd_active_flags(ev_hdl->fd_events[fd]) & EV_READ) && FD_ISSET(fd,xrfd)) {
                 int data;
                 do {
-                        ev_hdl->fd_events[fd]->callback(ev_hdl, fd,
-                                        ev_hdl->fd_events[fd]->data, EV_READ);
+                        wand_fd_callback(ev_hdl, ev_hdl->fd_events[fd],
+                                        EV_READ);
                 } while (ev_hdl->fd_events[fd] &&
+                                (wand_fd_active_flags(ev_hdl->fd_events[fd])
+                                        & EV_READ) &&
                                 ioctl(fd,FIONREAD,&data)>=0
                                 && data>0);
                 if (!ev_hdl->fd_events[fd])
                         return;
         }
-        if ((ev_hdl->fd_events[fd]->flags & EV_WRITE)
+        if ((wand_fd_active_flags(ev_hdl->fd_events[fd]) & EV_WRITE)
                         && FD_ISSET(fd,xwfd)) {
-                ev_hdl->fd_events[fd]->callback(
-                                ev_hdl, fd,
-                                ev_hdl->fd_events[fd]->data,
-                                EV_WRITE);
+                wand_fd_callback(ev_hdl, ev_hdl->fd_events[fd], EV_WRITE);
                 if (!ev_hdl->fd_events[fd])
                         return;
         }
-        if ((ev_hdl->fd_events[fd]->flags & EV_EXCEPT)
+        if ((wand_fd_active_flags(ev_hdl->fd_events[fd]) & EV_EXCEPT)
                         && FD_ISSET(fd,xxfd)) {
-                ev_hdl->fd_events[fd]->callback(
-                                ev_hdl, fd,
-                                ev_hdl->fd_events[fd]->data,
-                                EV_EXCEPT);
+                wand_fd_callback(ev_hdl, ev_hdl->fd_events[fd], EV_EXCEPT);
         }
 }
 
@@ -82,6 +96,11 @@ struct timeval calculate_select_delay(wand_event_handler_t *ev_hdl,
 		delay.tv_usec += 1000000;
 		--delay.tv_sec;
 	}
+	/* The clock may have moved on since we checked the timers */
+	if (delay.tv_sec < 0) {
+		delay.tv_sec = 0;
+		delay.tv_usec = 0;
+	}
 	return delay;
 }
 
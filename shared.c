@@ -0,0 +1,493 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Shared dispatch: fds that are served by whichever loop in a loop group
+ * is free, rather than by the loop they were added to.
+ *
+ * The fds are registered with their own epoll instance, using EPOLLONESHOT,
+ * and that epoll fd is watched by every loop in the group. A loop that sees
+ * it become readable takes a small batch of events from it, so the fds are
+ * spread across the loops that are not busy, and EPOLLONESHOT makes sure
+ * that only one loop at a time ever has an event for a given fd. The fd is
+ * re-armed once its callback has returned.
+ *
+ * The rest of the event handler is still owned by the thread running it,
+ * so the callback is given the handler of the loop that is running it, and
+ * timers and everything else should be used through that.
+ *
+ * Registrations can be changed from any thread. Each fd has a slot, with
+ * its own lock, in a table of fixed-size chunks that are allocated as
+ * needed and never move, so a slot can be found without locking the whole
+ * table. Each slot has a generation that is bumped whenever the fd is
+ * deleted, and the generation is stored in the epoll event, so that events
+ * for an fd that has since been deleted (and perhaps added again) are
+ * ignored. */
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+#if HAVE_SYS_EPOLL_H
+ #include <sys/epoll.h>
+ #include "epollhelper.h"
+#endif
+
+#if HAVE_SYS_EPOLL_H
+
+#define CHUNK_BITS 10
+#define CHUNK_SIZE (1 << CHUNK_BITS)
+/* Default number of events a loop takes at once */
+#define DEFAULT_BATCH 4
+
+struct shared_slot_t {
+	pthread_mutex_t lock;
+	bool active;
+	/* Bumped whenever the fd is deleted */
+	uint32_t gen;
+	int flags;
+	void *data;
+	void (*callback)(wand_event_handler_t *ev_hdl, int fd, void *data,
+			enum wand_eventtype_t ev);
+	/* Loops running the callback. EPOLLONESHOT means there is only ever
+	 * one for the current generation, but a callback may delete and
+	 * re-add its own fd, so another loop may start on the new generation
+	 * before the old one has finished */
+	int running;
+	/* Set while a loop is running the callback for the current
+	 * generation, which will re-arm the fd once it has finished */
+	bool gen_running;
+	/* Threads in wand_shared_del_fd() waiting for the callbacks */
+	int waiters;
+};
+
+struct wand_shared_t {
+	int epoll_fd;
+	int batch;
+	int nloops;
+	wand_event_handler_t **loops;
+
+	/* Chunks of CHUNK_SIZE slots, indexed by fd >> CHUNK_BITS */
+	struct shared_slot_t **chunks;
+	int nchunks;
+	/* Held while allocating a chunk, and signalled whenever a callback
+	 * finishes, for wand_shared_del_fd() */
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+
+	struct wand_shared_stats_t stats;
+};
+
+/* The slot whose callback this thread is running, if any */
+static __thread struct shared_slot_t *current_slot;
+
+static struct shared_slot_t *find_slot(wand_shared_t *sh, int fd) {
+	struct shared_slot_t *chunk;
+
+	if (fd < 0 || (fd >> CHUNK_BITS) >= sh->nchunks)
+		return NULL;
+	chunk = __atomic_load_n(&sh->chunks[fd >> CHUNK_BITS],
+			__ATOMIC_ACQUIRE);
+	if (chunk == NULL)
+		return NULL;
+	return &chunk[fd & (CHUNK_SIZE - 1)];
+}
+
+static struct shared_slot_t *create_slot(wand_shared_t *sh, int fd) {
+	struct shared_slot_t *chunk;
+	int i;
+
+	if (fd < 0 || (fd >> CHUNK_BITS) >= sh->nchunks)
+		return NULL;
+
+	pthread_mutex_lock(&sh->lock);
+	chunk = sh->chunks[fd >> CHUNK_BITS];
+	if (chunk == NULL) {
+		chunk = (struct shared_slot_t *)calloc(CHUNK_SIZE,
+				sizeof(struct shared_slot_t));
+		if (chunk == NULL) {
+			pthread_mutex_unlock(&sh->lock);
+			return NULL;
+		}
+		for (i = 0; i < CHUNK_SIZE; i++)
+			pthread_mutex_init(&chunk[i].lock, NULL);
+		__atomic_store_n(&sh->chunks[fd >> CHUNK_BITS], chunk,
+				__ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&sh->lock);
+	return &chunk[fd & (CHUNK_SIZE - 1)];
+}
+
+/* Arms (or re-arms) the fd for a single event. The slot must be locked */
+static int arm_slot(wand_shared_t *sh, struct shared_slot_t *slot, int fd,
+		int op) {
+	struct epoll_event epev;
+
+	set_epoll_event(&epev, fd, slot->flags);
+	epev.events |= EPOLLONESHOT;
+	epev.data.u64 = ((uint64_t)slot->gen << 32) | (uint32_t)fd;
+	return epoll_ctl(sh->epoll_fd, op, fd, &epev);
+}
+
+static void add_stat(uint64_t *stat, uint64_t n) {
+	__atomic_add_fetch(stat, n, __ATOMIC_RELAXED);
+}
+
+/* Runs the callback for one event, unless the fd has been deleted since
+ * the event was queued */
+static void dispatch_event(wand_shared_t *sh, wand_event_handler_t *ev_hdl,
+		struct epoll_event *epev) {
+	int fd = (int)(uint32_t)epev->data.u64;
+	uint32_t gen = (uint32_t)(epev->data.u64 >> 32);
+	struct shared_slot_t *slot = find_slot(sh, fd);
+	void (*callback)(wand_event_handler_t *, int, void *,
+			enum wand_eventtype_t);
+	void *data;
+	int ready = 0, i, flags;
+	bool wake;
+	static const int order[3] = { EV_READ, EV_WRITE, EV_EXCEPT };
+
+	if (slot == NULL)
+		return;
+
+	pthread_mutex_lock(&slot->lock);
+	if (!slot->active || slot->gen != gen) {
+		pthread_mutex_unlock(&slot->lock);
+		add_stat(&sh->stats.stale, 1);
+		return;
+	}
+	__atomic_add_fetch(&slot->running, 1, __ATOMIC_RELAXED);
+	slot->gen_running = true;
+	flags = slot->flags;
+	callback = slot->callback;
+	data = slot->data;
+	pthread_mutex_unlock(&slot->lock);
+
+	/* Same rules as process_epoll_event() */
+	if ((flags & EV_READ) && (epev->events & (EPOLLIN | EPOLLHUP |
+			EPOLLRDHUP)))
+		ready |= EV_READ;
+	if ((flags & EV_WRITE) && (epev->events & EPOLLOUT))
+		ready |= EV_WRITE;
+	if ((flags & EV_EXCEPT) && (epev->events & (EPOLLERR | EPOLLPRI)))
+		ready |= EV_EXCEPT;
+
+	current_slot = slot;
+	for (i = 0; i < 3; i++) {
+		if (!(ready & order[i]))
+			continue;
+		/* An earlier callback may have deleted the fd */
+		if (i > 0 && (!__atomic_load_n(&slot->active, __ATOMIC_ACQUIRE) ||
+				__atomic_load_n(&slot->gen, __ATOMIC_ACQUIRE)
+						!= gen))
+			break;
+		callback(ev_hdl, fd, data, (enum wand_eventtype_t)order[i]);
+		add_stat(&sh->stats.callbacks, 1);
+	}
+	current_slot = NULL;
+
+	pthread_mutex_lock(&slot->lock);
+	__atomic_sub_fetch(&slot->running, 1, __ATOMIC_RELEASE);
+	/* If the fd has been deleted since, it's up to whoever added it
+	 * back (or the loop running the new generation) to arm it */
+	if (slot->gen == gen) {
+		slot->gen_running = false;
+		if (slot->active && arm_slot(sh, slot, fd,
+				EPOLL_CTL_MOD) < 0) {
+			perror("epoll_ctl");
+			fprintf(stderr, "Libwandevent: failed to re-arm shared fd %d\n",
+					fd);
+		}
+	}
+	wake = slot->waiters > 0;
+	pthread_mutex_unlock(&slot->lock);
+
+	/* Somebody is in wand_shared_del_fd() waiting for us */
+	if (wake) {
+		pthread_mutex_lock(&sh->lock);
+		pthread_cond_broadcast(&sh->idle);
+		pthread_mutex_unlock(&sh->lock);
+	}
+}
+
+/* Called by each loop when the shared epoll fd is readable */
+static void shared_ready(wand_event_handler_t *ev_hdl, int fd, void *data,
+		enum wand_eventtype_t ev) {
+	wand_shared_t *sh = (wand_shared_t *)data;
+	struct epoll_event events[64];
+	int n, i;
+
+	(void)ev;
+	/* Every loop is woken, but only takes a few events, so that the
+	 * rest can be picked up by the other loops */
+	n = epoll_wait(fd, events, sh->batch, 0);
+	if (n <= 0) {
+		if (n < 0 && errno != EINTR)
+			perror("epoll_wait");
+		add_stat(&sh->stats.empty, 1);
+		return;
+	}
+	add_stat(&sh->stats.batches, 1);
+	for (i = 0; i < n; i++)
+		dispatch_event(sh, ev_hdl, &events[i]);
+}
+
+int wand_shared_create(wand_loop_group_t *group, int batch,
+		wand_shared_t **shp) {
+	wand_shared_t *sh;
+	struct rlimit rl;
+	rlim_t maxfds = 65536;
+	int i;
+
+	sh = (wand_shared_t *)calloc(1, sizeof(wand_shared_t));
+	if (sh == NULL)
+		return -1;
+	if (batch <= 0)
+		batch = DEFAULT_BATCH;
+	if (batch > 64)
+		batch = 64;
+	sh->batch = batch;
+
+	/* We can't grow the table without moving the slots, so make it big
+	 * enough for every fd we could have. Only the chunks that are used
+	 * are allocated */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_max != RLIM_INFINITY)
+		maxfds = rl.rlim_max;
+	sh->nchunks = (maxfds + CHUNK_SIZE - 1) >> CHUNK_BITS;
+	sh->chunks = (struct shared_slot_t **)calloc(sh->nchunks,
+			sizeof(struct shared_slot_t *));
+	sh->nloops = wand_loop_group_size(group);
+	sh->loops = (wand_event_handler_t **)calloc(sh->nloops,
+			sizeof(wand_event_handler_t *));
+	if (sh->chunks == NULL || sh->loops == NULL)
+		goto fail;
+
+	sh->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (sh->epoll_fd < 0) {
+		perror("epoll_create1");
+		goto fail;
+	}
+	pthread_mutex_init(&sh->lock, NULL);
+	pthread_cond_init(&sh->idle, NULL);
+
+	for (i = 0; i < sh->nloops; i++) {
+		sh->loops[i] = wand_loop_group_handler(group, i);
+		if (wand_add_fd(sh->loops[i], sh->epoll_fd, EV_READ, sh,
+				shared_ready) == NULL) {
+			while (--i >= 0)
+				wand_del_fd(sh->loops[i], sh->epoll_fd);
+			close(sh->epoll_fd);
+			pthread_mutex_destroy(&sh->lock);
+			pthread_cond_destroy(&sh->idle);
+			goto fail;
+		}
+	}
+	*shp = sh;
+	return 0;
+
+fail:
+	free(sh->loops);
+	free(sh->chunks);
+	free(sh);
+	return -1;
+}
+
+void wand_shared_destroy(wand_shared_t *sh) {
+	int i, j;
+
+	for (i = 0; i < sh->nloops; i++)
+		wand_del_fd(sh->loops[i], sh->epoll_fd);
+	close(sh->epoll_fd);
+
+	for (i = 0; i < sh->nchunks; i++) {
+		if (sh->chunks[i] == NULL)
+			continue;
+		for (j = 0; j < CHUNK_SIZE; j++)
+			pthread_mutex_destroy(&sh->chunks[i][j].lock);
+		free(sh->chunks[i]);
+	}
+	pthread_mutex_destroy(&sh->lock);
+	pthread_cond_destroy(&sh->idle);
+	free(sh->chunks);
+	free(sh->loops);
+	free(sh);
+}
+
+int wand_shared_add_fd(wand_shared_t *sh, int fd, int flags, void *data,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				void *data, enum wand_eventtype_t ev)) {
+	struct shared_slot_t *slot = create_slot(sh, fd);
+
+	if (slot == NULL) {
+		fprintf(stderr, "Libwandevent: cannot add shared fd %d\n", fd);
+		return -1;
+	}
+
+	pthread_mutex_lock(&slot->lock);
+	if (slot->active) {
+		pthread_mutex_unlock(&slot->lock);
+		fprintf(stderr, "Libwandevent fd event already exists for fd %d\n", fd);
+		return -1;
+	}
+	slot->flags = flags;
+	slot->data = data;
+	slot->callback = callback;
+	if (arm_slot(sh, slot, fd, EPOLL_CTL_ADD) < 0) {
+		pthread_mutex_unlock(&slot->lock);
+		perror("epoll_ctl");
+		fprintf(stderr, "Error adding fd %d to epoll\n", fd);
+		return -1;
+	}
+	__atomic_store_n(&slot->active, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&slot->lock);
+	__atomic_add_fetch(&sh->stats.fds, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int wand_shared_set_fd_flags(wand_shared_t *sh, int fd, int flags) {
+	struct shared_slot_t *slot = find_slot(sh, fd);
+	int ret = 0;
+
+	if (slot == NULL)
+		return -1;
+	pthread_mutex_lock(&slot->lock);
+	if (!slot->active) {
+		pthread_mutex_unlock(&slot->lock);
+		return -1;
+	}
+	slot->flags = flags;
+	/* A running callback re-arms the fd with the new flags when it
+	 * finishes, and arming it now would let another loop in */
+	if (!slot->gen_running)
+		ret = arm_slot(sh, slot, fd, EPOLL_CTL_MOD);
+	pthread_mutex_unlock(&slot->lock);
+	return ret;
+}
+
+int wand_shared_del_fd(wand_shared_t *sh, int fd) {
+	struct shared_slot_t *slot = find_slot(sh, fd);
+	uint32_t gen;
+	int self;
+
+	if (slot == NULL)
+		return -1;
+	pthread_mutex_lock(&slot->lock);
+	if (!slot->active) {
+		pthread_mutex_unlock(&slot->lock);
+		return -1;
+	}
+	gen = slot->gen;
+	__atomic_store_n(&slot->active, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot->gen, gen + 1, __ATOMIC_RELEASE);
+	slot->gen_running = false;
+	if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0)
+		perror("epoll_ctl");
+	__atomic_sub_fetch(&sh->stats.fds, 1, __ATOMIC_RELAXED);
+
+	/* Once we return, the caller may close the fd and free the data, so
+	 * wait for any other loops that are still running the callback. If
+	 * we are one of them, the callback itself is deleting the fd */
+	self = (current_slot == slot) ? 1 : 0;
+	if (slot->running <= self) {
+		pthread_mutex_unlock(&slot->lock);
+		return 0;
+	}
+	slot->waiters ++;
+	pthread_mutex_unlock(&slot->lock);
+
+	/* If the fd is added back, we may end up waiting for callbacks for
+	 * the new generation as well, but they won't hold us up for long */
+	pthread_mutex_lock(&sh->lock);
+	while (__atomic_load_n(&slot->running, __ATOMIC_ACQUIRE) > self)
+		pthread_cond_wait(&sh->idle, &sh->lock);
+	pthread_mutex_unlock(&sh->lock);
+
+	pthread_mutex_lock(&slot->lock);
+	slot->waiters --;
+	pthread_mutex_unlock(&slot->lock);
+	return 0;
+}
+
+void wand_get_shared_stats(wand_shared_t *sh,
+		struct wand_shared_stats_t *stats) {
+	stats->fds = __atomic_load_n(&sh->stats.fds, __ATOMIC_RELAXED);
+	stats->callbacks = __atomic_load_n(&sh->stats.callbacks,
+			__ATOMIC_RELAXED);
+	stats->batches = __atomic_load_n(&sh->stats.batches,
+			__ATOMIC_RELAXED);
+	stats->empty = __atomic_load_n(&sh->stats.empty, __ATOMIC_RELAXED);
+	stats->stale = __atomic_load_n(&sh->stats.stale, __ATOMIC_RELAXED);
+}
+
+#else
+
+int wand_shared_create(wand_loop_group_t *group, int batch,
+		wand_shared_t **shp) {
+	(void)group;
+	(void)batch;
+	(void)shp;
+	fprintf(stderr, "Libwandevent: shared dispatch requires epoll\n");
+	return -1;
+}
+
+void wand_shared_destroy(wand_shared_t *sh) {
+	(void)sh;
+}
+
+int wand_shared_add_fd(wand_shared_t *sh, int fd, int flags, void *data,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				void *data, enum wand_eventtype_t ev)) {
+	(void)sh; (void)fd; (void)flags; (void)data; (void)callback;
+	return -1;
+}
+
+int wand_shared_set_fd_flags(wand_shared_t *sh, int fd, int flags) {
+	(void)sh; (void)fd; (void)flags;
+	return -1;
+}
+
+int wand_shared_del_fd(wand_shared_t *sh, int fd) {
+	(void)sh; (void)fd;
+	return -1;
+}
+
+void wand_get_shared_stats(wand_shared_t *sh,
+		struct wand_shared_stats_t *stats) {
+	(void)sh;
+	memset(stats, 0, sizeof(struct wand_shared_stats_t));
+}
+
+#endif
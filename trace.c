@@ -0,0 +1,158 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Event trace recorder.
+ *
+ * Records are written straight into a shared mapping of the trace file, so
+ * recording one is a handful of stores and the trace survives the process
+ * crashing. Only the thread running the handler writes records, so the ring
+ * needs no locking; head is published with a release store so that a reader
+ * can look at the file while it is being written. Use wandevent-trace to
+ * decode it. */
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+static uint64_t monotonic_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Works out how fast the tick counter runs, by watching it for a couple of
+ * milliseconds */
+static void calibrate(struct wand_trace_header_t *hdr) {
+	uint64_t ns0, ns1, t0, t1;
+
+	ns0 = monotonic_ns();
+	t0 = wand_trace_ticks();
+#if defined(__x86_64__) || defined(__i386__)
+	do {
+		ns1 = monotonic_ns();
+	} while (ns1 - ns0 < 2000000);
+#else
+	ns1 = monotonic_ns();
+#endif
+	t1 = wand_trace_ticks();
+
+	if (t1 > t0 && ns1 > ns0)
+		hdr->ticks_per_ns = (double)(t1 - t0) / (ns1 - ns0);
+	else
+		hdr->ticks_per_ns = 1.0;
+	hdr->start_ticks = t1;
+	hdr->start_ns = ns1;
+}
+
+int wand_trace_start(wand_event_handler_t *ev_hdl, const char *path,
+		size_t nrecords) {
+	struct wand_trace_t *trace;
+	uint64_t n = 1;
+	void *map;
+
+	if (ev_hdl->trace) {
+		fprintf(stderr, "Libwandevent: a trace is already running\n");
+		return -1;
+	}
+
+	while (n < nrecords)
+		n <<= 1;
+
+	trace = (struct wand_trace_t *)calloc(1, sizeof(struct wand_trace_t));
+	if (trace == NULL)
+		return -1;
+	trace->maplen = sizeof(struct wand_trace_header_t) +
+			n * sizeof(struct wand_trace_record_t);
+	trace->mask = n - 1;
+
+	trace->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (trace->fd < 0) {
+		perror("open");
+		fprintf(stderr, "Libwandevent: can't create trace file %s\n",
+				path);
+		free(trace);
+		return -1;
+	}
+	if (ftruncate(trace->fd, trace->maplen) < 0) {
+		perror("ftruncate");
+		goto fail;
+	}
+
+	map = mmap(NULL, trace->maplen, PROT_READ | PROT_WRITE, MAP_SHARED,
+			trace->fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		goto fail;
+	}
+
+	trace->hdr = (struct wand_trace_header_t *)map;
+	trace->records = (struct wand_trace_record_t *)(trace->hdr + 1);
+
+	memcpy(trace->hdr->magic, WAND_TRACE_MAGIC, sizeof(WAND_TRACE_MAGIC));
+	trace->hdr->version = WAND_TRACE_VERSION;
+	trace->hdr->record_size = sizeof(struct wand_trace_record_t);
+	trace->hdr->nrecords = n;
+	trace->hdr->pid = getpid();
+	calibrate(trace->hdr);
+
+	ev_hdl->trace = trace;
+	return 0;
+
+fail:
+	fprintf(stderr, "Libwandevent: can't map trace file %s\n", path);
+	close(trace->fd);
+	free(trace);
+	return -1;
+}
+
+void wand_trace_stop(wand_event_handler_t *ev_hdl) {
+	struct wand_trace_t *trace = ev_hdl->trace;
+
+	if (trace == NULL)
+		return;
+
+	/* Gives the decoder an accurate rate for the whole trace */
+	trace->hdr->end_ticks = wand_trace_ticks();
+	trace->hdr->end_ns = monotonic_ns();
+
+	ev_hdl->trace = NULL;
+	munmap(trace->hdr, trace->maplen);
+	close(trace->fd);
+	free(trace);
+}
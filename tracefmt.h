@@ -0,0 +1,93 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+#ifndef TRACEFMT_H_
+#define TRACEFMT_H_
+
+#include <stdint.h>
+
+/* Layout of the trace files written by wand_trace_start() and read by the
+ * wandevent-trace tool. A file is a header followed by a ring of fixed-size
+ * records, which wraps around once it is full */
+
+#define WAND_TRACE_MAGIC "WANDTRC"
+#define WAND_TRACE_VERSION 1
+
+enum wand_trace_type_t {
+	TRACE_WAIT_START = 1,	/* arg: timeout in usec, or -1 */
+	TRACE_WAIT_END,		/* arg: number of ready fds */
+	TRACE_FD_START,		/* fd, evtype, id: callback */
+	TRACE_FD_END,		/* fd, evtype, id: callback */
+	TRACE_TIMER_START,	/* id: timer, arg: lateness in nsec */
+	TRACE_TIMER_END,	/* id: timer */
+	TRACE_ADD_FD,		/* fd, evtype: flags, id: callback */
+	TRACE_DEL_FD,		/* fd */
+	TRACE_ADD_TIMER,	/* id: timer, arg: delay in usec */
+	TRACE_MOD_TIMER,	/* id: timer, arg: delay in usec */
+	TRACE_DEL_TIMER,	/* id: timer */
+	TRACE_MOD_FD,		/* fd, evtype: active flags, arg: flags */
+	TRACE_MAX
+};
+
+struct wand_trace_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	/* Number of records in the ring, always a power of two */
+	uint64_t nrecords;
+	/* Total number of records written so far. The newest record is at
+	 * (head - 1) % nrecords. Updated after each record is complete */
+	uint64_t head;
+
+	/* Records are timestamped in ticks, which are TSC cycles where we
+	 * have them and nanoseconds otherwise. These convert them to
+	 * CLOCK_MONOTONIC nanoseconds */
+	uint64_t start_ticks;
+	uint64_t start_ns;
+	/* Zero until the trace is stopped */
+	uint64_t end_ticks;
+	uint64_t end_ns;
+	double ticks_per_ns;
+
+	uint32_t pid;
+	uint32_t pad;
+	uint64_t reserved[5];
+};
+
+struct wand_trace_record_t {
+	uint64_t ticks;
+	uint8_t type;
+	uint8_t evtype;
+	uint16_t pad;
+	int32_t fd;
+	int64_t arg;
+	uint64_t id;
+};
+
+#endif
@@ -0,0 +1,393 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Decodes the event traces written by wand_trace_start(), printing summary
+ * statistics and, optionally, a timeline of every record in the trace */
+#include "config.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tracefmt.h"
+
+#define TOP_CALLBACKS 10
+
+/* A growable list of durations, in nanoseconds */
+struct samples_t {
+	double *vals;
+	size_t count;
+	size_t size;
+};
+
+struct slow_cb_t {
+	double start;
+	double duration;
+	const struct wand_trace_record_t *rec;
+};
+
+static const char *type_names[TRACE_MAX] = {
+	NULL, "wait", "wait-end", "fd", "fd-end", "timer", "timer-end",
+	"add-fd", "del-fd", "add-timer", "mod-timer", "del-timer", "mod-fd"
+};
+
+static struct wand_trace_header_t *hdr;
+static double ticks_per_ns;
+
+static double to_ns(uint64_t ticks) {
+	return (double)(int64_t)(ticks - hdr->start_ticks) / ticks_per_ns;
+}
+
+static void add_sample(struct samples_t *s, double val) {
+	if (s->count == s->size) {
+		s->size = s->size ? s->size * 2 : 1024;
+		s->vals = (double *)realloc(s->vals, s->size * sizeof(double));
+		if (s->vals == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	s->vals[s->count++] = val;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(struct samples_t *s, double pct) {
+	size_t i = (size_t)(pct / 100.0 * (s->count - 1) + 0.5);
+
+	return s->vals[i];
+}
+
+static void print_samples(const char *name, struct samples_t *s) {
+	if (s->count == 0) {
+		printf("%-18s %10d\n", name, 0);
+		return;
+	}
+	qsort(s->vals, s->count, sizeof(double), cmp_double);
+	printf("%-18s %10zu %10.1f %10.1f %10.1f %10.1f\n", name, s->count,
+			percentile(s, 50) / 1000, percentile(s, 99) / 1000,
+			percentile(s, 99.9) / 1000,
+			s->vals[s->count - 1] / 1000);
+}
+
+static const char *evtype_name(int ev) {
+	switch (ev) {
+		case 1: return "read";
+		case 2: return "write";
+		case 4: return "except";
+	}
+	return "-";
+}
+
+static void print_record(const struct wand_trace_record_t *rec, double t,
+		double duration) {
+	printf("%14.3f  %-10s", t / 1000, rec->type < TRACE_MAX ?
+			type_names[rec->type] : "?");
+
+	switch (rec->type) {
+		case TRACE_WAIT_START:
+			if (rec->arg < 0)
+				printf(" timeout none");
+			else
+				printf(" timeout %" PRId64 "us", rec->arg);
+			break;
+		case TRACE_WAIT_END:
+			printf(" %" PRId64 " ready, waited %.3fus", rec->arg,
+					duration / 1000);
+			break;
+		case TRACE_FD_START:
+			printf(" fd %d %s cb 0x%" PRIx64, rec->fd,
+					evtype_name(rec->evtype), rec->id);
+			break;
+		case TRACE_FD_END:
+			printf(" fd %d %s took %.3fus", rec->fd,
+					evtype_name(rec->evtype), duration / 1000);
+			break;
+		case TRACE_TIMER_START:
+			printf(" 0x%" PRIx64 " late %.3fus", rec->id,
+					(double)rec->arg / 1000);
+			break;
+		case TRACE_TIMER_END:
+			printf(" 0x%" PRIx64 " took %.3fus", rec->id,
+					duration / 1000);
+			break;
+		case TRACE_ADD_FD:
+			printf(" fd %d flags %d cb 0x%" PRIx64, rec->fd,
+					rec->evtype, rec->id);
+			break;
+		case TRACE_DEL_FD:
+			printf(" fd %d", rec->fd);
+			break;
+		case TRACE_MOD_FD:
+			printf(" fd %d flags %" PRId64 " active %d", rec->fd,
+					rec->arg, rec->evtype);
+			break;
+		case TRACE_ADD_TIMER:
+		case TRACE_MOD_TIMER:
+			printf(" 0x%" PRIx64 " in %" PRId64 "us", rec->id,
+					rec->arg);
+			break;
+		case TRACE_DEL_TIMER:
+			printf(" 0x%" PRIx64, rec->id);
+			break;
+	}
+	printf("\n");
+}
+
+/* Keeps track of the slowest callbacks seen, slowest first */
+static void note_callback(struct slow_cb_t *slow, double start,
+		double duration, const struct wand_trace_record_t *rec) {
+	int i;
+
+	if (duration <= slow[TOP_CALLBACKS - 1].duration)
+		return;
+	for (i = TOP_CALLBACKS - 1; i > 0 &&
+			slow[i - 1].duration < duration; i--)
+		slow[i] = slow[i - 1];
+	slow[i].start = start;
+	slow[i].duration = duration;
+	slow[i].rec = rec;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-t] tracefile\n"
+			"  -t  print a timeline of every record\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+	struct samples_t waits = {0}, busy = {0}, fdcbs = {0}, timercbs = {0};
+	struct samples_t lateness = {0};
+	struct slow_cb_t slow[TOP_CALLBACKS];
+	uint64_t counts[TRACE_MAX];
+	const struct wand_trace_record_t *records, *rec;
+	uint64_t first, i, nrecords, head, nevents = 0;
+	double t, first_t = 0, last_t = 0;
+	double wait_start = -1, wait_end = -1, fd_start = -1, timer_start = -1;
+	double waiting = 0;
+	bool timeline = false;
+	struct stat st;
+	void *map;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "th")) != -1) {
+		switch (opt) {
+			case 't':
+				timeline = true;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if ((size_t)st.st_size < sizeof(struct wand_trace_header_t)) {
+		fprintf(stderr, "%s: not a trace file\n", argv[optind]);
+		return 1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	hdr = (struct wand_trace_header_t *)map;
+	if (memcmp(hdr->magic, WAND_TRACE_MAGIC, sizeof(WAND_TRACE_MAGIC)) ||
+			hdr->version != WAND_TRACE_VERSION ||
+			hdr->record_size != sizeof(struct wand_trace_record_t)) {
+		fprintf(stderr, "%s: not a trace file, or an unsupported version\n",
+				argv[optind]);
+		return 1;
+	}
+
+	/* Trace files get copied around, so don't trust the header to
+	 * describe a ring that actually fits in the file. The header is
+	 * read once, as the trace may still be being written */
+	nrecords = hdr->nrecords;
+	head = hdr->head;
+	if (nrecords == 0 || (nrecords & (nrecords - 1)) != 0 ||
+			nrecords > (st.st_size - sizeof(*hdr)) /
+			hdr->record_size) {
+		fprintf(stderr, "%s: trace file is corrupt or truncated\n",
+				argv[optind]);
+		return 1;
+	}
+	records = (const struct wand_trace_record_t *)(hdr + 1);
+
+	/* Prefer the rate measured over the whole trace, if it has been
+	 * stopped cleanly */
+	if (hdr->end_ns > hdr->start_ns && hdr->end_ticks > hdr->start_ticks)
+		ticks_per_ns = (double)(hdr->end_ticks - hdr->start_ticks) /
+				(hdr->end_ns - hdr->start_ns);
+	else
+		ticks_per_ns = hdr->ticks_per_ns;
+	if (ticks_per_ns <= 0)
+		ticks_per_ns = 1.0;
+
+	memset(counts, 0, sizeof(counts));
+	memset(slow, 0, sizeof(slow));
+
+	first = head > nrecords ? head - nrecords : 0;
+	for (i = first; i < head; i++) {
+		double duration = 0;
+
+		rec = &records[i & (nrecords - 1)];
+		t = to_ns(rec->ticks);
+		if (i == first)
+			first_t = t;
+		last_t = t;
+		if (rec->type < TRACE_MAX)
+			counts[rec->type]++;
+
+		switch (rec->type) {
+			case TRACE_WAIT_START:
+				if (wait_end >= 0)
+					add_sample(&busy, t - wait_end);
+				wait_start = t;
+				break;
+			case TRACE_WAIT_END:
+				if (wait_start >= 0) {
+					duration = t - wait_start;
+					add_sample(&waits, duration);
+					waiting += duration;
+				}
+				nevents += rec->arg;
+				wait_end = t;
+				break;
+			case TRACE_FD_START:
+				fd_start = t;
+				break;
+			case TRACE_FD_END:
+				if (fd_start >= 0) {
+					duration = t - fd_start;
+					add_sample(&fdcbs, duration);
+					note_callback(slow, fd_start, duration,
+							rec);
+				}
+				fd_start = -1;
+				break;
+			case TRACE_TIMER_START:
+				timer_start = t;
+				add_sample(&lateness, (double)rec->arg);
+				break;
+			case TRACE_TIMER_END:
+				if (timer_start >= 0) {
+					duration = t - timer_start;
+					add_sample(&timercbs, duration);
+					note_callback(slow, timer_start,
+							duration, rec);
+				}
+				timer_start = -1;
+				break;
+		}
+
+		if (timeline)
+			print_record(rec, t - first_t, duration);
+	}
+
+	if (timeline)
+		printf("\n");
+
+	printf("Trace of pid %u: %" PRIu64 " records", hdr->pid,
+			head - first);
+	if (first)
+		printf(" (%" PRIu64 " older records overwritten)", first);
+	printf(", %.6f seconds\n", (last_t - first_t) / 1e9);
+	if (hdr->end_ns == 0)
+		printf("Trace was not stopped cleanly, or is still running\n");
+
+	printf("Waits: %zu, %.2f ready fds per wait, %.1f%% of the time "
+			"spent waiting\n\n", waits.count,
+			waits.count ? (double)nevents / waits.count : 0.0,
+			last_t > first_t ?
+			waiting * 100 / (last_t - first_t) : 0.0);
+
+	printf("%-18s %10s %10s %10s %10s %10s\n", "(usec)", "count", "p50",
+			"p99", "p99.9", "max");
+	print_samples("wait", &waits);
+	print_samples("busy between waits", &busy);
+	print_samples("fd callback", &fdcbs);
+	print_samples("timer callback", &timercbs);
+	print_samples("timer lateness", &lateness);
+
+	printf("\nadd-fd %" PRIu64 ", mod-fd %" PRIu64 ", del-fd %" PRIu64
+			", add-timer %" PRIu64 ", mod-timer %" PRIu64
+			", del-timer %" PRIu64 "\n",
+			counts[TRACE_ADD_FD], counts[TRACE_MOD_FD],
+			counts[TRACE_DEL_FD],
+			counts[TRACE_ADD_TIMER], counts[TRACE_MOD_TIMER],
+			counts[TRACE_DEL_TIMER]);
+
+	if (slow[0].rec) {
+		printf("\nSlowest callbacks:\n");
+		for (i = 0; i < TOP_CALLBACKS && slow[i].rec; i++) {
+			rec = slow[i].rec;
+			if (rec->type == TRACE_FD_END)
+				printf("%14.3f  %10.3fus  fd %d %s cb 0x%"
+						PRIx64 "\n",
+						(slow[i].start - first_t) / 1000,
+						slow[i].duration / 1000,
+						rec->fd, evtype_name(rec->evtype),
+						rec->id);
+			else
+				printf("%14.3f  %10.3fus  timer 0x%" PRIx64
+						"\n", (slow[i].start - first_t) / 1000,
+						slow[i].duration / 1000,
+						rec->id);
+		}
+	}
+
+	free(waits.vals);
+	free(busy.vals);
+	free(fdcbs.vals);
+	free(timercbs.vals);
+	free(lateness.vals);
+	munmap(map, st.st_size);
+	close(fd);
+	return 0;
+}
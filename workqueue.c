@@ -0,0 +1,353 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Worker thread pool for running blocking work outside of the event loop.
+ *
+ * Work is queued by the loop thread and picked up by a bounded pool of
+ * worker threads, which are started on demand. Once a piece of work has
+ * finished (or been cancelled), its done callback is passed back to the loop
+ * thread via the handler's mailbox, so completions arrive in batches with a
+ * single wakeup. */
+#include "config.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+#define DEFAULT_WORK_THREADS 4
+
+enum {
+	WORK_QUEUED,
+	WORK_RUNNING,
+	WORK_DONE,
+	WORK_CANCELLED
+};
+
+struct wand_work_t {
+	void (*work_fn)(void *data);
+	void (*done_fn)(wand_event_handler_t *ev_hdl, void *data,
+			bool cancelled);
+	void *data;
+	int state;
+
+	/* The work queue is a doubly-linked list so that cancelled work can
+	 * be removed cheaply */
+	struct wand_work_t *prev;
+	struct wand_work_t *next;
+
+	struct wand_workqueue_t *wq;
+	wand_event_handler_t *ev_hdl;
+	/* Used to deliver the completion back to the loop thread */
+	struct wand_mailbox_msg_t msg;
+};
+
+struct wand_workqueue_t {
+	pthread_mutex_t lock;
+	/* Signalled whenever work is queued or the pool is shutting down */
+	pthread_cond_t cond;
+
+	struct wand_work_t *head;
+	struct wand_work_t *tail;
+
+	pthread_t *threads;
+	int nthreads;
+	int maxthreads;
+	int idle;
+	bool shutdown;
+
+	struct wand_work_stats_t stats;
+};
+
+static void *worker_thread(void *data) {
+	struct wand_workqueue_t *wq = (struct wand_workqueue_t *)data;
+	struct wand_work_t *work;
+
+	pthread_mutex_lock(&wq->lock);
+	while (!wq->shutdown) {
+		if (wq->head == NULL) {
+			wq->idle ++;
+			pthread_cond_wait(&wq->cond, &wq->lock);
+			wq->idle --;
+			continue;
+		}
+
+		work = wq->head;
+		wq->head = work->next;
+		if (wq->head)
+			wq->head->prev = NULL;
+		else
+			wq->tail = NULL;
+		work->prev = work->next = NULL;
+		work->state = WORK_RUNNING;
+		wq->stats.queued --;
+		wq->stats.running ++;
+		pthread_mutex_unlock(&wq->lock);
+
+		work->work_fn(work->data);
+
+		pthread_mutex_lock(&wq->lock);
+		work->state = WORK_DONE;
+		wq->stats.running --;
+		wq->stats.completing ++;
+		wand_mailbox_post(work->ev_hdl, &work->msg);
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return NULL;
+}
+
+/* Mailbox callback -- runs on the loop thread */
+static void work_complete(wand_event_handler_t *ev_hdl, void *data) {
+	struct wand_work_t *work = (struct wand_work_t *)data;
+	struct wand_workqueue_t *wq = ev_hdl->workq;
+	bool cancelled;
+
+	pthread_mutex_lock(&wq->lock);
+	cancelled = (work->state == WORK_CANCELLED);
+	if (cancelled) {
+		wq->stats.total_cancelled ++;
+	} else {
+		wq->stats.completing --;
+		wq->stats.total_completed ++;
+	}
+	pthread_mutex_unlock(&wq->lock);
+
+	if (work->done_fn)
+		work->done_fn(ev_hdl, work->data, cancelled);
+	free(work);
+}
+
+static struct wand_workqueue_t *get_workqueue(wand_event_handler_t *ev_hdl) {
+	struct wand_workqueue_t *wq;
+
+	if (ev_hdl->workq)
+		return ev_hdl->workq;
+
+	if (wand_mailbox_init(ev_hdl) < 0)
+		return NULL;
+
+	wq = (struct wand_workqueue_t *)calloc(1,
+			sizeof(struct wand_workqueue_t));
+	if (wq == NULL)
+		return NULL;
+	wq->maxthreads = DEFAULT_WORK_THREADS;
+	wq->threads = (pthread_t *)calloc(wq->maxthreads, sizeof(pthread_t));
+	if (wq->threads == NULL) {
+		free(wq);
+		return NULL;
+	}
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+
+	ev_hdl->workq = wq;
+	return wq;
+}
+
+/* Starts another worker thread. Must be called with the lock held.
+ * Returns -1 if the thread couldn't be started */
+static int start_worker(struct wand_workqueue_t *wq) {
+	sigset_t all, old;
+	int ret = 0;
+
+	/* Signals are handled by the event loop, so make sure none of them
+	 * are ever delivered to a worker thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if (pthread_create(&wq->threads[wq->nthreads], NULL, worker_thread,
+			wq) != 0) {
+		fprintf(stderr, "Libwandevent: failed to start worker thread\n");
+		ret = -1;
+	} else {
+		wq->nthreads ++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return ret;
+}
+
+int wand_set_work_threads(wand_event_handler_t *ev_hdl, int nthreads) {
+	struct wand_workqueue_t *wq;
+	pthread_t *threads;
+
+	if (nthreads <= 0)
+		return -1;
+
+	if ((wq = get_workqueue(ev_hdl)) == NULL)
+		return -1;
+
+	pthread_mutex_lock(&wq->lock);
+	/* We can't take away threads that are already running */
+	if (nthreads < wq->nthreads) {
+		pthread_mutex_unlock(&wq->lock);
+		return -1;
+	}
+	threads = (pthread_t *)realloc(wq->threads,
+			sizeof(pthread_t) * nthreads);
+	if (threads == NULL) {
+		pthread_mutex_unlock(&wq->lock);
+		return -1;
+	}
+	wq->threads = threads;
+	wq->maxthreads = nthreads;
+	pthread_mutex_unlock(&wq->lock);
+	return 0;
+}
+
+wand_work_t *wand_queue_work(wand_event_handler_t *ev_hdl,
+		void (*work_fn)(void *data),
+		void (*done_fn)(wand_event_handler_t *ev_hdl, void *data,
+				bool cancelled),
+		void *data) {
+	struct wand_workqueue_t *wq;
+	struct wand_work_t *work;
+
+	assert(work_fn);
+	if ((wq = get_workqueue(ev_hdl)) == NULL)
+		return NULL;
+
+	work = (struct wand_work_t *)calloc(1, sizeof(struct wand_work_t));
+	if (work == NULL)
+		return NULL;
+	work->work_fn = work_fn;
+	work->done_fn = done_fn;
+	work->data = data;
+	work->state = WORK_QUEUED;
+	work->wq = wq;
+	work->ev_hdl = ev_hdl;
+	work->msg.callback = work_complete;
+	work->msg.data = work;
+
+	pthread_mutex_lock(&wq->lock);
+	/* Only start a new thread if all of the existing ones are busy. If
+	 * there are no threads at all, the work would never run */
+	if (wq->idle == 0 && wq->nthreads < wq->maxthreads &&
+			start_worker(wq) < 0 && wq->nthreads == 0) {
+		pthread_mutex_unlock(&wq->lock);
+		free(work);
+		return NULL;
+	}
+
+	work->prev = wq->tail;
+	if (wq->tail)
+		wq->tail->next = work;
+	else
+		wq->head = work;
+	wq->tail = work;
+	wq->stats.queued ++;
+	wq->stats.total_queued ++;
+	if (wq->stats.queued > wq->stats.max_queued)
+		wq->stats.max_queued = wq->stats.queued;
+	pthread_cond_signal(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+
+	return work;
+}
+
+int wand_cancel_work(wand_event_handler_t *ev_hdl, wand_work_t *work) {
+	struct wand_workqueue_t *wq = ev_hdl->workq;
+
+	assert(wq && work->wq == wq);
+
+	pthread_mutex_lock(&wq->lock);
+	if (work->state != WORK_QUEUED) {
+		/* Too late, a worker has already picked it up */
+		pthread_mutex_unlock(&wq->lock);
+		return -1;
+	}
+
+	if (work->prev)
+		work->prev->next = work->next;
+	else
+		wq->head = work->next;
+	if (work->next)
+		work->next->prev = work->prev;
+	else
+		wq->tail = work->prev;
+	work->prev = work->next = NULL;
+	work->state = WORK_CANCELLED;
+	wq->stats.queued --;
+	pthread_mutex_unlock(&wq->lock);
+
+	/* The done callback still gets called, but always from the loop so
+	 * that the caller doesn't have to deal with re-entrancy */
+	wand_mailbox_post(ev_hdl, &work->msg);
+	return 0;
+}
+
+void wand_get_work_stats(wand_event_handler_t *ev_hdl,
+		struct wand_work_stats_t *stats) {
+	struct wand_workqueue_t *wq = ev_hdl->workq;
+
+	if (wq == NULL) {
+		memset(stats, 0, sizeof(struct wand_work_stats_t));
+		return;
+	}
+
+	pthread_mutex_lock(&wq->lock);
+	*stats = wq->stats;
+	stats->threads = wq->nthreads;
+	pthread_mutex_unlock(&wq->lock);
+}
+
+void wand_workqueue_destroy(wand_event_handler_t *ev_hdl) {
+	struct wand_workqueue_t *wq = ev_hdl->workq;
+	int i;
+
+	if (wq == NULL)
+		return;
+
+	/* Let the workers finish whatever they are currently doing */
+	pthread_mutex_lock(&wq->lock);
+	wq->shutdown = true;
+	pthread_cond_broadcast(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+
+	for (i = 0; i < wq->nthreads; i++) {
+		pthread_join(wq->threads[i], NULL);
+	}
+
+	/* Anything that never got started is cancelled */
+	while (wq->head) {
+		wand_cancel_work(ev_hdl, wq->head);
+	}
+
+	/* Deliver the done callbacks for everything that finished or was
+	 * cancelled, so the user gets a chance to free their data */
+	wand_mailbox_flush(ev_hdl);
+
+	free(wq->threads);
+	pthread_cond_destroy(&wq->cond);
+	pthread_mutex_destroy(&wq->lock);
+	free(wq);
+	ev_hdl->workq = NULL;
+}
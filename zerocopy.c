@@ -0,0 +1,318 @@
+/*
+ * This file is part of libwandevent
+ *
+ * Copyright (c) 2009 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND research
+ * group. For further information, please see http://www.wand.net.nz/
+ *
+ * libwandevent is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License (GPL) as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * libwandevent is distributed in the hope that it will be useful but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with libwandevent; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Any feedback (bug reports, suggestions, complaints) should be sent to
+ * contact@wand.net.nz
+ *
+ */
+
+
+/* Zero-copy sends using MSG_ZEROCOPY.
+ *
+ * With MSG_ZEROCOPY, the kernel transmits directly from the user's buffer
+ * instead of copying it, so the buffer can't be reused until the kernel says
+ * it is finished with it. Each zero-copy send is numbered by the kernel and
+ * notifications covering a range of those numbers are posted to the socket's
+ * error queue, which epoll reports as EPOLLERR. We watch for that, read the
+ * notifications and hand each buffer back to the user via a callback.
+ *
+ * Pinning pages and processing the notification costs more than copying a
+ * small buffer, so sends below a threshold are simply copied. */
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#if HAVE_LINUX_ERRQUEUE_H
+ #include <linux/errqueue.h>
+#endif
+
+#include "libwandevent.h"
+#include "eventinternal.h"
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && \
+		defined(SO_EE_ORIGIN_ZEROCOPY)
+ #define USE_ZEROCOPY 1
+#endif
+
+/* Default size below which we copy rather than use MSG_ZEROCOPY */
+#define DEFAULT_ZC_THRESHOLD 16384
+
+/* A zero-copy send that the kernel hasn't finished with yet */
+struct zc_pending_t {
+	uint32_t id;
+	void *cookie;
+	struct zc_pending_t *next;
+};
+
+struct wand_zc_t {
+	int fd;
+	/* The flags the socket was registered with */
+	int flags;
+	bool enabled;
+	size_t threshold;
+	/* Number that the kernel will give to the next zero-copy send */
+	uint32_t next_id;
+
+	/* Outstanding sends, oldest first */
+	struct zc_pending_t *head;
+	struct zc_pending_t *tail;
+
+	void (*callback)(wand_event_handler_t *ev_hdl, int fd, void *data,
+			enum wand_eventtype_t ev);
+	void (*release)(wand_event_handler_t *ev_hdl, int fd, void *cookie,
+			void *data);
+	void *data;
+	wand_event_handler_t *ev_hdl;
+
+	struct wand_zc_stats_t stats;
+};
+
+/* Releases every outstanding send numbered between lo and hi, inclusive */
+static void release_range(struct wand_zc_t *zc, uint32_t lo, uint32_t hi) {
+	struct zc_pending_t *p, *prev = NULL, *next;
+
+	for (p = zc->head; p != NULL; p = next) {
+		next = p->next;
+		/* Careful, the numbers can wrap */
+		if ((uint32_t)(p->id - lo) > (uint32_t)(hi - lo)) {
+			prev = p;
+			continue;
+		}
+
+		if (prev)
+			prev->next = next;
+		else
+			zc->head = next;
+		if (zc->tail == p)
+			zc->tail = prev;
+
+		zc->stats.pending --;
+		if (zc->release)
+			zc->release(zc->ev_hdl, zc->fd, p->cookie, zc->data);
+		free(p);
+	}
+}
+
+/* Empties the error queue, releasing any sends that have completed. Returns
+ * true if the queue held anything other than zero-copy completions, which
+ * the user needs to hear about */
+static bool read_completions(struct wand_zc_t *zc) {
+#if USE_ZEROCOPY
+	struct msghdr msg;
+	char control[128];
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+	bool other = false;
+
+	/* Keep going even if nothing is pending, otherwise anything else
+	 * sitting in the queue would leave EPOLLERR set forever */
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("recvmsg");
+			return other;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_errno != 0 ||
+					serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				other = true;
+				continue;
+			}
+
+			/* The kernel fell back to copying for these, which
+			 * usually means zero-copy isn't worth it here (e.g.
+			 * loopback) */
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				zc->stats.kernel_copied +=
+					serr->ee_data - serr->ee_info + 1;
+			}
+			release_range(zc, serr->ee_info, serr->ee_data);
+		}
+	}
+#else
+	(void)zc;
+	return false;
+#endif
+}
+
+/* Checks whether the socket still has an error, e.g. a pending SO_ERROR */
+static bool socket_error(int fd) {
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = 0;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLERR);
+}
+
+static void zc_event(wand_event_handler_t *ev_hdl, int fd, void *data,
+		enum wand_eventtype_t ev) {
+	struct wand_zc_t *zc = (struct wand_zc_t *)data;
+	bool other;
+
+#if HAVE_SYS_EPOLL_H
+	if (ev != EV_EXCEPT) {
+		if (zc->callback)
+			zc->callback(ev_hdl, fd, zc->data, ev);
+		return;
+	}
+#endif
+	/* select() doesn't tell us about the error queue, so check it
+	 * whenever anything happens on the socket */
+	other = read_completions(zc);
+
+	/* Exceptions that were only completions are ours, but anything else
+	 * has to go to the user -- if they didn't ask for EV_EXCEPT they
+	 * still need to read SO_ERROR and close the socket, or epoll would
+	 * keep waking us up for it */
+	if (ev == EV_EXCEPT && !(zc->flags & EV_EXCEPT) && !other &&
+			!socket_error(fd))
+		return;
+
+	if (zc->callback)
+		zc->callback(ev_hdl, fd, zc->data, ev);
+}
+
+wand_zc_t *wand_add_zc_fd(wand_event_handler_t *ev_hdl, int fd, int flags,
+		size_t threshold, void *data,
+		void (*callback)(wand_event_handler_t *ev_hdl, int fd,
+				void *data, enum wand_eventtype_t ev),
+		void (*release)(wand_event_handler_t *ev_hdl, int fd,
+				void *cookie, void *data)) {
+	struct wand_zc_t *zc;
+
+	zc = (struct wand_zc_t *)calloc(1, sizeof(struct wand_zc_t));
+	if (zc == NULL)
+		return NULL;
+
+	zc->fd = fd;
+	zc->flags = flags;
+	zc->threshold = threshold ? threshold : DEFAULT_ZC_THRESHOLD;
+	zc->callback = callback;
+	zc->release = release;
+	zc->data = data;
+	zc->ev_hdl = ev_hdl;
+
+#if USE_ZEROCOPY
+	{
+		int one = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one,
+				sizeof(one)) == 0)
+			zc->enabled = true;
+	}
+#endif
+
+	/* We need exception events to find out about completions */
+	if (wand_add_fd(ev_hdl, fd, flags | EV_EXCEPT, zc, zc_event) == NULL) {
+		free(zc);
+		return NULL;
+	}
+	return zc;
+}
+
+ssize_t wand_zc_send(wand_zc_t *zc, const void *buf, size_t len, int flags,
+		void *cookie) {
+	struct zc_pending_t *p;
+	ssize_t ret;
+
+#if USE_ZEROCOPY
+	if (zc->enabled && len >= zc->threshold) {
+		p = (struct zc_pending_t *)malloc(sizeof(struct zc_pending_t));
+		if (p == NULL)
+			goto copy;
+
+		ret = send(zc->fd, buf, len, flags | MSG_ZEROCOPY);
+		if (ret < 0) {
+			free(p);
+			/* Out of memory for pinning pages, so just copy */
+			if (errno == ENOBUFS)
+				goto copy;
+			return ret;
+		}
+
+		/* The kernel numbers every successful zero-copy send */
+		p->id = zc->next_id ++;
+		p->cookie = cookie;
+		p->next = NULL;
+		if (zc->tail)
+			zc->tail->next = p;
+		else
+			zc->head = p;
+		zc->tail = p;
+
+		zc->stats.zerocopy_sends ++;
+		zc->stats.pending ++;
+		return ret;
+	}
+copy:
+#endif
+	(void)p;
+	ret = send(zc->fd, buf, len, flags);
+	if (ret < 0)
+		return ret;
+
+	/* The data has been copied, so the buffer is free straight away */
+	zc->stats.copied_sends ++;
+	if (zc->release)
+		zc->release(zc->ev_hdl, zc->fd, cookie, zc->data);
+	return ret;
+}
+
+void wand_get_zc_stats(wand_zc_t *zc, struct wand_zc_stats_t *stats) {
+	*stats = zc->stats;
+}
+
+void wand_del_zc_fd(wand_event_handler_t *ev_hdl, wand_zc_t *zc) {
+	struct zc_pending_t *p;
+
+	wand_del_fd(ev_hdl, zc->fd);
+
+	/* Pick up anything that has completed in the meantime. We have no
+	 * way of hearing about the rest, so they are released regardless --
+	 * callers should wait for the pending count in the stats to reach
+	 * zero before removing a socket if they intend to reuse the buffers */
+	read_completions(zc);
+	while ((p = zc->head) != NULL) {
+		zc->head = p->next;
+		if (zc->release)
+			zc->release(ev_hdl, zc->fd, p->cookie, zc->data);
+		free(p);
+	}
+	free(zc);
+}